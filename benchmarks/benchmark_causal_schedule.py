@@ -0,0 +1,125 @@
+# Compares the tile dispatch of the causal forward, the persistent scheduler against one launch per
+# (batch, head), on the host-side model of the launch. Runs without a GPU.
+import torch
+import torch.utils.benchmark as benchmark
+
+import flash_attn_2_cuda as flash_attn_cuda
+
+
+def efficiency(schedule, num_workers):
+    """Fraction of the worker time covered by tiles. Spinning on a producer counts as covered."""
+    start, end = schedule[:, 4], schedule[:, 5]
+    return (end - start).sum().item() / (num_workers * end.max().item())
+
+
+block_m, block_n = 128, 64
+num_workers_vals = [108, 216]  # A100: 108 SMs, 1 or 2 CTAs per SM
+bs_seqlen_vals = [(32, 512), (16, 1024), (8, 2048), (4, 4096), (2, 8192), (1, 16384)]
+dim = 2048
+headdim = 128
+nheads = dim // headdim
+
+for num_workers in num_workers_vals:
+    for batch_size, seqlen in bs_seqlen_vals:
+        makespan = {}
+        for per_head_launch in [True, False]:
+            schedule = flash_attn_cuda.fwd_causal_schedule(
+                batch_size, nheads, seqlen, seqlen, block_m, block_n, num_workers, per_head_launch
+            )
+            desc = "per-head launch" if per_head_launch else "persistent"
+            makespan[desc] = schedule[:, 5].max().item()
+            print(
+                f"{num_workers=}, {batch_size=}, {seqlen=}, {desc}: "
+                f"makespan {makespan[desc]} steps, efficiency {efficiency(schedule, num_workers):.3f}"
+            )
+        print(f"Speedup: {makespan['per-head launch'] / makespan['persistent']:.3f}x")
+
+# Packed batches of mixed lengths: the tile plan of the varlen forward against the bottom-up order
+# over max_seqlen_q.
+torch.manual_seed(0)
+for num_workers in num_workers_vals:
+    for max_seqlen in [1024, 4096, 16384]:
+        seqlens = torch.randint(1, max_seqlen + 1, (16,), dtype=torch.int32)
+        cu_seqlens = torch.nn.functional.pad(seqlens.cumsum(0, dtype=torch.int32), (1, 0))
+        makespan = {}
+        for planned in [False, True]:
+            schedule = flash_attn_cuda.fwd_varlen_causal_schedule(
+                cu_seqlens, cu_seqlens, nheads, block_m, block_n, num_workers, planned
+            )
+            desc = "planned" if planned else "bottom-up"
+            makespan[desc] = schedule[:, 5].max().item()
+            print(
+                f"{num_workers=}, {max_seqlen=}, varlen {desc}: {schedule.shape[0]} tiles, "
+                f"makespan {makespan[desc]} steps, efficiency {efficiency(schedule, num_workers):.3f}"
+            )
+        print(f"Speedup: {makespan['bottom-up'] / makespan['planned']:.3f}x")
+
+# The CPU backend dispatches the causal forward through the same scheduler.
+repeats = 5
+batch_size, seqlen = 2, 2048
+q, k, v = [torch.randn(batch_size, seqlen, nheads, headdim, dtype=torch.bfloat16) for _ in range(3)]
+timer = benchmark.Timer(
+    stmt="flash_attn_cuda.fwd(q, k, v, None, None, 0.0, headdim ** -0.5, True, -1, -1, False, None, 0, None, None, None, None, None, None, False, None)",
+    globals=dict(flash_attn_cuda=flash_attn_cuda, q=q, k=k, v=v, headdim=headdim),
+    num_threads=torch.get_num_threads(),
+    label="CPU causal forward",
+)
+print(timer.timeit(repeats))
+
+# Per-tile trace of one CPU causal forward: the tail is how long the last worker runs on after the
+# others are done. Open flash_fwd_causal_trace.json in chrome://tracing or Perfetto.
+flash_attn_cuda.fwd_tile_trace_start(batch_size * nheads * ((seqlen + block_m - 1) // block_m))
+flash_attn_cuda.fwd(q, k, v, None, None, 0.0, headdim ** -0.5, True, -1, -1, False, None, 0, None, None, None, None, None, None, False, None)
+records, _, trace_json = flash_attn_cuda.fwd_tile_trace_stop()
+with open("flash_fwd_causal_trace.json", "w") as f:
+    f.write(trace_json)
+worker, start, end = records[:, 4], records[:, 6], records[:, 7]
+worker_end = torch.stack([end[worker == w].max() for w in worker.unique()])
+t0 = start.min()
+print(
+    f"CPU causal forward trace: {records.shape[0]} tiles on {worker_end.numel()} workers, makespan "
+    f"{(end.max() - t0).item() / 1e6:.2f} ms, tail {(worker_end.max() - worker_end.min()).item() / 1e6:.2f} ms"
+)
+
+seqlens = torch.tensor([2048, 17, 300, 1024, 64, 1500, 128, 900], dtype=torch.int32)
+cu_seqlens = torch.nn.functional.pad(seqlens.cumsum(0, dtype=torch.int32), (1, 0))
+q, k, v = [torch.randn(seqlens.sum().item(), nheads, headdim, dtype=torch.bfloat16) for _ in range(3)]
+timer = benchmark.Timer(
+    stmt="flash_attn_cuda.varlen_fwd(q, k, v, None, cu_seqlens, cu_seqlens, None, max_seqlen, max_seqlen, "
+    "0.0, headdim ** -0.5, False, True, -1, -1, False, None, None, None, False)",
+    globals=dict(
+        flash_attn_cuda=flash_attn_cuda, q=q, k=k, v=v, cu_seqlens=cu_seqlens,
+        max_seqlen=seqlens.max().item(), headdim=headdim,
+    ),
+    num_threads=torch.get_num_threads(),
+    label="CPU varlen causal forward",
+)
+print(timer.timeit(repeats))
+
+# Decoding: few queries against a long KV cache leave most workers idle without split-KV.
+batch_size, seqlen_q, seqlen_k = 1, 1, 16384
+q = torch.randn(batch_size, seqlen_q, nheads, headdim, dtype=torch.bfloat16)
+k, v = [torch.randn(batch_size, seqlen_k, nheads, headdim, dtype=torch.bfloat16) for _ in range(2)]
+for num_splits in [1, 0]:
+    timer = benchmark.Timer(
+        stmt="flash_attn_cuda.fwd(q, k, v, None, None, 0.0, headdim ** -0.5, False, -1, -1, False, None, num_splits, None, None, None, None, None, None, False, None)",
+        globals=dict(flash_attn_cuda=flash_attn_cuda, q=q, k=k, v=v, headdim=headdim, num_splits=num_splits),
+        num_threads=torch.get_num_threads(),
+        label=f"CPU decode forward, num_splits={num_splits or 'heuristic'}",
+    )
+    print(timer.timeit(repeats))
+
+# Sliding window: the tiles outside the window of every row of a row block are skipped.
+batch_size, seqlen = 1, 8192
+q, k, v = [torch.randn(batch_size, seqlen, nheads, headdim, dtype=torch.bfloat16) for _ in range(3)]
+for window_size in [(-1, -1), (-1, 0), (1024, 0), (256, 256)]:
+    computed, skipped = flash_attn_cuda.fwd_local_tile_count(seqlen, seqlen, block_m, block_n, *window_size)
+    timer = benchmark.Timer(
+        stmt="flash_attn_cuda.fwd(q, k, v, None, None, 0.0, headdim ** -0.5, False, wl, wr, False, None, 0, None, None, None, None, None, None, False, None)",
+        globals=dict(
+            flash_attn_cuda=flash_attn_cuda, q=q, k=k, v=v, headdim=headdim, wl=window_size[0], wr=window_size[1]
+        ),
+        num_threads=torch.get_num_threads(),
+        label=f"CPU forward, {window_size=}: {computed} tiles computed, {skipped} skipped",
+    )
+    print(timer.timeit(repeats))
@@ -0,0 +1,54 @@
+# Speculative decoding on the GPU: few_query_attention, the num_queries drafts of each sequence in one
+# launch that reads the KV cache once, against num_queries single_query_attention calls one after the
+# other, each reading the whole cache. Reports the time of a step and the cache bandwidth of the
+# few-query kernel.
+import torch
+import torch.utils.benchmark as benchmark
+from einops import rearrange
+
+import ft_attention
+
+
+def pack_k_cache(k_cache):
+    return rearrange(k_cache, "b h s (d x) -> b h d s x", x=8).contiguous()
+
+
+def sequential_single_query(q, k, v, k_cache, v_cache, lengths):
+    for j in range(q.shape[1]):
+        ft_attention.single_query_attention(
+            q[:, j], k[:, j], v[:, j], k_cache, v_cache, lengths + j, None, None, None, 0
+        )
+
+
+repeats = 30
+device, dtype = "cuda", torch.float16
+batch_size, nheads, nheads_kv, headdim = 8, 32, 8, 128
+torch.random.manual_seed(0)
+for seqlen in [1024, 4096, 16384]:
+    k_cache = pack_k_cache(torch.randn(batch_size, nheads_kv, seqlen, headdim, device=device, dtype=dtype))
+    v_cache = torch.randn(batch_size, nheads_kv, seqlen, headdim, device=device, dtype=dtype)
+    cache_bytes = k_cache.numel() * k_cache.element_size() + v_cache.numel() * v_cache.element_size()
+    for num_queries in [2, 4, 8]:
+        lengths = torch.full((batch_size,), seqlen - num_queries, dtype=torch.int32, device=device)
+        q = torch.randn(batch_size, num_queries, nheads, headdim, device=device, dtype=dtype)
+        k, v = [torch.randn(batch_size, num_queries, nheads_kv, headdim, device=device, dtype=dtype) for _ in range(2)]
+        inputs = dict(q=q, k=k, v=v, k_cache=k_cache, v_cache=v_cache, lengths=lengths)
+        fused = benchmark.Timer(
+            stmt="ft_attention.few_query_attention(q, k, v, k_cache, v_cache, lengths, 0)",
+            globals=dict(ft_attention=ft_attention, **inputs),
+            label=f"{seqlen=}, {num_queries=}, few_query_attention",
+        ).timeit(repeats)
+        sequential = benchmark.Timer(
+            stmt="sequential_single_query(q, k, v, k_cache, v_cache, lengths)",
+            globals=dict(sequential_single_query=sequential_single_query, **inputs),
+            label=f"{seqlen=}, {num_queries=}, {num_queries} x single_query_attention",
+        ).timeit(repeats)
+        print(fused)
+        print(sequential)
+        # The cache is read once per KV head group by each of its query heads.
+        cache_read = cache_bytes * nheads // nheads_kv
+        print(
+            f"{seqlen=}, {num_queries=}: few-query {fused.mean * 1e6:.1f} us "
+            f"({cache_read / fused.mean / 1e9:.0f} GB/s of cache), "
+            f"sequential {sequential.mean * 1e6:.1f} us, speedup {sequential.mean / fused.mean:.2f}x"
+        )
@@ -0,0 +1,309 @@
+// Copyright (c) 2023, Tri Dao.
+
+// Microbenchmarks of the flash_api entry points, called directly from C++ without Python in the way:
+// mha_fwd, mha_varlen_fwd and mha_bwd, on CUDA or on the CPU backend. mha_bwd_deterministic is
+// mha_bwd with deterministic=true, for the cost of reducing dQ in order rather than atomically.
+// Sweeps (batch, seqlen, heads, hdim, causal, dtype), prints time, TFLOP/s and bytes moved per
+// benchmark, and writes the results in the JSON format of Google Benchmark, so they can be compared
+// across builds with its tools/compare.py.
+//
+// Build and run with benchmarks/build_benchmark_flash_api.py, which forwards its arguments:
+//   --device=cpu|cuda               default: cuda if there's a GPU, else cpu
+//   --entries=mha_fwd,mha_varlen_fwd,mha_bwd,mha_bwd_deterministic
+//   --batch=2,8 --seqlen=512,2048 --heads=16 --hdim=64,128 --causal=0,1 --dtype=fp16,bf16
+//   --benchmark_filter=<regex>      only the benchmarks whose name matches
+//   --benchmark_min_time=<seconds>  per benchmark, default 0.5
+//   --benchmark_out=<file.json>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <torch/torch.h>
+
+std::vector<at::Tensor>
+mha_fwd(const at::Tensor &q, const at::Tensor &k, const at::Tensor &v, c10::optional<at::Tensor> &out_,
+        c10::optional<at::Tensor> &alibi_slopes_, const float p_dropout, const float softmax_scale, bool is_causal,
+        int window_size_left, int window_size_right, const bool return_softmax, c10::optional<at::Generator> gen_,
+        const int num_splits, c10::optional<at::Tensor> &block_table_, c10::optional<at::Tensor> &k_new_,
+        c10::optional<at::Tensor> &v_new_, c10::optional<at::Tensor> &cache_seqlens_,
+        c10::optional<at::Tensor> &rotary_cos_, c10::optional<at::Tensor> &rotary_sin_,
+        const bool is_rotary_interleaved, c10::optional<at::Tensor> &softmax_lse_);
+
+std::vector<at::Tensor>
+mha_varlen_fwd(const at::Tensor &q, const at::Tensor &k, const at::Tensor &v, c10::optional<at::Tensor> &out_,
+               const at::Tensor &cu_seqlens_q, const at::Tensor &cu_seqlens_k, c10::optional<at::Tensor> &alibi_slopes_,
+               const int max_seqlen_q, const int max_seqlen_k, const float p_dropout, const float softmax_scale,
+               const bool zero_tensors, bool is_causal, int window_size_left, int window_size_right,
+               const bool return_softmax, c10::optional<at::Generator> gen_, c10::optional<at::Tensor> &rotary_cos_,
+               c10::optional<at::Tensor> &rotary_sin_, const bool is_rotary_interleaved);
+
+std::vector<at::Tensor>
+mha_bwd(const at::Tensor &dout, const at::Tensor &q, const at::Tensor &k, const at::Tensor &v, const at::Tensor &out,
+        const at::Tensor &softmax_lse, c10::optional<at::Tensor> &dq_, c10::optional<at::Tensor> &dk_,
+        c10::optional<at::Tensor> &dv_, c10::optional<at::Tensor> &alibi_slopes_, const float p_dropout,
+        const float softmax_scale, bool is_causal, int window_size_left, int window_size_right,
+        const bool deterministic, c10::optional<at::Generator> gen_, c10::optional<at::Tensor> &rng_state);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Benchmark_case {
+    std::string entry;
+    bool is_cuda;
+    int batch, seqlen, heads, hdim;
+    bool causal;
+    bool is_bf16;
+
+    bool is_bwd() const { return entry == "mha_bwd" || entry == "mha_bwd_deterministic"; }
+
+    std::string name() const {
+        std::ostringstream name;
+        name << "BM_" << entry << "/" << (is_cuda ? "cuda" : "cpu") << "/" << (is_bf16 ? "bf16" : "fp16")
+             << "/batch:" << batch << "/seqlen:" << seqlen << "/heads:" << heads << "/hdim:" << hdim
+             << "/causal:" << causal;
+        return name.str();
+    }
+
+    // Same count as flops() in benchmark_flash_attention.py.
+    double flops() const {
+        const double f = 4.0 * batch * double(seqlen) * seqlen * heads * hdim / (causal ? 2 : 1);
+        return is_bwd() ? 2.5 * f : f;
+    }
+
+    // Bytes read and written by one call: Q, K, V and O, and the fp32 LSE. The backward also reads
+    // dO and writes dQ, dK, dV, and its fp32 dot(dO, O). The dQ accumulators are not counted, so
+    // that both flavours of the backward are measured against the same traffic.
+    double bytes() const {
+        const double qkvo = double(batch) * seqlen * heads * hdim * 2;  // fp16 / bf16
+        const double rows = double(batch) * heads * seqlen * 4;
+        return is_bwd() ? 8 * qkvo + 2 * rows : 4 * qkvo + rows;
+    }
+};
+
+struct Benchmark_result {
+    Benchmark_case config;
+    int64_t iterations;
+    double real_time_us;
+    double cpu_time_us;
+    std::string skipped;  // Why it didn't run, empty if it did.
+};
+
+// Runs fn until min_time is spent (at least one iteration after the warmup), waiting for the device
+// after each batch of iterations like Google Benchmark's UseRealTime.
+Benchmark_result run_benchmark(const Benchmark_case &config, const std::function<void()> &fn, const double min_time) {
+    auto sync = [&] { if (config.is_cuda) { torch::cuda::synchronize(); } };
+    fn();  // Warmup, also builds the launch config cache.
+    sync();
+    int64_t iterations = 0;
+    double elapsed = 0, cpu_elapsed = 0;
+    for (int64_t batch = 1; elapsed < min_time; batch = std::min<int64_t>(batch * 2, 1 << 20)) {
+        const auto start = std::chrono::steady_clock::now();
+        const std::clock_t cpu_start = std::clock();
+        for (int64_t i = 0; i < batch; ++i) { fn(); }
+        sync();
+        elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cpu_elapsed += double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+        iterations += batch;
+    }
+    return {config, iterations, elapsed / iterations * 1e6, cpu_elapsed / iterations * 1e6, ""};
+}
+
+Benchmark_result run_case(const Benchmark_case &config, const double min_time) {
+    const auto opts = torch::dtype(config.is_bf16 ? torch::kBFloat16 : torch::kFloat16)
+                          .device(config.is_cuda ? torch::kCUDA : torch::kCPU);
+    const float softmax_scale = 1.f / std::sqrt(float(config.hdim));
+    c10::optional<at::Tensor> none;
+    if (config.entry == "mha_varlen_fwd") {
+        const int total = config.batch * config.seqlen;
+        const at::Tensor q = torch::randn({total, config.heads, config.hdim}, opts);
+        const at::Tensor k = torch::randn({total, config.heads, config.hdim}, opts);
+        const at::Tensor v = torch::randn({total, config.heads, config.hdim}, opts);
+        const at::Tensor cu_seqlens = torch::arange(0, total + 1, config.seqlen,
+                                                    torch::dtype(torch::kInt32).device(opts.device()));
+        c10::optional<at::Tensor> out = torch::empty_like(q);
+        return run_benchmark(config, [&] {
+            mha_varlen_fwd(q, k, v, out, cu_seqlens, cu_seqlens, none, config.seqlen, config.seqlen, 0.f, softmax_scale,
+                           false, config.causal, -1, -1, false, c10::nullopt, none, none, false);
+        }, min_time);
+    }
+    const at::Tensor q = torch::randn({config.batch, config.seqlen, config.heads, config.hdim}, opts);
+    const at::Tensor k = torch::randn({config.batch, config.seqlen, config.heads, config.hdim}, opts);
+    const at::Tensor v = torch::randn({config.batch, config.seqlen, config.heads, config.hdim}, opts);
+    c10::optional<at::Tensor> out = torch::empty_like(q);
+    auto fwd = [&] {
+        return mha_fwd(q, k, v, out, none, 0.f, softmax_scale, config.causal, -1, -1, false, c10::nullopt,
+                       /*num_splits=*/1, none, none, none, none, none, none, false, none);
+    };
+    if (config.entry == "mha_fwd") { return run_benchmark(config, [&] { fwd(); }, min_time); }
+    const auto fwd_out = fwd();
+    const at::Tensor o = fwd_out[0], softmax_lse = fwd_out[5];
+    const at::Tensor dout = torch::randn_like(q);
+    c10::optional<at::Tensor> dq = torch::empty_like(q), dk = torch::empty_like(k), dv = torch::empty_like(v);
+    const bool deterministic = config.entry == "mha_bwd_deterministic";
+    return run_benchmark(config, [&] {
+        mha_bwd(dout, q, k, v, o, softmax_lse, dq, dk, dv, none, 0.f, softmax_scale, config.causal, -1, -1,
+                deterministic, c10::nullopt, none);
+    }, min_time);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');) {
+        if (!item.empty()) { items.push_back(item); }
+    }
+    return items;
+}
+
+std::vector<int> split_ints(const std::string &list) {
+    std::vector<int> values;
+    for (const auto &item : split(list)) { values.push_back(std::stoi(item)); }
+    return values;
+}
+
+std::string json_escape(const std::string &s) {
+    std::string escaped;
+    for (const char c : s) {
+        if (c == '"' || c == '\\') { escaped += '\\'; }
+        escaped += c;
+    }
+    return escaped;
+}
+
+void write_json(std::ostream &out, const std::string &executable, const std::vector<Benchmark_result> &results) {
+    char host_name[256] = {0};
+    gethostname(host_name, sizeof(host_name) - 1);
+    char date[64];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": \"" << date << "\",\n"
+        << "    \"host_name\": \"" << json_escape(host_name) << "\",\n"
+        << "    \"executable\": \"" << json_escape(executable) << "\",\n"
+        << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"num_threads\": " << at::get_num_threads() << ",\n"
+        << "    \"library_build_type\": \"release\"\n"
+        << "  },\n  \"benchmarks\": [";
+    bool first = true;
+    for (const auto &result : results) {
+        if (!result.skipped.empty()) { continue; }
+        const auto &config = result.config;
+        const double seconds = result.real_time_us * 1e-6;
+        out << (first ? "\n" : ",\n") << "    {\n"
+            << "      \"name\": \"" << config.name() << "\",\n"
+            << "      \"run_name\": \"" << config.name() << "\",\n"
+            << "      \"run_type\": \"iteration\",\n"
+            << "      \"iterations\": " << result.iterations << ",\n"
+            << "      \"real_time\": " << result.real_time_us << ",\n"
+            << "      \"cpu_time\": " << result.cpu_time_us << ",\n"
+            << "      \"time_unit\": \"us\",\n"
+            << "      \"TFLOPS\": " << config.flops() / seconds * 1e-12 << ",\n"
+            << "      \"bytes\": " << config.bytes() << ",\n"
+            << "      \"bytes_per_second\": " << config.bytes() / seconds << "\n"
+            << "    }";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char **argv) {
+    const bool has_cuda = torch::cuda::is_available();
+    std::string device = has_cuda ? "cuda" : "cpu", filter = ".*", out_path;
+    std::string entries = "mha_fwd,mha_varlen_fwd,mha_bwd,mha_bwd_deterministic", dtypes = "fp16,bf16";
+    std::string batches, seqlens, heads = "16", hdims = "64,128", causals = "0,1";
+    double min_time = 0.5;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const auto eq = arg.find('=');
+        const std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--device") { device = value; }
+        else if (key == "--entries") { entries = value; }
+        else if (key == "--batch") { batches = value; }
+        else if (key == "--seqlen") { seqlens = value; }
+        else if (key == "--heads") { heads = value; }
+        else if (key == "--hdim") { hdims = value; }
+        else if (key == "--causal") { causals = value; }
+        else if (key == "--dtype") { dtypes = value; }
+        else if (key == "--benchmark_filter") { filter = value; }
+        else if (key == "--benchmark_min_time") { min_time = std::stod(value); }
+        else if (key == "--benchmark_out") { out_path = value; }
+        else {
+            std::cerr << "Unknown argument " << arg << ", see the top of benchmark_flash_api.cpp" << std::endl;
+            return 1;
+        }
+    }
+    if (device != "cpu" && device != "cuda") {
+        std::cerr << "--device must be cpu or cuda" << std::endl;
+        return 1;
+    }
+    if (device == "cuda" && !has_cuda) {
+        std::cerr << "No CUDA device" << std::endl;
+        return 1;
+    }
+    const bool is_cuda = device == "cuda";
+    // The CPU backend is a reference implementation, its default sweep is kept small.
+    if (batches.empty()) { batches = is_cuda ? "2,8" : "1"; }
+    if (seqlens.empty()) { seqlens = is_cuda ? "512,2048,8192" : "256,1024"; }
+
+    std::vector<Benchmark_case> cases;
+    const std::regex filter_regex(filter);
+    for (const auto &entry : split(entries)) {
+        for (const auto &dtype : split(dtypes)) {
+            for (const int batch : split_ints(batches)) {
+                for (const int seqlen : split_ints(seqlens)) {
+                    for (const int nheads : split_ints(heads)) {
+                        for (const int hdim : split_ints(hdims)) {
+                            for (const int causal : split_ints(causals)) {
+                                const Benchmark_case config{entry, is_cuda, batch, seqlen, nheads, hdim, causal != 0, dtype == "bf16"};
+                                if (std::regex_search(config.name(), filter_regex)) { cases.push_back(config); }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<Benchmark_result> results;
+    std::printf("%-90s %14s %12s %10s %14s\n", "Benchmark", "Time", "Iterations", "TFLOP/s", "Bytes");
+    for (const auto &config : cases) {
+        Benchmark_result result;
+        try {
+            result = run_case(config, min_time);
+        } catch (const c10::Error &e) {
+            result = {config, 0, 0, 0, e.what_without_backtrace()};
+        }
+        if (!result.skipped.empty()) {
+            std::printf("%-90s SKIPPED: %s\n", config.name().c_str(), result.skipped.c_str());
+        } else {
+            std::printf("%-90s %11.1f us %12lld %10.3f %14.0f\n", config.name().c_str(), result.real_time_us,
+                        (long long)result.iterations, config.flops() / (result.real_time_us * 1e-6) * 1e-12,
+                        config.bytes());
+        }
+        std::fflush(stdout);
+        results.push_back(result);
+    }
+    if (!out_path.empty()) {
+        std::ofstream out(out_path);
+        write_json(out, argv[0], results);
+        if (!out) {
+            std::cerr << "Could not write " << out_path << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
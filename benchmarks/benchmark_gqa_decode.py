@@ -0,0 +1,46 @@
+# GQA / MQA decoding: the query heads of a KV head group folded into one row block, against one row
+# block per query head. Reports the bytes the forward loads per output element, from the tile
+# counts of the launch, and the time of the CPU backend. Runs without a GPU.
+import torch
+import torch.utils.benchmark as benchmark
+from einops import repeat
+
+import flash_attn_2_cuda as flash_attn_cuda
+
+
+def bytes_per_output(batch_size, nheads, nheads_k, seqlen_k, headdim, grouped, block_m=128, elem_size=2):
+    """Every row block reads Q once and all of K and V of its KV head, and writes O once."""
+    ngroups = nheads // nheads_k
+    if grouped:
+        num_row_blocks = batch_size * nheads_k * ((ngroups + block_m - 1) // block_m)
+    else:
+        num_row_blocks = batch_size * nheads
+    kv_bytes = num_row_blocks * 2 * seqlen_k * headdim * elem_size
+    qo_bytes = 2 * batch_size * nheads * headdim * elem_size
+    return (kv_bytes + qo_bytes) / (batch_size * nheads * headdim)
+
+
+repeats = 5
+batch_size, headdim, nheads = 4, 128, 32
+for nheads_k in [32, 8, 4, 1]:
+    for seqlen_k in [2048, 16384]:
+        q = torch.randn(batch_size, 1, nheads, headdim, dtype=torch.bfloat16)
+        k, v = [torch.randn(batch_size, seqlen_k, nheads_k, headdim, dtype=torch.bfloat16) for _ in range(2)]
+        # Repeating K / V for every query head gives the per-head row blocks the same inputs.
+        k_rep, v_rep = [repeat(x, "b s h d -> b s (h g) d", g=nheads // nheads_k) for x in (k, v)]
+        for grouped in [False, True]:
+            desc = "grouped" if grouped else "per-head"
+            timer = benchmark.Timer(
+                stmt="flash_attn_cuda.fwd(q, k, v, None, None, 0.0, headdim ** -0.5, False, -1, -1, False, None, 0, None, None, None, None, None, None, False, None)",
+                globals=dict(
+                    flash_attn_cuda=flash_attn_cuda, q=q, k=k if grouped else k_rep, v=v if grouped else v_rep,
+                    headdim=headdim,
+                ),
+                num_threads=torch.get_num_threads(),
+                label=(
+                    f"CPU decode, {nheads}:{nheads_k} heads, {seqlen_k=}, {desc}: "
+                    f"{bytes_per_output(batch_size, nheads, nheads_k, seqlen_k, headdim, grouped):.0f} "
+                    "bytes loaded per output element"
+                ),
+            )
+            print(timer.timeit(repeats))
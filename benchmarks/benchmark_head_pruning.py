@@ -0,0 +1,70 @@
+# Online head pruning (HeadPruningPolicy) in a decode loop of single_query_attention on the CPU backend:
+# the time of a decoding step against the relative error of the attention output, after the output
+# projection, with respect to attending all the heads. The heads get values of different scales, as
+# trained models have heads that contribute little. Runs without a GPU.
+import time
+
+import torch
+from einops import rearrange
+
+import ft_attention
+from flash_attn.utils.generation import HeadPruningPolicy
+
+
+def pack_k_cache(k_cache):
+    return rearrange(k_cache, "b h s (d x) -> b h d s x", x=8).contiguous()
+
+
+torch.random.manual_seed(0)
+batch_size, nheads, headdim, nlayers = 4, 32, 128, 4
+prompt_len, nsteps = 2048, 64
+max_seqlen = prompt_len + nsteps
+dtype = torch.bfloat16
+# Log-normal head scales: a few heads dominate the output.
+head_scales = torch.exp(2 * torch.randn(nlayers, nheads))
+out_proj = torch.randn(nlayers, nheads * headdim, nheads * headdim) / (nheads * headdim) ** 0.5
+caches = []
+for layer in range(nlayers):
+    k_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, dtype=dtype)
+    v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim) * head_scales[layer, None, :, None, None]
+    caches.append((pack_k_cache(k_cache), v_cache.to(dtype)))
+inputs = [
+    [torch.randn(batch_size, nheads, headdim, dtype=dtype) for _ in range(3)] for _ in range(nsteps * nlayers)
+]
+
+
+def decode(keep_ratio):
+    """Returns the time per step and the outputs of every step and layer, after the output projection."""
+    policy = HeadPruningPolicy(keep_ratio=keep_ratio) if keep_ratio < 1.0 else None
+    step_caches = [(k.clone(), v.clone()) for k, v in caches]
+    outputs, elapsed = [], 0.0
+    for step in range(nsteps):
+        start = time.perf_counter()
+        for layer in range(nlayers):
+            q, k, v = inputs[step * nlayers + layer]
+            v = v * head_scales[layer, :, None].to(dtype)
+            nnz_head_idx = policy.nnz_head_idx(layer) if policy is not None else None
+            context = ft_attention.single_query_attention(
+                q, k, v, *step_caches[layer], None, None, None, nnz_head_idx, prompt_len + step, headdim
+            )
+            if policy is not None:
+                policy.observe(layer, context, nnz_head_idx)
+            outputs.append(context)
+        if policy is not None:
+            policy.step()
+        elapsed += time.perf_counter() - start
+    outputs = [
+        rearrange(o, "b h d -> b (h d)").float() @ out_proj[i % nlayers].T for i, o in enumerate(outputs)
+    ]
+    return elapsed / nsteps, outputs
+
+
+time_ref, outputs_ref = decode(1.0)
+print(f"all heads: {time_ref * 1000:.2f} ms / step")
+for keep_ratio in [0.75, 0.5, 0.25, 0.125]:
+    time_step, outputs = decode(keep_ratio)
+    rel_err = torch.stack([(o - r).norm() / r.norm() for o, r in zip(outputs, outputs_ref)])
+    print(
+        f"{keep_ratio=}: {time_step * 1000:.2f} ms / step, {time_ref / time_step:.2f}x, "
+        f"relative error of the output mean {rel_err.mean().item():.3f}, max {rel_err.max().item():.3f}"
+    )
@@ -0,0 +1,62 @@
+# 8-bit KV cache of single_query_attention: the cache bytes per token against the error of the
+# output, for the fp16 cache and the int8 / fp8 e4m3 ones with a scale per head and token, and the
+# time of a decoding step on the CPU backend. Runs without a GPU.
+import math
+
+import torch
+import torch.utils.benchmark as benchmark
+from einops import rearrange
+
+import ft_attention
+from flash_attn.utils.generation import dequantize_kv_cache, quantize_kv_cache
+
+
+def pack_k_cache(k_cache):
+    return rearrange(k_cache, "b h s (d x) -> b h d s x", x=8).contiguous()
+
+
+def attention_fp32(q, k_cache, v_cache):
+    """q: (batch_size, nheads, headdim), k_cache, v_cache: (batch_size, nheads_kv, seqlen, headdim)."""
+    g = q.shape[1] // k_cache.shape[1]
+    k, v = [x.float().repeat_interleave(g, dim=1) for x in (k_cache, v_cache)]
+    scores = torch.einsum("bhd,bhsd->bhs", q.float() / math.sqrt(q.shape[-1]), k)
+    return torch.einsum("bhs,bhsd->bhd", torch.softmax(scores, dim=-1), v)
+
+
+repeats = 5
+batch_size, nheads, nheads_kv, headdim = 4, 32, 8, 128
+for seqlen in [1024, 8192]:
+    q = torch.randn(batch_size, nheads, headdim, dtype=torch.float16)
+    # The new key and value of the step are the last ones of the caches.
+    k_full, v_full = [torch.randn(batch_size, nheads_kv, seqlen, headdim) for _ in range(2)]
+    k, v = [x[:, :, -1].to(torch.float16) for x in (k_full, v_full)]
+    out_ref = attention_fp32(q, k_full.half(), v_full.half())
+    for quant_dtype in [None, torch.int8, torch.uint8]:
+        if quant_dtype is None:
+            desc, scales = "fp16", {}
+            k_cache, v_cache = pack_k_cache(k_full.half()), v_full.half()
+            bytes_per_token = 2 * nheads_kv * headdim * 2
+        else:
+            desc = "int8" if quant_dtype == torch.int8 else "fp8 e4m3"
+            (k_cache, k_scale), (v_cache, v_scale) = [quantize_kv_cache(x, quant_dtype) for x in (k_full, v_full)]
+            k_cache = pack_k_cache(k_cache)
+            scales = dict(k_cache_scale_=k_scale, v_cache_scale_=v_scale)
+            bytes_per_token = 2 * nheads_kv * (headdim + 4)
+        lengths = torch.full((batch_size,), seqlen - 1, dtype=torch.int32)
+        out = ft_attention.single_query_attention(
+            q, k, v, k_cache, v_cache, lengths, None, None, None, seqlen - 1, **scales
+        )
+        err = (out.float() - out_ref).abs()
+        timer = benchmark.Timer(
+            stmt="ft_attention.single_query_attention(q, k, v, k_cache, v_cache, lengths, None, None, None, seqlen - 1, **scales)",
+            globals=dict(
+                ft_attention=ft_attention, q=q, k=k, v=v, k_cache=k_cache, v_cache=v_cache, lengths=lengths,
+                seqlen=seqlen, scales=scales,
+            ),
+            num_threads=torch.get_num_threads(),
+            label=(
+                f"CPU decode, {seqlen=}, {desc} cache: {bytes_per_token} bytes per token and layer, "
+                f"output max err {err.max().item():.2e}, mean err {err.mean().item():.2e}"
+            ),
+        )
+        print(timer.timeit(repeats))
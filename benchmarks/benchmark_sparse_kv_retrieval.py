@@ -0,0 +1,76 @@
+# Sparse top-k page retrieval of single_query_attention: the time of a decoding step with long caches,
+# attending every timestep or only the top_k_pages pages of page_size timesteps (by the min / max key
+# summary of kv_page_summary) plus a recent window, and the error of the output with respect to exact
+# attention. Each head has a few keys close to its query among weak ones, as the retrieval heads of
+# long-context models do. Runs on the GPU when there is one, else on the CPU backend. On the GPU the
+# dense kernel keeps a logit per cached timestep in shared memory and cannot launch with the longest
+# caches, the sparse one only keeps those of the timesteps it attends.
+import math
+
+import torch
+import torch.utils.benchmark as benchmark
+from einops import rearrange
+
+import ft_attention
+from flash_attn.utils.generation import kv_page_summary
+
+
+def pack_k_cache(k_cache):
+    return rearrange(k_cache, "b h s (d x) -> b h d s x", x=8).contiguous()
+
+
+def attention_ref(q, k, v, k_cache, v_cache, length):
+    """Exact attention of q over the first length cached timesteps and the new key / value."""
+    keys = torch.cat([k_cache[:, :, :length], k[:, :, None]], dim=2).float()
+    values = torch.cat([v_cache[:, :, :length], v[:, :, None]], dim=2).float()
+    q = rearrange(q.float(), "b (h g) d -> b h g d", h=k.shape[1]) / math.sqrt(q.shape[-1])
+    probs = torch.softmax(torch.einsum("bhgd,bhsd->bhgs", q, keys), dim=-1)
+    return rearrange(torch.einsum("bhgs,bhsd->bhgd", probs, values), "b h g d -> b (h g) d")
+
+
+repeats = 5
+device = "cuda" if torch.cuda.is_available() else "cpu"
+batch_size, nheads, nheads_kv, headdim = 1, 32, 8, 128
+page_size, recent_window, num_needles = 64, 256, 16
+# The longest cache whose logits (and their fp16 copies) fit in the shared memory of a block.
+max_dense_seqlen = 32 * 1024 if device == "cuda" else None
+dtype = torch.float16
+torch.random.manual_seed(0)
+for seqlen in [16 * 1024, 64 * 1024, 128 * 1024]:
+    length = seqlen - 1
+    q = torch.randn(batch_size, nheads, headdim, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, nheads_kv, headdim, device=device, dtype=dtype) for _ in range(2)]
+    k_cache = 0.1 * torch.randn(batch_size, nheads_kv, seqlen, headdim, device=device)
+    v_cache = torch.randn(batch_size, nheads_kv, seqlen, headdim, device=device, dtype=dtype)
+    # The needles of each KV head, close to the mean query of its group.
+    q_group = rearrange(q.float(), "b (h g) d -> b h g d", h=nheads_kv).mean(dim=2)
+    positions = torch.randint(length - recent_window, (batch_size, nheads_kv, num_needles), device=device)
+    needles = 1.5 * q_group[:, :, None].expand(-1, -1, num_needles, -1)
+    k_cache.scatter_(2, positions[..., None].expand(-1, -1, -1, headdim), needles)
+    k_cache = k_cache.to(dtype)
+    out_ref = attention_ref(q, k, v, k_cache, v_cache, length)
+    k_cache = pack_k_cache(k_cache)
+    lengths = torch.full((batch_size,), length, dtype=torch.int32, device=device)
+    page_summary = kv_page_summary(k_cache, page_size, lengths)
+    args = (q, k, v, k_cache, v_cache, lengths, None, None, None, length)
+    for top_k_pages in [None, 16, 64]:
+        if top_k_pages is None and max_dense_seqlen is not None and seqlen > max_dense_seqlen:
+            print(f"{device} decode, {seqlen=}: dense attention does not fit in shared memory")
+            continue
+        sparse = {} if top_k_pages is None else dict(
+            page_summary_=page_summary.clone(), page_size=page_size, top_k_pages=top_k_pages,
+            recent_window=recent_window,
+        )
+        out = ft_attention.single_query_attention(*args, **sparse)
+        err = (out.float() - out_ref).abs()
+        attended = seqlen if top_k_pages is None else top_k_pages * page_size + recent_window
+        timer = benchmark.Timer(
+            stmt="ft_attention.single_query_attention(*args, **sparse)",
+            globals=dict(ft_attention=ft_attention, args=args, sparse=sparse),
+            num_threads=torch.get_num_threads(),
+            label=(
+                f"{device} decode, {seqlen=}, {top_k_pages=}: attends up to {attended} timesteps, "
+                f"output max err {err.max().item():.2e}, mean err {err.mean().item():.2e}"
+            ),
+        )
+        print(timer.timeit(repeats))
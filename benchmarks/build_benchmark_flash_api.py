@@ -0,0 +1,53 @@
+# Builds benchmark_flash_api.cpp into a standalone executable, linked against libtorch and the same
+# sources as the flash_attn_2_cuda extension (without its Python bindings), and runs it. Arguments
+# are passed through, e.g.
+#   python benchmarks/build_benchmark_flash_api.py --device=cpu --benchmark_out=flash_api.json
+# The build is cached under the torch extensions directory, only changed sources are rebuilt.
+import glob
+import os
+import subprocess
+import sys
+
+from torch.utils.cpp_extension import load
+
+this_dir = os.path.dirname(os.path.abspath(__file__))
+csrc_dir = os.path.join(this_dir, "..", "csrc")
+flash_dir = os.path.join(csrc_dir, "flash_attn")
+
+sources = (
+    [os.path.join(this_dir, "benchmark_flash_api.cpp"), os.path.join(flash_dir, "flash_api.cpp")]
+    + sorted(glob.glob(os.path.join(flash_dir, "src", "flash_*_sm80.cu")))
+    + [os.path.join(flash_dir, "src", "flash_fwd_cpu.cpp"), os.path.join(flash_dir, "src", "flash_bwd_cpu.cpp")]
+)
+
+# Same flags as setup.py.
+executable = load(
+    name="benchmark_flash_api",
+    sources=sources,
+    extra_cflags=["-O3", "-std=c++17", "-DFLASH_ATTN_NO_PYTHON"],
+    extra_cuda_cflags=[
+        "-O3",
+        "-std=c++17",
+        "-DFLASH_ATTN_NO_PYTHON",
+        "-U__CUDA_NO_HALF_OPERATORS__",
+        "-U__CUDA_NO_HALF_CONVERSIONS__",
+        "-U__CUDA_NO_HALF2_OPERATORS__",
+        "-U__CUDA_NO_BFLOAT16_CONVERSIONS__",
+        "--expt-relaxed-constexpr",
+        "--expt-extended-lambda",
+        "--use_fast_math",
+        "-gencode",
+        "arch=compute_80,code=sm_80",
+    ],
+    extra_include_paths=[
+        flash_dir,
+        os.path.join(flash_dir, "src"),
+        os.path.join(csrc_dir, "cutlass", "include"),
+    ],
+    extra_ldflags=["-lcuda"],
+    is_python_module=False,
+    is_standalone=True,
+    verbose=True,
+)
+
+sys.exit(subprocess.call([executable] + sys.argv[1:]))
@@ -2,17 +2,60 @@
  * Copyright (c) 2023, Tri Dao.
  ******************************************************************************/
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+// FLASH_ATTN_NO_PYTHON leaves out the Python bindings, for C++ programs calling mha_fwd & co
+// directly, e.g. benchmarks/benchmark_flash_api.cpp.
+#ifdef FLASH_ATTN_NO_PYTHON
+#include <torch/torch.h>
+#else
 #include <torch/extension.h>
+#include <pybind11/functional.h>
+#endif
 #include <ATen/cuda/CUDAContext.h>
 #include <c10/cuda/CUDAGuard.h>
 
 #include <cutlass/numeric_types.h>
 
 #include "flash.h"
+#include "flash_fwd_scheduler.h"
+#include "flash_fwd_tuning.h"
+#include "flash_launch_config.h"
+#include "flash_tile_trace.h"
 #include "static_switch.h"
 
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
 
+// FLASH_ATTENTION_CHECK_KV_APPEND=1 makes the GPU forward check that the k_new / v_new it appends fit in
+// the KV cache, at the cost of a sync with the device per call. The CPU forward always checks.
+bool check_kv_append() {
+    const char *env = std::getenv("FLASH_ATTENTION_CHECK_KV_APPEND");
+    return env != nullptr && std::strcmp(env, "1") == 0;
+}
+
+// The largest element offset into t, the one of its last element for a contiguous tensor.
+int64_t max_offset(const at::Tensor &t) {
+    int64_t offset = 0;
+    for (int64_t i = 0; i < t.dim(); ++i) {
+        if (t.size(i) == 0) { return 0; }
+        offset += (t.size(i) - 1) * std::abs(t.stride(i));
+    }
+    return offset;
+}
+
+// Whether one of the offsets could overflow the 32-bit index_t of the kernels. The bound is 2^31
+// rather than 2^32, as some of the offsets are built up in int before they reach index_t.
+bool exceeds_index32(std::initializer_list<int64_t> max_offsets) {
+    return std::any_of(max_offsets.begin(), max_offsets.end(),
+                       [](const int64_t offset) { return offset >= (int64_t(1) << 31); });
+}
+
 
 void set_params_fprop(Flash_fwd_params &params,
                       // sizes
@@ -38,7 +81,9 @@ void set_params_fprop(Flash_fwd_params &params,
                       void *softmax_lse_d,
                       float p_dropout,
                       float softmax_scale,
-                      bool is_causal) {
+                      bool is_causal,
+                      int window_size_left,
+                      int window_size_right) {
 
     // Reset the parameters
     memset(&params, 0, sizeof(params));
@@ -108,6 +153,66 @@ void set_params_fprop(Flash_fwd_params &params,
     //TORCH_CHECK(p_dropout < 1.f);
 
     params.is_causal = is_causal;
+    // The causal mask has kernels of its own, it doesn't go through the sliding window.
+    params.window_size_left = is_causal ? -1 : window_size_left;
+    params.window_size_right = is_causal ? -1 : window_size_right;
+
+    // P and the LSE are contiguous, (b, h, seqlen_q_rounded, seqlen_k_rounded) and (b, h, seqlen_q).
+    params.is_index64 = exceeds_index32({max_offset(q), max_offset(k), max_offset(v), max_offset(out),
+                                         p_d == nullptr ? 0 : int64_t(b) * h * seqlen_q_rounded * seqlen_k_rounded,
+                                         int64_t(b) * h * seqlen_q});
+}
+
+// A window that covers all of the keys of every query is no window, and (-1, 0) is the causal mask.
+// A left window with is_causal is the window (window_size_left, 0).
+void normalize_window_size(bool &is_causal, int &window_size_left, int &window_size_right,
+                           const int seqlen_q, const int seqlen_k) {
+    TORCH_CHECK(window_size_left >= -1 && window_size_right >= -1, "window_size must be -1 or non-negative");
+    if (window_size_left >= seqlen_q) { window_size_left = -1; }
+    if (window_size_right >= seqlen_k) { window_size_right = -1; }
+    if (is_causal) { window_size_right = 0; }
+    is_causal = window_size_left < 0 && window_size_right == 0;
+}
+
+// ALiBi slopes are fp32, either (num_heads) shared by the batch or (batch_size, num_heads).
+void set_params_alibi(Flash_fwd_params &params, c10::optional<at::Tensor> &alibi_slopes_,
+                      const int batch_size, const int num_heads, const at::Device device) {
+    if (!alibi_slopes_.has_value()) { return; }
+    auto alibi_slopes = alibi_slopes_.value();
+    TORCH_CHECK(alibi_slopes.dtype() == torch::kFloat32, "ALiBi slopes must have dtype fp32");
+    TORCH_CHECK(alibi_slopes.device() == device, "ALiBi slopes must be on the same device as inputs");
+    TORCH_CHECK(alibi_slopes.stride(-1) == 1, "ALiBi slopes tensor must have contiguous last dimension");
+    TORCH_CHECK(alibi_slopes.sizes() == torch::IntArrayRef({num_heads})
+                || alibi_slopes.sizes() == torch::IntArrayRef({batch_size, num_heads}),
+                "ALiBi slopes must have shape (num_heads) or (batch_size, num_heads)");
+    params.alibi_slopes_ptr = alibi_slopes.data_ptr();
+    params.alibi_slopes_batch_stride = alibi_slopes.dim() == 2 ? alibi_slopes.stride(0) : 0;
+}
+
+// Rotary tables are (seqlen_ro, rotary_dim / 2) with the dtype of the inputs, and cover the positions
+// of every query and key.
+void set_params_rotary(Flash_fwd_params &params, c10::optional<at::Tensor> &rotary_cos_,
+                       c10::optional<at::Tensor> &rotary_sin_, const bool is_rotary_interleaved,
+                       const int seqlen_q, const int seqlen_k, const int head_size_og, const at::Tensor &q) {
+    TORCH_CHECK(rotary_cos_.has_value() == rotary_sin_.has_value(), "rotary_cos and rotary_sin must be passed together");
+    if (!rotary_cos_.has_value()) { return; }
+    auto rotary_cos = rotary_cos_.value();
+    auto rotary_sin = rotary_sin_.value();
+    TORCH_CHECK(rotary_cos.dtype() == q.dtype() && rotary_sin.dtype() == q.dtype(),
+                "rotary_cos and rotary_sin must have the same dtype as inputs");
+    TORCH_CHECK(rotary_cos.device() == q.device() && rotary_sin.device() == q.device(),
+                "rotary_cos and rotary_sin must be on the same device as inputs");
+    TORCH_CHECK(rotary_cos.is_contiguous() && rotary_sin.is_contiguous(), "rotary_cos and rotary_sin must be contiguous");
+    TORCH_CHECK(rotary_cos.dim() == 2, "rotary_cos must have shape (seqlen_ro, rotary_dim / 2)");
+    const int seqlen_ro = rotary_cos.size(0);
+    const int rotary_dim = rotary_cos.size(1) * 2;
+    TORCH_CHECK(rotary_dim <= head_size_og, "rotary_dim must be at most head_size");
+    TORCH_CHECK(seqlen_ro >= std::max(seqlen_q, seqlen_k), "cos / sin tables must cover the positions of all queries and keys");
+    CHECK_SHAPE(rotary_sin, seqlen_ro, rotary_dim / 2);
+    params.rotary_cos_ptr = rotary_cos.data_ptr();
+    params.rotary_sin_ptr = rotary_sin.data_ptr();
+    params.rotary_dim = rotary_dim;
+    params.is_rotary_interleaved = is_rotary_interleaved;
 }
 
 void set_params_dgrad(Flash_bwd_params &params,
@@ -141,7 +246,9 @@ void set_params_dgrad(Flash_bwd_params &params,
                       void *dsoftmax_sum_d,
                       float p_dropout,
                       float softmax_scale,
-                      bool is_causal) {
+                      bool is_causal,
+                      int window_size_left,
+                      int window_size_right) {
 
     set_params_fprop(params,
                      b, seqlen_q, seqlen_k, seqlen_q_rounded, seqlen_k_rounded, h, h_k, d, d_rounded,
@@ -154,7 +261,9 @@ void set_params_dgrad(Flash_bwd_params &params,
                      softmax_lse_d,
                      p_dropout,
                      softmax_scale,
-                     is_causal);
+                     is_causal,
+                     window_size_left,
+                     window_size_right);
 
     // Set the pointers and strides.
     params.do_ptr = dout.data_ptr();
@@ -181,8 +290,36 @@ void set_params_dgrad(Flash_bwd_params &params,
     params.dk_accum_ptr = dk_accum_d;
     params.dv_accum_ptr = dv_accum_d;
 
+    // dQ / dK / dV accum are (b, h, seqlen_rounded, d_rounded) in fp32, with h_k heads for dK / dV.
+    params.is_index64 = params.is_index64
+        || exceeds_index32({max_offset(dout), max_offset(dq), max_offset(dk), max_offset(dv),
+                            int64_t(b) * seqlen_q_rounded * h * d_rounded,
+                            int64_t(b) * seqlen_k_rounded * h_k * d_rounded});
+
     // Softmax sum
     params.dsoftmax_sum = dsoftmax_sum_d;
+
+    params.deterministic = false;
+    params.dq_accum_splits = 1;
+    params.dq_accum_split_stride = 0;
+}
+
+// Number of dQ partial buffers of the deterministic backward, one per CTA column of the seqk-parallel
+// grid: enough of them to fill the SMs. The CPU backend takes a fixed count rather than its number of
+// threads, so that its results do not depend on that either.
+int num_dq_accum_splits(const bool deterministic, const int batch_size, const int num_heads, const bool is_cpu) {
+    if (!deterministic) { return 1; }
+    const int num_sm = is_cpu ? 64 : at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+    return std::max(1, (num_sm + batch_size * num_heads - 1) / (batch_size * num_heads));
+}
+
+// dq_accum is (dq_accum_splits, b, h, seqlen_q_rounded, d_rounded) in deterministic mode.
+void set_params_deterministic(Flash_bwd_params &params, const bool deterministic, const at::Tensor &dq_accum) {
+    if (!deterministic) { return; }
+    params.deterministic = true;
+    params.dq_accum_splits = dq_accum.size(0);
+    params.dq_accum_split_stride = dq_accum.stride(0);
+    params.is_index64 = params.is_index64 || exceeds_index32({dq_accum.numel()});
 }
 
 void run_mha_fwd(Flash_fwd_params &params, cudaStream_t stream) {
@@ -194,26 +331,137 @@ void run_mha_fwd(Flash_fwd_params &params, cudaStream_t stream) {
     });
 }
 
+void run_mha_fwd_cpu(Flash_fwd_params &params) {
+    FP16_SWITCH(!params.is_bf16, [&] {
+        FWD_HEADDIM_SWITCH(params.d, [&] {
+            run_mha_fwd_cpu_<elem_type, kHeadDim>(params);
+        });
+    });
+}
+
+// Completion flags of the causal pairing (Flash_fwd_params::complete_flags), sized for kBlockM = 64,
+// the smallest row block of the forward kernels. The caller holds on to the returned tensor until its
+// launch is done.
+// On the CPU the flags are allocated per call: they are cheap next to the forward, and a buffer shared
+// by the callers could be regrown and freed under one of them.
+// On the GPU the consumers hand every flag back at 0, so one buffer per (device, stream) is kept around
+// and reused by the later launches on that stream, and only zeroed when it has to grow. Replacing a
+// buffer is stream ordered, as the caching allocator only hands its memory out again to that stream.
+// At most kMaxFlagStreams streams keep a buffer, the map starts over past that.
+constexpr int kMaxFlagStreams = 16;
+at::Tensor get_complete_flags(const int batch_size, const int num_heads, const int seqlen_q, const at::Device device) {
+    const int64_t num_flags = int64_t(batch_size) * num_heads * ((seqlen_q + 63) / 64);
+    auto opts = torch::dtype(torch::kInt32).device(device);
+    if (device.is_cpu()) { return torch::zeros({num_flags}, opts); }
+    static std::mutex mutex;
+    static std::map<std::pair<int, cudaStream_t>, at::Tensor> flags_cache;
+    const auto key = std::make_pair(int(device.index()), at::cuda::getCurrentCUDAStream().stream());
+    std::lock_guard<std::mutex> lock(mutex);
+    if (flags_cache.size() >= kMaxFlagStreams && flags_cache.count(key) == 0) { flags_cache.clear(); }
+    at::Tensor &flags = flags_cache[key];
+    if (!flags.defined() || flags.numel() < num_flags) {
+        flags = torch::zeros({num_flags}, opts);
+    }
+    return flags;
+}
+
+// Per-tile profiling of the forward (flash_tile_trace.h), off until fwd_tile_trace_start. While it's
+// on, the forwards append their tiles to one ring buffer, allocated on the device of the first of
+// them, until fwd_tile_trace_stop reads it back.
+struct Fwd_tile_trace {
+    std::mutex mutex;
+    bool enabled = false;
+    int capacity = 0;
+    at::Tensor trace;  // (capacity, kTileTraceFields) int64
+    at::Tensor count;  // (1) int64, records appended so far
+};
+
+Fwd_tile_trace &get_fwd_tile_trace() {
+    static Fwd_tile_trace tile_trace;
+    return tile_trace;
+}
+
+void set_params_tile_trace(Flash_fwd_params &params, const at::Device device) {
+    auto &tile_trace = get_fwd_tile_trace();
+    std::lock_guard<std::mutex> lock(tile_trace.mutex);
+    if (!tile_trace.enabled) { return; }
+    if (!tile_trace.trace.defined()) {
+        auto opts = torch::dtype(torch::kInt64).device(device);
+        tile_trace.trace = torch::zeros({tile_trace.capacity, flash::kTileTraceFields}, opts);
+        tile_trace.count = torch::zeros({1}, opts);
+    }
+    TORCH_CHECK(tile_trace.trace.device() == device, "the tile trace records the forwards of one device, ",
+                tile_trace.trace.device(), ", not ", device);
+    params.tile_trace = tile_trace.trace.data_ptr<int64_t>();
+    params.tile_trace_count = reinterpret_cast<unsigned long long *>(tile_trace.count.data_ptr<int64_t>());
+    params.tile_trace_capacity = tile_trace.capacity;
+}
+
+// Number of splits of seqlen_k for the split-KV forward. Splitting fills the machine when there are
+// few (batch, head, m_block) tiles, e.g. in decoding, but every split adds a write and a read of the
+// partial O. So we find the best wave efficiency over the eligible numbers of splits, then take the
+// smallest number of splits within 85% of it. With 48 tiles on 108 SMs, 2 splits (efficiency 0.89)
+// wins over 3 (efficiency 0.67).
+// The block counts are estimates: the tile sizes depend on the kernel traits picked at launch.
+inline int num_splits_heuristic(const int num_tiles, const int num_sms, const int num_n_blocks, int max_splits) {
+    // If we have enough tiles to almost fill the machine, we don't split.
+    if (num_tiles >= 0.8f * num_sms) { return 1; }
+    max_splits = std::min({max_splits, num_sms, num_n_blocks});
+    auto ceil_div = [](const int a, const int b) { return (a + b - 1) / b; };
+    // A number of splits is only eligible if it changes the number of blocks per split: with 64
+    // blocks, 12 splits of 6 blocks are really 11 splits.
+    auto is_eligible = [&](const int n) { return n == 1 || ceil_div(num_n_blocks, n) != ceil_div(num_n_blocks, n - 1); };
+    auto efficiency = [&](const int n) {
+        const float n_waves = float(num_tiles * n) / num_sms;
+        return n_waves / std::ceil(n_waves);
+    };
+    float max_efficiency = 0.f;
+    for (int n = 1; n <= max_splits; ++n) {
+        if (is_eligible(n)) { max_efficiency = std::max(max_efficiency, efficiency(n)); }
+    }
+    for (int n = 1; n <= max_splits; ++n) {
+        if (is_eligible(n) && efficiency(n) >= 0.85f * max_efficiency) { return n; }
+    }
+    return 1;
+}
+
 std::vector<at::Tensor>
 mha_fwd(const at::Tensor &q,         // batch_size x seqlen_q x num_heads x head_size
-        const at::Tensor &k,         // batch_size x seqlen_k x num_heads_k x head_size
-        const at::Tensor &v,         // batch_size x seqlen_k x num_heads_k x head_size
+        const at::Tensor &k,         // batch_size x seqlen_k x num_heads_k x head_size, or num_blocks x page_block_size x num_heads_k x head_size if there's a block_table
+        const at::Tensor &v,         // batch_size x seqlen_k x num_heads_k x head_size, or num_blocks x page_block_size x num_heads_k x head_size if there's a block_table
         c10::optional<at::Tensor> &out_,             // batch_size x seqlen_q x num_heads x head_size
+        c10::optional<at::Tensor> &alibi_slopes_,    // num_heads or batch_size x num_heads
         const float p_dropout,
         const float softmax_scale,
-        const bool is_causal,
+        bool is_causal,
+        int window_size_left,       // -1 for unbounded
+        int window_size_right,      // -1 for unbounded
         const bool return_softmax,
-        c10::optional<at::Generator> gen_) {
+        c10::optional<at::Generator> gen_,
+        const int num_splits,       // Split-KV: 0 for the heuristic, 1 for off
+        c10::optional<at::Tensor> &block_table_,    // batch_size x max_num_blocks_per_seq
+        c10::optional<at::Tensor> &k_new_,          // batch_size x seqlen_new x num_heads_k x head_size
+        c10::optional<at::Tensor> &v_new_,          // batch_size x seqlen_new x num_heads_k x head_size
+        c10::optional<at::Tensor> &cache_seqlens_,  // batch_size
+        c10::optional<at::Tensor> &rotary_cos_,     // seqlen_ro x (rotary_dim / 2)
+        c10::optional<at::Tensor> &rotary_sin_,     // seqlen_ro x (rotary_dim / 2)
+        const bool is_rotary_interleaved,
+        c10::optional<at::Tensor> &softmax_lse_) {  // batch_size x num_heads x seqlen_q, the incoming state with out_
 
     //printf("a\n");
     
-    auto dprops = at::cuda::getCurrentDeviceProperties();
-    // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
-    bool is_sm8x = dprops->major == 8 && dprops->minor >= 0;
-    bool is_sm90 = dprops->major == 9 && dprops->minor == 0;
-    TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
-    // We will support Turing in the near future
-    // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+    // CPU tensors are dispatched to the CPU backend, which has no architecture requirement.
+    const bool is_cpu = q.is_cpu();
+    bool is_sm8x = true, is_sm90 = false;
+    if (!is_cpu) {
+        auto dprops = at::cuda::getCurrentDeviceProperties();
+        // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
+        is_sm8x = dprops->major == 8 && dprops->minor >= 0;
+        is_sm90 = dprops->major == 9 && dprops->minor == 0;
+        TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+        // We will support Turing in the near future
+        // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+    }
     
     auto q_dtype = q.dtype();
     
@@ -225,9 +473,14 @@ mha_fwd(const at::Tensor &q,         // batch_size x seqlen_q x num_heads x head
     TORCH_CHECK(k.dtype() == q_dtype, "query and key must have the same dtype");
     TORCH_CHECK(v.dtype() == q_dtype, "query and value must have the same dtype");
 
-    TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
+    if (is_cpu) {
+        TORCH_CHECK(k.is_cpu() && v.is_cpu(), "Input tensors must all be on the same device");
+        TORCH_CHECK(p_dropout == 0.f, "The CPU backend does not support dropout");
+    } else {
+        TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
+    }
 
     TORCH_CHECK(q.stride(-1) == 1, "Input tensor must have contiguous last dimension");
     TORCH_CHECK(k.stride(-1) == 1, "Input tensor must have contiguous last dimension");
@@ -236,39 +489,139 @@ mha_fwd(const at::Tensor &q,         // batch_size x seqlen_q x num_heads x head
     const auto sizes = q.sizes();
 
     const int batch_size = sizes[0];
-    const int seqlen_q = sizes[1];
-    const int num_heads = sizes[2];
+    int seqlen_q = sizes[1];
+    int num_heads = sizes[2];
     const int head_size_og = sizes[3];
-    const int seqlen_k = k.size(1);
     const int num_heads_k = k.size(2);
+
+    // With a paged KV cache, the keys / values of a sequence are the pages listed in its row of the
+    // block table, and seqlen_k covers all of them.
+    const bool paged_KV = block_table_.has_value();
+    at::Tensor block_table;
+    if (paged_KV) {
+        block_table = block_table_.value();
+        TORCH_CHECK(block_table.dtype() == torch::kInt32, "block_table must have dtype torch.int32");
+        TORCH_CHECK(block_table.device() == q.device(), "block_table must be on the same device as inputs");
+        TORCH_CHECK(block_table.stride(-1) == 1, "block_table must have contiguous last dimension");
+        TORCH_CHECK(!is_causal, "Paged KV cache does not support causal");
+    }
+    // KV cache: k / v have room for seqlen_k keys / values per sequence, of which cache_seqlens are in
+    // use. k_new / v_new are written right after them, and attended over together with them.
+    const bool has_cache_seqlens = cache_seqlens_.has_value();
+    const bool append_KV = k_new_.has_value();
+    TORCH_CHECK(k_new_.has_value() == v_new_.has_value(), "k_new and v_new must be passed together");
+    TORCH_CHECK(!append_KV || has_cache_seqlens, "Appending k_new / v_new requires cache_seqlens");
+    at::Tensor cache_seqlens, k_new, v_new;
+    if (has_cache_seqlens) {
+        cache_seqlens = cache_seqlens_.value();
+        TORCH_CHECK(cache_seqlens.dtype() == torch::kInt32, "cache_seqlens must have dtype int32");
+        TORCH_CHECK(cache_seqlens.device() == q.device(), "cache_seqlens must be on the same device as inputs");
+        TORCH_CHECK(cache_seqlens.is_contiguous(), "cache_seqlens must be contiguous");
+        TORCH_CHECK(!is_causal && window_size_left < 0 && window_size_right < 0,
+                    "KV cache supports neither causal nor sliding window");
+        TORCH_CHECK(!alibi_slopes_.has_value(), "KV cache does not support ALiBi");
+        TORCH_CHECK(!rotary_cos_.has_value(), "KV cache does not support rotary embedding");
+    }
+    if (append_KV) {
+        k_new = k_new_.value();
+        v_new = v_new_.value();
+        TORCH_CHECK(k_new.dtype() == q_dtype && v_new.dtype() == q_dtype, "k_new and v_new must have the same dtype as inputs");
+        TORCH_CHECK(k_new.device() == q.device() && v_new.device() == q.device(), "k_new and v_new must be on the same device as inputs");
+        TORCH_CHECK(k_new.stride(-1) == 1 && v_new.stride(-1) == 1, "k_new and v_new must have contiguous last dimension");
+    }
+
+    const int num_blocks = k.size(0);
+    const int page_block_size = paged_KV ? k.size(1) : 1;
+    const int seqlen_k = paged_KV ? block_table.size(1) * page_block_size : k.size(1);
+    normalize_window_size(is_causal, window_size_left, window_size_right, seqlen_q, seqlen_k);
     
     TORCH_CHECK(batch_size > 0, "batch size must be postive");
     TORCH_CHECK(head_size_og <= 256, "FlashAttention forward only supports head dimension at most 256");
     TORCH_CHECK(num_heads % num_heads_k == 0, "Number of heads in key/value must divide number of heads in query");
+    TORCH_CHECK(num_splits >= 0, "num_splits must be non-negative");
+    TORCH_CHECK(num_splits <= 1 || (!is_causal && p_dropout == 0.f), "Split-KV supports neither causal nor dropout");
 
     CHECK_SHAPE(q, batch_size, seqlen_q, num_heads, head_size_og);
-    CHECK_SHAPE(k, batch_size, seqlen_k, num_heads_k, head_size_og);
-    CHECK_SHAPE(v, batch_size, seqlen_k, num_heads_k, head_size_og);
+    // Chunked / ring attention: out_ and softmax_lse_ hold the (O, LSE) state over the key chunks
+    // attended so far. The result over k / v is merged into them in place, as softmax_merge_o merges
+    // two partial rows, so that chunk after chunk ends up as the attention over all of the keys.
+    const bool merge_state = softmax_lse_.has_value();
+    at::Tensor softmax_lse_state;
+    if (merge_state) {
+        softmax_lse_state = softmax_lse_.value();
+        TORCH_CHECK(out_.has_value(), "softmax_lse must be passed together with out, the O of the incoming state");
+        TORCH_CHECK(softmax_lse_state.dtype() == torch::kFloat32, "softmax_lse must have dtype float32");
+        TORCH_CHECK(softmax_lse_state.device() == q.device(), "softmax_lse must be on the same device as inputs");
+        TORCH_CHECK(softmax_lse_state.is_contiguous(), "softmax_lse must be contiguous");
+        CHECK_SHAPE(softmax_lse_state, batch_size, num_heads, seqlen_q);
+        // The state is updated in place, so it can't be a padded copy.
+        TORCH_CHECK(head_size_og % 8 == 0, "Merging into softmax_lse requires head_size to be a multiple of 8");
+    }
+    if (paged_KV) {
+        // The rows of a kBlockN tile must not cross a page, and kBlockN is at most 128.
+        TORCH_CHECK(page_block_size % 128 == 0, "Paged KV cache block size must be divisible by 128");
+        CHECK_SHAPE(block_table, batch_size, block_table.size(1));
+        CHECK_SHAPE(k, num_blocks, page_block_size, num_heads_k, head_size_og);
+        CHECK_SHAPE(v, num_blocks, page_block_size, num_heads_k, head_size_og);
+    } else {
+        CHECK_SHAPE(k, batch_size, seqlen_k, num_heads_k, head_size_og);
+        CHECK_SHAPE(v, batch_size, seqlen_k, num_heads_k, head_size_og);
+    }
+    if (has_cache_seqlens) { CHECK_SHAPE(cache_seqlens, batch_size); }
+    const int seqlen_new = append_KV ? k_new.size(1) : 0;
+    if (append_KV) {
+        // The cache is written in place, so it can't be a padded copy.
+        TORCH_CHECK(head_size_og % 8 == 0, "Appending to the KV cache requires head_size to be a multiple of 8");
+        CHECK_SHAPE(k_new, batch_size, seqlen_new, num_heads_k, head_size_og);
+        CHECK_SHAPE(v_new, batch_size, seqlen_new, num_heads_k, head_size_og);
+        // On the GPU this check syncs with the device, so it is left to the caller unless asked for.
+        if (is_cpu || check_kv_append()) {
+            TORCH_CHECK(cache_seqlens.max().item<int>() + seqlen_new <= seqlen_k, "The KV cache is too small for k_new / v_new");
+        }
+    }
     
+    // GQA / MQA decoding: with a single query, the query heads that share a KV head are folded into the
+    // rows of one Q tile, so that a CTA reads each K / V tile once for its whole head group instead of
+    // once per query head. q becomes (batch_size, ngroups, num_heads_k, head_size), a view. The row of
+    // a query head is not its position, hence none of the position dependent options.
+    const int seqlen_q_og = seqlen_q, num_heads_og = num_heads;
+    const int ngroups = num_heads / num_heads_k;
+    const bool seqlenq_ngroups_swapped = seqlen_q == 1 && ngroups > 1 && !is_causal && window_size_left < 0
+        && window_size_right < 0 && p_dropout == 0.f && !return_softmax && !alibi_slopes_.has_value()
+        && !rotary_cos_.has_value() && head_size_og % 8 == 0;
+    at::Tensor q_grouped = q;
+    if (seqlenq_ngroups_swapped) {
+        q_grouped = q.reshape({batch_size, num_heads_k, ngroups, head_size_og}).transpose(1, 2);
+        seqlen_q = ngroups;
+        num_heads = num_heads_k;
+    }
+
     at::Tensor q_padded, k_padded, v_padded;
     if (head_size_og % 8 != 0) {
         q_padded = torch::nn::functional::pad(q, torch::nn::functional::PadFuncOptions({0, 8 - head_size_og % 8}));
         k_padded = torch::nn::functional::pad(k, torch::nn::functional::PadFuncOptions({0, 8 - head_size_og % 8}));
         v_padded = torch::nn::functional::pad(v, torch::nn::functional::PadFuncOptions({0, 8 - head_size_og % 8}));
     } else {
-        q_padded = q;
+        q_padded = q_grouped;
         k_padded = k;
         v_padded = v;
     }
 
-    at::Tensor out;
+    at::Tensor out, out_state;
     if (out_.has_value()) {
         out = out_.value();
         TORCH_CHECK(out.dtype() == q_dtype, "Output must have the same dtype as inputs");
-        TORCH_CHECK(out.is_cuda(), "Output tensor must be on CUDA device");
+        TORCH_CHECK(out.device() == q.device(), "Output tensor must be on the same device as inputs");
         TORCH_CHECK(out.stride(-1) == 1, "Output tensor must have contiguous last dimension");
-        CHECK_SHAPE(out, batch_size, seqlen_q, num_heads, head_size_og);
+        CHECK_SHAPE(out, batch_size, seqlen_q_og, num_heads_og, head_size_og);
         if (head_size_og % 8 != 0) { out = torch::empty_like(q_padded); }
+        // A view of out_ in the folded layout when it can be one, else a buffer written back to out_ below.
+        if (seqlenq_ngroups_swapped) { out = out.reshape({batch_size, num_heads_k, ngroups, head_size_og}).transpose(1, 2); }
+        // The forward writes its O to a buffer of its own, the merge then reads both.
+        if (merge_state) {
+            out_state = out;
+            out = torch::empty_like(q_padded);
+        }
     } else {
         out = torch::empty_like(q_padded);
     }
@@ -281,13 +634,18 @@ mha_fwd(const at::Tensor &q,         // batch_size x seqlen_q x num_heads x head
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    c10::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
 
     auto opts = q.options();
 
     auto scores_max = torch::empty({batch_size, num_heads, seqlen_q}, opts.dtype(at::kFloat));
     auto scores_sum = torch::empty({batch_size, num_heads, seqlen_q}, opts.dtype(at::kFloat));
-    auto softmax_lse = torch::empty({batch_size, num_heads, seqlen_q}, opts.dtype(at::kFloat));
+    // With an incoming state, the rows without any key (an empty KV cache) keep it as it is. These are
+    // never written by the forward, hence the +inf of an empty row up front.
+    auto softmax_lse = merge_state
+        ? torch::full({batch_size, num_heads, seqlen_q}, INFINITY, opts.dtype(at::kFloat))
+        : torch::empty({batch_size, num_heads, seqlen_q}, opts.dtype(at::kFloat));
     at::Tensor p;
     // Only return softmax if there's dropout to reduce compilation time
     if (return_softmax) {
@@ -311,13 +669,46 @@ mha_fwd(const at::Tensor &q,         // batch_size x seqlen_q x num_heads x head
                      softmax_lse.data_ptr(),
                      p_dropout,
                      softmax_scale,
-                     is_causal);
+                     is_causal,
+                     window_size_left,
+                     window_size_right);
+    set_params_alibi(params, alibi_slopes_, batch_size, num_heads, q.device());
+    set_params_rotary(params, rotary_cos_, rotary_sin_, is_rotary_interleaved, seqlen_q, seqlen_k, head_size_og, q);
+    if (merge_state) {
+        params.o_state_ptr = out_state.data_ptr();
+        params.o_state_batch_stride = out_state.stride(0);
+        params.o_state_row_stride = out_state.stride(-3);
+        params.o_state_head_stride = out_state.stride(-2);
+        params.softmax_lse_state_ptr = softmax_lse_state.data_ptr();
+        params.is_index64 = params.is_index64 || exceeds_index32({max_offset(out_state)});
+    }
+
+    if (paged_KV) {
+        // k_batch_stride / v_batch_stride are now the strides between pages.
+        params.block_table = block_table.data_ptr<int>();
+        params.block_table_batch_stride = block_table.stride(0);
+        params.page_block_size = page_block_size;
+    }
+    if (has_cache_seqlens) {
+        params.cache_seqlens = cache_seqlens.data_ptr<int>();
+    }
+    if (append_KV) {
+        params.knew_ptr = k_new.data_ptr();
+        params.vnew_ptr = v_new.data_ptr();
+        params.knew_batch_stride = k_new.stride(0);
+        params.vnew_batch_stride = v_new.stride(0);
+        params.knew_row_stride = k_new.stride(-3);
+        params.vnew_row_stride = v_new.stride(-3);
+        params.knew_head_stride = k_new.stride(-2);
+        params.vnew_head_stride = v_new.stride(-2);
+        params.seqlen_knew = seqlen_new;
+    }
 
     // number of times random will be generated per thread, to offset philox counter in thc random
     // state
     // We use a custom RNG that increases the offset by batch_size * nheads * 32.
     int64_t counter_offset = params.b * params.h * 32;
-    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(torch::kCUDA);
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(q.device());
     auto rng_state = torch::empty({2}, options.dtype(torch::kInt64));
     // Forward kernel will populate memory with the seed and offset.
     params.rng_state = reinterpret_cast<uint64_t*>(rng_state.data_ptr());
@@ -330,17 +721,60 @@ mha_fwd(const at::Tensor &q,         // batch_size x seqlen_q x num_heads x head
         params.philox_args = gen->philox_cuda_state(counter_offset);
     }
 
-    auto stream = at::cuda::getCurrentCUDAStream().stream();
+    // The persistent causal kernel takes its tiles off this counter.
+    at::Tensor tile_count_semaphore;
+    if (is_causal && !is_cpu) {
+        tile_count_semaphore = torch::zeros({1}, opts.dtype(torch::kInt32));
+        params.tile_count_semaphore = tile_count_semaphore.data_ptr<int>();
+    }
+    at::Tensor complete_flags;
+    if (is_causal) {
+        complete_flags = get_complete_flags(batch_size, num_heads, seqlen_q, q.device());
+        params.complete_flags = complete_flags.data_ptr<int>();
+    }
 
-    //printf("b\n");
+    params.num_splits = num_splits;
+    if (num_splits == 0) {
+        params.num_splits = is_causal || p_dropout > 0.f
+            ? 1
+            : num_splits_heuristic(batch_size * num_heads * ((seqlen_q + 127) / 128),
+                                   is_cpu ? at::get_num_threads() : at::cuda::getCurrentDeviceProperties()->multiProcessorCount,
+                                   (seqlen_k + 63) / 64, 128);
+    }
+    at::Tensor softmax_lse_accum, out_accum;
+    if (params.num_splits > 1) {
+        softmax_lse_accum = torch::empty({params.num_splits, batch_size, num_heads, seqlen_q}, opts.dtype(at::kFloat));
+        out_accum = torch::empty({params.num_splits, batch_size, num_heads, seqlen_q, head_size_rounded}, opts.dtype(at::kFloat));
+        params.softmax_lseaccum_ptr = softmax_lse_accum.data_ptr();
+        params.oaccum_ptr = out_accum.data_ptr();
+        params.is_index64 = params.is_index64 || exceeds_index32({max_offset(out_accum)});
+    }
 
-    run_mha_fwd(params, stream);
+    set_params_tile_trace(params, q.device());
+    if (is_cpu) {
+        run_mha_fwd_cpu(params);
+    } else {
+        auto stream = at::cuda::getCurrentCUDAStream().stream();
+        run_mha_fwd(params, stream);
+    }
     //printf("d\n");
 
+    if (merge_state) {
+        out = out_state;
+        softmax_lse = softmax_lse_state.view({batch_size, num_heads, seqlen_q});
+    }
+    if (seqlenq_ngroups_swapped) {
+        out = out.transpose(1, 2).reshape({batch_size, seqlen_q_og, num_heads_og, head_size_og});
+        q_padded = q_padded.transpose(1, 2).reshape({batch_size, seqlen_q_og, num_heads_og, head_size_og});
+        softmax_lse = softmax_lse.reshape({batch_size, num_heads_og, seqlen_q_og});
+    }
     at::Tensor out_padded = out;
     if (head_size_og % 8 != 0) {
         out = out.index({"...", torch::indexing::Slice(torch::indexing::None, head_size_og)});
         if (out_.has_value()) { out_.value().copy_(out); }
+    } else if (out_.has_value() && out.data_ptr() != out_.value().data_ptr()) {
+        out_.value().copy_(out);
+        out = out_.value();
     }
     //printf("e\n");
     return {out, q_padded, k_padded, v_padded, out_padded, softmax_lse, p, rng_state};
@@ -353,22 +787,33 @@ mha_varlen_fwd(const at::Tensor &q,  // total_q x num_heads x head_size, total_q
                c10::optional<at::Tensor> &out_, // total_q x num_heads x head_size, total_k := \sum_{i=0}^{b} s_i
                const at::Tensor &cu_seqlens_q,  // b+1
                const at::Tensor &cu_seqlens_k,  // b+1
+               c10::optional<at::Tensor> &alibi_slopes_, // num_heads or b x num_heads
                const int max_seqlen_q,
                const int max_seqlen_k,
                const float p_dropout,
                const float softmax_scale,
                const bool zero_tensors,
-               const bool is_causal,
+               bool is_causal,
+               int window_size_left,  // -1 for unbounded
+               int window_size_right, // -1 for unbounded
                const bool return_softmax,
-               c10::optional<at::Generator> gen_) {
-
-    auto dprops = at::cuda::getCurrentDeviceProperties();
-    // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
-    bool is_sm8x = dprops->major == 8 && dprops->minor >= 0;
-    bool is_sm90 = dprops->major == 9 && dprops->minor == 0;
-    TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
-    // We will support Turing in the near future
-    // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+               c10::optional<at::Generator> gen_,
+               c10::optional<at::Tensor> &rotary_cos_,  // max_seqlen x (rotary_dim / 2)
+               c10::optional<at::Tensor> &rotary_sin_,  // max_seqlen x (rotary_dim / 2)
+               const bool is_rotary_interleaved) {
+
+    // CPU tensors are dispatched to the CPU backend, which has no architecture requirement.
+    const bool is_cpu = q.is_cpu();
+    bool is_sm8x = true, is_sm90 = false;
+    if (!is_cpu) {
+        auto dprops = at::cuda::getCurrentDeviceProperties();
+        // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
+        is_sm8x = dprops->major == 8 && dprops->minor >= 0;
+        is_sm90 = dprops->major == 9 && dprops->minor == 0;
+        TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+        // We will support Turing in the near future
+        // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+    }
 
     auto q_dtype = q.dtype();
     TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16,
@@ -381,11 +826,16 @@ mha_varlen_fwd(const at::Tensor &q,  // total_q x num_heads x head_size, total_q
     TORCH_CHECK(cu_seqlens_q.dtype() == torch::kInt32, "cu_seqlens_q must have dtype int32");
     TORCH_CHECK(cu_seqlens_k.dtype() == torch::kInt32, "cu_seqlens_k must have dtype int32");
 
-    TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(cu_seqlens_q.is_cuda(), "cu_seqlens_q must be on CUDA device");
-    TORCH_CHECK(cu_seqlens_k.is_cuda(), "cu_seqlens_k must be on CUDA device");
+    if (is_cpu) {
+        TORCH_CHECK(k.is_cpu() && v.is_cpu(), "Input tensors must all be on the same device");
+        TORCH_CHECK(p_dropout == 0.f, "The CPU backend does not support dropout");
+    } else {
+        TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
+    }
+    TORCH_CHECK(cu_seqlens_q.device() == q.device(), "cu_seqlens_q must be on the same device as inputs");
+    TORCH_CHECK(cu_seqlens_k.device() == q.device(), "cu_seqlens_k must be on the same device as inputs");
 
     TORCH_CHECK(q.stride(-1) == 1, "Input tensor must have contiguous last dimension");
     TORCH_CHECK(k.stride(-1) == 1, "Input tensor must have contiguous last dimension");
@@ -426,7 +876,7 @@ mha_varlen_fwd(const at::Tensor &q,  // total_q x num_heads x head_size, total_q
     if (out_.has_value()) {
         out = out_.value();
         TORCH_CHECK(out.dtype() == q_dtype, "Output must have the same dtype as inputs");
-        TORCH_CHECK(out.is_cuda(), "Output tensor must be on CUDA device");
+        TORCH_CHECK(out.device() == q.device(), "Output tensor must be on the same device as inputs");
         TORCH_CHECK(out.stride(-1) == 1, "Output tensor must have contiguous last dimension");
         CHECK_SHAPE(out, total_q, num_heads, head_size_og);
         if (head_size_og % 8 != 0) { out = torch::empty_like(q_padded); }
@@ -442,7 +892,8 @@ mha_varlen_fwd(const at::Tensor &q,  // total_q x num_heads x head_size, total_q
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    c10::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
 
     auto opts = q.options();
 
@@ -462,6 +913,8 @@ mha_varlen_fwd(const at::Tensor &q,  // total_q x num_heads x head_size, total_q
         if (return_softmax) {p.zero_();}
     }
 
+    normalize_window_size(is_causal, window_size_left, window_size_right, max_seqlen_q, max_seqlen_k);
+
     Flash_fwd_params params;
     set_params_fprop(params,
                      batch_size,
@@ -478,13 +931,18 @@ mha_varlen_fwd(const at::Tensor &q,  // total_q x num_heads x head_size, total_q
                      softmax_lse.data_ptr(),
                      p_dropout,
                      softmax_scale,
-                     is_causal);
+                     is_causal,
+                     window_size_left,
+                     window_size_right);
+    set_params_alibi(params, alibi_slopes_, batch_size, num_heads, q.device());
+    // The position of a row is its index in its own sequence.
+    set_params_rotary(params, rotary_cos_, rotary_sin_, is_rotary_interleaved, max_seqlen_q, max_seqlen_k, head_size_og, q);
 
     // number of times random will be generated per thread, to offset philox counter in thc random
     // state
     // We use a custom RNG that increases the offset by batch_size * nheads * 32.
     int64_t counter_offset = params.b * params.h * 32;
-    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(torch::kCUDA);
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(q.device());
     auto rng_state = torch::empty({2}, options.dtype(torch::kInt64));
     // Forward kernel will populate memory with the seed and offset.
     params.rng_state = reinterpret_cast<uint64_t*>(rng_state.data_ptr());
@@ -497,8 +955,36 @@ mha_varlen_fwd(const at::Tensor &q,  // total_q x num_heads x head_size, total_q
         params.philox_args = gen->philox_cuda_state(counter_offset);
     }
 
-    auto stream = at::cuda::getCurrentCUDAStream().stream();
-    run_mha_fwd(params, stream);
+    // The persistent causal kernel takes its tiles off this counter.
+    at::Tensor tile_count_semaphore;
+    if (is_causal && !is_cpu) {
+        tile_count_semaphore = torch::zeros({1}, opts.dtype(torch::kInt32));
+        params.tile_count_semaphore = tile_count_semaphore.data_ptr<int>();
+    }
+    at::Tensor complete_flags;
+    if (is_causal) {
+        complete_flags = get_complete_flags(batch_size, num_heads, max_seqlen_q, q.device());
+        params.complete_flags = complete_flags.data_ptr<int>();
+    }
+    // The tiles of the persistent causal kernel are planned over the actual sequence lengths: on
+    // the host by the CPU backend, whose cu_seqlens are already there, and on the device by the
+    // CUDA launch, without a copy.
+    if (is_causal) {
+        if (is_cpu) {
+            params.cu_seqlens_q_host = cu_seqlens_q.data_ptr<int>();
+            params.cu_seqlens_k_host = cu_seqlens_k.data_ptr<int>();
+        } else {
+            params.plan_varlen_causal = true;
+        }
+    }
+
+    set_params_tile_trace(params, q.device());
+    if (is_cpu) {
+        run_mha_fwd_cpu(params);
+    } else {
+        auto stream = at::cuda::getCurrentCUDAStream().stream();
+        run_mha_fwd(params, stream);
+    }
 
     at::Tensor out_padded = out;
     if (head_size_og % 8 != 0) {
@@ -531,6 +1017,14 @@ void run_mha_bwd(Flash_bwd_params &params, cudaStream_t stream, const bool confi
     });
 }
 
+void run_mha_bwd_cpu(Flash_bwd_params &params) {
+    FP16_SWITCH(!params.is_bf16, [&] {
+        FWD_HEADDIM_SWITCH(params.d, [&] {
+            run_mha_bwd_cpu_<elem_type, kHeadDim>(params);
+        });
+    });
+}
+
 std::vector<at::Tensor>
 mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_size_og
         const at::Tensor &q,   // batch_size x seqlen_q x num_heads x head_size
@@ -541,22 +1035,30 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
         c10::optional<at::Tensor> &dq_,   // batch_size x seqlen_q x num_heads x head_size
         c10::optional<at::Tensor> &dk_,   // batch_size x seqlen_k x num_heads_k x head_size
         c10::optional<at::Tensor> &dv_,   // batch_size x seqlen_k x num_heads_k x head_size
+        c10::optional<at::Tensor> &alibi_slopes_, // num_heads or batch_size x num_heads
         const float p_dropout,         // probability to drop
         const float softmax_scale,
-        const bool is_causal,
+        bool is_causal,
+        int window_size_left,          // -1 for unbounded
+        int window_size_right,         // -1 for unbounded
+        const bool deterministic,
         c10::optional<at::Generator> gen_,
         c10::optional<at::Tensor> &rng_state) {
-    auto dprops = at::cuda::getCurrentDeviceProperties();
-    // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
-    bool is_sm8x = dprops->major == 8 && dprops->minor >= 0;
-    bool is_sm80 = dprops->major == 8 && dprops->minor == 0;
-    bool is_sm90 = dprops->major == 9 && dprops->minor == 0;
-    TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
-    // We will support Turing in the near future
-    // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+    // CPU tensors are dispatched to the CPU backend, which has no architecture requirement.
+    const bool is_cpu = q.is_cpu();
+    bool is_sm8x = true, is_sm80 = true, is_sm90 = false;
+    if (!is_cpu) {
+        auto dprops = at::cuda::getCurrentDeviceProperties();
+        // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
+        is_sm8x = dprops->major == 8 && dprops->minor >= 0;
+        is_sm80 = dprops->major == 8 && dprops->minor == 0;
+        is_sm90 = dprops->major == 9 && dprops->minor == 0;
+        TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+        // We will support Turing in the near future
+        // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+    }
 
     bool is_dropout = p_dropout > 0.0;
-    auto stream = at::cuda::getCurrentCUDAStream().stream();
 
     auto q_dtype = q.dtype();
     TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16,
@@ -569,12 +1071,18 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
     TORCH_CHECK(out.dtype() == q_dtype, "query and out must have the same dtype");
     TORCH_CHECK(dout.dtype() == q_dtype, "query and dout must have the same dtype");
 
-    TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(out.is_cuda(), "out tensor must be on CUDA device");
-    TORCH_CHECK(dout.is_cuda(), "dout tensor must be on CUDA device");
-    TORCH_CHECK(softmax_lse.is_cuda(), "softmax_lse tensor must be on CUDA device");
+    if (is_cpu) {
+        TORCH_CHECK(k.is_cpu() && v.is_cpu() && out.is_cpu() && dout.is_cpu() && softmax_lse.is_cpu(),
+                    "Input tensors must all be on the same device");
+        TORCH_CHECK(!is_dropout, "The CPU backend does not support dropout");
+    } else {
+        TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(out.is_cuda(), "out tensor must be on CUDA device");
+        TORCH_CHECK(dout.is_cuda(), "dout tensor must be on CUDA device");
+        TORCH_CHECK(softmax_lse.is_cuda(), "softmax_lse tensor must be on CUDA device");
+    }
 
     TORCH_CHECK(q.stride(-1) == 1, "Input tensor must have contiguous last dimension");
     TORCH_CHECK(k.stride(-1) == 1, "Input tensor must have contiguous last dimension");
@@ -616,7 +1124,7 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
     if (dq_.has_value()) {
         dq = dq_.value();
         TORCH_CHECK(dq.dtype() == q_dtype, "dq must have the same dtype as q");
-        TORCH_CHECK(dq.is_cuda(), "dq must be on CUDA device");
+        TORCH_CHECK(dq.device() == q.device(), "dq must be on the same device as q");
         TORCH_CHECK(dq.stride(-1) == 1, "dq must have contiguous last dimension");
         CHECK_SHAPE(dq, batch_size, seqlen_q, num_heads, head_size);
     } else {
@@ -625,7 +1133,7 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
     if (dk_.has_value()) {
         dk = dk_.value();
         TORCH_CHECK(dk.dtype() == q_dtype, "dk must have the same dtype as q");
-        TORCH_CHECK(dk.is_cuda(), "dk must be on CUDA device");
+        TORCH_CHECK(dk.device() == q.device(), "dk must be on the same device as q");
         TORCH_CHECK(dk.stride(-1) == 1, "dk must have contiguous last dimension");
         CHECK_SHAPE(dk, batch_size, seqlen_k, num_heads_k, head_size);
     } else {
@@ -634,7 +1142,7 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
     if (dv_.has_value()) {
         dv = dv_.value();
         TORCH_CHECK(dv.dtype() == q_dtype, "dv must have the same dtype as q");
-        TORCH_CHECK(dv.is_cuda(), "dv must be on CUDA device");
+        TORCH_CHECK(dv.device() == q.device(), "dv must be on the same device as q");
         TORCH_CHECK(dv.stride(-1) == 1, "dv must have contiguous last dimension");
         CHECK_SHAPE(dv, batch_size, seqlen_k, num_heads_k, head_size);
     } else {
@@ -654,14 +1162,20 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    c10::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
 
     auto opts = q.options();
     auto softmax_d = torch::empty({batch_size, num_heads, seqlen_q_rounded}, opts.dtype(at::kFloat));
     at::Tensor dq_accum;
     at::Tensor dk_accum, dv_accum;
     if (loop) {
-        dq_accum = torch::empty({batch_size, num_heads, seqlen_q_rounded, head_size_rounded}, opts.dtype(at::kFloat));
+        if (!deterministic) {
+            dq_accum = torch::empty({batch_size, num_heads, seqlen_q_rounded, head_size_rounded}, opts.dtype(at::kFloat));
+        } else {
+            const int nsplits = num_dq_accum_splits(deterministic, batch_size, num_heads, is_cpu);
+            dq_accum = torch::zeros({nsplits, batch_size, num_heads, seqlen_q_rounded, head_size_rounded}, opts.dtype(at::kFloat));
+        }
         // dk_accum = torch::empty({batch_size, num_heads_k, seqlen_k_rounded, head_size_rounded}, opts.dtype(at::kFloat));
         // dv_accum = torch::empty({batch_size, num_heads_k, seqlen_k_rounded, head_size_rounded}, opts.dtype(at::kFloat));
     }
@@ -675,6 +1189,8 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
         dv_expanded = dv;
     }
 
+    normalize_window_size(is_causal, window_size_left, window_size_right, seqlen_q, seqlen_k);
+
     Flash_bwd_params params;
 
     set_params_dgrad(params,
@@ -696,30 +1212,39 @@ mha_bwd(const at::Tensor &dout,  // batch_size x seqlen_q x num_heads, x head_si
                      softmax_d.data_ptr(),
                      p_dropout,
                      softmax_scale,
-                     is_causal);
-
-    auto launch = &run_mha_bwd;
-    // launch(params, stream, /*configure=*/true);
+                     is_causal,
+                     window_size_left,
+                     window_size_right);
+    set_params_alibi(params, alibi_slopes_, batch_size, num_heads, q.device());
+    set_params_deterministic(params, deterministic, dq_accum);
+
+    if (is_cpu) {
+        run_mha_bwd_cpu(params);
+    } else {
+        auto stream = at::cuda::getCurrentCUDAStream().stream();
+        auto launch = &run_mha_bwd;
+        // launch(params, stream, /*configure=*/true);
 
-    auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
-        gen_, at::cuda::detail::getDefaultCUDAGenerator());
+        auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+            gen_, at::cuda::detail::getDefaultCUDAGenerator());
 
-    // We use a custom RNG that increases the offset by batch_size * nheads * 32.
-    int64_t counter_offset = params.b * params.h * 32;
+        // We use a custom RNG that increases the offset by batch_size * nheads * 32.
+        int64_t counter_offset = params.b * params.h * 32;
+
+        if ( rng_state.has_value() ) {
+            params.rng_state = reinterpret_cast<uint64_t*>(rng_state.value().data_ptr());
+        } else if( is_dropout ) {
+            // See Note [Acquire lock when using random generators]
+            std::lock_guard<std::mutex> lock(gen->mutex_);
+            params.philox_args = gen->philox_cuda_state(counter_offset);
+            auto seeds = at::cuda::philox::unpack(params.philox_args);
+            params.rng_state[0] = std::get<0>(seeds);
+            params.rng_state[1] = std::get<1>(seeds);
+        }
 
-    if ( rng_state.has_value() ) {
-        params.rng_state = reinterpret_cast<uint64_t*>(rng_state.value().data_ptr());
-    } else if( is_dropout ) {
-        // See Note [Acquire lock when using random generators]
-        std::lock_guard<std::mutex> lock(gen->mutex_);
-        params.philox_args = gen->philox_cuda_state(counter_offset);
-        auto seeds = at::cuda::philox::unpack(params.philox_args);
-        params.rng_state[0] = std::get<0>(seeds);
-        params.rng_state[1] = std::get<1>(seeds);
+        launch(params, stream, /*configure=*/false);
     }
 
-    launch(params, stream, /*configure=*/false);
-
     // For MQA/GQA we need to sum dK and dV across the groups
     if (num_heads_k != num_heads) {
         at::sum_out(dk, at::reshape(dk_expanded, {batch_size, seqlen_k, num_heads_k, num_heads / num_heads_k, head_size}), {3});
@@ -746,25 +1271,33 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
                c10::optional<at::Tensor> &dv_,   // total_k x num_heads_k x head_size, total_k := \sum_{i=0}^{b} s_i
                const at::Tensor &cu_seqlens_q,  // b+1
                const at::Tensor &cu_seqlens_k,  // b+1
+               c10::optional<at::Tensor> &alibi_slopes_, // num_heads or b x num_heads
                const int max_seqlen_q,
                const int max_seqlen_k,          // max sequence length to choose the kernel
                const float p_dropout,         // probability to drop
                const float softmax_scale,
                const bool zero_tensors,
-               const bool is_causal,
+               bool is_causal,
+               int window_size_left,  // -1 for unbounded
+               int window_size_right, // -1 for unbounded
+               const bool deterministic,
                c10::optional<at::Generator> gen_,
                c10::optional<at::Tensor> &rng_state
 ) {
-    auto dprops = at::cuda::getCurrentDeviceProperties();
-    // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
-    bool is_sm8x = dprops->major == 8 && dprops->minor >= 0;
-    bool is_sm80 = dprops->major == 8 && dprops->minor == 0;
-    bool is_sm90 = dprops->major == 9 && dprops->minor == 0;
-    TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
-    // We will support Turing in the near future
-    // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+    // CPU tensors are dispatched to the CPU backend, like in mha_bwd.
+    const bool is_cpu = q.is_cpu();
+    bool is_sm8x = true, is_sm80 = true, is_sm90 = false;
+    if (!is_cpu) {
+        auto dprops = at::cuda::getCurrentDeviceProperties();
+        // bool is_sm75 = dprops->major == 7 && dprops->minor == 5;
+        is_sm8x = dprops->major == 8 && dprops->minor >= 0;
+        is_sm80 = dprops->major == 8 && dprops->minor == 0;
+        is_sm90 = dprops->major == 9 && dprops->minor == 0;
+        TORCH_CHECK(is_sm90 || is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+        // We will support Turing in the near future
+        // TORCH_CHECK(is_sm90 || is_sm8x || is_sm75, "FlashAttention only supports Turing GPUs or newer.");
+    }
     bool is_dropout = p_dropout > 0.0;
-    auto stream = at::cuda::getCurrentCUDAStream().stream();
 
     auto q_dtype = q.dtype();
     TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16,
@@ -779,14 +1312,21 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
     TORCH_CHECK(cu_seqlens_q.dtype() == torch::kInt32, "cu_seqlens_q must have dtype int32");
     TORCH_CHECK(cu_seqlens_k.dtype() == torch::kInt32, "cu_seqlens_k must have dtype int32");
 
-    TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
-    TORCH_CHECK(out.is_cuda(), "out tensor must be on CUDA device");
-    TORCH_CHECK(dout.is_cuda(), "dout tensor must be on CUDA device");
-    TORCH_CHECK(softmax_lse.is_cuda(), "softmax_lse tensor must be on CUDA device");
-    TORCH_CHECK(cu_seqlens_q.is_cuda(), "cu_seqlens_q must be on CUDA device");
-    TORCH_CHECK(cu_seqlens_k.is_cuda(), "cu_seqlens_k must be on CUDA device");
+    if (is_cpu) {
+        TORCH_CHECK(k.is_cpu() && v.is_cpu() && out.is_cpu() && dout.is_cpu() && softmax_lse.is_cpu()
+                    && cu_seqlens_q.is_cpu() && cu_seqlens_k.is_cpu(),
+                    "Input tensors must all be on the same device");
+        TORCH_CHECK(!is_dropout, "The CPU backend does not support dropout");
+    } else {
+        TORCH_CHECK(q.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(k.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(v.is_cuda(), "Input tensor must be on CUDA device");
+        TORCH_CHECK(out.is_cuda(), "out tensor must be on CUDA device");
+        TORCH_CHECK(dout.is_cuda(), "dout tensor must be on CUDA device");
+        TORCH_CHECK(softmax_lse.is_cuda(), "softmax_lse tensor must be on CUDA device");
+        TORCH_CHECK(cu_seqlens_q.is_cuda(), "cu_seqlens_q must be on CUDA device");
+        TORCH_CHECK(cu_seqlens_k.is_cuda(), "cu_seqlens_k must be on CUDA device");
+    }
 
     TORCH_CHECK(q.stride(-1) == 1, "Input tensor must have contiguous last dimension");
     TORCH_CHECK(k.stride(-1) == 1, "Input tensor must have contiguous last dimension");
@@ -832,7 +1372,7 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
     if (dq_.has_value()) {
         dq = dq_.value();
         TORCH_CHECK(dq.dtype() == q_dtype, "dq must have the same dtype as q");
-        TORCH_CHECK(dq.is_cuda(), "dq must be on CUDA device");
+        TORCH_CHECK(dq.device() == q.device(), "dq must be on the same device as q");
         TORCH_CHECK(dq.stride(-1) == 1, "dq must have contiguous last dimension");
         CHECK_SHAPE(dq, total_q, num_heads, head_size);
     } else {
@@ -841,7 +1381,7 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
     if (dk_.has_value()) {
         dk = dk_.value();
         TORCH_CHECK(dk.dtype() == q_dtype, "dk must have the same dtype as q");
-        TORCH_CHECK(dk.is_cuda(), "dk must be on CUDA device");
+        TORCH_CHECK(dk.device() == q.device(), "dk must be on the same device as q");
         TORCH_CHECK(dk.stride(-1) == 1, "dk must have contiguous last dimension");
         CHECK_SHAPE(dk, total_k, num_heads_k, head_size);
     } else {
@@ -850,7 +1390,7 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
     if (dv_.has_value()) {
         dv = dv_.value();
         TORCH_CHECK(dv.dtype() == q_dtype, "dv must have the same dtype as q");
-        TORCH_CHECK(dv.is_cuda(), "dv must be on CUDA device");
+        TORCH_CHECK(dv.device() == q.device(), "dv must be on the same device as q");
         TORCH_CHECK(dv.stride(-1) == 1, "dv must have contiguous last dimension");
         CHECK_SHAPE(dv, total_k, num_heads_k, head_size);
     } else {
@@ -870,13 +1410,19 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    c10::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
 
     auto opts = q.options();
     auto softmax_d = torch::empty({batch_size, num_heads, seqlen_q_rounded}, opts.dtype(at::kFloat));
     at::Tensor dq_accum;
     if (loop) {
-        dq_accum = torch::empty({batch_size, num_heads, seqlen_q_rounded, head_size_rounded}, opts.dtype(at::kFloat));
+        if (!deterministic) {
+            dq_accum = torch::empty({batch_size, num_heads, seqlen_q_rounded, head_size_rounded}, opts.dtype(at::kFloat));
+        } else {
+            const int nsplits = num_dq_accum_splits(deterministic, batch_size, num_heads, is_cpu);
+            dq_accum = torch::zeros({nsplits, batch_size, num_heads, seqlen_q_rounded, head_size_rounded}, opts.dtype(at::kFloat));
+        }
     }
 
     at::Tensor dk_expanded, dv_expanded;
@@ -895,6 +1441,8 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
         softmax_d.zero_();
     }
 
+    normalize_window_size(is_causal, window_size_left, window_size_right, max_seqlen_q, max_seqlen_k);
+
     Flash_bwd_params params;
 
     set_params_dgrad(params,
@@ -914,30 +1462,39 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
                      softmax_d.data_ptr(),
                      p_dropout,
                      softmax_scale,
-                     is_causal);
-
-    auto launch = &run_mha_bwd;
-    // launch(params, stream, /*configure=*/true);
+                     is_causal,
+                     window_size_left,
+                     window_size_right);
+    set_params_alibi(params, alibi_slopes_, batch_size, num_heads, q.device());
+    set_params_deterministic(params, deterministic, dq_accum);
+
+    if (is_cpu) {
+        run_mha_bwd_cpu(params);
+    } else {
+        auto stream = at::cuda::getCurrentCUDAStream().stream();
+        auto launch = &run_mha_bwd;
+        // launch(params, stream, /*configure=*/true);
 
-    auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
-        gen_, at::cuda::detail::getDefaultCUDAGenerator());
+        auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+            gen_, at::cuda::detail::getDefaultCUDAGenerator());
 
-    // We use a custom RNG that increases the offset by batch_size * nheads * 32.
-    int64_t counter_offset = params.b * params.h * 32;
+        // We use a custom RNG that increases the offset by batch_size * nheads * 32.
+        int64_t counter_offset = params.b * params.h * 32;
+
+        if ( rng_state.has_value() ) {
+            params.rng_state = reinterpret_cast<uint64_t*>(rng_state.value().data_ptr());
+        } else if( is_dropout ) {
+            // See Note [Acquire lock when using random generators]
+            std::lock_guard<std::mutex> lock(gen->mutex_);
+            params.philox_args = gen->philox_cuda_state(counter_offset);
+            auto seeds = at::cuda::philox::unpack(params.philox_args);
+            params.rng_state[0] = std::get<0>(seeds);
+            params.rng_state[1] = std::get<1>(seeds);
+        }
 
-    if ( rng_state.has_value() ) {
-        params.rng_state = reinterpret_cast<uint64_t*>(rng_state.value().data_ptr());
-    } else if( is_dropout ) {
-        // See Note [Acquire lock when using random generators]
-        std::lock_guard<std::mutex> lock(gen->mutex_);
-        params.philox_args = gen->philox_cuda_state(counter_offset);
-        auto seeds = at::cuda::philox::unpack(params.philox_args);
-        params.rng_state[0] = std::get<0>(seeds);
-        params.rng_state[1] = std::get<1>(seeds);
+        launch(params, stream, /*configure=*/false);
     }
 
-    launch(params, stream, /*configure=*/false);
-
     // For MQA/GQA we need to sum dK and dV across the groups
     if (num_heads_k != num_heads) {
         at::sum_out(dk, at::reshape(dk_expanded, {total_k, num_heads_k, num_heads / num_heads_k, head_size}), {2});
@@ -952,10 +1509,345 @@ mha_varlen_bwd(const at::Tensor &dout,  // total_q x num_heads, x head_size
     return { dq, dk, dv, softmax_d };
 }
 
+// (tiles, 6) tensor of (worker, bidb, bidh, m_block, start, end), in dispatch order.
+at::Tensor tile_dispatches_to_tensor(const std::vector<flash::Tile_dispatch> &dispatches) {
+    auto schedule = torch::empty({int64_t(dispatches.size()), 6}, torch::dtype(torch::kInt64));
+    auto schedule_a = schedule.accessor<int64_t, 2>();
+    for (size_t i = 0; i < dispatches.size(); ++i) {
+        schedule_a[i][0] = dispatches[i].worker;
+        schedule_a[i][1] = dispatches[i].bidb;
+        schedule_a[i][2] = dispatches[i].bidh;
+        schedule_a[i][3] = dispatches[i].m_block;
+        schedule_a[i][4] = dispatches[i].start;
+        schedule_a[i][5] = dispatches[i].end;
+    }
+    return schedule;
+}
+
+at::Tensor
+fwd_causal_schedule(const int batch_size,
+                    const int num_heads,
+                    const int seqlen_q,
+                    const int seqlen_k,
+                    const int block_m,
+                    const int block_n,
+                    const int num_workers,
+                    const bool per_head_launch) {
+    TORCH_CHECK(batch_size > 0 && num_heads > 0, "batch size and number of heads must be positive");
+    TORCH_CHECK(block_m > 0 && block_n > 0, "block sizes must be positive");
+    TORCH_CHECK(num_workers > 0, "number of workers must be positive");
+    const auto dispatches = flash::simulate_causal_fwd_schedule(batch_size, num_heads, seqlen_q, seqlen_k,
+                                                                block_m, block_n, num_workers, per_head_launch);
+    return tile_dispatches_to_tensor(dispatches);
+}
+
+at::Tensor
+fwd_varlen_causal_schedule(const at::Tensor &cu_seqlens_q,  // b+1
+                           const at::Tensor &cu_seqlens_k,  // b+1
+                           const int num_heads,
+                           const int block_m,
+                           const int block_n,
+                           const int num_workers,
+                           const bool planned) {
+    TORCH_CHECK(cu_seqlens_q.dtype() == torch::kInt32, "cu_seqlens_q must have dtype int32");
+    TORCH_CHECK(cu_seqlens_k.dtype() == torch::kInt32, "cu_seqlens_k must have dtype int32");
+    const int batch_size = cu_seqlens_q.numel() - 1;
+    CHECK_SHAPE(cu_seqlens_k, batch_size + 1);
+    TORCH_CHECK(batch_size > 0 && num_heads > 0, "batch size and number of heads must be positive");
+    TORCH_CHECK(block_m > 0 && block_n > 0, "block sizes must be positive");
+    TORCH_CHECK(num_workers > 0, "number of workers must be positive");
+    const auto cu_seqlens_q_host = cu_seqlens_q.cpu().contiguous();
+    const auto cu_seqlens_k_host = cu_seqlens_k.cpu().contiguous();
+    const auto dispatches = flash::simulate_varlen_causal_fwd_schedule(
+        cu_seqlens_q_host.data_ptr<int>(), cu_seqlens_k_host.data_ptr<int>(), batch_size, num_heads,
+        block_m, block_n, num_workers, planned);
+    return tile_dispatches_to_tensor(dispatches);
+}
+
+// (computed, skipped) kBlockM x kBlockN tiles of one (batch, head) of the sliding window forward,
+// following flash::local_n_block_range. The window is normalized like in mha_fwd.
+std::tuple<int64_t, int64_t>
+fwd_local_tile_count(const int seqlen_q,
+                     const int seqlen_k,
+                     const int block_m,
+                     const int block_n,
+                     int window_size_left,
+                     int window_size_right) {
+    TORCH_CHECK(seqlen_q >= 0 && seqlen_k >= 0, "sequence lengths must be non-negative");
+    TORCH_CHECK(block_m > 0 && block_n > 0, "block sizes must be positive");
+    bool is_causal = false;
+    normalize_window_size(is_causal, window_size_left, window_size_right, seqlen_q, seqlen_k);
+    return flash::local_fwd_tile_count(seqlen_q, seqlen_k, block_m, block_n, window_size_left, window_size_right);
+}
+
+// Tiles of each CTA of one (batch, head) of the causal backward, with the column blocks paired up
+// like the kernels do, or one column block per CTA.
+std::vector<int>
+bwd_causal_cta_tiles(const int seqlen_q,
+                     const int seqlen_k,
+                     const int block_m,
+                     const int block_n,
+                     const bool paired) {
+    TORCH_CHECK(seqlen_q >= 0 && seqlen_k >= 0, "sequence lengths must be non-negative");
+    TORCH_CHECK(block_m > 0 && block_n > 0, "block sizes must be positive");
+    return flash::causal_bwd_cta_tiles(seqlen_q, seqlen_k, block_m, block_n, paired);
+}
+
+// Whether the forward (with backward, the backward) of inputs of these shapes and strides is launched
+// with the 64-bit variant of the kernels, as decided by set_params_fprop / set_params_dgrad. The data
+// is never touched, so meta tensors will do.
+bool
+is_index64(const at::Tensor &q,  // batch_size x seqlen_q x num_heads x head_size
+           const at::Tensor &k,  // batch_size x seqlen_k x num_heads_k x head_size
+           const at::Tensor &v,  // batch_size x seqlen_k x num_heads_k x head_size
+           const bool backward) {
+    TORCH_CHECK(q.dim() == 4 && k.dim() == 4 && v.dim() == 4, "q, k and v must have 4 dimensions");
+    const int batch_size = q.size(0), seqlen_q = q.size(1), num_heads = q.size(2), head_size = q.size(3);
+    const int seqlen_k = k.size(1), num_heads_k = k.size(2);
+    auto round_multiple = [](int x, int m) { return (x + m - 1) / m * m; };
+    const int head_size_rounded = round_multiple(head_size, 32);
+    const int seqlen_q_rounded = round_multiple(seqlen_q, 128);
+    const int seqlen_k_rounded = round_multiple(seqlen_k, 128);
+    const at::Tensor out = torch::empty_like(q);
+    Flash_bwd_params params;
+    if (backward) {
+        set_params_dgrad(params, batch_size, seqlen_q, seqlen_k, seqlen_q_rounded, seqlen_k_rounded,
+                         num_heads, num_heads_k, head_size, head_size_rounded,
+                         q, k, v, out, torch::empty_like(q), torch::empty_like(q), torch::empty_like(k), torch::empty_like(v),
+                         /*cu_seqlens_q_d=*/nullptr, /*cu_seqlens_k_d=*/nullptr,
+                         /*dq_accum_d=*/nullptr, /*dk_accum_d=*/nullptr, /*dv_accum_d=*/nullptr,
+                         /*softmax_lse_d=*/nullptr, /*dsoftmax_sum_d=*/nullptr,
+                         /*p_dropout=*/0.f, /*softmax_scale=*/1.f, /*is_causal=*/false, -1, -1);
+    } else {
+        set_params_fprop(params, batch_size, seqlen_q, seqlen_k, seqlen_q_rounded, seqlen_k_rounded,
+                         num_heads, num_heads_k, head_size, head_size_rounded,
+                         q, k, v, out, /*cu_seqlens_q_d=*/nullptr, /*cu_seqlens_k_d=*/nullptr,
+                         /*p_d=*/nullptr, /*scores_max_d=*/nullptr, /*scores_sum_d=*/nullptr, /*softmax_lse_d=*/nullptr,
+                         /*p_dropout=*/0.f, /*softmax_scale=*/1.f, /*is_causal=*/false, -1, -1);
+    }
+    return params.is_index64;
+}
+
+// Names of the kernel trait sets the forward of this head dimension is tuned over, the default first.
+std::vector<std::string>
+fwd_tuning_candidates(const int head_size) {
+    std::vector<std::string> names;
+    for (const auto &candidate : flash::fwd_tuning_candidates(head_size)) { names.push_back(candidate.name()); }
+    return names;
+}
+
+// Time of one forward of the key with the candidate forced, in ms, on the current CUDA device. The
+// shapes keep about 16k tokens and a model dim of 2k per launch. +inf if the candidate can't run.
+float
+fwd_tuning_time_cuda(const flash::Fwd_tuning_key &key, const flash::Fwd_tuning_candidate &candidate) {
+    auto dprops = at::cuda::getCurrentDeviceProperties();
+    if (size_t(candidate.smem_size(key.hdim)) > dprops->sharedMemPerBlockOptin) {
+        return std::numeric_limits<float>::infinity();
+    }
+    const int seqlen = key.seqlen_bucket;
+    const int batch_size = std::max(1, 16384 / seqlen), num_heads = std::max(1, 2048 / key.hdim);
+    auto opts = torch::dtype(key.is_bf16 ? torch::kBFloat16 : torch::kFloat16).device(torch::kCUDA);
+    const at::Tensor q = torch::randn({batch_size, seqlen, num_heads, key.hdim}, opts);
+    const at::Tensor k = torch::randn({batch_size, seqlen, num_heads, key.hdim}, opts);
+    const at::Tensor v = torch::randn({batch_size, seqlen, num_heads, key.hdim}, opts);
+    c10::optional<at::Tensor> out = torch::empty_like(q), none;
+    flash::Fwd_tuning_force force(candidate.name());
+    auto run = [&] {
+        mha_fwd(q, k, v, out, none, 0.f, 1.f / std::sqrt(float(key.hdim)), key.is_causal, -1, -1, false, c10::nullopt,
+                /*num_splits=*/1, none, none, none, none, none, none, false, none);
+    };
+    try {
+        run();  // Warmup, also sets up the smem attribute of the kernel.
+        const cudaStream_t stream = at::cuda::getCurrentCUDAStream().stream();
+        cudaEvent_t start, stop;
+        C10_CUDA_CHECK(cudaEventCreate(&start));
+        C10_CUDA_CHECK(cudaEventCreate(&stop));
+        C10_CUDA_CHECK(cudaEventRecord(start, stream));
+        run();
+        C10_CUDA_CHECK(cudaEventRecord(stop, stream));
+        C10_CUDA_CHECK(cudaEventSynchronize(stop));
+        float ms = 0.f;
+        C10_CUDA_CHECK(cudaEventElapsedTime(&ms, start, stop));
+        C10_CUDA_CHECK(cudaEventDestroy(start));
+        C10_CUDA_CHECK(cudaEventDestroy(stop));
+        return ms;
+    } catch (const c10::Error &) {
+        return std::numeric_limits<float>::infinity();
+    }
+}
+
+// Tunes the forward without dropout for every head dimension in head_sizes, fp16 and bf16, causal and
+// not, and the seqlen bucket of every seqlen in seqlens; saves the winners to cache_path and has the
+// dispatch use them from now on. timer(head_size, is_bf16, is_causal, seqlen_bucket, candidate) -> ms
+// replaces the CUDA timing, e.g. to test the driver without a GPU; device then names the cache.
+// Returns the (head_size, is_bf16, is_causal, seqlen_bucket, candidate, ms) entries.
+std::vector<std::tuple<int, bool, bool, int, std::string, float>>
+fwd_autotune(const std::string &cache_path,
+             const std::vector<int> &head_sizes,
+             const std::vector<int> &seqlens,
+             const int repeats,
+             c10::optional<std::function<float(int, bool, bool, int, const std::string &)>> timer_,
+             std::string device) {
+    TORCH_CHECK(repeats > 0, "repeats must be positive");
+    for (const int head_size : head_sizes) {
+        TORCH_CHECK(!flash::fwd_tuning_candidates(head_size).empty(), "no tuning candidates for head dimension ", head_size);
+    }
+    if (!timer_.has_value()) {
+        TORCH_CHECK(at::cuda::is_available(), "fwd_autotune needs a CUDA device, or a timer");
+        device = at::cuda::getCurrentDeviceProperties()->name;
+    }
+    std::vector<int> buckets;
+    for (const int seqlen : seqlens) { buckets.push_back(flash::fwd_tuning_seqlen_bucket(seqlen)); }
+    std::sort(buckets.begin(), buckets.end());
+    buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+    std::vector<flash::Fwd_tuning_key> keys;
+    for (const int head_size : head_sizes) {
+        for (const bool is_bf16 : {false, true}) {
+            for (const bool is_causal : {false, true}) {
+                for (const int bucket : buckets) { keys.push_back({head_size, is_bf16, is_causal, bucket}); }
+            }
+        }
+    }
+    flash::Fwd_tuning_cache cache(device);
+    if (timer_.has_value()) {
+        const auto &timer = timer_.value();
+        flash::fwd_autotune(cache, keys, repeats, [&](const flash::Fwd_tuning_key &key, const flash::Fwd_tuning_candidate &candidate) {
+            return timer(key.hdim, key.is_bf16, key.is_causal, key.seqlen_bucket, candidate.name());
+        });
+    } else {
+        flash::fwd_autotune(cache, keys, repeats, fwd_tuning_time_cuda);
+    }
+    TORCH_CHECK(cache.save(cache_path), "could not write the tuning cache to ", cache_path);
+    std::vector<std::tuple<int, bool, bool, int, std::string, float>> entries;
+    for (const auto &[key, entry] : cache.entries()) {
+        entries.emplace_back(key.hdim, key.is_bf16, key.is_causal, key.seqlen_bucket, entry.candidate, entry.time_ms);
+    }
+    flash::Fwd_tuning_dispatch::get().set(std::move(cache));
+    return entries;
+}
+
+// Makes dispatch use the tuning cache at path, as FLASH_ATTENTION_TUNING_CACHE does at startup.
+// False, and dispatch back to the defaults, if it isn't a cache of this version for the device.
+bool
+fwd_load_tuning_cache(const std::string &path, const std::string &device) {
+    flash::Fwd_tuning_cache cache;
+    const bool loaded = cache.load(path, device);
+    flash::Fwd_tuning_dispatch::get().set(std::move(cache));
+    return loaded;
+}
+
+// The candidate the forward dispatches to for these arguments on the device, empty for the default.
+std::string
+fwd_tuned_candidate(const int head_size, const bool is_bf16, const bool is_causal, const int seqlen_k, const std::string &device) {
+    return flash::Fwd_tuning_dispatch::get().lookup({head_size, is_bf16, is_causal, flash::fwd_tuning_seqlen_bucket(seqlen_k)}, device);
+}
+
+// (hits, misses) of the launch config cache since it was last cleared.
+std::tuple<int64_t, int64_t>
+launch_config_cache_stats() {
+    const auto stats = flash::Launch_config_cache::get().stats();
+    return {stats.first, stats.second};
+}
+
+void
+clear_launch_config_cache() {
+    flash::Launch_config_cache::get().clear();
+}
+
+// Starts recording the tiles of the forward, in a ring buffer of the latest capacity tiles.
+void
+fwd_tile_trace_start(const int capacity) {
+    TORCH_CHECK(capacity > 0, "capacity must be positive");
+    auto &tile_trace = get_fwd_tile_trace();
+    std::lock_guard<std::mutex> lock(tile_trace.mutex);
+    tile_trace.enabled = true;
+    tile_trace.capacity = capacity;
+    tile_trace.trace = at::Tensor();
+    tile_trace.count = at::Tensor();
+}
+
+// Stops recording. Returns the records, oldest first, as a (num_records, 8) int64 CPU tensor of
+// (tile, bidb, bidh, m_block, worker, sm, start_ns, end_ns), the number of tiles recorded (more than
+// num_records if the ring buffer wrapped around), and the records as Chrome trace JSON.
+std::tuple<at::Tensor, int64_t, std::string>
+fwd_tile_trace_stop() {
+    auto &tile_trace = get_fwd_tile_trace();
+    std::lock_guard<std::mutex> lock(tile_trace.mutex);
+    tile_trace.enabled = false;
+    at::Tensor records = torch::empty({0, flash::kTileTraceFields}, torch::dtype(torch::kInt64));
+    int64_t num_recorded = 0;
+    if (tile_trace.trace.defined()) {
+        const at::Tensor trace = tile_trace.trace.cpu();
+        num_recorded = tile_trace.count.item<int64_t>();
+        if (num_recorded <= tile_trace.capacity) {
+            records = trace.slice(0, 0, num_recorded).contiguous();
+        } else {
+            const int64_t oldest = num_recorded % tile_trace.capacity;
+            records = torch::cat({trace.slice(0, oldest), trace.slice(0, 0, oldest)});
+        }
+        tile_trace.trace = at::Tensor();
+        tile_trace.count = at::Tensor();
+    }
+    return {records, num_recorded, flash::tile_trace_to_chrome_json(records.data_ptr<int64_t>(), records.size(0))};
+}
+
+#ifndef FLASH_ATTN_NO_PYTHON
+
+// Opt-in launch telemetry: hook(dict) is called on every kernel launch (every task grid of the CPU
+// backend) with its kernel, device, head_dim, block_m, block_n, num_threads, smem_size, ctas_per_sm,
+// grid and whether its launch config came from the cache. None turns it off.
+void
+set_launch_telemetry_hook(c10::optional<py::function> hook_) {
+    if (!hook_.has_value()) {
+        flash::Launch_config_cache::get().set_telemetry_hook(nullptr);
+        return;
+    }
+    // Releasing the last reference to the callable needs the GIL too.
+    auto hook = std::shared_ptr<py::function>(new py::function(hook_.value()), [](py::function *f) {
+        py::gil_scoped_acquire gil;
+        delete f;
+    });
+    flash::Launch_config_cache::get().set_telemetry_hook([hook](const flash::Launch_telemetry &t) {
+        py::gil_scoped_acquire gil;
+        py::dict record;
+        record["kernel"] = t.kernel;
+        record["device"] = t.device;
+        record["head_dim"] = t.head_dim;
+        record["block_m"] = t.block_m;
+        record["block_n"] = t.block_n;
+        record["num_threads"] = t.num_threads;
+        record["smem_size"] = t.smem_size;
+        record["ctas_per_sm"] = t.ctas_per_sm;
+        record["grid"] = py::make_tuple(t.grid_x, t.grid_y, t.grid_z);
+        record["cache_hit"] = t.cache_hit;
+        (*hook)(record);
+    });
+}
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     m.doc() = "FlashAttention";
     m.def("fwd", &mha_fwd, "Forward pass");
     m.def("varlen_fwd", &mha_varlen_fwd, "Forward pass (variable length)");
     m.def("bwd", &mha_bwd, "Backward pass");
     m.def("varlen_bwd", &mha_varlen_bwd, "Backward pass (variable length)");
+    m.def("fwd_causal_schedule", &fwd_causal_schedule, "Simulated tile dispatch of the causal forward");
+    m.def("fwd_varlen_causal_schedule", &fwd_varlen_causal_schedule, "Simulated tile dispatch of the varlen causal forward");
+    m.def("fwd_local_tile_count", &fwd_local_tile_count, "Tiles computed and skipped by the sliding window forward");
+    m.def("bwd_causal_cta_tiles", &bwd_causal_cta_tiles, "Tiles of each CTA of the causal backward");
+    m.def("is_index64", &is_index64, "Whether the kernels are launched with 64-bit offsets");
+    m.def("fwd_tuning_candidates", &fwd_tuning_candidates, "Kernel trait sets the forward is tuned over");
+    m.def("fwd_autotune", &fwd_autotune, "Tune the forward and save the winners to a cache file");
+    m.def("fwd_load_tuning_cache", &fwd_load_tuning_cache, "Load the forward tuning cache for a device");
+    m.def("fwd_tuned_candidate", &fwd_tuned_candidate, "Kernel trait set the forward dispatches to");
+    m.def("set_launch_telemetry_hook", &set_launch_telemetry_hook, "Set or clear the kernel launch telemetry hook");
+    m.def("launch_config_cache_stats", &launch_config_cache_stats, "Hits and misses of the launch config cache");
+    m.def("clear_launch_config_cache", &clear_launch_config_cache, "Clear the launch config cache");
+    m.def("fwd_tile_trace_start", &fwd_tile_trace_start, "Start recording the per-tile timings of the forward");
+    m.def("fwd_tile_trace_stop", &fwd_tile_trace_stop, "Stop recording and return the per-tile timings of the forward");
+    // The hook holds a Python callable, which must go before the interpreter does.
+    py::module_::import("atexit").attr("register")(py::cpp_function([] {
+        flash::Launch_config_cache::get().set_telemetry_hook(nullptr);
+    }));
 }
+
+#endif
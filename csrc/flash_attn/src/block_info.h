@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <type_traits>
+
 namespace flash {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -16,24 +18,52 @@ struct BlockInfo {
         : sum_s_q(!Varlen || params.cu_seqlens_q == nullptr ? -1 : params.cu_seqlens_q[bidb])
         , sum_s_k(!Varlen || params.cu_seqlens_k == nullptr ? -1 : params.cu_seqlens_k[bidb])
         , actual_seqlen_q(!Varlen || params.cu_seqlens_q == nullptr ? params.seqlen_q : params.cu_seqlens_q[bidb + 1] - sum_s_q)
-        , actual_seqlen_k(!Varlen || params.cu_seqlens_k == nullptr ? params.seqlen_k : params.cu_seqlens_k[bidb + 1] - sum_s_k)
+        , seqlen_k_cache(!Varlen || (params.cu_seqlens_k == nullptr && params.cache_seqlens == nullptr) ? params.seqlen_k
+                         : (params.cache_seqlens != nullptr ? params.cache_seqlens[bidb] : params.cu_seqlens_k[bidb + 1] - sum_s_k))
+        , actual_seqlen_k(seqlen_k_cache + (!Varlen || params.knew_ptr == nullptr ? 0 : params.seqlen_knew))
+        , block_table(params.block_table == nullptr ? nullptr : params.block_table + bidb * params.block_table_batch_stride)
+        , page_block_size(params.page_block_size)
         {
         }
 
     template <typename index_t>
     inline __device__ index_t q_offset(const index_t batch_stride, const index_t row_stride, const int bidb) const {
-        return sum_s_q == -1 ? bidb * batch_stride : uint32_t(sum_s_q) * row_stride;
+        return sum_s_q == -1 ? bidb * batch_stride : index_t(sum_s_q) * row_stride;
     }
 
     template <typename index_t>
     inline __device__ index_t k_offset(const index_t batch_stride, const index_t row_stride, const int bidb) const {
-        return sum_s_k == -1 ? bidb * batch_stride : uint32_t(sum_s_k) * row_stride;
+        return sum_s_k == -1 ? bidb * batch_stride : index_t(sum_s_k) * row_stride;
+    }
+
+    // Offset of the key / value row `row` of the sequence, head excluded. With a paged KV cache the
+    // row is looked up in the block table; the rows of a kBlockN tile never cross a page.
+    template <typename index_t>
+    inline __device__ index_t k_offset(const index_t batch_stride, const index_t row_stride, const int bidb, const int row) const {
+        if (block_table == nullptr) { return k_offset(batch_stride, row_stride, bidb) + index_t(row) * row_stride; }
+        const int page_idx = row / page_block_size;
+        return index_t(block_table[page_idx]) * batch_stride + index_t(row - page_idx * page_block_size) * row_stride;
+    }
+
+    // Increment of a K / V tile pointer moving from the row row_src to the row row_dst. Signed, and as
+    // wide as index_t, since the pages of a paged KV cache may lie further apart than an int allows.
+    template <typename index_t>
+    inline __device__ std::make_signed_t<index_t> k_advance(const index_t batch_stride, const index_t row_stride, const int bidb,
+                                                            const int row_src, const int row_dst) const {
+        using offset_t = std::make_signed_t<index_t>;
+        return block_table == nullptr
+            ? (row_dst - row_src) * offset_t(row_stride)
+            : offset_t(k_offset(batch_stride, row_stride, bidb, row_dst) - k_offset(batch_stride, row_stride, bidb, row_src));
     }
 
     const int sum_s_q;
     const int sum_s_k;
     const uint32_t actual_seqlen_q;
+    // Keys / values in the cache before the append, if any.
+    const int seqlen_k_cache;
     const uint32_t actual_seqlen_k;
+    const int *block_table;
+    const int page_block_size;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -23,7 +23,9 @@ constexpr int D_DIM = 2;
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 struct Qkv_params {
-    using index_t = uint32_t;
+    // The strides are kept in 64 bits. The kernels compute their offsets in Kernel_traits::index_t,
+    // 32 bits unless is_index64 is set.
+    using index_t = int64_t;
     // The QKV matrices.
     void *__restrict__ q_ptr;
     void *__restrict__ k_ptr;
@@ -69,6 +71,11 @@ struct Flash_fwd_params : public Qkv_params {
     // The pointer to the softmax sum.
     void * __restrict__ softmax_lse_ptr;
 
+    // Split-KV: the number of splits of seqlen_k (1 if off), and the partial O and LSE of each split.
+    int num_splits;
+    void * __restrict__ oaccum_ptr;
+    void * __restrict__ softmax_lseaccum_ptr;
+
     // The dimensions.
     int b, seqlen_q, seqlen_k, d, seqlen_q_rounded, seqlen_k_rounded, d_rounded;
 
@@ -82,6 +89,58 @@ struct Flash_fwd_params : public Qkv_params {
 
     int *__restrict__ blockmask;
 
+    // Paged KV cache: K and V are (num_blocks, page_block_size, h_k, d), and the key / value rows
+    // [i * page_block_size, (i + 1) * page_block_size) of sequence bidb live in the page
+    // block_table[bidb * block_table_batch_stride + i]. k_batch_stride / v_batch_stride are then the
+    // strides between pages. nullptr if K and V are contiguous.
+    int * __restrict__ block_table;
+    index_t block_table_batch_stride;
+    int page_block_size;
+
+    // KV cache: the number of keys / values already in the cache of each sequence, with seqlen_k the
+    // capacity of the cache. nullptr if K and V are used in full.
+    int * __restrict__ cache_seqlens;
+
+    // New keys / values, (b, seqlen_knew, h_k, d). The forward writes them to the cache rows
+    // [cache_seqlens[bidb], cache_seqlens[bidb] + seqlen_knew) and attends over them together with
+    // the cache. nullptr if there's nothing to append.
+    void * __restrict__ knew_ptr;
+    void * __restrict__ vnew_ptr;
+    index_t knew_batch_stride;
+    index_t vnew_batch_stride;
+    index_t knew_row_stride;
+    index_t vnew_row_stride;
+    index_t knew_head_stride;
+    index_t vnew_head_stride;
+    int seqlen_knew;
+
+    // Tile counter of the persistent causal forward, zero before the launch.
+    int * __restrict__ tile_count_semaphore;
+
+    // Varlen causal forward: the tiles are handed out in the order of a plan over the actual
+    // sequence lengths (flash::plan_varlen_causal_fwd). The CPU backend plans on the host, from
+    // cu_seqlens_q_host / cu_seqlens_k_host. The CUDA launch plans on the device, from cu_seqlens_q /
+    // cu_seqlens_k, when plan_varlen_causal is set, so that it neither syncs nor copies.
+    const int * cu_seqlens_q_host;
+    const int * cu_seqlens_k_host;
+    bool plan_varlen_causal;
+
+    // Device tile plan of the persistent causal forward, (*num_planned_tiles, 3) of (bidb, bidh,
+    // m_block). Filled in by the planner kernel of the launch.
+    const int * tile_plan;
+    const int * num_planned_tiles;
+
+    // Completion flags of the causal producer / consumer pairing, laid out as
+    // (b, h, ceil_div(seqlen_q, kBlockM)) and indexed by the consumer's m_block. Zero before the
+    // launch, and handed back at zero by the consumers.
+    int * __restrict__ complete_flags;
+
+    // Per-tile timing trace (flash_tile_trace.h), nullptr unless profiling: a ring buffer of
+    // tile_trace_capacity records and the number of records appended to it so far.
+    int64_t * __restrict__ tile_trace;
+    unsigned long long * __restrict__ tile_trace_count;
+    int tile_trace_capacity;
+
     // The dropout probability (probability of keeping an activation).
     float p_dropout;
     // uint32_t p_dropout_in_uint;
@@ -100,6 +159,40 @@ struct Flash_fwd_params : public Qkv_params {
 
     bool is_bf16;
     bool is_causal;
+
+    // Whether an offset into one of the tensors could overflow 32 bits, set on the host by
+    // set_params_fprop / set_params_dgrad. The kernels are then launched with Kernel_traits::Index64.
+    bool is_index64;
+
+    // Sliding window: query row i attends to the keys [i - window_size_left, i + window_size_right],
+    // -1 leaving that side unbounded. Both are -1 for the causal and the full attention. The kernels
+    // narrow the key blocks of a row block (the query blocks of a column block in the backward) to
+    // the window, so the tiles outside of it are never loaded.
+    int window_size_left;
+    int window_size_right;
+
+    // ALiBi: fp32 slopes of (b, h), or of (h) with alibi_slopes_batch_stride 0. The score of query
+    // row i and key j gets the bias -alibi_slopes[bidb][bidh] * |i - j|. nullptr if off.
+    void * __restrict__ alibi_slopes_ptr;
+    index_t alibi_slopes_batch_stride;
+
+    // Rotary embedding, fused into the loads of Q and K: cos / sin tables of (seqlen_ro, rotary_dim / 2),
+    // contiguous and of the same type as Q. The first rotary_dim columns of the row at position i
+    // are rotated by the angles of row i of the tables, in pairs (2j, 2j + 1) if is_rotary_interleaved
+    // (GPT-J style) or (j, j + rotary_dim / 2) otherwise (GPT-NeoX style). nullptr if off.
+    void * __restrict__ rotary_cos_ptr;
+    void * __restrict__ rotary_sin_ptr;
+    int rotary_dim;
+    bool is_rotary_interleaved;
+
+    // Chunked / ring attention: the incoming (O, LSE) state over the keys attended so far, of the
+    // shapes of O and of the LSE. The O and LSE of this call, written to o_ptr / softmax_lse_ptr, are
+    // merged into it in place once the forward is done. nullptr if off.
+    void * __restrict__ o_state_ptr;
+    void * __restrict__ softmax_lse_state_ptr;
+    index_t o_state_batch_stride;
+    index_t o_state_row_stride;
+    index_t o_state_head_stride;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -122,8 +215,7 @@ struct Flash_bwd_params : public Flash_fwd_params {
     // dv_accum_ptr;
 
     // The stride between rows of the dO, dQ, dK and dV matrices.
-    // TD [2022-04-16]: We're using 32-bit indexing to save registers.
-    // The code probably won't work for arrays larger than 2GB.
+    // Offsets past 2^31 elements take the 64-bit variant of the kernels, see is_index64.
     index_t do_batch_stride;
     index_t do_row_stride;
     index_t do_head_stride;
@@ -139,10 +231,21 @@ struct Flash_bwd_params : public Flash_fwd_params {
 
     // The pointer to the softmax d sum.
     void *__restrict__ dsoftmax_sum;
+
+    // Deterministic mode: instead of all the CTAs of a (batch, head) adding their dQ atomically into
+    // dq_accum, in whatever order they get there, dq_accum holds dq_accum_splits partial buffers
+    // dq_accum_split_stride apart. CTA blockIdx.x of the seqk-parallel grid, of dq_accum_splits per
+    // (batch, head), runs its column blocks in a fixed order and only adds into its own buffer, and
+    // convert_dQ sums the buffers in order. dq_accum_splits is 1 otherwise.
+    bool deterministic;
+    int dq_accum_splits;
+    index_t dq_accum_split_stride;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<typename T, int Headdim> void run_mha_fwd_(Flash_fwd_params &params, cudaStream_t stream);
+template<typename T, int Headdim> void run_mha_fwd_cpu_(Flash_fwd_params &params);
 
 template<typename T, int Headdim> void run_mha_bwd_(Flash_bwd_params &params, cudaStream_t stream, const bool configure);
+template<typename T, int Headdim> void run_mha_bwd_cpu_(Flash_bwd_params &params);
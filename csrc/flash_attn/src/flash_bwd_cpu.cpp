@@ -0,0 +1,86 @@
+// Copyright (c) 2023, Tri Dao.
+
+// CPU backend for the backward pass. Consumes the same Flash_bwd_params as the CUDA kernels and
+// follows run_flash_bwd_seqk_parallel, so that it can serve as a reference on machines without a GPU.
+
+#include <ATen/Parallel.h>
+
+#include "flash.h"
+#include "flash_bwd_cpu_kernel.h"
+#include "flash_fwd_scheduler.h"
+#include "flash_launch_config.h"
+#include "static_switch.h"
+
+template<typename Kernel_traits, bool Is_causal>
+void run_flash_bwd_cpu(Flash_bwd_params &params) {
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kBlockN = Kernel_traits::kBlockN;
+    const int num_m_block = (params.seqlen_q + kBlockM - 1) / kBlockM;
+    const int num_n_block = (params.seqlen_k + kBlockN - 1) / kBlockN;
+    // Goes through the launch config cache like the CUDA kernels, for the telemetry.
+    const auto config = flash::Launch_config_cache::get().get_or_compute(
+        reinterpret_cast<const void *>(&run_flash_bwd_cpu<Kernel_traits, Is_causal>), /*device=*/-1, [] {
+            flash::Launch_config config;
+            config.smem_size = flash::cpu::Bwd_workspace<Kernel_traits>::kSmemSize;
+            config.ctas_per_sm = 1;
+            return config;
+        });
+
+    at::parallel_for(0, int64_t(params.b) * params.h * num_m_block, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t tile = begin; tile < end; ++tile) {
+            flash::cpu::compute_dot_do_o<Kernel_traits>(params, tile / num_m_block / params.h,
+                                                        (tile / num_m_block) % params.h, tile % num_m_block);
+        }
+    });
+
+    // One task per (batch, head, column block), or per pair of column blocks when causal. In
+    // deterministic mode one task per dQ partial buffer instead, each running its share in order:
+    // since dq_accum_splits does not depend on the number of threads, neither do the results.
+    const int num_ctas = Is_causal ? flash::causal_bwd_num_ctas(num_n_block) : num_n_block;
+    const int grid_x = params.deterministic ? params.dq_accum_splits : num_ctas;
+    flash::report_launch<Kernel_traits>("compute_dq_dk_dv_seqk_parallel", /*device=*/-1, config, grid_x, params.b, params.h);
+    at::parallel_for(0, int64_t(params.b) * params.h * grid_x, 1, [&](int64_t begin, int64_t end) {
+        flash::cpu::Bwd_workspace<Kernel_traits> ws;
+        for (int64_t tile = begin; tile < end; ++tile) {
+            const int block_x = tile % grid_x;
+            const int bidh = (tile / grid_x) % params.h;
+            const int bidb = tile / grid_x / params.h;
+            flash::cpu::compute_dq_dk_dv_seqk_parallel<Kernel_traits, Is_causal>(params, bidb, bidh, block_x, grid_x, ws);
+        }
+    });
+
+    at::parallel_for(0, int64_t(params.b) * params.h * num_m_block, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t tile = begin; tile < end; ++tile) {
+            flash::cpu::convert_dq<Kernel_traits>(params, tile / num_m_block / params.h,
+                                                  (tile / num_m_block) % params.h, tile % num_m_block);
+        }
+    });
+}
+
+template<typename T, int Headdim>
+void run_mha_bwd_cpu_(Flash_bwd_params &params) {
+    // About the tile sizes of the sm80 configurations in flash_bwd_launch_template.h.
+    constexpr int kBlockM = Headdim <= 64 ? 128 : 64;
+    constexpr int kBlockN = Headdim <= 128 ? 128 : 64;
+    using Kernel_traits = flash::cpu::Flash_bwd_cpu_kernel_traits<Headdim, kBlockM, kBlockN, T>;
+    BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+        run_flash_bwd_cpu<Kernel_traits, Is_causal>(params);
+    });
+}
+
+template void run_mha_bwd_cpu_<cutlass::half_t, 32>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::half_t, 64>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::half_t, 96>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::half_t, 128>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::half_t, 160>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::half_t, 192>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::half_t, 224>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::half_t, 256>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 32>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 64>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 96>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 128>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 160>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 192>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 224>(Flash_bwd_params &params);
+template void run_mha_bwd_cpu_<cutlass::bfloat16_t, 256>(Flash_bwd_params &params);
@@ -0,0 +1,295 @@
+/******************************************************************************
+ * Copyright (c) 2023, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <cutlass/numeric_types.h>
+
+#include "flash_fwd_cpu_kernel.h"
+#include "flash_fwd_scheduler.h"
+
+namespace flash {
+
+namespace cpu {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host-side counterpart of Flash_bwd_kernel_traits, the tiling only.
+template<int kHeadDim_, int kBlockM_, int kBlockN_, typename elem_type=cutlass::half_t>
+struct Flash_bwd_cpu_kernel_traits : public Flash_fwd_cpu_kernel_traits<kHeadDim_, kBlockM_, kBlockN_, elem_type> {};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Per-thread scratch space of compute_dq_dk_dv_1colblock: the smem tiles (sK, sV, sQ, sdO), the
+// dK / dV accumulators of the column block, and P / dS and the dQ partial of the current row block.
+template<typename Kernel_traits>
+struct Bwd_workspace {
+    static constexpr int kBlockM = Kernel_traits::kBlockM;
+    static constexpr int kBlockN = Kernel_traits::kBlockN;
+    static constexpr int kHeadDim = Kernel_traits::kHeadDim;
+    // Bytes of the tiles, the counterpart of the kSmemSize1colblock of the CUDA kernel traits.
+    static constexpr int kSmemSize = int(sizeof(float)) * (3 * kBlockM * kHeadDim + 4 * kBlockN * kHeadDim
+                                                           + 2 * kBlockM * kBlockN + 2 * kBlockM);
+
+    Bwd_workspace()
+        : sQ(kBlockM * kHeadDim), sdO(kBlockM * kHeadDim), sK(kBlockN * kHeadDim), sV(kBlockN * kHeadDim)
+        , acc_dk(kBlockN * kHeadDim), acc_dv(kBlockN * kHeadDim), acc_s(kBlockM * kBlockN), acc_dp(kBlockM * kBlockN)
+        , acc_dq(kBlockM * kHeadDim), lse(kBlockM), dp_sum(kBlockM) {}
+
+    std::vector<float> sQ, sdO, sK, sV;
+    std::vector<float> acc_dk, acc_dv;
+    std::vector<float> acc_s, acc_dp, acc_dq;
+    std::vector<float> lse, dp_sum;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// atomicAdd of the CUDA kernels on a float in gmem.
+inline void atomic_add(float *address, const float val) {
+    float expected;
+    __atomic_load(address, &expected, __ATOMIC_RELAXED);
+    float desired = expected + val;
+    while (!__atomic_compare_exchange(address, &expected, &desired, /*weak=*/true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        desired = expected + val;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as flash::compute_dot_do_o with Clear_dQaccum: D = rowsum(dO * O) of the row block
+// (bidb, bidh, m_block) into params.dsoftmax_sum, and its rows of dq_accum zeroed.
+template<typename Kernel_traits, typename Params>
+inline void compute_dot_do_o(const Params &params, const int bidb, const int bidh, const int m_block) {
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    if (m_block * kBlockM >= binfo.actual_seqlen_q) return;
+    const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM);
+
+    const index_t row_offset_do = binfo.q_offset(index_t(params.do_batch_stride), index_t(params.do_row_stride), bidb)
+        + index_t(m_block) * kBlockM * params.do_row_stride + index_t(bidh) * params.do_head_stride;
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + index_t(m_block) * kBlockM * params.o_row_stride + index_t(bidh) * params.o_head_stride;
+    const index_t row_offset_dq_accum = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
+                                         + index_t(m_block) * kBlockM) * params.d_rounded;
+    const index_t row_offset_dpsum = (index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded + m_block * kBlockM;
+
+    for (int mi = 0; mi < m_rows; ++mi) {
+        const Element *dout = reinterpret_cast<const Element *>(params.do_ptr) + row_offset_do + mi * index_t(params.do_row_stride);
+        const Element *out = reinterpret_cast<const Element *>(params.o_ptr) + row_offset_o + mi * index_t(params.o_row_stride);
+        float dot = 0.f;
+        for (int c = 0; c < params.d; ++c) { dot += float(dout[c]) * float(out[c]); }
+        reinterpret_cast<ElementAccum *>(params.dsoftmax_sum)[row_offset_dpsum + mi] = dot;
+        ElementAccum *dq_accum = reinterpret_cast<ElementAccum *>(params.dq_accum_ptr) + row_offset_dq_accum + mi * index_t(params.d_rounded);
+        std::fill(dq_accum, dq_accum + params.d_rounded, 0.f);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as flash::compute_dq_dk_dv_1colblock in its Seq_parallel flavour: dK and dV of the column
+// block n_block of (bidb, bidh), written out, and its share of dQ added into dq_accum. Query
+// blocks are visited in reverse order, like the GPU kernel. P and dS go through Element before
+// their GEMMs, and dK / dQ are scaled by the softmax scale at the end (dQ in convert_dq). In
+// deterministic mode dQ goes with plain adds into the partial buffer of the split, which only the
+// calling task writes to.
+template<typename Kernel_traits, bool Is_causal, typename Params>
+inline void compute_dq_dk_dv_1colblock(const Params &params, const int bidb, const int bidh, const int n_block,
+                                       const int split, Bwd_workspace<Kernel_traits> &ws) {
+
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kBlockN = Kernel_traits::kBlockN;
+    constexpr int kHeadDim = Kernel_traits::kHeadDim;
+
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    if (n_block * kBlockN >= binfo.actual_seqlen_k || binfo.actual_seqlen_q == 0) return;
+
+    const int d = params.d;
+    const int n_cols = std::min(kBlockN, binfo.actual_seqlen_k - n_block * kBlockN);
+    const float alibi_slope = params.alibi_slopes_ptr == nullptr ? 0.f
+        : reinterpret_cast<const float *>(params.alibi_slopes_ptr)[index_t(bidb) * params.alibi_slopes_batch_stride + bidh] / params.scale_softmax;
+
+    int m_block_max = (binfo.actual_seqlen_q + kBlockM - 1) / kBlockM;
+    int m_block_min = 0;
+    if (params.window_size_left >= 0 || params.window_size_right >= 0) {
+        local_m_block_range(n_block, binfo.actual_seqlen_q, kBlockM, kBlockN,
+                            params.window_size_left, params.window_size_right, m_block_min, m_block_max);
+    }
+    if (Is_causal) { m_block_min = (n_block * kBlockN) / kBlockM; }
+
+    const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb)
+        + index_t(n_block) * kBlockN * params.k_row_stride + index_t(bidh / params.h_h_k_ratio) * params.k_head_stride;
+    const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb)
+        + index_t(n_block) * kBlockN * params.v_row_stride + index_t(bidh / params.h_h_k_ratio) * params.v_head_stride;
+    copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.k_ptr) + row_offset_k,
+                        index_t(params.k_row_stride), ws.sK.data(), n_cols, d);
+    copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.v_ptr) + row_offset_v,
+                        index_t(params.v_row_stride), ws.sV.data(), n_cols, d);
+
+    std::fill(ws.acc_dk.begin(), ws.acc_dk.end(), 0.f);
+    std::fill(ws.acc_dv.begin(), ws.acc_dv.end(), 0.f);
+
+    for (int m_block = m_block_max - 1; m_block >= m_block_min; --m_block) {
+        const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM);
+        const index_t row_offset_q = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+            + index_t(m_block) * kBlockM * params.q_row_stride + index_t(bidh) * params.q_head_stride;
+        const index_t row_offset_do = binfo.q_offset(index_t(params.do_batch_stride), index_t(params.do_row_stride), bidb)
+            + index_t(m_block) * kBlockM * params.do_row_stride + index_t(bidh) * params.do_head_stride;
+        const index_t row_offset_lse = (index_t(bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+        const index_t row_offset_dpsum = (index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded + m_block * kBlockM;
+        copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.q_ptr) + row_offset_q,
+                            index_t(params.q_row_stride), ws.sQ.data(), m_rows, d);
+        copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.do_ptr) + row_offset_do,
+                            index_t(params.do_row_stride), ws.sdO.data(), m_rows, d);
+        for (int mi = 0; mi < m_rows; ++mi) {
+            ws.lse[mi] = reinterpret_cast<const ElementAccum *>(params.softmax_lse_ptr)[row_offset_lse + mi];
+            ws.dp_sum[mi] = reinterpret_cast<const ElementAccum *>(params.dsoftmax_sum)[row_offset_dpsum + mi];
+        }
+
+        // P = exp(S * scale - LSE), with the masking folded in, and dS = P * (dO V^T - D).
+        for (int mi = 0; mi < m_rows; ++mi) {
+            const int row_idx = m_block * kBlockM + mi;
+            int col_idx_limit = Is_causal ? std::min(binfo.actual_seqlen_k, row_idx + 1) : binfo.actual_seqlen_k;
+            if (params.window_size_right >= 0) { col_idx_limit = std::min(col_idx_limit, row_idx + 1 + params.window_size_right); }
+            const int col_idx_min = params.window_size_left < 0 ? 0 : row_idx - params.window_size_left;
+            const float *q = ws.sQ.data() + mi * kHeadDim;
+            const float *dout = ws.sdO.data() + mi * kHeadDim;
+            float *p = ws.acc_s.data() + mi * kBlockN;
+            float *ds = ws.acc_dp.data() + mi * kBlockN;
+            for (int ni = 0; ni < n_cols; ++ni) {
+                const int col_idx = n_block * kBlockN + ni;
+                if (col_idx >= col_idx_limit || col_idx < col_idx_min) { p[ni] = ds[ni] = 0.f; continue; }
+                const float *k = ws.sK.data() + ni * kHeadDim;
+                const float *v = ws.sV.data() + ni * kHeadDim;
+                float s = 0.f, dp = 0.f;
+                for (int c = 0; c < d; ++c) {
+                    s += q[c] * k[c];
+                    dp += dout[c] * v[c];
+                }
+                p[ni] = std::exp((s - alibi_slope * std::abs(row_idx - col_idx)) * params.scale_softmax - ws.lse[mi]);
+                ds[ni] = p[ni] * (dp - ws.dp_sum[mi]);
+            }
+        }
+
+        // dV += P^T dO, dK += dS^T Q, dQ = dS K.
+        std::fill(ws.acc_dq.begin(), ws.acc_dq.end(), 0.f);
+        for (int mi = 0; mi < m_rows; ++mi) {
+            const float *q = ws.sQ.data() + mi * kHeadDim;
+            const float *dout = ws.sdO.data() + mi * kHeadDim;
+            const float *p = ws.acc_s.data() + mi * kBlockN;
+            const float *ds = ws.acc_dp.data() + mi * kBlockN;
+            float *dq = ws.acc_dq.data() + mi * kHeadDim;
+            for (int ni = 0; ni < n_cols; ++ni) {
+                const float p_rounded = float(Element(p[ni]));
+                const float ds_rounded = float(Element(ds[ni]));
+                if (p_rounded == 0.f && ds_rounded == 0.f) { continue; }
+                const float *k = ws.sK.data() + ni * kHeadDim;
+                float *dk = ws.acc_dk.data() + ni * kHeadDim;
+                float *dv = ws.acc_dv.data() + ni * kHeadDim;
+                for (int c = 0; c < d; ++c) {
+                    dv[c] += p_rounded * dout[c];
+                    dk[c] += ds_rounded * q[c];
+                    dq[c] += ds_rounded * k[c];
+                }
+            }
+        }
+        const index_t row_offset_dq_accum = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
+                                             + index_t(m_block) * kBlockM) * params.d_rounded
+            + (params.deterministic ? index_t(split) * params.dq_accum_split_stride : 0);
+        ElementAccum *gdQaccum = reinterpret_cast<ElementAccum *>(params.dq_accum_ptr) + row_offset_dq_accum;
+        for (int mi = 0; mi < m_rows; ++mi) {
+            ElementAccum *dq_accum = gdQaccum + mi * index_t(params.d_rounded);
+            const float *dq = ws.acc_dq.data() + mi * kHeadDim;
+            if (params.deterministic) {
+                for (int c = 0; c < d; ++c) { dq_accum[c] += dq[c]; }
+            } else {
+                for (int c = 0; c < d; ++c) { atomic_add(dq_accum + c, dq[c]); }
+            }
+        }
+    }
+
+    // Column blocks that no query sees get a zero dK / dV.
+    const index_t row_offset_dk = binfo.k_offset(index_t(params.dk_batch_stride), index_t(params.dk_row_stride), bidb)
+        + index_t(n_block) * kBlockN * params.dk_row_stride + index_t(bidh) * params.dk_head_stride;
+    const index_t row_offset_dv = binfo.k_offset(index_t(params.dv_batch_stride), index_t(params.dv_row_stride), bidb)
+        + index_t(n_block) * kBlockN * params.dv_row_stride + index_t(bidh) * params.dv_head_stride;
+    for (int ni = 0; ni < n_cols; ++ni) {
+        Element *dk = reinterpret_cast<Element *>(params.dk_ptr) + row_offset_dk + ni * index_t(params.dk_row_stride);
+        Element *dv = reinterpret_cast<Element *>(params.dv_ptr) + row_offset_dv + ni * index_t(params.dv_row_stride);
+        for (int c = 0; c < d; ++c) {
+            dk[c] = Element(ws.acc_dk[ni * kHeadDim + c] * params.scale_softmax);
+            dv[c] = Element(ws.acc_dv[ni * kHeadDim + c]);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as flash::compute_dq_dk_dv_seqk_parallel: the task block_x of a grid of grid_x per
+// (bidb, bidh) runs the column blocks cta = block_x, block_x + grid_x, ..., in that order, or with
+// Is_causal the pairs of flash::causal_bwd_n_block, counted on the actual seqlen_k.
+template<typename Kernel_traits, bool Is_causal, typename Params>
+inline void compute_dq_dk_dv_seqk_parallel(const Params &params, const int bidb, const int bidh,
+                                           const int block_x, const int grid_x, Bwd_workspace<Kernel_traits> &ws) {
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    const int num_n_block = (binfo.actual_seqlen_k + Kernel_traits::kBlockN - 1) / Kernel_traits::kBlockN;
+    const int num_ctas = Is_causal ? causal_bwd_num_ctas(num_n_block) : num_n_block;
+    for (int cta = block_x; cta < num_ctas; cta += grid_x) {
+        for (int pair_idx = 0; pair_idx < (Is_causal ? 2 : 1); ++pair_idx) {
+            const int n_block = Is_causal ? causal_bwd_n_block(cta, pair_idx, num_n_block) : cta;
+            if (pair_idx == 1 && n_block == cta) break;
+            compute_dq_dk_dv_1colblock<Kernel_traits, Is_causal>(params, bidb, bidh, n_block, block_x, ws);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as flash::convert_dQ: dQ of the row block (bidb, bidh, m_block) = dq_accum * softmax scale,
+// with the partial buffers of the splits summed in order first in deterministic mode.
+template<typename Kernel_traits, typename Params>
+inline void convert_dq(const Params &params, const int bidb, const int bidh, const int m_block) {
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    if (m_block * kBlockM >= binfo.actual_seqlen_q) return;
+    const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM);
+
+    const index_t row_offset_dq = binfo.q_offset(index_t(params.dq_batch_stride), index_t(params.dq_row_stride), bidb)
+        + index_t(m_block) * kBlockM * params.dq_row_stride + index_t(bidh) * params.dq_head_stride;
+    const index_t row_offset_dq_accum = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
+                                         + index_t(m_block) * kBlockM) * params.d_rounded;
+    for (int mi = 0; mi < m_rows; ++mi) {
+        const ElementAccum *dq_accum = reinterpret_cast<const ElementAccum *>(params.dq_accum_ptr) + row_offset_dq_accum + mi * index_t(params.d_rounded);
+        Element *dq = reinterpret_cast<Element *>(params.dq_ptr) + row_offset_dq + mi * index_t(params.dq_row_stride);
+        for (int c = 0; c < params.d; ++c) {
+            float acc = dq_accum[c];
+            for (int split = 1; split < params.dq_accum_splits; ++split) { acc += dq_accum[split * params.dq_accum_split_stride + c]; }
+            dq[c] = Element(acc * params.scale_softmax);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace cpu
+
+}  // namespace flash
@@ -13,6 +13,7 @@
 #include <cutlass/numeric_conversion.h>
 
 #include "block_info.h"
+#include "flash_fwd_scheduler.h"
 #include "kernel_traits.h"
 #include "utils.h"
 #include "softmax.h"
@@ -129,19 +130,19 @@ inline __device__ void compute_dot_do_o(const Params &params) {
     const BlockInfo binfo(params, bidb);
     if (m_block * kBlockM >= binfo.actual_seqlen_q) return;
 
-    const index_t row_offset_do = binfo.q_offset(params.do_batch_stride, params.do_row_stride, bidb)
-        + m_block * kBlockM * params.do_row_stride + bidh * params.do_head_stride;
-    const index_t row_offset_o = binfo.q_offset(params.o_batch_stride, params.o_row_stride, bidb)
-        + m_block * kBlockM * params.o_row_stride + bidh * params.o_head_stride;
-    const index_t row_offset_dq_accum = ((bidb * params.h + bidh) * params.seqlen_q_rounded + m_block * kBlockM) * params.d_rounded;
-    const index_t row_offset_dpsum = (bidb * params.h + bidh) * params.seqlen_q_rounded + m_block * kBlockM;
+    const index_t row_offset_do = binfo.q_offset(index_t(params.do_batch_stride), index_t(params.do_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.do_row_stride) + bidh * index_t(params.do_head_stride);
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    const index_t row_offset_dq_accum = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded + m_block * kBlockM) * params.d_rounded;
+    const index_t row_offset_dpsum = (index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded + m_block * kBlockM;
 
     Tensor gdO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.do_ptr) + row_offset_do),
                              Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                             make_stride(params.do_row_stride, _1{}));
+                             make_stride(index_t(params.do_row_stride), _1{}));
     Tensor gO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.o_ptr) + row_offset_o),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.o_row_stride, _1{}));
+                            make_stride(index_t(params.o_row_stride), _1{}));
     Tensor gdQaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.dq_accum_ptr) + row_offset_dq_accum),
                                   Shape<Int<kBlockM>, Int<kHeadDim>>{}, Stride<Int<kHeadDim>, _1>{});
     Tensor dP_sum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.dsoftmax_sum) + row_offset_dpsum),
@@ -208,7 +209,7 @@ inline __device__ void clear_dKVaccum(const Params &params) {
     const BlockInfo binfo(params, bidb);
     if (n_block * kBlockN >= binfo.actual_seqlen_k) return;
 
-    const index_t row_offset_dkv_accum = ((bidb * params.h_k + bidh) * params.seqlen_k_rounded + n_block * kBlockN) * params.d_rounded;
+    const index_t row_offset_dkv_accum = ((index_t(bidb) * params.h_k + bidh) * params.seqlen_k_rounded + n_block * kBlockN) * params.d_rounded;
 
     Tensor gdKaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.dk_accum_ptr) + row_offset_dkv_accum),
                                   Shape<Int<kBlockN>, Int<kHeadDim>>{}, Stride<Int<kHeadDim>, _1>{});
@@ -252,14 +253,14 @@ inline __device__ void convert_dQ(const Params &params) {
     const BlockInfo binfo(params, bidb);
     if (m_block * kBlockM >= binfo.actual_seqlen_q) return;
 
-    const index_t row_offset_dq = binfo.q_offset(params.dq_batch_stride, params.dq_row_stride, bidb)
-        + m_block * kBlockM * params.dq_row_stride + bidh * params.dq_head_stride;
-    const index_t row_offset_dq_accum = ((bidb * params.h + bidh) * params.seqlen_q_rounded
+    const index_t row_offset_dq = binfo.q_offset(index_t(params.dq_batch_stride), index_t(params.dq_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.dq_row_stride) + bidh * index_t(params.dq_head_stride);
+    const index_t row_offset_dq_accum = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
                                          + m_block * kBlockM) * params.d_rounded;
 
     Tensor gdQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dq_ptr) + row_offset_dq),
                              Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                             make_stride(params.dq_row_stride, _1{}));
+                             make_stride(index_t(params.dq_row_stride), _1{}));
     Tensor gdQaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.dq_accum_ptr) + row_offset_dq_accum),
                                   Shape<Int<kBlockM>, Int<kHeadDim>>{},
                                   Stride<Int<kHeadDim>, _1>{});
@@ -287,9 +288,16 @@ inline __device__ void convert_dQ(const Params &params) {
     Tensor tdQrdQaccum = make_fragment_like(tdQgdQaccum);
     cute::copy(gmem_tiled_copy_dQaccum, tdQgdQaccum, tdQrdQaccum);
     #pragma unroll
-    for (int i = 0; i < size(acc_dq); ++i) {
-        acc_dq(i) = tdQrdQaccum(i) * params.scale_softmax_rp_dropout;
+    for (int i = 0; i < size(acc_dq); ++i) { acc_dq(i) = tdQrdQaccum(i); }
+    // Deterministic mode: the partial buffers of the splits are summed in order.
+    for (int split = 1; split < params.dq_accum_splits; ++split) {
+        tdQgdQaccum.data() = tdQgdQaccum.data() + params.dq_accum_split_stride;
+        cute::copy(gmem_tiled_copy_dQaccum, tdQgdQaccum, tdQrdQaccum);
+        #pragma unroll
+        for (int i = 0; i < size(acc_dq); ++i) { acc_dq(i) += tdQrdQaccum(i); }
     }
+    #pragma unroll
+    for (int i = 0; i < size(acc_dq); ++i) { acc_dq(i) *= params.scale_softmax_rp_dropout; }
     // Convert acc_dq from fp32 to fp16
     Tensor rdQ = flash::convert_type<Element>(acc_dq);
     Tensor taccdQrdQ = smem_thr_copy_dQ.retile_S(rdQ);  // ((Atom,AtomNum), MMA_N, MMA_N)
@@ -336,19 +344,19 @@ inline __device__ void convert_dKV(const Params &params) {
     const BlockInfo binfo(params, bidb);
     if (n_block * kBlockN >= binfo.actual_seqlen_k) return;
 
-    const index_t row_offset_dk = binfo.k_offset(params.dk_batch_stride, params.dk_row_stride, bidb)
-        + n_block * kBlockN * params.dk_row_stride + bidh * params.dk_head_stride;
-    const index_t row_offset_dv = binfo.k_offset(params.dv_batch_stride, params.dv_row_stride, bidb)
-        + n_block * kBlockN * params.dv_row_stride + bidh * params.dv_head_stride;
-    const index_t row_offset_dkv_accum = ((bidb * params.h_k + bidh) * params.seqlen_k_rounded
+    const index_t row_offset_dk = binfo.k_offset(index_t(params.dk_batch_stride), index_t(params.dk_row_stride), bidb)
+        + n_block * kBlockN * index_t(params.dk_row_stride) + bidh * index_t(params.dk_head_stride);
+    const index_t row_offset_dv = binfo.k_offset(index_t(params.dv_batch_stride), index_t(params.dv_row_stride), bidb)
+        + n_block * kBlockN * index_t(params.dv_row_stride) + bidh * index_t(params.dv_head_stride);
+    const index_t row_offset_dkv_accum = ((index_t(bidb) * params.h_k + bidh) * params.seqlen_k_rounded
                                           + n_block * kBlockN) * params.d_rounded;
 
     Tensor gdK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dk_ptr) + row_offset_dk),
                              Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                             make_stride(params.dk_row_stride, _1{}));
+                             make_stride(index_t(params.dk_row_stride), _1{}));
     Tensor gdV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dv_ptr) + row_offset_dv),
                              Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                             make_stride(params.dv_row_stride, _1{}));
+                             make_stride(index_t(params.dv_row_stride), _1{}));
     Tensor gdKaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.dk_accum_ptr) + row_offset_dkv_accum),
                                   Shape<Int<kBlockN>, Int<kHeadDim>>{},
                                   Stride<Int<kHeadDim>, _1>{});
@@ -446,47 +454,58 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
     constexpr bool Double_buffer = !Kernel_traits::No_double_buffer;
 
     const BlockInfo</*Varlen=*/!Is_even_MN> binfo(params, bidb);
+    // ALiBi slope of this (batch, head), divided by the softmax scale like the scores it is added to.
+    const float alibi_slope = params.alibi_slopes_ptr == nullptr ? 0.0f
+        : reinterpret_cast<float *>(params.alibi_slopes_ptr)[bidb * index_t(params.alibi_slopes_batch_stride) + bidh] / params.scale_softmax;
     if (n_block * kBlockN >= binfo.actual_seqlen_k || binfo.actual_seqlen_q == 0) return;
 
     int m_block_max = cute::ceil_div(binfo.actual_seqlen_q, kBlockM);
+    // Sliding window: only the query blocks [m_block_min, m_block_max) see this column block.
+    const bool is_local = params.window_size_left >= 0 || params.window_size_right >= 0;
+    int m_block_min_local = 0;
+    if (is_local) {
+        flash::local_m_block_range(n_block, binfo.actual_seqlen_q, kBlockM, kBlockN,
+                                   params.window_size_left, params.window_size_right, m_block_min_local, m_block_max);
+    }
 
-    const index_t row_offset_q = binfo.q_offset(params.q_batch_stride, params.q_row_stride, bidb)
-        + (m_block_max - 1) * kBlockM * params.q_row_stride + bidh * params.q_head_stride;
-    const index_t row_offset_k = binfo.k_offset(params.k_batch_stride, params.k_row_stride, bidb)
-        + n_block * kBlockN * params.k_row_stride + (bidh / params.h_h_k_ratio) * params.k_head_stride;
-    const index_t row_offset_v = binfo.k_offset(params.v_batch_stride, params.v_row_stride, bidb)
-        + n_block * kBlockN * params.v_row_stride + (bidh / params.h_h_k_ratio) * params.v_head_stride;
-    const index_t row_offset_do = binfo.q_offset(params.do_batch_stride, params.do_row_stride, bidb)
-        + (m_block_max - 1) * kBlockM * params.do_row_stride + bidh * params.do_head_stride;
-    const index_t row_offset_o = binfo.q_offset(params.o_batch_stride, params.o_row_stride, bidb)
-        + (m_block_max - 1) * kBlockM * params.o_row_stride + bidh * params.o_head_stride;
-    const index_t row_offset_dq = binfo.q_offset(params.dq_batch_stride, params.dq_row_stride, bidb)
-        + (m_block_max - 1) * kBlockM * params.dq_row_stride + bidh * params.dq_head_stride;
-    const index_t row_offset_dq_accum = ((bidb * params.h + bidh) * params.seqlen_q_rounded
-                                         + (m_block_max - 1) * kBlockM) * params.d_rounded;
-    const index_t row_offset_lse = (bidb * params.h + bidh) * params.seqlen_q
+    const index_t row_offset_q = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+        + (m_block_max - 1) * kBlockM * index_t(params.q_row_stride) + bidh * index_t(params.q_head_stride);
+    const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb)
+        + n_block * kBlockN * index_t(params.k_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.k_head_stride);
+    const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb)
+        + n_block * kBlockN * index_t(params.v_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.v_head_stride);
+    const index_t row_offset_do = binfo.q_offset(index_t(params.do_batch_stride), index_t(params.do_row_stride), bidb)
+        + (m_block_max - 1) * kBlockM * index_t(params.do_row_stride) + bidh * index_t(params.do_head_stride);
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + (m_block_max - 1) * kBlockM * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    const index_t row_offset_dq = binfo.q_offset(index_t(params.dq_batch_stride), index_t(params.dq_row_stride), bidb)
+        + (m_block_max - 1) * kBlockM * index_t(params.dq_row_stride) + bidh * index_t(params.dq_head_stride);
+    const index_t row_offset_dq_accum = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
+                                         + (m_block_max - 1) * kBlockM) * params.d_rounded
+        + (Seq_parallel && params.deterministic ? index_t(blockIdx.x) * params.dq_accum_split_stride : 0);
+    const index_t row_offset_lse = (index_t(bidb) * params.h + bidh) * params.seqlen_q
         + (m_block_max - 1) * kBlockM;
-    const index_t row_offset_dpsum = (bidb * params.h + bidh) * params.seqlen_q_rounded
+    const index_t row_offset_dpsum = (index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
         + (m_block_max - 1) * kBlockM;
 
     Tensor gQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.q_ptr) + row_offset_q),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.q_row_stride, _1{}));
+                            make_stride(index_t(params.q_row_stride), _1{}));
     Tensor gK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.k_ptr) + row_offset_k),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.k_row_stride, _1{}));
+                            make_stride(index_t(params.k_row_stride), _1{}));
     Tensor gV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.v_ptr) + row_offset_v),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.v_row_stride, _1{}));
+                            make_stride(index_t(params.v_row_stride), _1{}));
     Tensor gdO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.do_ptr) + row_offset_do),
                              Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                             make_stride(params.do_row_stride, _1{}));
+                             make_stride(index_t(params.do_row_stride), _1{}));
     Tensor gO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.o_ptr) + row_offset_o),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.o_row_stride, _1{}));
+                            make_stride(index_t(params.o_row_stride), _1{}));
     Tensor gdQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dq_ptr) + row_offset_dq),
                              Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                             make_stride(params.dq_row_stride, _1{}));
+                             make_stride(index_t(params.dq_row_stride), _1{}));
     Tensor gdQaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.dq_accum_ptr) + row_offset_dq_accum),
                                   Shape<Int<kBlockM>, Int<kHeadDim>>{},
                                   Stride<Int<kHeadDim>, _1>{});
@@ -655,27 +674,27 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
     // Prologue
 
     // We'll advance gdQ and gdQaccum before the 1st read/write.
-    tdQgdQ.data() = tdQgdQ.data() + kBlockM * params.dq_row_stride;
+    tdQgdQ.data() = tdQgdQ.data() + kBlockM * index_t(params.dq_row_stride);
     tdQgdQaccum.data() = tdQgdQaccum.data() + kBlockM * params.d_rounded;
 
     int m_block = m_block_max - 1;
-    int m_block_min = !Is_causal ? 0 : (n_block * kBlockN) / kBlockM;
+    int m_block_min = !Is_causal ? m_block_min_local : (n_block * kBlockN) / kBlockM;
 
     // We might need to exit early and write 0 to dK and dV.
     // Otherwise we get wrong result for the case where we don't enter the for loop.
     // And we might read OOB elements from gQ and gdO.
     // TODO: what if we're not parallelizing, do we need to compute dot_do_o?
-    if (Is_causal && m_block < m_block_min) {
-        const index_t row_offset_dk = binfo.k_offset(params.dk_batch_stride, params.dk_row_stride, bidb)
-          + n_block * kBlockN * params.dk_row_stride + bidh * params.dk_head_stride;
-        const index_t row_offset_dv = binfo.k_offset(params.dv_batch_stride, params.dv_row_stride, bidb)
-          + n_block * kBlockN * params.dv_row_stride + bidh * params.dv_head_stride;
+    if ((Is_causal || is_local) && m_block < m_block_min) {
+        const index_t row_offset_dk = binfo.k_offset(index_t(params.dk_batch_stride), index_t(params.dk_row_stride), bidb)
+          + n_block * kBlockN * index_t(params.dk_row_stride) + bidh * index_t(params.dk_head_stride);
+        const index_t row_offset_dv = binfo.k_offset(index_t(params.dv_batch_stride), index_t(params.dv_row_stride), bidb)
+          + n_block * kBlockN * index_t(params.dv_row_stride) + bidh * index_t(params.dv_head_stride);
         Tensor gdK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dk_ptr) + row_offset_dk),
                                  Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                                 make_stride(params.dk_row_stride, _1{}));
+                                 make_stride(index_t(params.dk_row_stride), _1{}));
         Tensor gdV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dv_ptr) + row_offset_dv),
                                  Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                                 make_stride(params.dv_row_stride, _1{}));
+                                 make_stride(index_t(params.dv_row_stride), _1{}));
         typename Kernel_traits::GmemTiledCopydKV gmem_tiled_copy_dKV;
         auto gmem_thr_copy_dKV = gmem_tiled_copy_dKV.get_thread_slice(tidx);
         Tensor tdKgdK = gmem_thr_copy_dKV.partition_D(gdK);
@@ -778,7 +797,7 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
     }
 
     auto seed = params.rng_state[0];
-    auto offset = params.rng_state[1] + (bidb * params.h + bidh) * 32 + tidx % 32;
+    auto offset = params.rng_state[1] + (index_t(bidb) * params.h + bidh) * 32 + tidx % 32;
 
     clear(acc_dv);
     clear(acc_dk);
@@ -805,6 +824,11 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
 
         // Reshape acc_s from (MMA=4, MMA_N, MMA_N) to (col=(2, MMA_N), row=(2, MMA_N))
         Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+        // The bias has no gradient w.r.t. Q and K, it only enters through P.
+        if (params.alibi_slopes_ptr != nullptr) {
+            flash::apply_alibi(scores, n_block * kBlockN + (tidx / 32 / AtomLayoutMS) * MMA_N_SdP * 16,
+                               m_block * kBlockM + get<0>(taccScS_row(0)), AtomLayoutMS * 16, alibi_slope);
+        }
         // if (cute::thread(32, 0)) { print(scores); }
         // TD [2023-07-29]: I was thinking that we don't need to mask out the elements beyond
         // actual_seqlen_k, because acc_s would be some finite value for those indices.
@@ -813,7 +837,11 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
         // However, it's possible that the values in acc_s are so large that they overflow
         // when we multiply with dP and convert to fp16, resulting in Inf in dS and NaNs in dQ.
         // So we need to mask out the elements beyond actual_seqlen_k.
-        if (!Is_causal) {
+        if (is_local) {
+            flash::apply_mask_local(scores, n_block * kBlockN + (tidx / 32 / AtomLayoutMS) * MMA_N_SdP * 16,
+                                    binfo.actual_seqlen_k, m_block * kBlockM + get<0>(taccScS_row(0)),
+                                    AtomLayoutMS * 16, params.window_size_left, params.window_size_right);
+        } else if (!Is_causal) {
             if (!Is_even_MN && (n_block + 1) * kBlockN >= binfo.actual_seqlen_k) {
                 flash::apply_mask(scores, binfo.actual_seqlen_k,
                                   n_block * kBlockN + (tidx / 32 / AtomLayoutMS) * MMA_N_SdP * 16);
@@ -914,7 +942,7 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
             tQsQ.data() = tQsQ.data() + sQ_offset;
             tSsQ.data() = tSsQ.data() + sQ_offset;
             // Advance gQ
-            tQgQ.data() = tQgQ.data() + (-int(kBlockM * params.q_row_stride));
+            tQgQ.data() = tQgQ.data() + (-int(kBlockM * index_t(params.q_row_stride)));
             flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tQgQ, tQsQ, tQcQ, tQpQ);
             flash::cp_async_fence();
         }
@@ -941,9 +969,9 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
 
         if (m_block > m_block_min) {
             // Advance gdO
-            tdOgdO.data() = tdOgdO.data() + (-int(kBlockM * params.do_row_stride));
+            tdOgdO.data() = tdOgdO.data() + (-int(kBlockM * index_t(params.do_row_stride)));
             if (Is_first) {
-                tdOgO.data() = tdOgO.data() + (-int(kBlockM * params.o_row_stride));
+                tdOgO.data() = tdOgO.data() + (-int(kBlockM * index_t(params.o_row_stride)));
                 flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_dO, tdOgdO, tdOrdO, tQcQ, tQpQ);
                 flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_dO, tdOgO, tdOrO, tQcQ, tQpQ);
             } else {
@@ -979,8 +1007,14 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
             } else {
                 // if (cute::thread0()) { print(acc_dq.layout()); printf("\n"); print(acc_dq_reshaped.layout()); printf("\n"); print(tdQgdQaccum.layout()); printf("\n"); }
                 CUTE_STATIC_ASSERT_V(size(acc_dq) == size(tdQgdQaccum));
-                #pragma unroll
-                for (int i = 0; i < size(acc_dq); ++i) { atomicAdd(&tdQgdQaccum(i), acc_dq(i)); }
+                if (params.deterministic) {
+                    // The split of dq_accum belongs to this CTA alone, and each element to one thread.
+                    #pragma unroll
+                    for (int i = 0; i < size(acc_dq); ++i) { tdQgdQaccum(i) += acc_dq(i); }
+                } else {
+                    #pragma unroll
+                    for (int i = 0; i < size(acc_dq); ++i) { atomicAdd(&tdQgdQaccum(i), acc_dq(i)); }
+                }
             }
         } else {
             #pragma unroll
@@ -1000,7 +1034,7 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
         if (!Double_buffer && m_block > m_block_min) {
             __syncthreads();
             // Advance gQ
-            tQgQ.data() = tQgQ.data() + (-int(kBlockM * params.q_row_stride));
+            tQgQ.data() = tQgQ.data() + (-int(kBlockM * index_t(params.q_row_stride)));
             flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tQgQ, tQsQ, tQcQ, tQpQ);
             flash::cp_async_fence();
         }
@@ -1015,7 +1049,7 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
             __syncthreads();
             Tensor tdQrdQ = make_tensor<Element>(shape(tdQgdQ));
             cute::copy(gmem_tiled_copy_dQ, tdQsdQ, tdQrdQ);
-            tdQgdQ.data() = tdQgdQ.data() + (-int(kBlockM * params.dq_row_stride));
+            tdQgdQ.data() = tdQgdQ.data() + (-int(kBlockM * index_t(params.dq_row_stride)));
             Tensor cdQ = make_identity_tensor(Shape<Int<kBlockM>, Int<kHeadDim>>{});    // (BLK_M,BLK_K) -> (blk_m,blk_k)
             Tensor tdQcdQ = gmem_thr_copy_dQ.partition_D(cdQ);
             #pragma unroll
@@ -1061,16 +1095,16 @@ inline __device__ void compute_dq_dk_dv_1colblock(const Params &params, const in
     cute::copy(smem_tiled_copy_dKV, taccdKrdK, taccdKsdK);
     cute::copy(smem_tiled_copy_dKV, taccdVrdV, taccdVsdV);
 
-    const index_t row_offset_dk = binfo.k_offset(params.dk_batch_stride, params.dk_row_stride, bidb)
-       + n_block * kBlockN * params.dk_row_stride + bidh * params.dk_head_stride;
-    const index_t row_offset_dv = binfo.k_offset(params.dv_batch_stride, params.dv_row_stride, bidb)
-       + n_block * kBlockN * params.dv_row_stride + bidh * params.dv_head_stride;
+    const index_t row_offset_dk = binfo.k_offset(index_t(params.dk_batch_stride), index_t(params.dk_row_stride), bidb)
+       + n_block * kBlockN * index_t(params.dk_row_stride) + bidh * index_t(params.dk_head_stride);
+    const index_t row_offset_dv = binfo.k_offset(index_t(params.dv_batch_stride), index_t(params.dv_row_stride), bidb)
+       + n_block * kBlockN * index_t(params.dv_row_stride) + bidh * index_t(params.dv_head_stride);
     Tensor gdK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dk_ptr) + row_offset_dk),
                              Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                             make_stride(params.dk_row_stride, _1{}));
+                             make_stride(index_t(params.dk_row_stride), _1{}));
     Tensor gdV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dv_ptr) + row_offset_dv),
                              Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                             make_stride(params.dv_row_stride, _1{}));
+                             make_stride(index_t(params.dv_row_stride), _1{}));
 
     typename Kernel_traits::GmemTiledCopydKV gmem_tiled_copy_dKV;
     auto gmem_thr_copy_dKV = gmem_tiled_copy_dKV.get_thread_slice(tidx);
@@ -1122,6 +1156,9 @@ inline __device__ void compute_dq_dk_dv_1rowblock(const Params &params, const in
     constexpr int AtomLayoutMS = Kernel_traits::AtomLayoutMSdP;
 
     const BlockInfo</*Varlen=*/!Is_even_N> binfo(params, bidb);
+    // ALiBi slope of this (batch, head), divided by the softmax scale like the scores it is added to.
+    const float alibi_slope = params.alibi_slopes_ptr == nullptr ? 0.0f
+        : reinterpret_cast<float *>(params.alibi_slopes_ptr)[bidb * index_t(params.alibi_slopes_batch_stride) + bidh] / params.scale_softmax;
     if (m_block * kBlockM >= binfo.actual_seqlen_q || binfo.actual_seqlen_k == 0) return;
 
     int n_block_max = cute::ceil_div(binfo.actual_seqlen_k, kBlockN);
@@ -1133,38 +1170,38 @@ inline __device__ void compute_dq_dk_dv_1rowblock(const Params &params, const in
     // that needs masking when we read K and V from global memory. Moreover, iterating in reverse
     // might save us 1 register (we just need n_block instead of both n_block and n_block_max).
 
-    const index_t row_offset_q = binfo.q_offset(params.q_batch_stride, params.q_row_stride, bidb)
-        + m_block * kBlockM * params.q_row_stride + bidh * params.q_head_stride;
+    const index_t row_offset_q = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.q_row_stride) + bidh * index_t(params.q_head_stride);
     // We move K and V to the last block.
-    const index_t row_offset_k = binfo.k_offset(params.k_batch_stride, params.k_row_stride, bidb)
-        + (n_block_max - 1) * kBlockN * params.k_row_stride + (bidh / params.h_h_k_ratio) * params.k_head_stride;
-    const index_t row_offset_v = binfo.k_offset(params.v_batch_stride, params.v_row_stride, bidb)
-        + (n_block_max - 1) * kBlockN * params.v_row_stride + (bidh / params.h_h_k_ratio) * params.v_head_stride;
-    const index_t row_offset_do = binfo.q_offset(params.do_batch_stride, params.do_row_stride, bidb)
-        + m_block * kBlockM * params.do_row_stride + bidh * params.do_head_stride;
-    const index_t row_offset_o = binfo.q_offset(params.o_batch_stride, params.o_row_stride, bidb)
-        + m_block * kBlockM * params.o_row_stride + bidh * params.o_head_stride;
+    const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb)
+        + (n_block_max - 1) * kBlockN * index_t(params.k_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.k_head_stride);
+    const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb)
+        + (n_block_max - 1) * kBlockN * index_t(params.v_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.v_head_stride);
+    const index_t row_offset_do = binfo.q_offset(index_t(params.do_batch_stride), index_t(params.do_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.do_row_stride) + bidh * index_t(params.do_head_stride);
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
     // We'll advance gdKaccum and gdVaccum before the first write.
-    const index_t row_offset_dkv_accum = ((bidb * params.h_k + (bidh / params.h_h_k_ratio)) * params.seqlen_k_rounded
+    const index_t row_offset_dkv_accum = ((index_t(bidb) * params.h_k + (bidh / params.h_h_k_ratio)) * params.seqlen_k_rounded
                                           + n_block_max * kBlockN) * params.d_rounded;
-    const index_t row_offset_lse = (bidb * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    const index_t row_offset_lse = (index_t(bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
 
     // We assume that params.d == kHeadDim for now
     Tensor gQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.q_ptr) + row_offset_q),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.q_row_stride, _1{}));
+                            make_stride(index_t(params.q_row_stride), _1{}));
     Tensor gK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.k_ptr) + row_offset_k),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.k_row_stride, _1{}));
+                            make_stride(index_t(params.k_row_stride), _1{}));
     Tensor gV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.v_ptr) + row_offset_v),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.v_row_stride, _1{}));
+                            make_stride(index_t(params.v_row_stride), _1{}));
     Tensor gdO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.do_ptr) + row_offset_do),
                              Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                             make_stride(params.do_row_stride, _1{}));
+                             make_stride(index_t(params.do_row_stride), _1{}));
     Tensor gO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.o_ptr) + row_offset_o),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.o_row_stride, _1{}));
+                            make_stride(index_t(params.o_row_stride), _1{}));
     Tensor gdKaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.dk_accum_ptr) + row_offset_dkv_accum),
                                   Shape<Int<kBlockN>, Int<kHeadDim>>{},
                                   Stride<Int<kHeadDim>, _1>{});
@@ -1357,7 +1394,7 @@ inline __device__ void compute_dq_dk_dv_1rowblock(const Params &params, const in
     for (int mi = 0; mi < size(dP_sum); ++mi) { dP_sum(mi) = sdPsum(get<0>(taccScS_row(mi))); }
 
     auto seed = params.rng_state[0];
-    auto offset = params.rng_state[1] + (bidb * params.h + bidh) * 32 + tidx % 32;
+    auto offset = params.rng_state[1] + (index_t(bidb) * params.h + bidh) * 32 + tidx % 32;
 
     clear(acc_dq);
 
@@ -1372,6 +1409,11 @@ inline __device__ void compute_dq_dk_dv_1rowblock(const Params &params, const in
 
         // Reshape acc_s from (MMA=4, MMA_N, MMA_N) to (col=(2, MMA_N), row=(2, MMA_N))
         Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+        // The bias has no gradient w.r.t. Q and K, it only enters through P.
+        if (params.alibi_slopes_ptr != nullptr) {
+            flash::apply_alibi(scores, n_block * kBlockN + (tidx / 32 / AtomLayoutMS) * MMA_N_SdP * 16,
+                               m_block * kBlockM + get<0>(taccScS_row(0)), AtomLayoutMS * 16, alibi_slope);
+        }
         // We don't need to mask out the elements beyond actual_seqlen_k, because acc_s would
         // be some finite value for those indices. In the end when we multiply with K to get dQ,
         // the corresponding values of K would be 0, so the result would still be correct.
@@ -1440,8 +1482,8 @@ inline __device__ void compute_dq_dk_dv_1rowblock(const Params &params, const in
             tKsK.data() = tKsK.data() + sK_offset;
             tSsK.data() = tSsK.data() + sK_offset;
             // Advance gK, gV
-            tKgK.data() = tKgK.data() + (-int(kBlockN * params.k_row_stride));
-            tVgV.data() = tVgV.data() + (-int(kBlockN * params.v_row_stride));
+            tKgK.data() = tKgK.data() + (-int(kBlockN * index_t(params.k_row_stride)));
+            tVgV.data() = tVgV.data() + (-int(kBlockN * index_t(params.v_row_stride)));
             flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
             flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
             // This cp_async_fence needs to be in the if block, otherwise the synchronization
@@ -1492,11 +1534,11 @@ inline __device__ void compute_dq_dk_dv_1rowblock(const Params &params, const in
     __syncthreads();
     cute::copy(smem_tiled_copy_dQ, taccdQrdQ, taccdQsdQ);
 
-    const index_t row_offset_dq = binfo.q_offset(params.dq_batch_stride, params.dq_row_stride, bidb)
-        + m_block * kBlockM * params.dq_row_stride + bidh * params.dq_head_stride;
+    const index_t row_offset_dq = binfo.q_offset(index_t(params.dq_batch_stride), index_t(params.dq_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.dq_row_stride) + bidh * index_t(params.dq_head_stride);
     Tensor gdQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.dq_ptr) + row_offset_dq),
                              Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                             make_stride(params.dq_row_stride, _1{}));
+                             make_stride(index_t(params.dq_row_stride), _1{}));
 
     typename Kernel_traits::GmemTiledCopydQ gmem_tiled_copy_dQ;
     auto gmem_thr_copy_dQ = gmem_tiled_copy_dQ.get_thread_slice(tidx);
@@ -1553,13 +1595,27 @@ inline __device__ void compute_dq_dk_dv(const Params &params) {
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_even_MN, bool Is_even_K, typename Params>
 inline __device__ void compute_dq_dk_dv_seqk_parallel(const Params &params) {
 
-    const int n_block = blockIdx.x;
     // The block index for the batch.
     const int bidb = blockIdx.y;
     // The block index for the head.
     const int bidh = blockIdx.z;
 
-    compute_dq_dk_dv_1colblock<Kernel_traits, Is_dropout, Is_causal, Is_even_MN, Is_even_K, false, false, /*Seq_parallel=*/true>(params, bidb, bidh, n_block);
+    // One CTA per column block, or when causal per pair of them (see flash::causal_bwd_num_ctas),
+    // counted on the actual seqlen_k of the sequence.
+    const BlockInfo</*Varlen=*/!Is_even_MN> binfo(params, bidb);
+    const int num_n_block = cute::ceil_div(binfo.actual_seqlen_k, Kernel_traits::kBlockN);
+    const int num_ctas = Is_causal ? flash::causal_bwd_num_ctas(num_n_block) : num_n_block;
+    // In deterministic mode the grid is narrower than that, and each CTA runs every gridDim.x-th one.
+    for (int cta = blockIdx.x; cta < num_ctas; cta += gridDim.x) {
+        for (int pair_idx = 0; pair_idx < (Is_causal ? 2 : 1); ++pair_idx) {
+            const int n_block = Is_causal ? flash::causal_bwd_n_block(cta, pair_idx, num_n_block) : cta;
+            // The middle column block of an odd count has no mirror.
+            if (pair_idx == 1 && n_block == cta) break;
+            // The previous column block may still be reading sdK / sdV.
+            if (cta != blockIdx.x || pair_idx == 1) { __syncthreads(); }
+            compute_dq_dk_dv_1colblock<Kernel_traits, Is_dropout, Is_causal, Is_even_MN, Is_even_K, false, false, /*Seq_parallel=*/true>(params, bidb, bidh, n_block);
+        }
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -7,6 +7,7 @@
 #include "static_switch.h"
 #include "flash.h"
 #include "flash_bwd_kernel.h"
+#include "flash_launch_config.h"
 
 template<bool Clear_dQaccum=true, typename Kernel_traits>
 __global__ void flash_bwd_dot_do_o_kernel(Flash_bwd_params params) {
@@ -48,7 +49,10 @@ void run_flash_bwd_seqk_parallel(Flash_bwd_params &params, cudaStream_t stream,
     const int num_m_block = (params.seqlen_q + Kernel_traits::kBlockM - 1) / Kernel_traits::kBlockM;
     dim3 grid_m(num_m_block, params.b, params.h);
     const int num_n_block = (params.seqlen_k + Kernel_traits::kBlockN - 1) / Kernel_traits::kBlockN;
-    dim3 grid_n(num_n_block, params.b, params.h);
+    // The causal backward pairs up the long and the short column blocks, two per CTA. In deterministic
+    // mode there is one CTA per dQ partial buffer instead, each taking a share of those.
+    const int num_ctas = params.is_causal ? flash::causal_bwd_num_ctas(num_n_block) : num_n_block;
+    dim3 grid_n(params.deterministic ? params.dq_accum_splits : num_ctas, params.b, params.h);
 
     flash_bwd_dot_do_o_kernel<true, Kernel_traits><<<grid_m, Kernel_traits::kNThreads, 0, stream>>>(params);
     C10_CUDA_KERNEL_LAUNCH_CHECK();
@@ -64,10 +68,9 @@ void run_flash_bwd_seqk_parallel(Flash_bwd_params &params, cudaStream_t stream,
             BOOL_SWITCH(is_even_K, IsEvenKConst, [&] {
                 auto kernel = &flash_bwd_dq_dk_dv_loop_seqk_parallel_kernel<Kernel_traits, Is_dropout, IsCausalConst, IsEvenMNConst, IsEvenKConst>;
                 // auto kernel = &flash_bwd_dq_dk_dv_loop_seqk_parallel_kernel<Kernel_traits, Is_dropout, IsCausalConst, IsEvenMNConst, true>;
-                if (smem_size_dq_dk_dv >= 48 * 1024)  {
-                    C10_CUDA_CHECK(cudaFuncSetAttribute(
-                        kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size_dq_dk_dv));
-                }
+                int device;
+                const auto config = flash::get_launch_config(kernel, Kernel_traits::kNThreads, smem_size_dq_dk_dv, device);
+                flash::report_launch<Kernel_traits>("flash_bwd_dq_dk_dv_loop_seqk_parallel_kernel", device, config, grid_n.x, grid_n.y, grid_n.z);
                 kernel<<<grid_n, Kernel_traits::kNThreads, smem_size_dq_dk_dv, stream>>>(params);
                 C10_CUDA_KERNEL_LAUNCH_CHECK();
             });
@@ -75,10 +78,9 @@ void run_flash_bwd_seqk_parallel(Flash_bwd_params &params, cudaStream_t stream,
     });
 
     auto kernel_dq = &flash_bwd_convert_dq_kernel<Kernel_traits>;
-    if (Kernel_traits::kSmemdQSize >= 48 * 1024)  {
-        C10_CUDA_CHECK(cudaFuncSetAttribute(
-            kernel_dq, cudaFuncAttributeMaxDynamicSharedMemorySize, Kernel_traits::kSmemdQSize));
-    }
+    int device;
+    const auto config = flash::get_launch_config(kernel_dq, Kernel_traits::kNThreads, Kernel_traits::kSmemdQSize, device);
+    flash::report_launch<Kernel_traits>("flash_bwd_convert_dq_kernel", device, config, grid_m.x, grid_m.y, grid_m.z);
     kernel_dq<<<grid_m, Kernel_traits::kNThreads, Kernel_traits::kSmemdQSize, stream>>>(params);
     C10_CUDA_KERNEL_LAUNCH_CHECK();
 }
@@ -103,10 +105,9 @@ void run_flash_bwd_seqq_parallel(Flash_bwd_params &params, cudaStream_t stream,
             BOOL_SWITCH(is_even_K, IsEvenKConst, [&] {
                 auto kernel = &flash_bwd_dq_dk_dv_loop_seqq_parallel_kernel<Kernel_traits, Is_dropout, IsCausalConst, IsEvenNConst, IsEvenKConst>;
                 // auto kernel = &flash_bwd_dq_dk_dv_loop_seqq_parallel_kernel<Kernel_traits, false, false, IsEvenNConst, IsEvenKConst>;
-                if (smem_size_dq_dk_dv >= 48 * 1024)  {
-                    C10_CUDA_CHECK(cudaFuncSetAttribute(
-                        kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size_dq_dk_dv));
-                }
+                int device;
+                const auto config = flash::get_launch_config(kernel, Kernel_traits::kNThreads, smem_size_dq_dk_dv, device);
+                flash::report_launch<Kernel_traits>("flash_bwd_dq_dk_dv_loop_seqq_parallel_kernel", device, config, grid_m.x, grid_m.y, grid_m.z);
                 kernel<<<grid_m, Kernel_traits::kNThreads, smem_size_dq_dk_dv, stream>>>(params);
                 C10_CUDA_KERNEL_LAUNCH_CHECK();
             });
@@ -114,10 +115,9 @@ void run_flash_bwd_seqq_parallel(Flash_bwd_params &params, cudaStream_t stream,
     });
 
     auto kernel_dkv = &flash_bwd_convert_dkv_kernel<Kernel_traits>;
-    if (Kernel_traits::kSmemKVSize >= 48 * 1024)  {
-        C10_CUDA_CHECK(cudaFuncSetAttribute(
-            kernel_dkv, cudaFuncAttributeMaxDynamicSharedMemorySize, Kernel_traits::kSmemKVSize));
-    }
+    int device;
+    const auto config = flash::get_launch_config(kernel_dkv, Kernel_traits::kNThreads, Kernel_traits::kSmemKVSize, device);
+    flash::report_launch<Kernel_traits>("flash_bwd_convert_dkv_kernel", device, config, grid_n.x, grid_n.y, grid_n.z);
     kernel_dkv<<<grid_n, Kernel_traits::kNThreads, Kernel_traits::kSmemKVSize, stream>>>(params);
     C10_CUDA_KERNEL_LAUNCH_CHECK();
 }
@@ -126,6 +126,12 @@ void run_flash_bwd_seqq_parallel(Flash_bwd_params &params, cudaStream_t stream,
 template<typename Kernel_traits, bool Is_dropout>
 void run_flash_bwd(Flash_bwd_params &params, cudaStream_t stream, const bool configure) {
     if (configure) return;
+    if constexpr (!std::is_same_v<typename Kernel_traits::index_t, int64_t>) {
+        if (params.is_index64) {
+            run_flash_bwd<typename Kernel_traits::Index64, Is_dropout>(params, stream, configure);
+            return;
+        }
+    }
     // dim3 grid(params.b, params.h);
     // const int num_m_block = (params.seqlen_q + Kernel_traits::kBlockM - 1) / Kernel_traits::kBlockM;
     // dim3 grid_m(num_m_block, params.b, params.h);
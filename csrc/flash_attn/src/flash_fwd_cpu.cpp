@@ -0,0 +1,152 @@
+// Copyright (c) 2023, Tri Dao.
+
+// CPU backend for the forward pass. Consumes the same Flash_fwd_params as the CUDA kernels and
+// uses the same tiling, so that it can serve as a reference on machines without a GPU.
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <ATen/Parallel.h>
+
+#include "flash.h"
+#include "flash_fwd_cpu_kernel.h"
+#include "flash_fwd_scheduler.h"
+#include "flash_launch_config.h"
+#include "flash_stream_pool.h"
+#include "flash_tile_trace.h"
+#include "static_switch.h"
+
+// Profiling: the CPU counterpart of %globaltimer, in ns.
+inline int64_t tile_trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<typename Kernel_traits, bool Is_causal>
+void run_flash_fwd_cpu(Flash_fwd_params &params) {
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    const int num_m_block = (params.seqlen_q + kBlockM - 1) / kBlockM;
+    // Goes through the launch config cache like the CUDA kernels, for the telemetry.
+    const auto config = flash::Launch_config_cache::get().get_or_compute(
+        reinterpret_cast<const void *>(&run_flash_fwd_cpu<Kernel_traits, Is_causal>), /*device=*/-1, [] {
+            flash::Launch_config config;
+            config.smem_size = flash::cpu::Fwd_workspace<Kernel_traits>::kSmemSize;
+            config.ctas_per_sm = 1;
+            return config;
+        });
+    if (params.knew_ptr != nullptr) {
+        at::parallel_for(0, int64_t(params.b) * params.h_k, 1, [&](int64_t begin, int64_t end) {
+            for (int64_t i = begin; i < end; ++i) {
+                flash::cpu::append_kv_cache<Kernel_traits>(params, i / params.h_k, i % params.h_k);
+            }
+        });
+    }
+    if (Is_causal) {
+        // Same dispatch as the persistent causal kernel: each lane of the CPU stream pool is a worker
+        // taking the next tile off a shared counter, in the order of flash::Causal_fwd_tile_scheduler.
+        // That order hands out producers first, so the consumers can spin on params.complete_flags.
+        std::vector<int> tile_plan;
+        if (params.cu_seqlens_q_host != nullptr) {
+            tile_plan = flash::plan_varlen_causal_fwd(params.cu_seqlens_q_host, params.cu_seqlens_k_host,
+                                                      params.b, params.h, kBlockM, Kernel_traits::kBlockN);
+        }
+        const flash::Causal_fwd_tile_scheduler scheduler(params.b, params.h, num_m_block,
+                                                         tile_plan.empty() ? nullptr : tile_plan.data(), tile_plan.size() / 3);
+        std::atomic<int> tile_count_semaphore{0};
+        auto &pool = flash::Cpu_stream_pool::get();
+        const int num_workers = std::min(at::get_num_threads(), pool.max_lanes());
+        flash::report_launch<Kernel_traits>("compute_attn_1rowblock_causal", /*device=*/-1, config, num_workers);
+        auto fork = pool.fork(/*caller=*/0, num_workers);
+        for (int worker = 0; worker < num_workers; ++worker) {
+            fork.launch(worker, [&, worker](int /*lane*/) {
+                flash::cpu::Fwd_workspace<Kernel_traits> ws;
+                for (int tile_idx = tile_count_semaphore++; tile_idx < scheduler.num_tiles(); tile_idx = tile_count_semaphore++) {
+                    const auto tile = scheduler.get_tile(tile_idx);
+                    const int64_t start = params.tile_trace == nullptr ? 0 : tile_trace_now();
+                    flash::cpu::compute_attn_1rowblock_causal(params, tile.bidb, tile.bidh, tile.m_block, ws);
+                    if (params.tile_trace != nullptr) {
+                        flash::record_tile_host(params.tile_trace, params.tile_trace_count, params.tile_trace_capacity,
+                                                tile_idx, tile.bidb, tile.bidh, tile.m_block, worker, start, tile_trace_now());
+                    }
+                }
+            });
+        }
+        fork.join();
+        return;
+    }
+    if (params.num_splits > 1) {
+        // Split-KV: one task per (batch, head, m_block, split), then one per row to combine.
+        const int64_t num_tiles = int64_t(params.b) * params.h * num_m_block * params.num_splits;
+        flash::report_launch<Kernel_traits>("compute_attn_1rowblock_splitkv", /*device=*/-1, config,
+                                            num_m_block, params.num_splits, params.b * params.h);
+        at::parallel_for(0, num_tiles, 1, [&](int64_t begin, int64_t end) {
+            flash::cpu::Fwd_workspace<Kernel_traits> ws;
+            for (int64_t tile = begin; tile < end; ++tile) {
+                const int m_block = tile % num_m_block;
+                const int n_split_idx = (tile / num_m_block) % params.num_splits;
+                const int bidh = (tile / num_m_block / params.num_splits) % params.h;
+                const int bidb = tile / num_m_block / params.num_splits / params.h;
+                flash::cpu::compute_attn_1rowblock_splitkv(params, bidb, bidh, m_block, n_split_idx, ws);
+            }
+        });
+        at::parallel_for(0, int64_t(params.b) * params.h * params.seqlen_q, 1, [&](int64_t begin, int64_t end) {
+            for (int64_t row = begin; row < end; ++row) {
+                flash::cpu::combine_attn_1row_seqk_parallel<Kernel_traits>(params, row);
+            }
+        });
+        return;
+    }
+    // One task per (batch, head, m_block), the equivalent of one CTA of the non-causal grid.
+    const int64_t num_tiles = int64_t(params.b) * params.h * num_m_block;
+    flash::report_launch<Kernel_traits>("compute_attn_1rowblock", /*device=*/-1, config, num_m_block, params.b, params.h);
+    at::parallel_for(0, num_tiles, 1, [&](int64_t begin, int64_t end) {
+        flash::cpu::Fwd_workspace<Kernel_traits> ws;
+        for (int64_t tile = begin; tile < end; ++tile) {
+            const int m_block = tile % num_m_block;
+            const int bidh = (tile / num_m_block) % params.h;
+            const int bidb = tile / num_m_block / params.h;
+            const int64_t start = params.tile_trace == nullptr ? 0 : tile_trace_now();
+            flash::cpu::compute_attn_1rowblock<Kernel_traits, Is_causal>(params, bidb, bidh, m_block, ws);
+            if (params.tile_trace != nullptr) {
+                flash::record_tile_host(params.tile_trace, params.tile_trace_count, params.tile_trace_capacity,
+                                        tile, bidb, bidh, m_block, at::get_thread_num(), start, tile_trace_now());
+            }
+        }
+    });
+}
+
+template<typename T, int Headdim>
+void run_mha_fwd_cpu_(Flash_fwd_params &params) {
+    // Same tile sizes as the sm80 configurations without dropout in flash_fwd_launch_template.h.
+    constexpr int kBlockM = 128;
+    constexpr int kBlockN = Headdim <= 64 ? 128 : (Headdim == 160 ? 32 : 64);
+    using Kernel_traits = flash::cpu::Flash_fwd_cpu_kernel_traits<Headdim, kBlockM, kBlockN, T>;
+    BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+        run_flash_fwd_cpu<Kernel_traits, Is_causal>(params);
+    });
+    if (params.o_state_ptr != nullptr) {
+        // Chunked / ring attention: merge into the incoming state, one task per row.
+        at::parallel_for(0, int64_t(params.b) * params.h * params.seqlen_q, 1, [&](int64_t begin, int64_t end) {
+            for (int64_t row = begin; row < end; ++row) {
+                flash::cpu::merge_attn_1row_state<Kernel_traits>(params, row);
+            }
+        });
+    }
+}
+
+template void run_mha_fwd_cpu_<cutlass::half_t, 32>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::half_t, 64>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::half_t, 96>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::half_t, 128>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::half_t, 160>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::half_t, 192>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::half_t, 224>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::half_t, 256>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 32>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 64>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 96>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 128>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 160>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 192>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 224>(Flash_fwd_params &params);
+template void run_mha_fwd_cpu_<cutlass::bfloat16_t, 256>(Flash_fwd_params &params);
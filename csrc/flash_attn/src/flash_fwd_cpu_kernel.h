@@ -0,0 +1,577 @@
+/******************************************************************************
+ * Copyright (c) 2023, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <cutlass/numeric_types.h>
+
+#include "flash_fwd_scheduler.h"
+
+namespace flash {
+
+namespace cpu {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host-side counterpart of Flash_fwd_kernel_traits. Only the tiling carries over to the CPU, the
+// MMA atoms, smem layouts and copy atoms have no meaning here.
+template<int kHeadDim_, int kBlockM_, int kBlockN_, typename elem_type=cutlass::half_t>
+struct Flash_fwd_cpu_kernel_traits {
+    using Element = elem_type;
+    using ElementAccum = float;
+    // The CPU has no register pressure to worry about, so we always index with 64 bits.
+    using index_t = int64_t;
+
+    static constexpr int kBlockM = kBlockM_;
+    static constexpr int kBlockN = kBlockN_;
+    static constexpr int kHeadDim = kHeadDim_;
+    // A task runs on one thread.
+    static constexpr int kNThreads = 1;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host-side counterpart of flash::BlockInfo (block_info.h), which is __device__ only.
+template<bool Varlen=true>
+struct BlockInfo {
+
+    template<typename Params>
+    BlockInfo(const Params &params, const int bidb)
+        : sum_s_q(!Varlen || params.cu_seqlens_q == nullptr ? -1 : params.cu_seqlens_q[bidb])
+        , sum_s_k(!Varlen || params.cu_seqlens_k == nullptr ? -1 : params.cu_seqlens_k[bidb])
+        , actual_seqlen_q(!Varlen || params.cu_seqlens_q == nullptr ? params.seqlen_q : params.cu_seqlens_q[bidb + 1] - sum_s_q)
+        , seqlen_k_cache(!Varlen || (params.cu_seqlens_k == nullptr && params.cache_seqlens == nullptr) ? params.seqlen_k
+                         : (params.cache_seqlens != nullptr ? params.cache_seqlens[bidb] : params.cu_seqlens_k[bidb + 1] - sum_s_k))
+        , actual_seqlen_k(seqlen_k_cache + (!Varlen || params.knew_ptr == nullptr ? 0 : params.seqlen_knew))
+        , block_table(params.block_table == nullptr ? nullptr : params.block_table + bidb * params.block_table_batch_stride)
+        , page_block_size(params.page_block_size)
+        {
+        }
+
+    template <typename index_t>
+    inline index_t q_offset(const index_t batch_stride, const index_t row_stride, const int bidb) const {
+        return sum_s_q == -1 ? bidb * batch_stride : index_t(sum_s_q) * row_stride;
+    }
+
+    template <typename index_t>
+    inline index_t k_offset(const index_t batch_stride, const index_t row_stride, const int bidb) const {
+        return sum_s_k == -1 ? bidb * batch_stride : index_t(sum_s_k) * row_stride;
+    }
+
+    // Offset of the key / value row `row` of the sequence, head excluded. With a paged KV cache the
+    // row is looked up in the block table; the rows of a kBlockN tile never cross a page.
+    template <typename index_t>
+    inline index_t k_offset(const index_t batch_stride, const index_t row_stride, const int bidb, const int row) const {
+        if (block_table == nullptr) { return k_offset(batch_stride, row_stride, bidb) + index_t(row) * row_stride; }
+        const int page_idx = row / page_block_size;
+        return index_t(block_table[page_idx]) * batch_stride + index_t(row - page_idx * page_block_size) * row_stride;
+    }
+
+    const int sum_s_q;
+    const int sum_s_k;
+    const int actual_seqlen_q;
+    // Keys / values in the cache before the append, if any.
+    const int seqlen_k_cache;
+    const int actual_seqlen_k;
+    const int *block_table;
+    const int page_block_size;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Per-thread scratch space. This plays the role of the smem tiles (sQ, sK, sV) and of the register
+// fragments (acc_s, acc_o, scores_max, scores_sum) of compute_attn_1rowblock. sO holds the O of the
+// producer when a consumer merges it in.
+template<typename Kernel_traits>
+struct Fwd_workspace {
+    static constexpr int kBlockM = Kernel_traits::kBlockM;
+    static constexpr int kBlockN = Kernel_traits::kBlockN;
+    static constexpr int kHeadDim = Kernel_traits::kHeadDim;
+    // Bytes of the tiles, the counterpart of the kSmemSize of the CUDA kernel traits.
+    static constexpr int kSmemSize = int(sizeof(float)) * (3 * kBlockM * kHeadDim + 2 * kBlockN * kHeadDim
+                                                           + kBlockM * kBlockN + 2 * kBlockM);
+
+    Fwd_workspace()
+        : sQ(kBlockM * kHeadDim), sK(kBlockN * kHeadDim), sV(kBlockN * kHeadDim)
+        , sO(kBlockM * kHeadDim), acc_s(kBlockM * kBlockN), acc_o(kBlockM * kHeadDim)
+        , scores_max(kBlockM), scores_sum(kBlockM) {}
+
+    std::vector<float> sQ, sK, sV, sO;
+    std::vector<float> acc_s, acc_o;
+    std::vector<float> scores_max, scores_sum;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Copy a (rows x d) tile from gmem into a dense float tile with row stride kHeadDim.
+template<int kHeadDim, typename Element, typename index_t>
+inline void copy_tile(const Element *gmem, const index_t row_stride, float *tile, const int rows, const int d) {
+    for (int r = 0; r < rows; ++r) {
+        const Element *src = gmem + r * row_stride;
+        float *dst = tile + r * kHeadDim;
+        for (int c = 0; c < d; ++c) { dst[c] = float(src[c]); }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as flash::apply_rotary on a dense float tile: rotates the first rotary_dim columns of the
+// rows [0, rows), the first row being at position row_start, and rounds them to Element like the
+// GPU kernels do in smem.
+template<int kHeadDim, typename Element, typename Params>
+inline void apply_rotary(const Params &params, float *tile, const int row_start, const int rows) {
+    const int rotary_dim_half = params.rotary_dim / 2;
+    const Element *rotary_cos = reinterpret_cast<const Element *>(params.rotary_cos_ptr);
+    const Element *rotary_sin = reinterpret_cast<const Element *>(params.rotary_sin_ptr);
+    for (int r = 0; r < rows; ++r) {
+        float *x = tile + r * kHeadDim;
+        for (int j = 0; j < rotary_dim_half; ++j) {
+            const int col0 = params.is_rotary_interleaved ? 2 * j : j;
+            const int col1 = params.is_rotary_interleaved ? 2 * j + 1 : j + rotary_dim_half;
+            const float cos = float(rotary_cos[(row_start + r) * rotary_dim_half + j]);
+            const float sin = float(rotary_sin[(row_start + r) * rotary_dim_half + j]);
+            const float x0 = x[col0], x1 = x[col1];
+            x[col0] = float(Element(x0 * cos - x1 * sin));
+            x[col1] = float(Element(x0 * sin + x1 * cos));
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same math as flash::softmax_rescale_o with Check_inf=true. Scores are stored row-major with
+// row stride kBlockN; masked entries are -INFINITY.
+template<int kBlockN, int kHeadDim>
+inline void softmax_rescale_o(float *scores, float *scores_max, float *scores_sum, float *acc_o,
+                              const int rows, const int cols, const int d, const float softmax_scale_log2) {
+    for (int mi = 0; mi < rows; ++mi) {
+        float *s = scores + mi * kBlockN;
+        const float scores_max_prev = scores_max[mi];
+        float row_max = scores_max_prev;
+        for (int ni = 0; ni < cols; ++ni) { row_max = std::max(row_max, s[ni]); }
+        scores_max[mi] = row_max;
+        // If max is -inf, then all elements must have been -inf (possibly due to masking).
+        // We don't want (-inf - (-inf)) since that would give NaN.
+        const float scores_max_cur = row_max == -INFINITY ? 0.0f : row_max;
+        const float scores_scale = std::exp2((scores_max_prev - scores_max_cur) * softmax_scale_log2);
+        scores_sum[mi] *= scores_scale;
+        float *o = acc_o + mi * kHeadDim;
+        for (int k = 0; k < d; ++k) { o[k] *= scores_scale; }
+        const float max_scaled = scores_max_cur * softmax_scale_log2;
+        float sum = 0.f;
+        for (int ni = 0; ni < cols; ++ni) {
+            s[ni] = std::exp2(s[ni] * softmax_scale_log2 - max_scaled);
+            sum += s[ni];
+        }
+        scores_sum[mi] += sum;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes the new keys / values of (bidb, bidh_k) to the cache rows [seqlen_k_cache, actual_seqlen_k).
+// The GPU kernels do this in the tiles that read these rows; here it is a pass of its own before the
+// tiles, so that no two tasks write the same row.
+template<typename Kernel_traits, typename Params>
+inline void append_kv_cache(const Params &params, const int bidb, const int bidh_k) {
+    using Element = typename Kernel_traits::Element;
+    using index_t = typename Kernel_traits::index_t;
+
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    for (int row = binfo.seqlen_k_cache; row < binfo.actual_seqlen_k; ++row) {
+        const int row_new = row - binfo.seqlen_k_cache;
+        const Element *knew = reinterpret_cast<const Element *>(params.knew_ptr) + index_t(bidb) * params.knew_batch_stride
+            + index_t(row_new) * params.knew_row_stride + index_t(bidh_k) * params.knew_head_stride;
+        const Element *vnew = reinterpret_cast<const Element *>(params.vnew_ptr) + index_t(bidb) * params.vnew_batch_stride
+            + index_t(row_new) * params.vnew_row_stride + index_t(bidh_k) * params.vnew_head_stride;
+        Element *k = reinterpret_cast<Element *>(params.k_ptr)
+            + binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, row) + index_t(bidh_k) * params.k_head_stride;
+        Element *v = reinterpret_cast<Element *>(params.v_ptr)
+            + binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, row) + index_t(bidh_k) * params.v_head_stride;
+        std::copy(knew, knew + params.d, k);
+        std::copy(vnew, vnew + params.d, v);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Computes the row block m_block of (bidb, bidh) over the key blocks [n_block_min, n_block_max),
+// leaving the unnormalized acc_o together with scores_max / scores_sum in the workspace. Key blocks
+// are visited in reverse order, like the GPU kernel. The keys outside the sliding window of a row,
+// if any, are masked like the keys past the causal diagonal, and the ALiBi bias, if any, is added to
+// the unscaled scores like flash::apply_alibi does. Q and K are rotated on load if params has rotary
+// tables.
+template<typename Kernel_traits, bool Is_causal, typename Params>
+inline void compute_attn_1rowblock_partial(const Params &params, const BlockInfo</*Varlen=*/true> &binfo,
+                                           const int bidb, const int bidh, const int m_block,
+                                           const int n_block_min, const int n_block_max,
+                                           Fwd_workspace<Kernel_traits> &ws) {
+
+    using Element = typename Kernel_traits::Element;
+    using index_t = typename Kernel_traits::index_t;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kBlockN = Kernel_traits::kBlockN;
+    constexpr int kHeadDim = Kernel_traits::kHeadDim;
+
+    const int d = params.d;
+    const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM);
+    const float alibi_slope = params.alibi_slopes_ptr == nullptr ? 0.f
+        : reinterpret_cast<const float *>(params.alibi_slopes_ptr)[index_t(bidb) * params.alibi_slopes_batch_stride + bidh] / params.scale_softmax;
+
+    const index_t row_offset_q = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+        + index_t(m_block) * kBlockM * params.q_row_stride + index_t(bidh) * params.q_head_stride;
+    copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.q_ptr) + row_offset_q,
+                        index_t(params.q_row_stride), ws.sQ.data(), m_rows, d);
+    if (params.rotary_cos_ptr != nullptr) {
+        apply_rotary<kHeadDim, Element>(params, ws.sQ.data(), m_block * kBlockM, m_rows);
+    }
+
+    std::fill(ws.acc_o.begin(), ws.acc_o.end(), 0.f);
+    std::fill(ws.scores_max.begin(), ws.scores_max.end(), -INFINITY);
+    std::fill(ws.scores_sum.begin(), ws.scores_sum.end(), 0.f);
+
+    for (int n_block = n_block_max - 1; n_block >= n_block_min; --n_block) {
+        const int n_cols = std::min(kBlockN, binfo.actual_seqlen_k - n_block * kBlockN);
+        const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, n_block * kBlockN)
+            + index_t(bidh / params.h_h_k_ratio) * params.k_head_stride;
+        const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, n_block * kBlockN)
+            + index_t(bidh / params.h_h_k_ratio) * params.v_head_stride;
+        copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.k_ptr) + row_offset_k,
+                            index_t(params.k_row_stride), ws.sK.data(), n_cols, d);
+        if (params.rotary_cos_ptr != nullptr) {
+            apply_rotary<kHeadDim, Element>(params, ws.sK.data(), n_block * kBlockN, n_cols);
+        }
+        copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.v_ptr) + row_offset_v,
+                            index_t(params.v_row_stride), ws.sV.data(), n_cols, d);
+
+        // S = Q K^T, with the masking folded in: we simply never compute the masked entries.
+        for (int mi = 0; mi < m_rows; ++mi) {
+            const int row_idx = m_block * kBlockM + mi;
+            int col_idx_limit = Is_causal ? std::min(binfo.actual_seqlen_k, row_idx + 1) : binfo.actual_seqlen_k;
+            if (params.window_size_right >= 0) { col_idx_limit = std::min(col_idx_limit, row_idx + 1 + params.window_size_right); }
+            const int col_idx_min = params.window_size_left < 0 ? 0 : row_idx - params.window_size_left;
+            const float *q = ws.sQ.data() + mi * kHeadDim;
+            float *s = ws.acc_s.data() + mi * kBlockN;
+            for (int ni = 0; ni < n_cols; ++ni) {
+                const int col_idx = n_block * kBlockN + ni;
+                if (col_idx >= col_idx_limit || col_idx < col_idx_min) { s[ni] = -INFINITY; continue; }
+                const float *k = ws.sK.data() + ni * kHeadDim;
+                float acc = 0.f;
+                for (int c = 0; c < d; ++c) { acc += q[c] * k[c]; }
+                s[ni] = acc - alibi_slope * std::abs(row_idx - col_idx);
+            }
+        }
+
+        softmax_rescale_o<kBlockN, kHeadDim>(ws.acc_s.data(), ws.scores_max.data(), ws.scores_sum.data(),
+                                             ws.acc_o.data(), m_rows, n_cols, d, params.scale_softmax_log2);
+
+        // O += P V. P goes through Element first, like the fp16 / bf16 operand of the second GEMM.
+        for (int mi = 0; mi < m_rows; ++mi) {
+            const float *p = ws.acc_s.data() + mi * kBlockN;
+            float *o = ws.acc_o.data() + mi * kHeadDim;
+            for (int ni = 0; ni < n_cols; ++ni) {
+                const float p_rounded = float(Element(p[ni]));
+                if (p_rounded == 0.f) { continue; }
+                const float *v = ws.sV.data() + ni * kHeadDim;
+                for (int c = 0; c < d; ++c) { o[c] += p_rounded * v[c]; }
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Normalize acc_o (unless Is_normalized), then write O and the LSE of the row block (bidb, bidh, m_block).
+template<bool Is_normalized=false, typename Kernel_traits, typename Params>
+inline void write_o_lse(const Params &params, const BlockInfo</*Varlen=*/true> &binfo,
+                        const int bidb, const int bidh, const int m_block, Fwd_workspace<Kernel_traits> &ws) {
+
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kHeadDim = Kernel_traits::kHeadDim;
+
+    const int d = params.d;
+    const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM);
+
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + index_t(m_block) * kBlockM * params.o_row_stride + index_t(bidh) * params.o_head_stride;
+    const index_t row_offset_lse = (index_t(bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    Element *gO = reinterpret_cast<Element *>(params.o_ptr) + row_offset_o;
+    ElementAccum *gLSE = reinterpret_cast<ElementAccum *>(params.softmax_lse_ptr) + row_offset_lse;
+
+    for (int mi = 0; mi < m_rows; ++mi) {
+        const float sum = ws.scores_sum[mi];
+        const float inv_sum = (Is_normalized || sum == 0.f || sum != sum) ? 1.f : 1.f / sum;
+        gLSE[mi] = (sum == 0.f || sum != sum) ? INFINITY : ws.scores_max[mi] * params.scale_softmax + std::log(sum);
+        const float *o = ws.acc_o.data() + mi * kHeadDim;
+        Element *out = gO + mi * index_t(params.o_row_stride);
+        for (int c = 0; c < d; ++c) { out[c] = Element(o[c] * inv_sum); }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename Kernel_traits, bool Is_causal, typename Params>
+inline void compute_attn_1rowblock(const Params &params, const int bidb, const int bidh, const int m_block,
+                                   Fwd_workspace<Kernel_traits> &ws) {
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kBlockN = Kernel_traits::kBlockN;
+
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    if (m_block * kBlockM >= binfo.actual_seqlen_q || binfo.actual_seqlen_k == 0) return;
+
+    int n_block_max = (binfo.actual_seqlen_k + kBlockN - 1) / kBlockN;
+    if (Is_causal) {
+        n_block_max = std::min(n_block_max, ((m_block + 1) * kBlockM + kBlockN - 1) / kBlockN);
+    }
+    int n_block_min = 0;
+    if (params.window_size_left >= 0 || params.window_size_right >= 0) {
+        local_n_block_range(m_block, binfo.actual_seqlen_q, binfo.actual_seqlen_k, kBlockM, kBlockN,
+                            params.window_size_left, params.window_size_right, n_block_min, n_block_max);
+    }
+
+    compute_attn_1rowblock_partial<Kernel_traits, Is_causal>(params, binfo, bidb, bidh, m_block, n_block_min, n_block_max, ws);
+    write_o_lse(params, binfo, bidb, bidh, m_block, ws);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as flash::compute_attn_1rowblock_splitkv: computes the split n_split_idx of the key blocks of
+// the row block and writes its normalized O in fp32 to params.oaccum_ptr and its LSE to
+// params.softmax_lseaccum_ptr (-INFINITY for an empty split).
+template<typename Kernel_traits, typename Params>
+inline void compute_attn_1rowblock_splitkv(const Params &params, const int bidb, const int bidh, const int m_block,
+                                           const int n_split_idx, Fwd_workspace<Kernel_traits> &ws) {
+    using index_t = typename Kernel_traits::index_t;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kBlockN = Kernel_traits::kBlockN;
+    constexpr int kHeadDim = Kernel_traits::kHeadDim;
+
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    if (m_block * kBlockM >= binfo.actual_seqlen_q || binfo.actual_seqlen_k == 0) return;
+
+    const int n_blocks_per_split = ((params.seqlen_k + kBlockN - 1) / kBlockN + params.num_splits - 1) / params.num_splits;
+    int n_block_min = n_split_idx * n_blocks_per_split;
+    int n_block_max = std::min((binfo.actual_seqlen_k + kBlockN - 1) / kBlockN, (n_split_idx + 1) * n_blocks_per_split);
+    if (params.window_size_left >= 0 || params.window_size_right >= 0) {
+        int n_block_min_local, n_block_max_local;
+        local_n_block_range(m_block, binfo.actual_seqlen_q, binfo.actual_seqlen_k, kBlockM, kBlockN,
+                            params.window_size_left, params.window_size_right, n_block_min_local, n_block_max_local);
+        n_block_min = std::max(n_block_min, n_block_min_local);
+        n_block_max = std::min(n_block_max, n_block_max_local);
+    }
+
+    const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM);
+    const index_t row_offset_lseaccum = ((index_t(n_split_idx) * params.b + bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    float *gLSEaccum = reinterpret_cast<float *>(params.softmax_lseaccum_ptr) + row_offset_lseaccum;
+    float *gOaccum = reinterpret_cast<float *>(params.oaccum_ptr) + row_offset_lseaccum * params.d_rounded;
+    if (n_block_min >= n_block_max) {
+        std::fill(gLSEaccum, gLSEaccum + m_rows, -INFINITY);
+        return;
+    }
+
+    compute_attn_1rowblock_partial<Kernel_traits, /*Is_causal=*/false>(params, binfo, bidb, bidh, m_block,
+                                                                       n_block_min, n_block_max, ws);
+    for (int mi = 0; mi < m_rows; ++mi) {
+        const float sum = ws.scores_sum[mi];
+        const float inv_sum = (sum == 0.f || sum != sum) ? 1.f : 1.f / sum;
+        gLSEaccum[mi] = (sum == 0.f || sum != sum) ? -INFINITY : ws.scores_max[mi] * params.scale_softmax + std::log(sum);
+        const float *o = ws.acc_o.data() + mi * kHeadDim;
+        float *out = gOaccum + mi * index_t(params.d_rounded);
+        for (int k = 0; k < params.d; ++k) { out[k] = o[k] * inv_sum; }
+    }
+}
+
+// Same as flash::combine_attn_1row_seqk_parallel: merges the num_splits partials of one row of
+// (b, h, seqlen_q) into O and the LSE, partial s with the weight exp(lse_s - lse).
+template<typename Kernel_traits, typename Params>
+inline void combine_attn_1row_seqk_parallel(const Params &params, const int64_t row) {
+    using Element = typename Kernel_traits::Element;
+    using index_t = typename Kernel_traits::index_t;
+
+    const int m = row % params.seqlen_q;
+    const int bidh = (row / params.seqlen_q) % params.h;
+    const int bidb = row / params.seqlen_q / params.h;
+    const index_t split_stride = index_t(params.b) * params.h * params.seqlen_q;
+    const float *gLSEaccum = reinterpret_cast<const float *>(params.softmax_lseaccum_ptr) + row;
+    const float *gOaccum = reinterpret_cast<const float *>(params.oaccum_ptr) + row * params.d_rounded;
+
+    float lse_max = -INFINITY;
+    for (int s = 0; s < params.num_splits; ++s) { lse_max = std::max(lse_max, gLSEaccum[s * split_stride]); }
+    float sum = 0.f;
+    if (lse_max != -INFINITY) {
+        for (int s = 0; s < params.num_splits; ++s) { sum += std::exp(gLSEaccum[s * split_stride] - lse_max); }
+    }
+    const float lse = (sum == 0.f || sum != sum) ? INFINITY : lse_max + std::log(sum);
+    reinterpret_cast<float *>(params.softmax_lse_ptr)[row] = lse;
+
+    Element *gO = reinterpret_cast<Element *>(params.o_ptr) + bidb * index_t(params.o_batch_stride)
+        + m * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    for (int k = 0; k < params.d; ++k) {
+        float acc = 0.f;
+        for (int s = 0; s < params.num_splits; ++s) {
+            const float scale = std::exp(gLSEaccum[s * split_stride] - lse);
+            // The O of an empty split was never written.
+            if (scale > 0.f) { acc += scale * gOaccum[s * split_stride * params.d_rounded + k]; }
+        }
+        gO[k] = Element(acc);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same math as flash::softmax_merge_o: merges the normalized partial O of the producer (acc_o_2,
+// read back from gmem) into the normalized partial O of the consumer (acc_o_1), and the statistics
+// of both into scores_max_1 / scores_sum_1.
+template<int kHeadDim>
+inline void softmax_merge_o(float *scores_max_1, float *scores_sum_1,
+                            const float *scores_max_2, const float *scores_sum_2,
+                            float *acc_o_1, const float *acc_o_2,
+                            const int rows, const int d, const float softmax_scale_log2) {
+    for (int mi = 0; mi < rows; ++mi) {
+        const float scores_max = std::max(scores_max_1[mi], scores_max_2[mi]);
+        float scores_scale = (scores_sum_2[mi] / scores_sum_1[mi])
+                             * std::exp2((scores_max_2[mi] - scores_max_1[mi]) * softmax_scale_log2);
+        scores_scale = 1.f / (1.f + scores_scale);
+        float *o_1 = acc_o_1 + mi * kHeadDim;
+        const float *o_2 = acc_o_2 + mi * kHeadDim;
+        for (int k = 0; k < d; ++k) { o_1[k] = o_1[k] * scores_scale + o_2[k] * (1.f - scores_scale); }
+        scores_sum_1[mi] = scores_sum_1[mi] * std::exp2((scores_max_1[mi] - scores_max) * softmax_scale_log2)
+                           + scores_sum_2[mi] * std::exp2((scores_max_2[mi] - scores_max) * softmax_scale_log2);
+        scores_max_1[mi] = scores_max;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as flash::merge_attn_1row_state: merges the O and the LSE of one row of (b, h, seqlen_q) into
+// the incoming state in place, the state with the weight 1 / (1 + exp(lse_2 - lse_1)) and a side
+// with an infinite LSE with none.
+template<typename Kernel_traits, typename Params>
+inline void merge_attn_1row_state(const Params &params, const int64_t row) {
+    using Element = typename Kernel_traits::Element;
+    using index_t = typename Kernel_traits::index_t;
+
+    const int m = row % params.seqlen_q;
+    const int bidh = (row / params.seqlen_q) % params.h;
+    const int bidb = row / params.seqlen_q / params.h;
+    float *gLSE_state = reinterpret_cast<float *>(params.softmax_lse_state_ptr) + row;
+    const float lse_1 = *gLSE_state;
+    const float lse_2 = reinterpret_cast<const float *>(params.softmax_lse_ptr)[row];
+    const bool empty_1 = std::isinf(lse_1), empty_2 = std::isinf(lse_2);
+    const float scores_scale = empty_1 ? 0.f : (empty_2 ? 1.f : 1.f / (1.f + std::exp(lse_2 - lse_1)));
+    const float lse = empty_1 ? lse_2
+        : (empty_2 ? lse_1 : std::max(lse_1, lse_2) + std::log1p(std::exp(-std::abs(lse_1 - lse_2))));
+
+    Element *gO_state = reinterpret_cast<Element *>(params.o_state_ptr) + bidb * index_t(params.o_state_batch_stride)
+        + m * index_t(params.o_state_row_stride) + bidh * index_t(params.o_state_head_stride);
+    const Element *gO = reinterpret_cast<const Element *>(params.o_ptr) + bidb * index_t(params.o_batch_stride)
+        + m * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    for (int k = 0; k < params.d; ++k) {
+        // The O of an empty side may never have been written.
+        const float o_1 = empty_1 ? 0.f : float(gO_state[k]);
+        const float o_2 = empty_2 ? 0.f : float(gO[k]);
+        gO_state[k] = Element(o_1 * scores_scale + o_2 * (1.f - scores_scale));
+    }
+    *gLSE_state = empty_1 && empty_2 ? INFINITY : lse;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same producer / consumer pairing as flash::compute_attn_1rowblock_causal, including the flag
+// handshake through params.complete_flags:
+// - a producer computes the key blocks [0, dst) of its row block, writes the normalized O, the LSE
+//   and scores_max / scores_sum to gmem, then raises the flag of its consumer;
+// - a consumer computes its own row block, then the key blocks [dst, n_block_max) of the mirrored
+//   row block, waits for the flag (taking it back to 0) and merges in what the producer wrote.
+// The caller must hand out every producer before its consumer, e.g. in the order of
+// flash::Causal_fwd_tile_scheduler, or the consumer spins forever.
+template<typename Kernel_traits, typename Params>
+inline void compute_attn_1rowblock_causal(const Params &params, const int bidb, const int bidh, const int m_block,
+                                          Fwd_workspace<Kernel_traits> &ws) {
+
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kBlockN = Kernel_traits::kBlockN;
+    constexpr int kHeadDim = Kernel_traits::kHeadDim;
+
+    const BlockInfo</*Varlen=*/true> binfo(params, bidb);
+    if (m_block * kBlockM >= binfo.actual_seqlen_q || binfo.actual_seqlen_k == 0) return;
+
+    int *complete_flags = params.complete_flags + (index_t(bidb) * params.h + bidh) * ((params.seqlen_q + kBlockM - 1) / kBlockM);
+    const int num_m_block = (binfo.actual_seqlen_q + kBlockM - 1) / kBlockM;
+    const int dst = (kBlockM + kBlockN - 1) / kBlockN * (num_m_block / 2 + 1);
+    auto n_block_max = [&](const int m) {
+        return std::min((binfo.actual_seqlen_k + kBlockN - 1) / kBlockN, ((m + 1) * kBlockM + kBlockN - 1) / kBlockN);
+    };
+    auto row_offset_stats = [&](const int m) { return (index_t(bidb) * params.h + bidh) * params.seqlen_q + m * kBlockM; };
+
+    if (is_causal_producer(m_block, num_m_block)) {
+        compute_attn_1rowblock_partial<Kernel_traits, /*Is_causal=*/true>(params, binfo, bidb, bidh, m_block, 0,
+                                                                          std::min(dst, n_block_max(m_block)), ws);
+        write_o_lse(params, binfo, bidb, bidh, m_block, ws);
+        const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM);
+        std::copy(ws.scores_max.begin(), ws.scores_max.begin() + m_rows,
+                  reinterpret_cast<ElementAccum *>(params.scores_max_ptr) + row_offset_stats(m_block));
+        std::copy(ws.scores_sum.begin(), ws.scores_sum.begin() + m_rows,
+                  reinterpret_cast<ElementAccum *>(params.scores_sum_ptr) + row_offset_stats(m_block));
+        __atomic_fetch_or(&complete_flags[num_m_block - m_block - 1], 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    compute_attn_1rowblock_partial<Kernel_traits, /*Is_causal=*/true>(params, binfo, bidb, bidh, m_block, 0,
+                                                                      n_block_max(m_block), ws);
+    write_o_lse(params, binfo, bidb, bidh, m_block, ws);
+    if (!is_causal_consumer(m_block, num_m_block)) return;
+
+    const int reverse_m_block = num_m_block - 1 - m_block;
+    const int m_rows = std::min(kBlockM, binfo.actual_seqlen_q - reverse_m_block * kBlockM);
+    compute_attn_1rowblock_partial<Kernel_traits, /*Is_causal=*/true>(params, binfo, bidb, bidh, reverse_m_block,
+                                                                      dst, n_block_max(reverse_m_block), ws);
+    for (int mi = 0; mi < m_rows; ++mi) {
+        const float sum = ws.scores_sum[mi];
+        const float inv_sum = (sum == 0.f || sum != sum) ? 1.f : 1.f / sum;
+        float *o = ws.acc_o.data() + mi * kHeadDim;
+        for (int k = 0; k < params.d; ++k) { o[k] *= inv_sum; }
+    }
+
+    // Take the flag back to 0 so that the next call can't mistake it for its own producer.
+    int expected = 1;
+    while (!__atomic_compare_exchange_n(&complete_flags[m_block], &expected, 0, /*weak=*/false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        expected = 1;
+        std::this_thread::yield();
+    }
+
+    // The producer's O went through Element on its way to gmem.
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + index_t(reverse_m_block) * kBlockM * params.o_row_stride + index_t(bidh) * params.o_head_stride;
+    copy_tile<kHeadDim>(reinterpret_cast<const Element *>(params.o_ptr) + row_offset_o,
+                        index_t(params.o_row_stride), ws.sO.data(), m_rows, params.d);
+    softmax_merge_o<kHeadDim>(ws.scores_max.data(), ws.scores_sum.data(),
+                              reinterpret_cast<const ElementAccum *>(params.scores_max_ptr) + row_offset_stats(reverse_m_block),
+                              reinterpret_cast<const ElementAccum *>(params.scores_sum_ptr) + row_offset_stats(reverse_m_block),
+                              ws.acc_o.data(), ws.sO.data(), m_rows, params.d, params.scale_softmax_log2);
+    write_o_lse</*Is_normalized=*/true>(params, binfo, bidb, bidh, reverse_m_block, ws);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace cpu
+
+}  // namespace flash
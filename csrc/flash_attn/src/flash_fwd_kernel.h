@@ -14,6 +14,8 @@
 #include <cutlass/numeric_conversion.h>
 #include <chrono>
 #include "block_info.h"
+#include "flash_fwd_scheduler.h"
+#include "flash_tile_trace.h"
 #include "kernel_traits.h"
 #include "utils.h"
 #include "softmax.h"
@@ -166,6 +168,42 @@ inline __device__ void write_softmax_to_gmem(
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Writes the new keys / values of (bidb, bidh / h_h_k_ratio) to the cache rows [row_min, row_max),
+// which hold the rows [row_min - seqlen_k_cache, row_max - seqlen_k_cache) of Knew / Vnew. Each CTA
+// writes the rows it is about to read, and CTAs sharing a KV head write the same values, so the
+// __syncthreads at the end is the only synchronization needed.
+template<typename Kernel_traits, typename Params, typename BlockInfo_t>
+inline __device__ void append_kv_cache(const Params &params, const BlockInfo_t &binfo, const int bidb, const int bidh,
+                                       const int row_min, const int row_max) {
+    using Element = typename Kernel_traits::Element;
+    using index_t = typename Kernel_traits::index_t;
+
+    // 128-bit accesses, like the gmem copies of Q, K and V. d is a multiple of 8.
+    constexpr int kNElts = sizeof(uint4) / sizeof(Element);
+    const int num_chunks = params.d / kNElts;
+    const int bidh_k = bidh / params.h_h_k_ratio;
+    for (int idx = threadIdx.x; idx < (row_max - row_min) * num_chunks; idx += blockDim.x) {
+        const int row = row_min + idx / num_chunks;
+        const int col = (idx % num_chunks) * kNElts;
+        const int row_new = row - binfo.seqlen_k_cache;
+        const index_t row_offset_knew = bidb * index_t(params.knew_batch_stride) + row_new * index_t(params.knew_row_stride)
+            + bidh_k * index_t(params.knew_head_stride) + col;
+        const index_t row_offset_vnew = bidb * index_t(params.vnew_batch_stride) + row_new * index_t(params.vnew_row_stride)
+            + bidh_k * index_t(params.vnew_head_stride) + col;
+        const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, row)
+            + bidh_k * index_t(params.k_head_stride) + col;
+        const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, row)
+            + bidh_k * index_t(params.v_head_stride) + col;
+        *reinterpret_cast<uint4 *>(reinterpret_cast<Element *>(params.k_ptr) + row_offset_k)
+            = *reinterpret_cast<const uint4 *>(reinterpret_cast<const Element *>(params.knew_ptr) + row_offset_knew);
+        *reinterpret_cast<uint4 *>(reinterpret_cast<Element *>(params.v_ptr) + row_offset_v)
+            = *reinterpret_cast<const uint4 *>(reinterpret_cast<const Element *>(params.vnew_ptr) + row_offset_vnew);
+    }
+    __syncthreads();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_even_N, bool Is_even_K, bool Return_softmax, typename Params>
 inline __device__ void compute_attn_1rowblock(const Params &params, const int bidb, const int bidh, const int m_block) {
 
@@ -188,6 +226,9 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
     constexpr int MMA_M = kBlockM / decltype(size<0>(typename Kernel_traits::TiledMma::TiledShape_MNK{}))::value;
 
     const BlockInfo</*Varlen=*/!Is_even_N> binfo(params, bidb);
+    // ALiBi slope of this (batch, head), divided by the softmax scale like the scores it is added to.
+    const float alibi_slope = params.alibi_slopes_ptr == nullptr ? 0.0f
+        : reinterpret_cast<float *>(params.alibi_slopes_ptr)[bidb * index_t(params.alibi_slopes_batch_stride) + bidh] / params.scale_softmax;
     if (m_block * kBlockM >= binfo.actual_seqlen_q || binfo.actual_seqlen_k == 0) return;
 
     int n_block_max = cute::ceil_div(binfo.actual_seqlen_k, kBlockN);
@@ -197,30 +238,37 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
         //     printf("m_block = %d, n_block_max = %d\n", m_block, n_block_max);
         // }
     }
+    // Sliding window: only the key blocks [n_block_min, n_block_max) are loaded.
+    const bool is_local = params.window_size_left >= 0 || params.window_size_right >= 0;
+    int n_block_min = 0;
+    if (is_local) {
+        flash::local_n_block_range(m_block, binfo.actual_seqlen_q, binfo.actual_seqlen_k, kBlockM, kBlockN,
+                                   params.window_size_left, params.window_size_right, n_block_min, n_block_max);
+    }
 
     // We iterate over the blocks in reverse order. This is because the last block is the only one
     // that needs masking when we read K and V from global memory. Moreover, iterating in reverse
     // might save us 1 register (we just need n_block instead of both n_block and n_block_max).
 
-    const index_t row_offset_q = binfo.q_offset(params.q_batch_stride, params.q_row_stride, bidb)
-        + m_block * kBlockM * params.q_row_stride + bidh * params.q_head_stride;
+    const index_t row_offset_q = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.q_row_stride) + bidh * index_t(params.q_head_stride);
     // We move K and V to the last block.
-    const index_t row_offset_k = binfo.k_offset(params.k_batch_stride, params.k_row_stride, bidb)
-        + (n_block_max - 1) * kBlockN * params.k_row_stride + (bidh / params.h_h_k_ratio) * params.k_head_stride;
-    const index_t row_offset_v = binfo.k_offset(params.v_batch_stride, params.v_row_stride, bidb)
-        + (n_block_max - 1) * kBlockN * params.v_row_stride + (bidh / params.h_h_k_ratio) * params.v_head_stride;
-    const index_t row_offset_p = ((bidb * params.h + bidh) * params.seqlen_q_rounded
+    const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, (n_block_max - 1) * kBlockN)
+        + (bidh / params.h_h_k_ratio) * index_t(params.k_head_stride);
+    const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, (n_block_max - 1) * kBlockN)
+        + (bidh / params.h_h_k_ratio) * index_t(params.v_head_stride);
+    const index_t row_offset_p = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
         + m_block * kBlockM) * params.seqlen_k_rounded + (n_block_max - 1) * kBlockN;
 
     Tensor gQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.q_ptr) + row_offset_q),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.q_row_stride, _1{}));
+                            make_stride(index_t(params.q_row_stride), _1{}));
     Tensor gK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.k_ptr) + row_offset_k),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.k_row_stride, _1{}));
+                            make_stride(index_t(params.k_row_stride), _1{}));
     Tensor gV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.v_ptr) + row_offset_v),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.v_row_stride, _1{}));
+                            make_stride(index_t(params.v_row_stride), _1{}));
     Tensor gP = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.p_ptr) + row_offset_p),
                             Shape<Int<kBlockM>, Int<kBlockN>>{},
                             make_stride(params.seqlen_k_rounded, _1{}));
@@ -318,6 +366,12 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
         for (int k = 0; k < size(tKVpKV); ++k) { tKVpKV(k) = get<1>(tKVcKV(0, 0, k)) < params.d; }
     }
 
+    // Append the new keys / values before the cache is read.
+    if (params.knew_ptr != nullptr) {
+        flash::append_kv_cache<Kernel_traits>(params, binfo, bidb, bidh, binfo.seqlen_k_cache,
+                                              std::min(int(binfo.actual_seqlen_k), n_block_max * kBlockN));
+    }
+
     // Prologue
 
     Tensor tQrQ = make_fragment_like(tQgQ);
@@ -325,6 +379,14 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
     flash::copy</*Is_even_MN=*/false, Is_even_K>(gmem_tiled_copy_QKV, tQgQ, tQsQ, tQcQ, tQpQ,
                                                  binfo.actual_seqlen_q - m_block * kBlockM);
     if (Kernel_traits::Is_Q_in_regs) { cute::cp_async_fence(); }
+    // Rotary: wait for Q and rotate it in smem, before it is read by the first GEMM.
+    if (params.rotary_cos_ptr != nullptr) {
+        cute::cp_async_fence();
+        flash::cp_async_wait<0>();
+        __syncthreads();
+        flash::apply_rotary<Kernel_traits::kNThreads>(params, sQ, m_block * kBlockM, binfo.actual_seqlen_q - m_block * kBlockM, tidx);
+        __syncthreads();
+    }
 
     // // Copy rmem to smem
     // // copy(tQrQ, tQsQ);
@@ -384,10 +446,14 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
         clear(acc_s);
         flash::cp_async_wait<0>();
         __syncthreads();
+        if (params.rotary_cos_ptr != nullptr) {
+            flash::apply_rotary<Kernel_traits::kNThreads>(params, sK, n_block * kBlockN, binfo.actual_seqlen_k - n_block * kBlockN, tidx);
+            __syncthreads();
+        }
 
         // Advance gV
         if (masking_step > 0) {
-            tVgV.data() = tVgV.data() + (-int(kBlockN * params.v_row_stride));
+            tVgV.data() = tVgV.data() + binfo.k_advance(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, (n_block + 1) * kBlockN, n_block * kBlockN);
             flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
         } else {
             // Clear the smem tiles to account for predicated off loads
@@ -405,11 +471,19 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
 
         // Reshape acc_s from (MMA=4, MMA_M, MMA_N) to (nrow=(2, MMA_M), ncol=(2, MMA_N))
         Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+        if (params.alibi_slopes_ptr != nullptr) {
+            flash::apply_alibi(scores, n_block * kBlockN, m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4,
+                               kNWarps * 16, alibi_slope);
+        }
         // if (cute::thread0()) { print(scores); }
         // We don't put the masking before the matmul S = Q K^T because we don't clear sK
         // for rows outside actual_seqlen_k. So those rows could have Inf / NaN, and the matmul
         // can produce Inf / NaN.
-        if (!Is_causal) {
+        if (is_local) {
+            flash::apply_mask_local(scores, n_block * kBlockN, binfo.actual_seqlen_k,
+                                    m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4, kNWarps * 16,
+                                    params.window_size_left, params.window_size_right);
+        } else if (!Is_causal) {
             if (!Is_even_N) { flash::apply_mask(scores, binfo.actual_seqlen_k - n_block * kBlockN); }
         } else {
             // Tensor caccS = make_identity_tensor(Shape<Int<kBlockM>, Int<kBlockN>>{});    // (BLK_M,BLK_N) -> (blk_m,blk_n)
@@ -433,9 +507,9 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
 
         flash::cp_async_wait<0>();
         __syncthreads();
-        if (n_block > 0) {
+        if (n_block > n_block_min) {
             // Advance gK
-            tKgK.data() = tKgK.data() + (-int(kBlockN * params.k_row_stride));
+            tKgK.data() = tKgK.data() + binfo.k_advance(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, n_block * kBlockN, (n_block - 1) * kBlockN);
             flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
             // This cp_async_fence needs to be in the if block, otherwise the synchronization
             // isn't right and we get race conditions.
@@ -443,9 +517,16 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
         }
 
         // TODO: when we have key_padding_mask we'll need to Check_inf
-        masking_step == 0
-            ? softmax_rescale_o</*Is_first=*/true,  /*Check_inf=*/Is_causal>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2)
-            : softmax_rescale_o</*Is_first=*/false, /*Check_inf=*/Is_causal>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        if (is_local) {
+            // Rows can be fully masked anywhere in the window.
+            masking_step == 0
+                ? softmax_rescale_o</*Is_first=*/true,  /*Check_inf=*/true>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2)
+                : softmax_rescale_o</*Is_first=*/false, /*Check_inf=*/true>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        } else {
+            masking_step == 0
+                ? softmax_rescale_o</*Is_first=*/true,  /*Check_inf=*/Is_causal>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2)
+                : softmax_rescale_o</*Is_first=*/false, /*Check_inf=*/Is_causal>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        }
 
         // Convert scores from fp32 to fp16/bf16
         Tensor rP = flash::convert_type<Element>(scores);
@@ -474,20 +555,24 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
         // if (cute::thread0()) { print(scores); }
 
         // This check is at the end of the loop since we always have at least 1 iteration
-        if (n_masking_steps > 1 && n_block <= 0) {
+        if (n_masking_steps > 1 && n_block <= n_block_min) {
             --n_block;
             break;
         }
     }
 
-    // These are the iterations where we don't need masking on S
-    for (; n_block >= 0; --n_block) {
+    // These are the iterations where we don't need masking on S, unless there's a sliding window
+    for (; n_block >= n_block_min; --n_block) {
         Tensor acc_s = partition_fragment_C(tiled_mma, Shape<Int<kBlockM>, Int<kBlockN>>{});  // (MMA=4, MMA_M, MMA_N)
         clear(acc_s);
         flash::cp_async_wait<0>();
         __syncthreads();
+        if (params.rotary_cos_ptr != nullptr) {
+            flash::apply_rotary<Kernel_traits::kNThreads>(params, sK, n_block * kBlockN, binfo.actual_seqlen_k - n_block * kBlockN, tidx);
+            __syncthreads();
+        }
         // Advance gV
-        tVgV.data() = tVgV.data() + (-int(kBlockN * params.v_row_stride));
+        tVgV.data() = tVgV.data() + binfo.k_advance(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, (n_block + 1) * kBlockN, n_block * kBlockN);
         flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
         cute::cp_async_fence();
 
@@ -498,9 +583,9 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
 
         flash::cp_async_wait<0>();
         __syncthreads();
-        if (n_block > 0) {
+        if (n_block > n_block_min) {
             // Advance gK
-            tKgK.data() = tKgK.data() + (-int(kBlockN * params.k_row_stride));
+            tKgK.data() = tKgK.data() + binfo.k_advance(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, n_block * kBlockN, (n_block - 1) * kBlockN);
             flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
             // This cp_async_fence needs to be in the if block, otherwise the synchronization
             // isn't right and we get race conditions.
@@ -509,7 +594,18 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
 
         // Reshape acc_s from (MMA=4, MMA_M, MMA_N) to (nrow=(2, MMA_M), ncol=(2, MMA_N))
         Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
-        softmax_rescale_o</*Is_first=*/false>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        if (params.alibi_slopes_ptr != nullptr) {
+            flash::apply_alibi(scores, n_block * kBlockN, m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4,
+                               kNWarps * 16, alibi_slope);
+        }
+        if (is_local) {
+            flash::apply_mask_local(scores, n_block * kBlockN, binfo.actual_seqlen_k,
+                                    m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4, kNWarps * 16,
+                                    params.window_size_left, params.window_size_right);
+            softmax_rescale_o</*Is_first=*/false, /*Check_inf=*/true>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        } else {
+            softmax_rescale_o</*Is_first=*/false>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        }
 
         Tensor rP = flash::convert_type<Element>(scores);
         // Reshape rP from (nrow=(2, MMA_M), ncol=(2, MMA_N)) to ((2, 2, 2), MMA_M, MMA_N / 2)
@@ -567,12 +663,12 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
 
     cute::copy(smem_tiled_copy_O, taccOrO, taccOsO);
 
-    const index_t row_offset_o = binfo.q_offset(params.o_batch_stride, params.o_row_stride, bidb)
-        + m_block * kBlockM * params.o_row_stride + bidh * params.o_head_stride;
-    const index_t row_offset_lse = (bidb * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    const index_t row_offset_lse = (index_t(bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
     Tensor gO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.o_ptr) + row_offset_o),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.o_row_stride, _1{}));
+                            make_stride(index_t(params.o_row_stride), _1{}));
     Tensor gLSE = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.softmax_lse_ptr) + row_offset_lse),
                               Shape<Int<kBlockM>>{}, Stride<_1>{});
 
@@ -623,6 +719,397 @@ inline __device__ void compute_attn_1rowblock(const Params &params, const int bi
     // }
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Split-KV version of compute_attn_1rowblock: the key blocks of the row block are cut into
+// params.num_splits contiguous ranges, and this computes the range n_split_idx. The partial O is
+// normalized over its own range and written in fp32 to params.oaccum_ptr, laid out as
+// (num_splits, b, h, seqlen_q, d_rounded), with its LSE in params.softmax_lseaccum_ptr, laid out as
+// (num_splits, b, h, seqlen_q). combine_attn_seqk_parallel then merges the splits.
+// No dropout and no causal mask, these go through compute_attn_1rowblock(_causal) instead.
+template<typename Kernel_traits, bool Is_even_N, bool Is_even_K, typename Params>
+inline __device__ void compute_attn_1rowblock_splitkv(const Params &params, const int bidb, const int bidh,
+                                                      const int m_block, const int n_split_idx) {
+
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    // Shared memory.
+    extern __shared__ char smem_[];
+
+    // The thread index.
+    const int tidx = threadIdx.x;
+
+    constexpr int kBlockM = Kernel_traits::kBlockM;
+    constexpr int kBlockN = Kernel_traits::kBlockN;
+    constexpr int kHeadDim = Kernel_traits::kHeadDim;
+
+    const BlockInfo</*Varlen=*/!Is_even_N> binfo(params, bidb);
+    // ALiBi slope of this (batch, head), divided by the softmax scale like the scores it is added to.
+    const float alibi_slope = params.alibi_slopes_ptr == nullptr ? 0.0f
+        : reinterpret_cast<float *>(params.alibi_slopes_ptr)[bidb * index_t(params.alibi_slopes_batch_stride) + bidh] / params.scale_softmax;
+    if (m_block * kBlockM >= binfo.actual_seqlen_q || binfo.actual_seqlen_k == 0) return;
+
+    const int n_blocks_per_split = cute::ceil_div(cute::ceil_div(params.seqlen_k, kBlockN), params.num_splits);
+    int n_block_min = n_split_idx * n_blocks_per_split;
+    int n_block_max = std::min(cute::ceil_div(binfo.actual_seqlen_k, kBlockN), (n_split_idx + 1) * n_blocks_per_split);
+    // Sliding window: the split only loads its key blocks that are inside the window of the row block.
+    const bool is_local = params.window_size_left >= 0 || params.window_size_right >= 0;
+    if (is_local) {
+        int n_block_min_local, n_block_max_local;
+        flash::local_n_block_range(m_block, binfo.actual_seqlen_q, binfo.actual_seqlen_k, kBlockM, kBlockN,
+                                   params.window_size_left, params.window_size_right, n_block_min_local, n_block_max_local);
+        n_block_min = std::max(n_block_min, n_block_min_local);
+        n_block_max = std::min(n_block_max, n_block_max_local);
+    }
+
+    const index_t row_offset_lseaccum = ((index_t(n_split_idx) * params.b + bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    const index_t row_offset_oaccum = row_offset_lseaccum * params.d_rounded;
+    Tensor gLSEaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.softmax_lseaccum_ptr) + row_offset_lseaccum),
+                                   Shape<Int<kBlockM>>{}, Stride<_1>{});
+    Tensor gOaccum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.oaccum_ptr) + row_offset_oaccum),
+                                 Shape<Int<kBlockM>, Int<kHeadDim>>{},
+                                 make_stride(params.d_rounded, _1{}));
+
+    // Empty split (more splits than key blocks, or none in the window): it has no weight in the combine, which skips its O.
+    if (n_block_min >= n_block_max) {
+        for (int row = tidx; row < std::min(kBlockM, binfo.actual_seqlen_q - m_block * kBlockM); row += blockDim.x) {
+            gLSEaccum(row) = -INFINITY;
+        }
+        return;
+    }
+
+    // We iterate over the blocks in reverse order, like compute_attn_1rowblock.
+
+    const index_t row_offset_q = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.q_row_stride) + bidh * index_t(params.q_head_stride);
+    // We move K and V to the last block of the split.
+    const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, (n_block_max - 1) * kBlockN)
+        + (bidh / params.h_h_k_ratio) * index_t(params.k_head_stride);
+    const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, (n_block_max - 1) * kBlockN)
+        + (bidh / params.h_h_k_ratio) * index_t(params.v_head_stride);
+
+    Tensor gQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.q_ptr) + row_offset_q),
+                            Shape<Int<kBlockM>, Int<kHeadDim>>{},
+                            make_stride(index_t(params.q_row_stride), _1{}));
+    Tensor gK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.k_ptr) + row_offset_k),
+                            Shape<Int<kBlockN>, Int<kHeadDim>>{},
+                            make_stride(index_t(params.k_row_stride), _1{}));
+    Tensor gV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.v_ptr) + row_offset_v),
+                            Shape<Int<kBlockN>, Int<kHeadDim>>{},
+                            make_stride(index_t(params.v_row_stride), _1{}));
+
+    Tensor sQ = make_tensor(make_smem_ptr(reinterpret_cast<Element *>(smem_)),
+                            typename Kernel_traits::SmemLayoutQ{});
+    // Careful we're using the same smem for sQ and sK | sV if Share_Q_K_smem;
+    Tensor sK = make_tensor(sQ.data() + (Kernel_traits::Share_Q_K_smem ? 0 : size(sQ)),
+                            typename Kernel_traits::SmemLayoutKV{});
+    Tensor sV = make_tensor(sK.data() + size(sK), typename Kernel_traits::SmemLayoutKV{});
+    Tensor sVt = make_tensor(sV.data(), typename Kernel_traits::SmemLayoutVtransposed{});
+    Tensor sVtNoSwizzle = make_tensor(sV.data(), typename Kernel_traits::SmemLayoutVtransposedNoSwizzle{});
+
+    typename Kernel_traits::GmemTiledCopyQKV gmem_tiled_copy_QKV;
+    auto gmem_thr_copy_QKV = gmem_tiled_copy_QKV.get_thread_slice(tidx);
+
+    Tensor tQgQ = gmem_thr_copy_QKV.partition_S(gQ);
+    Tensor tQsQ = gmem_thr_copy_QKV.partition_D(sQ);
+    Tensor tKgK = gmem_thr_copy_QKV.partition_S(gK);  // (KCPY, KCPY_N, KCPY_K)
+    Tensor tKsK = gmem_thr_copy_QKV.partition_D(sK);
+    Tensor tVgV = gmem_thr_copy_QKV.partition_S(gV);  // (VCPY, VCPY_N, VCPY_K)
+    Tensor tVsV = gmem_thr_copy_QKV.partition_D(sV);
+
+    typename Kernel_traits::TiledMma tiled_mma;
+    auto thr_mma = tiled_mma.get_thread_slice(tidx);
+    Tensor tSrQ  = thr_mma.partition_fragment_A(sQ);                           // (MMA,MMA_M,MMA_K)
+    Tensor tSrK  = thr_mma.partition_fragment_B(sK);                           // (MMA,MMA_N,MMA_K)
+    Tensor tOrVt  = thr_mma.partition_fragment_B(sVtNoSwizzle);                // (MMA, MMA_K,MMA_N)
+
+    Tensor acc_o = partition_fragment_C(tiled_mma, Shape<Int<kBlockM>, Int<kHeadDim>>{});  // MMA, MMA_M, MMA_K
+
+    //
+    // Copy Atom retiling
+    //
+
+    auto smem_tiled_copy_Q = make_tiled_copy_A(typename Kernel_traits::SmemCopyAtom{}, tiled_mma);
+    auto smem_thr_copy_Q = smem_tiled_copy_Q.get_thread_slice(tidx);
+    Tensor tSsQ = smem_thr_copy_Q.partition_S(sQ);
+
+    auto smem_tiled_copy_K = make_tiled_copy_B(typename Kernel_traits::SmemCopyAtom{}, tiled_mma);
+    auto smem_thr_copy_K = smem_tiled_copy_K.get_thread_slice(tidx);
+    Tensor tSsK = smem_thr_copy_K.partition_S(sK);
+
+    auto smem_tiled_copy_V = make_tiled_copy_B(typename Kernel_traits::SmemCopyAtomTransposed{}, tiled_mma);
+    auto smem_thr_copy_V = smem_tiled_copy_V.get_thread_slice(tidx);
+    Tensor tOsVt = smem_thr_copy_V.partition_S(sVt);
+
+    Tensor scores_max = make_tensor<ElementAccum>(Shape<Int<2 * size<1>(acc_o)>>{});
+    Tensor scores_sum = make_fragment_like(scores_max);
+
+    //
+    // PREDICATES
+    //
+
+    // Construct identity layout for sQ and sK
+    Tensor cQ = make_identity_tensor(make_shape(size<0>(sQ), size<1>(sQ)));    // (BLK_M,BLK_K) -> (blk_m,blk_k)
+    Tensor cKV = make_identity_tensor(make_shape(size<0>(sK), size<1>(sK)));    // (BLK_N,BLK_K) -> (blk_n,blk_k)
+
+    // Repeat the partitioning with identity layouts
+    Tensor tQcQ = gmem_thr_copy_QKV.partition_S(cQ);       // (ACPY,ACPY_M,ACPY_K) -> (blk_m,blk_k)
+    Tensor tKVcKV = gmem_thr_copy_QKV.partition_S(cKV);   // (BCPY,BCPY_N,BCPY_K) -> (blk_n,blk_k)
+
+    // Allocate predicate tensors for k
+    Tensor tQpQ = make_tensor<bool>(make_shape(size<2>(tQsQ)));
+    Tensor tKVpKV = make_tensor<bool>(make_shape(size<2>(tKsK)));
+
+    // Set predicates for k bounds
+    if (!Is_even_K) {
+        #pragma unroll
+        for (int k = 0; k < size(tQpQ); ++k) { tQpQ(k) = get<1>(tQcQ(0, 0, k)) < params.d; }
+        #pragma unroll
+        for (int k = 0; k < size(tKVpKV); ++k) { tKVpKV(k) = get<1>(tKVcKV(0, 0, k)) < params.d; }
+    }
+
+    // Append the new keys / values of this split before the cache is read.
+    if (params.knew_ptr != nullptr) {
+        flash::append_kv_cache<Kernel_traits>(params, binfo, bidb, bidh,
+                                              std::max(binfo.seqlen_k_cache, n_block_min * kBlockN),
+                                              std::min(int(binfo.actual_seqlen_k), n_block_max * kBlockN));
+    }
+
+    // Prologue
+
+    // We don't need to clear the sQ smem tiles since we'll only write out the valid outputs
+    flash::copy</*Is_even_MN=*/false, Is_even_K>(gmem_tiled_copy_QKV, tQgQ, tQsQ, tQcQ, tQpQ,
+                                                 binfo.actual_seqlen_q - m_block * kBlockM);
+    if (Kernel_traits::Is_Q_in_regs) { cute::cp_async_fence(); }
+    // Rotary: wait for Q and rotate it in smem, before it is read by the first GEMM.
+    if (params.rotary_cos_ptr != nullptr) {
+        cute::cp_async_fence();
+        flash::cp_async_wait<0>();
+        __syncthreads();
+        flash::apply_rotary<Kernel_traits::kNThreads>(params, sQ, m_block * kBlockM, binfo.actual_seqlen_q - m_block * kBlockM, tidx);
+        __syncthreads();
+    }
+
+    if (Kernel_traits::Share_Q_K_smem) {
+        flash::cp_async_wait<0>();
+        __syncthreads();
+        Tensor tSrQ_copy_view = smem_thr_copy_Q.retile_D(tSrQ);
+        CUTE_STATIC_ASSERT_V(size<1>(tSsQ) == size<1>(tSrQ_copy_view));            // M
+        cute::copy(smem_tiled_copy_Q, tSsQ, tSrQ_copy_view);
+        __syncthreads();
+    }
+
+    int n_block = n_block_max - 1;
+    // We don't need to clear the sK smem tiles since we'll mask out the scores anyway.
+    flash::copy<Is_even_N, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV,
+                                      binfo.actual_seqlen_k - n_block * kBlockN);
+    cute::cp_async_fence();
+
+    if (Kernel_traits::Is_Q_in_regs && !Kernel_traits::Share_Q_K_smem) {
+        flash::cp_async_wait<1>();
+        __syncthreads();
+        Tensor tSrQ_copy_view = smem_thr_copy_Q.retile_D(tSrQ);
+        CUTE_STATIC_ASSERT_V(size<1>(tSsQ) == size<1>(tSrQ_copy_view));            // M
+        cute::copy(smem_tiled_copy_Q, tSsQ, tSrQ_copy_view);
+    }
+
+    clear(acc_o);
+
+    // Only the last block of the last split can need masking on S, when K and V has length not
+    // multiple of kBlockN. For the other splits apply_mask is a no-op.
+    for (; n_block >= n_block_min; --n_block) {
+        Tensor acc_s = partition_fragment_C(tiled_mma, Shape<Int<kBlockM>, Int<kBlockN>>{});  // (MMA=4, MMA_M, MMA_N)
+        clear(acc_s);
+        flash::cp_async_wait<0>();
+        __syncthreads();
+        if (params.rotary_cos_ptr != nullptr) {
+            flash::apply_rotary<Kernel_traits::kNThreads>(params, sK, n_block * kBlockN, binfo.actual_seqlen_k - n_block * kBlockN, tidx);
+            __syncthreads();
+        }
+
+        // Advance gV
+        if (n_block < n_block_max - 1) {
+            tVgV.data() = tVgV.data() + binfo.k_advance(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb, (n_block + 1) * kBlockN, n_block * kBlockN);
+            flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
+        } else {
+            // Clear the smem tiles to account for predicated off loads
+            flash::copy<Is_even_N, Is_even_K, /*Clear_OOB_MN=*/true>(
+                gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV, binfo.actual_seqlen_k - n_block * kBlockN
+            );
+        }
+        cute::cp_async_fence();
+
+        flash::gemm</*A_in_regs=*/Kernel_traits::Is_Q_in_regs>(
+            acc_s, tSrQ, tSrK, tSsQ, tSsK, tiled_mma, smem_tiled_copy_Q, smem_tiled_copy_K,
+            smem_thr_copy_Q, smem_thr_copy_K
+        );
+
+        // Reshape acc_s from (MMA=4, MMA_M, MMA_N) to (nrow=(2, MMA_M), ncol=(2, MMA_N))
+        Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+        if (params.alibi_slopes_ptr != nullptr) {
+            flash::apply_alibi(scores, n_block * kBlockN, m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4,
+                               Kernel_traits::kNWarps * 16, alibi_slope);
+        }
+        if (is_local) {
+            flash::apply_mask_local(scores, n_block * kBlockN, binfo.actual_seqlen_k,
+                                    m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4, Kernel_traits::kNWarps * 16,
+                                    params.window_size_left, params.window_size_right);
+        } else if (!Is_even_N && n_block == n_block_max - 1) {
+            flash::apply_mask(scores, binfo.actual_seqlen_k - n_block * kBlockN);
+        }
+
+        flash::cp_async_wait<0>();
+        __syncthreads();
+        if (n_block > n_block_min) {
+            // Advance gK
+            tKgK.data() = tKgK.data() + binfo.k_advance(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb, n_block * kBlockN, (n_block - 1) * kBlockN);
+            flash::copy</*Is_even_MN=*/true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
+            // This cp_async_fence needs to be in the if block, otherwise the synchronization
+            // isn't right and we get race conditions.
+            cute::cp_async_fence();
+        }
+
+        if (is_local) {
+            n_block == n_block_max - 1
+                ? softmax_rescale_o</*Is_first=*/true,  /*Check_inf=*/true>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2)
+                : softmax_rescale_o</*Is_first=*/false, /*Check_inf=*/true>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        } else {
+            n_block == n_block_max - 1
+                ? softmax_rescale_o</*Is_first=*/true>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2)
+                : softmax_rescale_o</*Is_first=*/false>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
+        }
+
+        // Convert scores from fp32 to fp16/bf16
+        Tensor rP = flash::convert_type<Element>(scores);
+        // Reshape rP from (nrow=(2, MMA_M), ncol=(2, MMA_N)) to ((2, 2, 2), MMA_M, MMA_N / 2)
+        // if using m16n8k16 or ((2, 2, 1), MMA_M, MMA_N) if using m16n8k8.
+        Tensor tOrP = make_tensor(rP.data(), flash::convert_layout_rowcol_Aregs<Kernel_traits::TiledMma>(rP.layout()));
+
+        flash::gemm_A_in_regs(acc_o, tOrP, tOrVt, tOsVt, tiled_mma, smem_tiled_copy_V, smem_thr_copy_V);
+    }
+
+    // Epilogue
+
+    // Reshape acc_o from (MMA=4, MMA_M, MMA_K) to (nrow=(2, MMA_M), ncol=(2, MMA_K))
+    Tensor acc_o_rowcol = make_tensor(acc_o.data(), flash::convert_layout_acc_rowcol(acc_o.layout()));
+    Tensor lse = make_fragment_like(scores_sum);
+    #pragma unroll
+    for (int mi = 0; mi < size<0>(acc_o_rowcol); ++mi) {
+        float sum = scores_sum(mi);
+        float inv_sum = (sum == 0.f || sum != sum) ? 1.f : 1.f / sum;
+        lse(mi) = (sum == 0.f || sum != sum) ? -INFINITY : scores_max(mi) * params.scale_softmax + __logf(sum);
+        #pragma unroll
+        for (int ni = 0; ni < size<1>(acc_o_rowcol); ++ni) { acc_o_rowcol(mi, ni) *= inv_sum; }
+    }
+
+    // The partial O stays in fp32 and goes straight from the accumulators to gmem: there are few
+    // rows in the cases split-KV is for, so we don't bother staging it through smem.
+    Tensor caccO = make_identity_tensor(Shape<Int<kBlockM>, Int<kHeadDim>>{});    // (BLK_M,BLK_K) -> (blk_m,blk_k)
+    Tensor taccOcO = thr_mma.partition_C(caccO);                           // (MMA,MMA_M,MMA_K)
+    static_assert(decltype(size<0>(taccOcO))::value == 4);
+    #pragma unroll
+    for (int i = 0; i < size(acc_o); ++i) {
+        const int row = get<0>(taccOcO(i));
+        const int col = get<1>(taccOcO(i));
+        if (row < binfo.actual_seqlen_q - m_block * kBlockM && (Is_even_K || col < params.d)) {
+            gOaccum(row, col) = acc_o(i);
+        }
+    }
+    // Convert to ((2, 2), MMA_M, MMA_K) then take only the row indices.
+    Tensor taccOcO_row = logical_divide(taccOcO, Shape<_2>{})(make_coord(0, _), _, 0);
+    CUTE_STATIC_ASSERT_V(size(lse) == size(taccOcO_row));                     // MMA_M
+    if (get<1>(taccOcO_row(0)) == 0) {
+        #pragma unroll
+        for (int mi = 0; mi < size(lse); ++mi) {
+            const int row = get<0>(taccOcO_row(mi));
+            if (row < binfo.actual_seqlen_q - m_block * kBlockM) { gLSEaccum(row) = lse(mi); }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Merges the num_splits partials of one row of (b, h, seqlen_q), written by
+// compute_attn_1rowblock_splitkv, into O and the LSE. This is softmax_merge_o applied to
+// num_splits partials instead of two: each partial is normalized, so its scores_max and scores_sum
+// only enter through its LSE, and partial s gets the weight exp(lse_s - lse).
+template<typename Kernel_traits, typename Params>
+inline __device__ void combine_attn_1row_seqk_parallel(const Params &params, const int row) {
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    const int m = row % params.seqlen_q;
+    const int bidh = (row / params.seqlen_q) % params.h;
+    const int bidb = row / params.seqlen_q / params.h;
+    const index_t split_stride = index_t(params.b) * params.h * params.seqlen_q;
+    const ElementAccum *gLSEaccum = reinterpret_cast<const ElementAccum *>(params.softmax_lseaccum_ptr) + row;
+    const ElementAccum *gOaccum = reinterpret_cast<const ElementAccum *>(params.oaccum_ptr) + index_t(row) * params.d_rounded;
+
+    float lse_max = -INFINITY;
+    for (int s = 0; s < params.num_splits; ++s) { lse_max = fmaxf(lse_max, gLSEaccum[s * split_stride]); }
+    float sum = 0.f;
+    if (lse_max != -INFINITY) {
+        for (int s = 0; s < params.num_splits; ++s) { sum += expf(gLSEaccum[s * split_stride] - lse_max); }
+    }
+    const float lse = (sum == 0.f || sum != sum) ? INFINITY : lse_max + logf(sum);
+    if (threadIdx.x == 0) { reinterpret_cast<ElementAccum *>(params.softmax_lse_ptr)[row] = lse; }
+
+    Element *gO = reinterpret_cast<Element *>(params.o_ptr) + bidb * index_t(params.o_batch_stride)
+        + m * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    for (int k = threadIdx.x; k < params.d; k += blockDim.x) {
+        float acc = 0.f;
+        for (int s = 0; s < params.num_splits; ++s) {
+            const float scale = expf(gLSEaccum[s * split_stride] - lse);
+            // The O of an empty split was never written.
+            if (scale > 0.f) { acc += scale * gOaccum[s * split_stride * params.d_rounded + k]; }
+        }
+        gO[k] = Element(acc);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Merges the O and the LSE of one row of (b, h, seqlen_q), as written by the forward, into the
+// incoming state (params.o_state_ptr, params.softmax_lse_state_ptr) in place. Same math as
+// softmax_merge_o with two normalized sides, whose scores_max and scores_sum only enter through
+// their LSE: the state keeps the weight 1 / (1 + exp(lse_2 - lse_1)). A side with an infinite LSE
+// has attended no key (the forward writes +inf for such a row, a fresh state may hold -inf) and
+// takes no weight.
+template<typename Kernel_traits, typename Params>
+inline __device__ void merge_attn_1row_state(const Params &params, const int row) {
+    using Element = typename Kernel_traits::Element;
+    using ElementAccum = typename Kernel_traits::ElementAccum;
+    using index_t = typename Kernel_traits::index_t;
+
+    const int m = row % params.seqlen_q;
+    const int bidh = (row / params.seqlen_q) % params.h;
+    const int bidb = row / params.seqlen_q / params.h;
+    ElementAccum *gLSE_state = reinterpret_cast<ElementAccum *>(params.softmax_lse_state_ptr) + row;
+    const float lse_1 = *gLSE_state;
+    const float lse_2 = reinterpret_cast<const ElementAccum *>(params.softmax_lse_ptr)[row];
+    const bool empty_1 = isinf(lse_1), empty_2 = isinf(lse_2);
+    const float scores_scale = empty_1 ? 0.f : (empty_2 ? 1.f : 1.f / (1.f + expf(lse_2 - lse_1)));
+    const float lse = empty_1 ? lse_2
+        : (empty_2 ? lse_1 : fmaxf(lse_1, lse_2) + log1pf(expf(-fabsf(lse_1 - lse_2))));
+
+    Element *gO_state = reinterpret_cast<Element *>(params.o_state_ptr) + bidb * index_t(params.o_state_batch_stride)
+        + m * index_t(params.o_state_row_stride) + bidh * index_t(params.o_state_head_stride);
+    const Element *gO = reinterpret_cast<const Element *>(params.o_ptr) + bidb * index_t(params.o_batch_stride)
+        + m * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    for (int k = threadIdx.x; k < params.d; k += blockDim.x) {
+        // The O of an empty side may never have been written.
+        const float o_1 = empty_1 ? 0.f : float(gO_state[k]);
+        const float o_2 = empty_2 ? 0.f : float(gO[k]);
+        gO_state[k] = Element(o_1 * scores_scale + o_2 * (1.f - scores_scale));
+    }
+    // Every thread has read the LSE of the state.
+    __syncthreads();
+    if (threadIdx.x == 0) { *gLSE_state = empty_1 && empty_2 ? INFINITY : lse; }
+}
+
 __device__ inline uint64_t GlobalTimer64(void) {
   // Due to a bug in CUDA's 64-bit globaltimer, the lower 32 bits can wrap
   // around after the upper bits have already been read. Work around this by
@@ -650,9 +1137,31 @@ static __device__ __inline__ uint32_t GetSMID(void) {
   return to_return;
 }
 
+// Profiling: start time of a tile, 0 when params.tile_trace is off.
+template<typename Params>
+inline __device__ uint64_t tile_start_time(const Params &params) {
+    return params.tile_trace == nullptr ? 0 : GlobalTimer64();
+}
+
+// Profiling: appends the record of a tile started at start to the ring buffer params.tile_trace (see
+// flash_tile_trace.h). Called by all threads once they're done with the tile, thread 0 writes.
+template<typename Params>
+inline __device__ void record_tile(const Params &params, const int tile, const int bidb, const int bidh,
+                                   const int m_block, const int worker, const uint64_t start) {
+    if (params.tile_trace == nullptr || threadIdx.x != 0) { return; }
+    const uint64_t end = GlobalTimer64();
+    const unsigned long long slot = atomicAdd(params.tile_trace_count, 1ull) % params.tile_trace_capacity;
+    int64_t *record = params.tile_trace + slot * kTileTraceFields;
+    record[kTileTraceTile] = tile;
+    record[kTileTraceBatch] = bidb;
+    record[kTileTraceHead] = bidh;
+    record[kTileTraceMBlock] = m_block;
+    record[kTileTraceWorker] = worker;
+    record[kTileTraceSm] = GetSMID();
+    record[kTileTraceStart] = start;
+    record[kTileTraceEnd] = end;
+}
 
-__device__ int CompleteMask[32][32][1024];
-//__device__ int CompleteMask;
 
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_even_N, bool Is_even_K, bool Return_softmax, typename Params>
 inline __device__ void compute_attn_1rowblock_causal(const Params &params, const int bidb, const int bidh, const int m_block) {
@@ -706,12 +1215,13 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
     constexpr int MMA_M = kBlockM / decltype(size<0>(typename Kernel_traits::TiledMma::TiledShape_MNK{}))::value;
 
     const BlockInfo<!Is_even_N> binfo(params, bidb);
+    // ALiBi slope of this (batch, head), divided by the softmax scale like the scores it is added to.
+    const float alibi_slope = params.alibi_slopes_ptr == nullptr ? 0.0f
+        : reinterpret_cast<float *>(params.alibi_slopes_ptr)[bidb * index_t(params.alibi_slopes_batch_stride) + bidh] / params.scale_softmax;
 
-    /**/
-    if (m_block + 1 > (((binfo.actual_seqlen_q + kBlockM - 1) / kBlockM) / 2) + 1 && threadIdx.x == 0) {
-        atomicAnd(&CompleteMask[bidh][bidb][blockIdx.x], 0);
-    }
-    
+    // Completion flags of this (batch, head), indexed by the consumer's m_block. They are handed back
+    // at 0 by the consumer, so there is nothing to reset here.
+    int *complete_flags = params.complete_flags + (index_t(bidb) * params.h + bidh) * cute::ceil_div(params.seqlen_q, kBlockM);
 
     if (m_block * kBlockM >= binfo.actual_seqlen_q || binfo.actual_seqlen_k == 0) return;
     
@@ -726,25 +1236,25 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
     // that needs masking when we read K and V from global memory. Moreover, iterating in reverse
     // might save us 1 register (we just need n_block instead of both n_block and n_block_max).
 
-    const index_t row_offset_q = binfo.q_offset(params.q_batch_stride, params.q_row_stride, bidb)
-        + m_block * kBlockM * params.q_row_stride + bidh * params.q_head_stride;
+    const index_t row_offset_q = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.q_row_stride) + bidh * index_t(params.q_head_stride);
     // We move K and V to the last block.
-    const index_t row_offset_k = binfo.k_offset(params.k_batch_stride, params.k_row_stride, bidb)
-        + 0 * kBlockN * params.k_row_stride + (bidh / params.h_h_k_ratio) * params.k_head_stride;
-    const index_t row_offset_v = binfo.k_offset(params.v_batch_stride, params.v_row_stride, bidb)
-        + 0 * kBlockN * params.v_row_stride + (bidh / params.h_h_k_ratio) * params.v_head_stride;
-    const index_t row_offset_p = ((bidb * params.h + bidh) * params.seqlen_q_rounded
+    const index_t row_offset_k = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb)
+        + 0 * kBlockN * index_t(params.k_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.k_head_stride);
+    const index_t row_offset_v = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb)
+        + 0 * kBlockN * index_t(params.v_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.v_head_stride);
+    const index_t row_offset_p = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
         + m_block * kBlockM) * params.seqlen_k_rounded + 0 * kBlockN;
 
     Tensor gQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.q_ptr) + row_offset_q),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.q_row_stride, _1{}));
+                            make_stride(index_t(params.q_row_stride), _1{}));
     Tensor gK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.k_ptr) + row_offset_k),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.k_row_stride, _1{}));
+                            make_stride(index_t(params.k_row_stride), _1{}));
     Tensor gV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.v_ptr) + row_offset_v),
                             Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                            make_stride(params.v_row_stride, _1{}));
+                            make_stride(index_t(params.v_row_stride), _1{}));
     Tensor gP = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.p_ptr) + row_offset_p),
                             Shape<Int<kBlockM>, Int<kBlockN>>{},
                             make_stride(params.seqlen_k_rounded, _1{}));
@@ -860,6 +1370,14 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
     flash::copy<false, Is_even_K>(gmem_tiled_copy_QKV, tQgQ, tQsQ, tQcQ, tQpQ,
                                                  binfo.actual_seqlen_q - m_block * kBlockM);
     if (Kernel_traits::Is_Q_in_regs) { cute::cp_async_fence(); }
+    // Rotary: wait for Q and rotate it in smem, before it is read by the first GEMM.
+    if (params.rotary_cos_ptr != nullptr) {
+        cute::cp_async_fence();
+        flash::cp_async_wait<0>();
+        __syncthreads();
+        flash::apply_rotary<Kernel_traits::kNThreads>(params, sQ, m_block * kBlockM, binfo.actual_seqlen_q - m_block * kBlockM, tidx);
+        __syncthreads();
+    }
 
     // // Copy rmem to smem
     // // copy(tQrQ, tQsQ);
@@ -931,10 +1449,14 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         clear(acc_s);
         flash::cp_async_wait<0>();
         __syncthreads();
+        if (params.rotary_cos_ptr != nullptr) {
+            flash::apply_rotary<Kernel_traits::kNThreads>(params, sK, n_block * kBlockN, binfo.actual_seqlen_k - n_block * kBlockN, tidx);
+            __syncthreads();
+        }
 
         // Advance gV
         if (n_block > 0) {
-            tVgV.data() = tVgV.data() + (+int(kBlockN * params.v_row_stride));
+            tVgV.data() = tVgV.data() + (+int(kBlockN * index_t(params.v_row_stride)));
             flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
         } else {
             // Clear the smem tiles to account for predicated off loads
@@ -953,7 +1475,7 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         __syncthreads();
         if (!(n_masking_steps == 0 && n_block == dst)) {
             // Advance gK
-            tKgK.data() = tKgK.data() + (+int(kBlockN * params.k_row_stride));
+            tKgK.data() = tKgK.data() + (+int(kBlockN * index_t(params.k_row_stride)));
             flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
             // This cp_async_fence needs to be in the if block, otherwise the synchronization
             // isn't right and we get race conditions.
@@ -962,6 +1484,10 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
 
         // Reshape acc_s from (MMA=4, MMA_M, MMA_N) to (nrow=(2, MMA_M), ncol=(2, MMA_N))
         Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+        if (params.alibi_slopes_ptr != nullptr) {
+            flash::apply_alibi(scores, n_block * kBlockN, m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4,
+                               kNWarps * 16, alibi_slope);
+        }
         
         n_block == 0
             ? softmax_rescale_o<true,  true>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2)
@@ -996,6 +1522,10 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         clear(acc_s);
         flash::cp_async_wait<0>();
         __syncthreads();
+        if (params.rotary_cos_ptr != nullptr) {
+            flash::apply_rotary<Kernel_traits::kNThreads>(params, sK, n_block * kBlockN, binfo.actual_seqlen_k - n_block * kBlockN, tidx);
+            __syncthreads();
+        }
 
         // Advance gV
         if (dst == 0) {
@@ -1003,7 +1533,7 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
                 gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV, binfo.actual_seqlen_k - n_block * kBlockN
             );
         } else {
-            tVgV.data() = tVgV.data() + (+int(kBlockN * params.v_row_stride));
+            tVgV.data() = tVgV.data() + (+int(kBlockN * index_t(params.v_row_stride)));
             flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
         }
         cute::cp_async_fence();
@@ -1016,6 +1546,10 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
 
         // Reshape acc_s from (MMA=4, MMA_M, MMA_N) to (nrow=(2, MMA_M), ncol=(2, MMA_N))
         Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+        if (params.alibi_slopes_ptr != nullptr) {
+            flash::apply_alibi(scores, n_block * kBlockN, m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4,
+                               kNWarps * 16, alibi_slope);
+        }
         // if (cute::thread0()) { print(scores); }
         // We don't put the masking before the matmul S = Q K^T because we don't clear sK
         // for rows outside actual_seqlen_k. So those rows could have Inf / NaN, and the matmul
@@ -1043,7 +1577,7 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         __syncthreads();
         if (n_block < dst) {
             // Advance gK
-            tKgK.data() = tKgK.data() + (+int(kBlockN * params.k_row_stride));
+            tKgK.data() = tKgK.data() + (+int(kBlockN * index_t(params.k_row_stride)));
             flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
             // This cp_async_fence needs to be in the if block, otherwise the synchronization
             // isn't right and we get race conditions.
@@ -1154,17 +1688,17 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
 
     //if (cute::thread0()) { printf("fence -1\n"); }
 
-    const index_t row_offset_o = binfo.q_offset(params.o_batch_stride, params.o_row_stride, bidb)
-        + m_block * kBlockM * params.o_row_stride + bidh * params.o_head_stride;
-    const index_t row_offset_lse = (bidb * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    const index_t row_offset_o = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+        + m_block * kBlockM * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
+    const index_t row_offset_lse = (index_t(bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
     Tensor gO = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.o_ptr) + row_offset_o),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.o_row_stride, _1{}));
+                            make_stride(index_t(params.o_row_stride), _1{}));
     Tensor gLSE = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.softmax_lse_ptr) + row_offset_lse),
                             Shape<Int<kBlockM>>{}, Stride<_1>{});
     // Bae: scores_max, scores_sum should be stored at glb mem, they are familiar to Q,O, only difference is kheaddim=1
-    const index_t row_offset_scores_max = (bidb * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
-    const index_t row_offset_scores_sum = (bidb * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    const index_t row_offset_scores_max = (index_t(bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
+    const index_t row_offset_scores_sum = (index_t(bidb) * params.h + bidh) * params.seqlen_q + m_block * kBlockM;
     Tensor gscores_max = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.scores_max_ptr) +row_offset_scores_max),
                             Shape<Int<kBlockM>>{}, Stride<_1>{});
     Tensor gscores_sum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.scores_sum_ptr) +row_offset_scores_sum),
@@ -1217,10 +1751,12 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         gmem_tiled_copy_O, tOrO, tOgO, tOcO, tOpO, binfo.actual_seqlen_q - m_block * kBlockM
     );
 
-    /**/
+    // Make the partial O / scores_max / scores_sum visible to the consumer, which may sit on
+    // another SM, before publishing them.
+    __threadfence();
     __syncthreads();
     if(m_block + 1 > (((binfo.actual_seqlen_q + kBlockM - 1) / kBlockM) / 2) + 1 && tidx == 0)
-        atomicOr(&CompleteMask[bidh][bidb][blockIdx.x], 1);
+        atomicOr(&complete_flags[((binfo.actual_seqlen_q + kBlockM - 1) / kBlockM) - m_block - 1], 1);
     
 
     //if (cute::thread0()) { printf("fence 1\n"); }
@@ -1266,25 +1802,25 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         printf("kBlockM=%d\n", kBlockM); 
         }*/
         //Bae: recompute pointers to ptr(N-m_block) blocks fragment
-        const index_t row_offset_q_frag = binfo.q_offset(params.q_batch_stride, params.q_row_stride, bidb)
-            + reverse_m_block * kBlockM * params.q_row_stride + bidh * params.q_head_stride;
+        const index_t row_offset_q_frag = binfo.q_offset(index_t(params.q_batch_stride), index_t(params.q_row_stride), bidb)
+            + reverse_m_block * kBlockM * index_t(params.q_row_stride) + bidh * index_t(params.q_head_stride);
         // We move K and V to the last block.
-        const index_t row_offset_k_frag = binfo.k_offset(params.k_batch_stride, params.k_row_stride, bidb)
-            + (n_block_max - 1) * kBlockN * params.k_row_stride + (bidh / params.h_h_k_ratio) * params.k_head_stride;
-        const index_t row_offset_v_frag = binfo.k_offset(params.v_batch_stride, params.v_row_stride, bidb)
-            + (n_block_max - 1) * kBlockN * params.v_row_stride + (bidh / params.h_h_k_ratio) * params.v_head_stride;
-        const index_t row_offset_p_frag = ((bidb * params.h + bidh) * params.seqlen_q_rounded
+        const index_t row_offset_k_frag = binfo.k_offset(index_t(params.k_batch_stride), index_t(params.k_row_stride), bidb)
+            + (n_block_max - 1) * kBlockN * index_t(params.k_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.k_head_stride);
+        const index_t row_offset_v_frag = binfo.k_offset(index_t(params.v_batch_stride), index_t(params.v_row_stride), bidb)
+            + (n_block_max - 1) * kBlockN * index_t(params.v_row_stride) + (bidh / params.h_h_k_ratio) * index_t(params.v_head_stride);
+        const index_t row_offset_p_frag = ((index_t(bidb) * params.h + bidh) * params.seqlen_q_rounded
             + reverse_m_block * kBlockM) * params.seqlen_k_rounded + (n_block_max - 1) * kBlockN;
 
         gQ = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.q_ptr) + row_offset_q_frag),
                                 Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                                make_stride(params.q_row_stride, _1{}));
+                                make_stride(index_t(params.q_row_stride), _1{}));
         gK = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.k_ptr) + row_offset_k_frag),
                                 Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                                make_stride(params.k_row_stride, _1{}));
+                                make_stride(index_t(params.k_row_stride), _1{}));
         gV = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.v_ptr) + row_offset_v_frag),
                                 Shape<Int<kBlockN>, Int<kHeadDim>>{},
-                                make_stride(params.v_row_stride, _1{}));
+                                make_stride(index_t(params.v_row_stride), _1{}));
         gP = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.p_ptr) + row_offset_p_frag),
                                 Shape<Int<kBlockM>, Int<kBlockN>>{},
                                 make_stride(params.seqlen_k_rounded, _1{}));
@@ -1334,6 +1870,14 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         flash::copy<false, Is_even_K>(gmem_tiled_copy_QKV, tQgQ, tQsQ, tQcQ, tQpQ,
                                                     binfo.actual_seqlen_q - reverse_m_block * kBlockM);
         if (Kernel_traits::Is_Q_in_regs) { cute::cp_async_fence(); }
+        // Rotary: wait for Q and rotate it in smem, before it is read by the first GEMM.
+        if (params.rotary_cos_ptr != nullptr) {
+            cute::cp_async_fence();
+            flash::cp_async_wait<0>();
+            __syncthreads();
+            flash::apply_rotary<Kernel_traits::kNThreads>(params, sQ, reverse_m_block * kBlockM, binfo.actual_seqlen_q - reverse_m_block * kBlockM, tidx);
+            __syncthreads();
+        }
 
         // // Copy rmem to smem
         // // copy(tQrQ, tQsQ);
@@ -1401,10 +1945,14 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
             clear(acc_s);
             flash::cp_async_wait<0>();
             __syncthreads();
+            if (params.rotary_cos_ptr != nullptr) {
+                flash::apply_rotary<Kernel_traits::kNThreads>(params, sK, n_block * kBlockN, binfo.actual_seqlen_k - n_block * kBlockN, tidx);
+                __syncthreads();
+            }
 
             // Advance gV
             if (masking_step > 0) {
-                tVgV.data() = tVgV.data() + (-int(kBlockN * params.v_row_stride));
+                tVgV.data() = tVgV.data() + (-int(kBlockN * index_t(params.v_row_stride)));
                 flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
             } else {
                 // Clear the smem tiles to account for predicated off loads
@@ -1422,6 +1970,10 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
 
             // Reshape acc_s from (MMA=4, MMA_M, MMA_N) to (nrow=(2, MMA_M), ncol=(2, MMA_N))
             Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+            if (params.alibi_slopes_ptr != nullptr) {
+                flash::apply_alibi(scores, n_block * kBlockN, reverse_m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4,
+                                   kNWarps * 16, alibi_slope);
+            }
             // if (cute::thread0()) { print(scores); }
             // We don't put the masking before the matmul S = Q K^T because we don't clear sK
             // for rows outside actual_seqlen_k. So those rows could have Inf / NaN, and the matmul
@@ -1449,7 +2001,7 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
             __syncthreads();
             if (n_block > dst) {
                 // Advance gK
-                tKgK.data() = tKgK.data() + (-int(kBlockN * params.k_row_stride));
+                tKgK.data() = tKgK.data() + (-int(kBlockN * index_t(params.k_row_stride)));
                 flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
                 // This cp_async_fence needs to be in the if block, otherwise the synchronization
                 // isn't right and we get race conditions.
@@ -1502,8 +2054,12 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
             clear(acc_s);
             flash::cp_async_wait<0>();
             __syncthreads();
+            if (params.rotary_cos_ptr != nullptr) {
+                flash::apply_rotary<Kernel_traits::kNThreads>(params, sK, n_block * kBlockN, binfo.actual_seqlen_k - n_block * kBlockN, tidx);
+                __syncthreads();
+            }
             // Advance gV
-            tVgV.data() = tVgV.data() + (-int(kBlockN * params.v_row_stride));
+            tVgV.data() = tVgV.data() + (-int(kBlockN * index_t(params.v_row_stride)));
             flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tVgV, tVsV, tKVcKV, tKVpKV);
             cute::cp_async_fence();
 
@@ -1517,7 +2073,7 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
             __syncthreads();
             if (n_block > dst) {
                 // Advance gK
-                tKgK.data() = tKgK.data() + (-int(kBlockN * params.k_row_stride));
+                tKgK.data() = tKgK.data() + (-int(kBlockN * index_t(params.k_row_stride)));
                 flash::copy<true, Is_even_K>(gmem_tiled_copy_QKV, tKgK, tKsK, tKVcKV, tKVpKV);
                 // This cp_async_fence needs to be in the if block, otherwise the synchronization
                 // isn't right and we get race conditions.
@@ -1526,6 +2082,10 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
 
             // Reshape acc_s from (MMA=4, MMA_M, MMA_N) to (nrow=(2, MMA_M), ncol=(2, MMA_N))
             Tensor scores = make_tensor(acc_s.data(), flash::convert_layout_acc_rowcol(acc_s.layout()));
+            if (params.alibi_slopes_ptr != nullptr) {
+                flash::apply_alibi(scores, n_block * kBlockN, reverse_m_block * kBlockM + (tidx / 32) * 16 + (tidx % 32) / 4,
+                                   kNWarps * 16, alibi_slope);
+            }
             softmax_rescale_o<false>(scores, scores_max, scores_sum, acc_o, params.scale_softmax_log2);
 
             Tensor rP = flash::convert_type<Element>(scores);
@@ -1612,8 +2172,10 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         //atomicAnd(&CompleteMask, 0);
 
         /**/
+        // Take the flag back to 0 so that the next call (or the next tile of a persistent worker)
+        // can't mistake it for its own producer.
         if (tidx == 0) {
-            while(atomicCAS(&CompleteMask[bidh][bidb][m_block], 0, 0) != 1);
+            while(atomicCAS(&complete_flags[m_block], 1, 0) != 1);
         }
         __syncthreads();
         
@@ -1632,19 +2194,19 @@ inline __device__ void compute_attn_1rowblock_causal(const Params &params, const
         //     after merging the result will be load to global memory (the same place as where stored fragment). 
             
         //Bae: fragment 1 to d/2-f(m_block) stored at sO, d/2-f(m_block) to d-f(m_block) stored at global mem somewhere, we need to recompute pointers
-        const index_t row_offset_frag_scores_max = (bidb * params.h + bidh) * params.seqlen_q + reverse_m_block * kBlockM;
-        const index_t row_offset_frag_scores_sum = (bidb * params.h + bidh) * params.seqlen_q + reverse_m_block * kBlockM;
+        const index_t row_offset_frag_scores_max = (index_t(bidb) * params.h + bidh) * params.seqlen_q + reverse_m_block * kBlockM;
+        const index_t row_offset_frag_scores_sum = (index_t(bidb) * params.h + bidh) * params.seqlen_q + reverse_m_block * kBlockM;
         gscores_max = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.scores_max_ptr) +row_offset_frag_scores_max),
                                 Shape<Int<kBlockM>>{}, Stride<_1>{});
         gscores_sum = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.scores_sum_ptr) +row_offset_frag_scores_sum),
                                 Shape<Int<kBlockM>>{}, Stride<_1>{});
         
-        const index_t row_offset_o_frag = binfo.q_offset(params.o_batch_stride, params.o_row_stride, bidb)
-            + reverse_m_block * kBlockM * params.o_row_stride + bidh * params.o_head_stride;
+        const index_t row_offset_o_frag = binfo.q_offset(index_t(params.o_batch_stride), index_t(params.o_row_stride), bidb)
+            + reverse_m_block * kBlockM * index_t(params.o_row_stride) + bidh * index_t(params.o_head_stride);
         Tensor gOf = make_tensor(make_gmem_ptr(reinterpret_cast<Element *>(params.o_ptr) + row_offset_o_frag),
                             Shape<Int<kBlockM>, Int<kHeadDim>>{},
-                            make_stride(params.o_row_stride, _1{}));
-        const index_t row_offset_lse_frag = (bidb * params.h + bidh) * params.seqlen_q + reverse_m_block * kBlockM;
+                            make_stride(index_t(params.o_row_stride), _1{}));
+        const index_t row_offset_lse_frag = (index_t(bidb) * params.h + bidh) * params.seqlen_q + reverse_m_block * kBlockM;
         gLSE = make_tensor(make_gmem_ptr(reinterpret_cast<ElementAccum *>(params.softmax_lse_ptr) + row_offset_lse_frag),
                             Shape<Int<kBlockM>>{}, Stride<_1>{});
         //Bae: reload fragment from g0f to shared mem sOf (O is the same size as Q, so the copy operation is similar), stores at sQ address
@@ -1896,6 +2458,29 @@ inline __device__ void compute_attn(const Params &params) {
     flash::compute_attn_1rowblock<Kernel_traits, Is_dropout, Is_causal, Is_even_N, Is_even_K, Return_softmax>(params, bidb, bidh, m_block);
 }
 
+template<typename Kernel_traits, bool Is_even_N, bool Is_even_K, typename Params>
+inline __device__ void compute_attn_splitkv(const Params &params) {
+    const int m_block = blockIdx.x;
+    // The block index for the split.
+    const int n_split_idx = blockIdx.y;
+    // The block index for the batch and the head.
+    const int bidb = blockIdx.z / params.h;
+    const int bidh = blockIdx.z % params.h;
+    flash::compute_attn_1rowblock_splitkv<Kernel_traits, Is_even_N, Is_even_K>(params, bidb, bidh, m_block, n_split_idx);
+}
+
+template<typename Kernel_traits, typename Params>
+inline __device__ void combine_attn_seqk_parallel(const Params &params) {
+    // One CTA per row of (b, h, seqlen_q).
+    flash::combine_attn_1row_seqk_parallel<Kernel_traits>(params, blockIdx.x);
+}
+
+template<typename Kernel_traits, typename Params>
+inline __device__ void merge_attn_state(const Params &params) {
+    // One CTA per row of (b, h, seqlen_q).
+    flash::merge_attn_1row_state<Kernel_traits>(params, blockIdx.x);
+}
+
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_even_N, bool Is_even_K, bool Return_softmax, typename Params>
 inline __device__ void compute_attn_casual(const Params &params, const int bidb, const int bidh) {
     const int m_block = gridDim.x - 1 - blockIdx.x;
@@ -1912,10 +2497,149 @@ inline __device__ void compute_attn_casual(const Params &params, const int bidb,
     // the attention matrix. This way, as long as we have the batch, head, and the location of
     // the 16 x 32 block within the attention matrix, we can generate the exact same dropout pattern.
 
+    const uint64_t start = tile_start_time(params);
     if(!Is_causal)
-        flash::compute_attn_1rowblock<Kernel_traits, Is_dropout, true/*Is_causal*/, Is_even_N, Is_even_K, Return_softmax>(params, blockIdx.y, blockIdx.z, m_block);
+        flash::compute_attn_1rowblock<Kernel_traits, Is_dropout, /*Is_causal=*/false, Is_even_N, Is_even_K, Return_softmax>(params, blockIdx.y, blockIdx.z, m_block);
     else
         flash::compute_attn_1rowblock_causal<Kernel_traits, Is_dropout, true/*Is_causal*/, Is_even_N, Is_even_K, Return_softmax>(params, bidb, bidh, m_block);
+    if (params.tile_trace != nullptr) {
+        const int trace_bidb = Is_causal ? bidb : blockIdx.y, trace_bidh = Is_causal ? bidh : blockIdx.z;
+        const int tile = (trace_bidb * params.h + trace_bidh) * gridDim.x + m_block;
+        __syncthreads();
+        record_tile(params, tile, trace_bidb, trace_bidh, m_block, /*worker=*/(blockIdx.z * gridDim.y + blockIdx.y) * gridDim.x + blockIdx.x, start);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Persistent version of the causal forward: each CTA keeps taking the next (batch, head, m_block)
+// tile off params.tile_count_semaphore until all b * h * num_m_block tiles are handed out.
+template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_even_N, bool Is_even_K, bool Return_softmax, typename Params>
+inline __device__ void compute_attn_causal_persistent(const Params &params) {
+    __shared__ int tile_idx_smem;
+    const Causal_fwd_tile_scheduler scheduler(params.b, params.h, cute::ceil_div(params.seqlen_q, Kernel_traits::kBlockM),
+                                              params.tile_plan, params.tile_plan == nullptr ? 0 : *params.num_planned_tiles);
+    while (true) {
+        if (threadIdx.x == 0) { tile_idx_smem = atomicAdd(params.tile_count_semaphore, 1); }
+        __syncthreads();
+        const int tile_idx = tile_idx_smem;
+        if (tile_idx >= scheduler.num_tiles()) { return; }
+        const Causal_fwd_tile_scheduler::Tile tile = scheduler.get_tile(tile_idx);
+        const uint64_t start = tile_start_time(params);
+        flash::compute_attn_1rowblock_causal<Kernel_traits, Is_dropout, true/*Is_causal*/, Is_even_N, Is_even_K, Return_softmax>(params, tile.bidb, tile.bidh, tile.m_block);
+        // The next tile reuses smem and tile_idx_smem.
+        __syncthreads();
+        record_tile(params, tile_idx, tile.bidb, tile.bidh, tile.m_block, /*worker=*/blockIdx.x, start);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Exclusive prefix sum of data[0, n) in place, by the kNThreads threads of the CTA.
+template<int kNThreads>
+inline __device__ void block_exclusive_scan(int *data, const int n, int *scan_smem) {
+    const int tidx = threadIdx.x;
+    int carry = 0;
+    for (int start = 0; start < n; start += kNThreads) {
+        const int i = start + tidx;
+        const int x = i < n ? data[i] : 0;
+        scan_smem[tidx] = x;
+        __syncthreads();
+        #pragma unroll
+        for (int offset = 1; offset < kNThreads; offset *= 2) {
+            const int y = tidx >= offset ? scan_smem[tidx - offset] : 0;
+            __syncthreads();
+            scan_smem[tidx] += y;
+            __syncthreads();
+        }
+        if (i < n) { data[i] = carry + scan_smem[tidx] - x; }
+        carry += scan_smem[kNThreads - 1];
+        __syncthreads();
+    }
+}
+
+// Device version of plan_varlen_causal_fwd, run by a single CTA ahead of the persistent causal
+// forward, into a buffer laid out as Varlen_causal_fwd_plan_layout. The row blocks are counting-
+// sorted by causal_fwd_plan_key: a histogram of the keys, its prefix sum, then the row blocks are
+// placed kNThreads at a time in (bidb, m_block) order, each one behind the row blocks with its key
+// placed before it, as the stable sort of the host does.
+template<int kNThreads>
+inline __device__ void plan_varlen_causal_fwd_device(const int *cu_seqlens_q, const int *cu_seqlens_k,
+                                                     const int kBlockM, const int kBlockN,
+                                                     const Varlen_causal_fwd_plan_layout layout, int *plan_buffer) {
+    __shared__ int scan_smem[kNThreads];
+    __shared__ int key_smem[kNThreads];
+    const int tidx = threadIdx.x;
+    const int b = layout.b, h = layout.h;
+    int *tile_plan = plan_buffer + layout.tile_plan_offset();
+    int *row_block_offsets = plan_buffer + layout.row_block_offsets_offset();
+    int *key_counts = plan_buffer + layout.key_counts_offset();
+
+    // The row blocks of sequence bidb are [row_block_offsets[bidb], row_block_offsets[bidb + 1]).
+    for (int bidb = tidx; bidb <= b; bidb += kNThreads) {
+        int num_m_block = 0;
+        if (bidb < b) {
+            const int seqlen_q = cu_seqlens_q[bidb + 1] - cu_seqlens_q[bidb];
+            const int seqlen_k = cu_seqlens_k[bidb + 1] - cu_seqlens_k[bidb];
+            if (seqlen_q > 0 && seqlen_k > 0) { num_m_block = cute::ceil_div(seqlen_q, kBlockM); }
+        }
+        row_block_offsets[bidb] = num_m_block;
+    }
+    for (int key = tidx; key < layout.num_keys; key += kNThreads) { key_counts[key] = 0; }
+    __syncthreads();
+    block_exclusive_scan<kNThreads>(row_block_offsets, b + 1, scan_smem);
+    const int num_row_blocks = row_block_offsets[b];
+
+    auto row_block = [&](const int r, int &bidb, int &m_block) {
+        // Last sequence whose first row block is at or before r, which can't be empty.
+        int lo = 0, hi = b;
+        while (hi - lo > 1) {
+            const int mid = (lo + hi) / 2;
+            if (row_block_offsets[mid] <= r) { lo = mid; } else { hi = mid; }
+        }
+        bidb = lo;
+        m_block = r - row_block_offsets[bidb];
+        const int seqlen_q = cu_seqlens_q[bidb + 1] - cu_seqlens_q[bidb];
+        const int seqlen_k = cu_seqlens_k[bidb + 1] - cu_seqlens_k[bidb];
+        return causal_fwd_plan_key(m_block, seqlen_q, seqlen_k, kBlockM, kBlockN, layout.max_cost);
+    };
+
+    for (int r = tidx; r < num_row_blocks; r += kNThreads) {
+        int bidb, m_block;
+        atomicAdd(&key_counts[row_block(r, bidb, m_block)], 1);
+    }
+    __syncthreads();
+    // key_counts[key] becomes the position of the next row block with that key.
+    block_exclusive_scan<kNThreads>(key_counts, layout.num_keys, scan_smem);
+
+    for (int start = 0; start < num_row_blocks; start += kNThreads) {
+        const int r = start + tidx;
+        int bidb = 0, m_block = 0, key = -1;
+        if (r < num_row_blocks) { key = row_block(r, bidb, m_block); }
+        key_smem[tidx] = key;
+        __syncthreads();
+        int rank = 0;
+        bool is_last = true;
+        for (int t = 0; t < kNThreads; ++t) {
+            if (key_smem[t] == key) {
+                if (t < tidx) { ++rank; } else if (t > tidx) { is_last = false; }
+            }
+        }
+        if (key >= 0) {
+            const int pos = key_counts[key] + rank;
+            for (int bidh = 0; bidh < h; ++bidh) {
+                int *tile = tile_plan + (int64_t(pos) * h + bidh) * 3;
+                tile[0] = bidb;
+                tile[1] = bidh;
+                tile[2] = m_block;
+            }
+        }
+        // Every thread has read its key's position before the last of each key moves it on.
+        __syncthreads();
+        if (key >= 0 && is_last) { key_counts[key] += rank + 1; }
+        __syncthreads();
+    }
+    if (tidx == 0) { plan_buffer[0] = num_row_blocks * h; }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
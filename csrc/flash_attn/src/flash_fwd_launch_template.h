@@ -5,10 +5,14 @@
 #pragma once
 
 #include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDACachingAllocator.h>
 
 #include "static_switch.h"
 #include "flash.h"
 #include "flash_fwd_kernel.h"
+#include "flash_fwd_tuning.h"
+#include "flash_launch_config.h"
+#include "flash_stream_pool.h"
 
 #include <cuda.h>
 #include <chrono>
@@ -398,9 +402,85 @@ __global__ void flash_fwd_kernel_casual(Flash_fwd_params params, const int bidb,
     flash::compute_attn_casual<Kernel_traits, Is_dropout, Is_causal, Is_even_N, Is_even_K, Return_softmax>(params, bidb, bidh);
 }
 
+template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_even_N, bool Is_even_K, bool Return_softmax>
+__global__ void flash_fwd_kernel_causal_persistent(Flash_fwd_params params) {
+    flash::compute_attn_causal_persistent<Kernel_traits, Is_dropout, Is_causal, Is_even_N, Is_even_K, Return_softmax>(params);
+}
+
+constexpr int kPlanVarlenCausalThreads = 512;
+
+template<int kBlockM, int kBlockN>
+__global__ void __launch_bounds__(kPlanVarlenCausalThreads)
+flash_fwd_plan_varlen_causal_kernel(const int *cu_seqlens_q, const int *cu_seqlens_k,
+                                    const flash::Varlen_causal_fwd_plan_layout layout, int *plan_buffer) {
+    flash::plan_varlen_causal_fwd_device<kPlanVarlenCausalThreads>(cu_seqlens_q, cu_seqlens_k, kBlockM, kBlockN, layout, plan_buffer);
+}
+
+template<typename Kernel_traits, bool Is_even_N, bool Is_even_K>
+__global__ void flash_fwd_splitkv_kernel(Flash_fwd_params params) {
+    flash::compute_attn_splitkv<Kernel_traits, Is_even_N, Is_even_K>(params);
+}
+
+template<typename Kernel_traits>
+__global__ void flash_fwd_splitkv_combine_kernel(Flash_fwd_params params) {
+    flash::combine_attn_seqk_parallel<Kernel_traits>(params);
+}
+
+template<typename Kernel_traits>
+__global__ void flash_fwd_merge_state_kernel(Flash_fwd_params params) {
+    flash::merge_attn_state<Kernel_traits>(params);
+}
+
+// Chunked / ring attention: merges the O and LSE of the forward into params.o_state_ptr /
+// params.softmax_lse_state_ptr, one CTA per row. Nothing to do without an incoming state.
+template<typename Kernel_traits>
+void run_flash_fwd_merge_state(Flash_fwd_params &params, cudaStream_t stream) {
+    if (params.o_state_ptr == nullptr) { return; }
+    flash_fwd_merge_state_kernel<Kernel_traits><<<params.b * params.h * params.seqlen_q, 128, 0, stream>>>(params);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// Split-KV forward: one CTA per (m_block, split, batch * head), then one CTA per row to combine.
+template<typename Kernel_traits>
+void run_flash_splitkv_fwd(Flash_fwd_params &params, cudaStream_t stream) {
+    constexpr size_t smem_size = Kernel_traits::kSmemSize;
+    const int num_m_block = (params.seqlen_q + Kernel_traits::kBlockM - 1) / Kernel_traits::kBlockM;
+    dim3 grid(num_m_block, params.num_splits, params.b * params.h);
+    const bool is_even_N = params.cu_seqlens_q == nullptr && params.cu_seqlens_k == nullptr && params.cache_seqlens == nullptr
+        && params.seqlen_k % Kernel_traits::kBlockN == 0;
+    const bool is_even_K = params.d == Kernel_traits::kHeadDim;
+    BOOL_SWITCH(is_even_N, IsEvenNConst, [&] {
+        BOOL_SWITCH(is_even_K, IsEvenKConst, [&] {
+            auto kernel = &flash_fwd_splitkv_kernel<Kernel_traits, IsEvenNConst, IsEvenKConst>;
+            int device;
+            const auto config = flash::get_launch_config(kernel, Kernel_traits::kNThreads, smem_size, device);
+            flash::report_launch<Kernel_traits>("flash_fwd_splitkv_kernel", device, config, grid.x, grid.y, grid.z);
+            kernel<<<grid, Kernel_traits::kNThreads, smem_size, stream>>>(params);
+            C10_CUDA_KERNEL_LAUNCH_CHECK();
+        });
+    });
+    flash_fwd_splitkv_combine_kernel<Kernel_traits><<<params.b * params.h * params.seqlen_q, 128, 0, stream>>>(params);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    run_flash_fwd_merge_state<Kernel_traits>(params, stream);
+}
+
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal>
 void run_flash_fwd(Flash_fwd_params &params, cudaStream_t stream) {
     constexpr size_t smem_size = Kernel_traits::kSmemSize;
+
+    // Offsets that could overflow 32 bits: the same kernels, with 64-bit offsets.
+    if constexpr (!std::is_same_v<typename Kernel_traits::index_t, int64_t>) {
+        if (params.is_index64) {
+            run_flash_fwd<typename Kernel_traits::Index64, Is_dropout, Is_causal>(params, stream);
+            return;
+        }
+    }
+
+    // mha_fwd only turns split-KV on without dropout and causal mask.
+    if (!Is_dropout && !Is_causal && params.num_splits > 1) {
+        run_flash_splitkv_fwd<Kernel_traits>(params, stream);
+        return;
+    }
     
     //printf("fuck you smem_size = %d\n", smem_size);
     //printf("y\n");
@@ -413,7 +493,8 @@ void run_flash_fwd(Flash_fwd_params &params, cudaStream_t stream) {
 
     // We also use is_even_N to set Unpadded in the BlockInfo constructor, so we need to check
     // for cu_seqlens_q as well.
-    const bool is_even_N = params.cu_seqlens_q == nullptr && params.cu_seqlens_k == nullptr && params.seqlen_k % Kernel_traits::kBlockN == 0;
+    const bool is_even_N = params.cu_seqlens_q == nullptr && params.cu_seqlens_k == nullptr && params.cache_seqlens == nullptr
+        && params.seqlen_k % Kernel_traits::kBlockN == 0;
     const bool is_even_K = params.d == Kernel_traits::kHeadDim;
     const bool return_softmax = params.p_ptr != nullptr;
     BOOL_SWITCH(is_even_N, IsEvenNConst, [&] {
@@ -423,63 +504,109 @@ void run_flash_fwd(Flash_fwd_params &params, cudaStream_t stream) {
                 /* auto kernel = &flash_fwd_kernel<Kernel_traits, Is_dropout, Is_causal, IsEvenNConst, IsEvenKConst, ReturnSoftmaxConst && Is_dropout>;
                 // auto kernel = &flash_fwd_kernel<Kernel_traits, Is_dropout, Is_causal, IsEvenNConst, true, ReturnSoftmaxConst && Is_dropout>;*/
                 if(Is_causal) {
+#ifdef FLASHATTENTION_CAUSAL_PER_HEAD_LAUNCH
+                    // One grid per (batch, head), e.g. to give each stream its own SM mask.
                     dim3 grid(num_m_block, 1, 1);
                     auto kernel = &flash_fwd_kernel_casual<Kernel_traits, Is_dropout, Is_causal, IsEvenNConst, IsEvenKConst, ReturnSoftmaxConst && Is_dropout>;
-                    int ctas_per_sm;
-                    if (smem_size >= 48 * 1024) {
-                       C10_CUDA_CHECK(cudaFuncSetAttribute(
-                           kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
-                    }
-                    cudaError status_ = cudaOccupancyMaxActiveBlocksPerMultiprocessor(
-                       &ctas_per_sm, kernel, Kernel_traits::kNThreads, smem_size);
-                    printf("smem_size = %d, CTAs per SM = %d\n", int(smem_size), ctas_per_sm);
+                    int device;
+                    const auto config = flash::get_launch_config(kernel, Kernel_traits::kNThreads, smem_size, device);
+                    flash::report_launch<Kernel_traits>("flash_fwd_kernel_casual", device, config, grid.x, params.b, params.h);
 
                     auto b = params.b;
                     auto h = params.h;
 
-                    cudaStream_t streams[7];
-                    uint64_t mask = 0x3fffffull;
-
-                    for(int i = 0; i < 7; i++) {
-                        cudaStreamCreate(&streams[i]);
-                        //libsmctrl_set_stream_mask(streams[i], ~mask);
-                        mask = ~mask;
-                    }
-
+                    // The launches are spread over the lanes of the device's stream pool, which fork
+                    // off and join back onto the caller's stream without blocking the host.
+                    auto fork = flash::Cuda_stream_pool::get().fork(stream, b * h);
                     for (int i = 0; i < b; i++) {
                         for (int j = 0; j < h; j++) {
                             //auto now = std::chrono::high_resolution_clock::now();
                             //auto duration = now.time_since_epoch();
                             //auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
                             //printf("start time of kernel(%d, %d) is %llu\n", i, j, nanoseconds);
-                            kernel<<<grid, Kernel_traits::kNThreads, smem_size, streams[(i*h+j)%7]>>>(params, i, j);
+                            fork.launch(i * h + j, [&](cudaStream_t lane) {
+                                //libsmctrl_set_stream_mask(lane, (i * h + j) % 2 ? 0x3fffffull : ~0x3fffffull);
+                                kernel<<<grid, Kernel_traits::kNThreads, smem_size, lane>>>(params, i, j);
+                            });
                         }
                     }
-
-                    for(int i = 0; i < 7; i++) {
-                        cudaStreamSynchronize(streams[i]);
-                        cudaStreamDestroy(streams[i]);
+                    fork.join();
+#else
+                    // A single launch of persistent CTAs that take (batch, head, m_block) tiles off
+                    // params.tile_count_semaphore, in the order of flash::Causal_fwd_tile_scheduler.
+                    auto kernel = &flash_fwd_kernel_causal_persistent<Kernel_traits, Is_dropout, Is_causal, IsEvenNConst, IsEvenKConst, ReturnSoftmaxConst && Is_dropout>;
+                    int device;
+                    const auto config = flash::get_launch_config(kernel, Kernel_traits::kNThreads, smem_size, device);
+
+                    // Varlen: the tiles are handed out in the order of a plan over the actual lengths,
+                    // built on the device from the cu_seqlens by one CTA queued ahead, so that neither
+                    // blocks the host and both can be captured in a CUDA graph. The grid is sized for
+                    // the bottom-up upper bound, the CTAs past the planned tiles return right away.
+                    // The buffer comes from the caching allocator on the current stream, which only
+                    // hands it out again to work queued after the forward.
+                    const int num_tiles = params.b * params.h * num_m_block;
+                    c10::DataPtr plan_buffer;
+                    if (params.plan_varlen_causal) {
+                        const flash::Varlen_causal_fwd_plan_layout layout(params.b, params.h, params.seqlen_q, params.seqlen_k,
+                                                                          Kernel_traits::kBlockM, Kernel_traits::kBlockN);
+                        plan_buffer = c10::cuda::CUDACachingAllocator::get()->allocate(layout.size() * sizeof(int));
+                        int *plan = static_cast<int *>(plan_buffer.get());
+                        flash_fwd_plan_varlen_causal_kernel<Kernel_traits::kBlockM, Kernel_traits::kBlockN>
+                            <<<1, kPlanVarlenCausalThreads, 0, stream>>>(params.cu_seqlens_q, params.cu_seqlens_k, layout, plan);
+                        C10_CUDA_KERNEL_LAUNCH_CHECK();
+                        params.tile_plan = plan + layout.tile_plan_offset();
+                        params.num_planned_tiles = plan;
                     }
+                    const int num_sms = at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+                    dim3 grid(std::max(std::min(num_tiles, num_sms * std::max(config.ctas_per_sm, 1)), 1));
+                    flash::report_launch<Kernel_traits>("flash_fwd_kernel_causal_persistent", device, config, grid.x);
+                    kernel<<<grid, Kernel_traits::kNThreads, smem_size, stream>>>(params);
+#endif
                 }
                 else {
                     dim3 grid(num_m_block, params.b, params.h);
                     auto kernel = &flash_fwd_kernel_casual<Kernel_traits, Is_dropout, Is_causal, IsEvenNConst, IsEvenKConst, ReturnSoftmaxConst && Is_dropout>;
-                    if (smem_size >= 48 * 1024) {
-                       C10_CUDA_CHECK(cudaFuncSetAttribute(
-                           kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
-                    }
-                    int ctas_per_sm;
-                    cudaError status_ = cudaOccupancyMaxActiveBlocksPerMultiprocessor(
-                       &ctas_per_sm, kernel, Kernel_traits::kNThreads, smem_size);
-                    printf("smem_size = %d, CTAs per SM = %d\n", int(smem_size), ctas_per_sm);
+                    int device;
+                    const auto config = flash::get_launch_config(kernel, Kernel_traits::kNThreads, smem_size, device);
+                    flash::report_launch<Kernel_traits>("flash_fwd_kernel_casual", device, config, grid.x, grid.y, grid.z);
                     kernel<<<grid, Kernel_traits::kNThreads, smem_size, stream>>>(params, 0, 0);
-					cudaStreamSynchronize(stream);
                 }
                 C10_CUDA_KERNEL_LAUNCH_CHECK();  
                 //printf("yyy\n");
             });
         });
     });
+    run_flash_fwd_merge_state<Kernel_traits>(params, stream);
+}
+
+// Autotuned dispatch: runs the candidate the tuning cache (flash::Fwd_tuning_dispatch) has for the
+// head dimension, dtype, causal mask and seqlen_k bucket, if it is one of Candidates and fits in
+// smem. Returns false to leave it to the default choice of run_mha_fwd_hdim*, e.g. without a cache.
+// Only the forward without dropout is tuned.
+template<bool Is_dropout, bool Is_causal, typename... Candidates>
+bool run_flash_fwd_tuned(Flash_fwd_params &params, cudaStream_t stream) {
+    if constexpr (Is_dropout) {
+        return false;
+    } else {
+        constexpr int Headdim = std::tuple_element_t<0, std::tuple<Candidates...>>::kHeadDim;
+        auto dprops = at::cuda::getCurrentDeviceProperties();
+        const auto candidate = flash::Fwd_tuning_dispatch::get().resolve(
+            {Headdim, params.is_bf16, Is_causal, flash::fwd_tuning_seqlen_bucket(params.seqlen_k)},
+            c10::cuda::current_device(), dprops->name);
+        if (!candidate.has_value()) { return false; }
+        bool launched = false;
+        auto launch = [&](auto *traits) {
+            using Kernel_traits = std::remove_pointer_t<decltype(traits)>;
+            const flash::Fwd_tuning_candidate traits_candidate{Kernel_traits::kBlockM, Kernel_traits::kBlockN, Kernel_traits::kNWarps,
+                                                               Kernel_traits::Is_Q_in_regs, Kernel_traits::Share_Q_K_smem};
+            if (launched || !(*candidate == traits_candidate)
+                || size_t(Kernel_traits::kSmemSize) > dprops->sharedMemPerBlockOptin) { return; }
+            run_flash_fwd<Kernel_traits, Is_dropout, Is_causal>(params, stream);
+            launched = true;
+        };
+        (launch(static_cast<Candidates *>(nullptr)), ...);
+        return launched;
+    }
 }
 
 template<typename T>
@@ -487,6 +614,11 @@ void run_mha_fwd_hdim32(Flash_fwd_params &params, cudaStream_t stream) {
     constexpr int Headdim = 32;
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 128, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 4, false, false, T>>(params, stream)) {
+                return;
+            }
             run_flash_fwd<Flash_fwd_kernel_traits<Headdim, 128, 128, 4, false, false, T>, Is_dropout, Is_causal>(params, stream);
         });
     });
@@ -497,6 +629,12 @@ void run_mha_fwd_hdim64(Flash_fwd_params &params, cudaStream_t stream) {
     constexpr int Headdim = 64;
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 128, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 4, true, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 4, true, true, T>>(params, stream)) {
+                return;
+            }
             if constexpr(!Is_dropout) {
                 // Using 8 warps is 18% slower for seqlen=2k, 2 warps is 5% slower
                 // Using block size (64 x 256) is 27% slower for seqlen=2k
@@ -521,6 +659,12 @@ void run_mha_fwd_hdim96(Flash_fwd_params &params, cudaStream_t stream) {
     bool is_sm8x = dprops->major == 8 && dprops->minor > 0;
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 4, true, false, T>>(params, stream)) {
+                return;
+            }
             // For sm86 or sm89, 64 x 64 is the fastest for causal (because it's square),
             if (is_sm8x) {
                 //if constexpr(!Is_causal) {
@@ -548,6 +692,13 @@ void run_mha_fwd_hdim128(Flash_fwd_params &params, cudaStream_t stream) {
     bool is_sm8x = dprops->major == 8 && dprops->minor > 0;
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 32, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 128, 4, false, false, T>>(params, stream)) {
+                return;
+            }
             if constexpr(!Is_dropout) {
                 // For sm86 or sm89, 64 x 64 is the fastest for causal (because it's square),
                 // and 128 x 32 (48 KB smem) is the fastest for non-causal since we get 2 CTAs per SM.
@@ -586,6 +737,13 @@ void run_mha_fwd_hdim160(Flash_fwd_params &params, cudaStream_t stream) {
     bool is_sm8x = dprops->major == 8 && dprops->minor > 0;
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 32, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 8, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 4, false, false, T>>(params, stream)) {
+                return;
+            }
             // For A100, H100, 128 x 32 is the fastest.
             // For sm86 or sm89, 64 x 64 is the fastest for causal (because it's square),
             // and 128 x 64 with 8 warps is the fastest for non-causal.
@@ -615,6 +773,13 @@ void run_mha_fwd_hdim192(Flash_fwd_params &params, cudaStream_t stream) {
     constexpr int Headdim = 192;
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 8, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 32, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 32, 8, false, false, T>>(params, stream)) {
+                return;
+            }
             if constexpr(!Is_dropout) {
                 run_flash_fwd<Flash_fwd_kernel_traits<Headdim, 128, 64, 8, false, false, T>, Is_dropout, Is_causal>(params, stream);
             } else {
@@ -640,6 +805,13 @@ void run_mha_fwd_hdim224(Flash_fwd_params &params, cudaStream_t stream) {
     // printf("max_smem_per_block = %d\n", max_smem_per_block);
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 8, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 32, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 32, 4, false, false, T>>(params, stream)) {
+                return;
+            }
             if (max_smem_per_block >= 2 * Headdim * (128 + 2 * 64)) {  // 112 KB
                 run_flash_fwd<Flash_fwd_kernel_traits<Headdim, 128, 64, 8, false, false, T>, Is_dropout, Is_causal>(params, stream);
             } else {
@@ -668,6 +840,13 @@ void run_mha_fwd_hdim256(Flash_fwd_params &params, cudaStream_t stream) {
     // printf("max_smem_per_sm = %d, max_smem_per_block = %d\n", max_smem_per_sm, max_smem_per_block);
     BOOL_SWITCH(params.p_dropout < 1.f, Is_dropout, [&] {
         BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            if (run_flash_fwd_tuned<Is_dropout, Is_causal,
+                    Flash_fwd_kernel_traits<Headdim, 128, 64, 8, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 64, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 64, 32, 4, false, false, T>,
+                    Flash_fwd_kernel_traits<Headdim, 128, 32, 8, false, false, T>>(params, stream)) {
+                return;
+            }
             // For A100, we want to run with 128 x 64 (128KB smem).
             // For H100 we want to run with 64 x 64 (96KB smem) since then we can get 2 CTAs per SM.
             if (max_smem_per_block >= 2 * Headdim * (128 + 2 * 64) && max_smem_per_sm < 4 * Headdim * (64 + 2 * 64)) {
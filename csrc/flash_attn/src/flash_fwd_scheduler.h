@@ -0,0 +1,393 @@
+/******************************************************************************
+ * Copyright (c) 2023, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <cutlass/cutlass.h>
+
+namespace flash {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Roles of a row block in compute_attn_1rowblock_causal. With half = num_m_block / 2, a producer
+// (bottom half) computes the left part of its row and publishes it, a consumer (top half) computes
+// its own row and the right part of the mirrored row block num_m_block - 1 - m_block, then merges
+// in what the producer published. The row blocks in between do their own row only.
+CUTLASS_HOST_DEVICE bool is_causal_producer(const int m_block, const int num_m_block) {
+    return m_block + 1 > num_m_block / 2 + 1;
+}
+
+CUTLASS_HOST_DEVICE bool is_causal_consumer(const int m_block, const int num_m_block) {
+    return m_block + 1 < (num_m_block + 1) / 2;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Sliding window (Flash_fwd_params::window_size_left / window_size_right, -1 for unbounded).
+// Key blocks [n_block_min, n_block_max) of the row block m_block that overlap the window of any of
+// its rows. When no key is in the window of any row, this is narrowed down to the last key block,
+// which is then fully masked: the kernels have one block to run and write out a zero O.
+CUTLASS_HOST_DEVICE void local_n_block_range(const int m_block, const int seqlen_q, const int seqlen_k,
+                                             const int kBlockM, const int kBlockN,
+                                             const int window_size_left, const int window_size_right,
+                                             int &n_block_min, int &n_block_max) {
+    n_block_max = (seqlen_k + kBlockN - 1) / kBlockN;
+    if (window_size_right >= 0) {
+        const int row_idx_max = std::min((m_block + 1) * kBlockM, seqlen_q);
+        n_block_max = std::min(n_block_max, (row_idx_max + window_size_right + kBlockN - 1) / kBlockN);
+    }
+    n_block_min = window_size_left < 0 ? 0 : std::max(0, (m_block * kBlockM - window_size_left) / kBlockN);
+    n_block_min = std::min(n_block_min, n_block_max - 1);
+}
+
+// Same for the backward: query blocks [m_block_min, m_block_max) of the column block n_block that
+// overlap the window. The range is empty when no query sees any of its keys.
+CUTLASS_HOST_DEVICE void local_m_block_range(const int n_block, const int seqlen_q, const int kBlockM, const int kBlockN,
+                                             const int window_size_left, const int window_size_right,
+                                             int &m_block_min, int &m_block_max) {
+    m_block_max = (seqlen_q + kBlockM - 1) / kBlockM;
+    if (window_size_left >= 0) {
+        m_block_max = std::min(m_block_max, ((n_block + 1) * kBlockN + window_size_left + kBlockM - 1) / kBlockM);
+    }
+    m_block_min = window_size_right < 0 ? 0 : std::max(0, (n_block * kBlockN - window_size_right) / kBlockM);
+}
+
+// Causal backward. Column block n_block sees the query blocks from its diagonal down, so the work of
+// the column blocks of a (batch, head) goes from num_m_block tiles down to one or two. Like the
+// forward pairs up its row blocks, the backward runs ceil_div(num_n_block, 2) CTAs, CTA cta taking
+// the column block cta (pair_idx 0) then its mirror num_n_block - 1 - cta (pair_idx 1), a long one
+// and a short one. With an odd count, the middle column block is on its own.
+CUTLASS_HOST_DEVICE int causal_bwd_num_ctas(const int num_n_block) {
+    return (num_n_block + 1) / 2;
+}
+
+CUTLASS_HOST_DEVICE int causal_bwd_n_block(const int cta, const int pair_idx, const int num_n_block) {
+    return pair_idx == 0 ? cta : num_n_block - 1 - cta;
+}
+
+// Query blocks of the causal column block n_block, the (kBlockM x kBlockN) tiles it computes.
+CUTLASS_HOST_DEVICE int causal_bwd_n_block_tiles(const int n_block, const int seqlen_q, const int seqlen_k,
+                                                 const int kBlockM, const int kBlockN) {
+    if (n_block * kBlockN >= seqlen_k) { return 0; }
+    const int num_m_block = (seqlen_q + kBlockM - 1) / kBlockM;
+    return std::max(0, num_m_block - n_block * kBlockN / kBlockM);
+}
+
+// Tiles of each CTA of one (batch, head) of the causal backward, with the column blocks paired up
+// or, as before the pairing, one per CTA.
+inline std::vector<int> causal_bwd_cta_tiles(const int seqlen_q, const int seqlen_k, const int kBlockM, const int kBlockN,
+                                             const bool paired) {
+    const int num_n_block = (seqlen_k + kBlockN - 1) / kBlockN;
+    std::vector<int> tiles;
+    for (int cta = 0; cta < (paired ? causal_bwd_num_ctas(num_n_block) : num_n_block); ++cta) {
+        int cta_tiles = causal_bwd_n_block_tiles(cta, seqlen_q, seqlen_k, kBlockM, kBlockN);
+        const int mirror = causal_bwd_n_block(cta, /*pair_idx=*/1, num_n_block);
+        if (paired && mirror != cta) { cta_tiles += causal_bwd_n_block_tiles(mirror, seqlen_q, seqlen_k, kBlockM, kBlockN); }
+        tiles.push_back(cta_tiles);
+    }
+    return tiles;
+}
+
+// Number of (kBlockM x kBlockN) tiles of one (batch, head) that the sliding window forward
+// computes, and of those it skips, out of the ceil_div(seqlen_q, kBlockM) x ceil_div(seqlen_k, kBlockN).
+inline std::pair<int64_t, int64_t> local_fwd_tile_count(const int seqlen_q, const int seqlen_k,
+                                                        const int kBlockM, const int kBlockN,
+                                                        const int window_size_left, const int window_size_right) {
+    const int num_m_block = (seqlen_q + kBlockM - 1) / kBlockM;
+    const int num_n_block = (seqlen_k + kBlockN - 1) / kBlockN;
+    int64_t computed = 0;
+    for (int m_block = 0; m_block < num_m_block && num_n_block > 0; ++m_block) {
+        int n_block_min, n_block_max;
+        local_n_block_range(m_block, seqlen_q, seqlen_k, kBlockM, kBlockN, window_size_left, window_size_right,
+                            n_block_min, n_block_max);
+        computed += n_block_max - n_block_min;
+    }
+    return {computed, int64_t(num_m_block) * num_n_block - computed};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Order in which the persistent causal forward hands out its (batch, head, m_block) tiles: the
+// tile_idx-th tile goes to whichever worker takes tile_idx off the atomic tile counter.
+// Row blocks are handed out bottom-up, with all (batch, head) pairs of one m_block next to each
+// other. This has two consequences:
+// - Every producer is handed out before its consumer, for any actual_seqlen_q <= seqlen_q. A
+//   consumer therefore only ever spins on a producer that is already running, and the handshake
+//   can't deadlock however many workers are resident.
+// - The producer / consumer halves of a (batch, head) are spread over all workers instead of
+//   queuing behind each other in one launch.
+// With a tile plan (see plan_varlen_causal_fwd), the tiles are taken from the plan instead.
+struct Causal_fwd_tile_scheduler {
+
+    struct Tile {
+        int bidb;
+        int bidh;
+        int m_block;
+    };
+
+    CUTLASS_HOST_DEVICE Causal_fwd_tile_scheduler(const int b, const int h, const int num_m_block,
+                                                  const int *tile_plan=nullptr, const int num_planned_tiles=0)
+        : b(b), h(h), num_m_block(num_m_block), tile_plan(tile_plan), num_planned_tiles(num_planned_tiles) {}
+
+    CUTLASS_HOST_DEVICE int num_tiles() const {
+        return tile_plan == nullptr ? b * h * num_m_block : num_planned_tiles;
+    }
+
+    CUTLASS_HOST_DEVICE Tile get_tile(const int tile_idx) const {
+        if (tile_plan != nullptr) {
+            return {tile_plan[3 * tile_idx], tile_plan[3 * tile_idx + 1], tile_plan[3 * tile_idx + 2]};
+        }
+        const int bh = tile_idx % (b * h);
+        return {bh / h, bh % h, num_m_block - 1 - tile_idx / (b * h)};
+    }
+
+    const int b;
+    const int h;
+    const int num_m_block;
+    // (num_planned_tiles, 3) array of (bidb, bidh, m_block).
+    const int *tile_plan;
+    const int num_planned_tiles;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Work of one row block in kBlockM x kBlockN steps, following the loops of
+// compute_attn_1rowblock_causal: steps before the handshake and steps after it.
+CUTLASS_HOST_DEVICE void causal_fwd_tile_steps(const int m_block, const int seqlen_q, const int seqlen_k,
+                                               const int kBlockM, const int kBlockN,
+                                               int &steps_before, int &steps_after) {
+    steps_before = steps_after = 0;
+    if (m_block * kBlockM >= seqlen_q || seqlen_k == 0) { return; }
+    const int num_m_block = (seqlen_q + kBlockM - 1) / kBlockM;
+    const int num_n_block = (seqlen_k + kBlockN - 1) / kBlockN;
+    const int n_block_max = std::min(num_n_block, ((m_block + 1) * kBlockM + kBlockN - 1) / kBlockN);
+    const int dst = (kBlockM + kBlockN - 1) / kBlockN * (num_m_block / 2 + 1);
+    if (is_causal_producer(m_block, num_m_block)) {
+        steps_before = std::min(dst, n_block_max);
+    } else if (is_causal_consumer(m_block, num_m_block)) {
+        const int n_block_max_reverse = std::min(num_n_block, ((num_m_block - m_block) * kBlockM + kBlockN - 1) / kBlockN);
+        steps_before = n_block_max + std::max(n_block_max_reverse - dst, 0);
+        // The merge of the two halves costs about as much as one more step.
+        steps_after = 1;
+    } else {
+        steps_before = n_block_max;
+    }
+}
+
+// Tile plan of the varlen causal forward, in the format of Causal_fwd_tile_scheduler::tile_plan.
+// The bottom-up order balances the work when all sequences have the same length. With mixed
+// lengths, the heavy consumers of the long sequences (their small m_blocks) are handed out last,
+// behind the row blocks of all the short sequences, and the tiles past the end of the short
+// sequences are handed out for nothing. The plan instead reads the actual lengths off the
+// cu_seqlens, leaves out the empty tiles and orders the others globally, across sequences:
+// - all producers first, so that the consumers don't wait on them;
+// - then the consumers and the row blocks on their own.
+// Both groups are handed out longest first, so that the short row blocks of any sequence fill in
+// behind the long ones of the others (longest processing time first list scheduling). The heads of
+// a row block stay next to each other.
+// The CUDA launch builds the plan on the device (plan_varlen_causal_fwd_device in flash_fwd_kernel.h),
+// the CPU backend and the host-side model on the host (plan_varlen_causal_fwd). Both sort the row
+// blocks stably by causal_fwd_plan_key, in (bidb, m_block) order for equal keys, so the plans match.
+
+// No row block costs more than a consumer with the whole mirrored row left over, plus the merge.
+CUTLASS_HOST_DEVICE int causal_fwd_plan_max_cost(const int max_seqlen_k, const int kBlockN) {
+    return 2 * ((max_seqlen_k + kBlockN - 1) / kBlockN) + 1;
+}
+
+// Keys are in [0, causal_fwd_plan_num_keys): producers, then the others, each by decreasing cost.
+CUTLASS_HOST_DEVICE int causal_fwd_plan_num_keys(const int max_seqlen_k, const int kBlockN) {
+    return 2 * (causal_fwd_plan_max_cost(max_seqlen_k, kBlockN) + 1);
+}
+
+CUTLASS_HOST_DEVICE int causal_fwd_plan_key(const int m_block, const int seqlen_q, const int seqlen_k,
+                                            const int kBlockM, const int kBlockN, const int max_cost) {
+    int steps_before, steps_after;
+    causal_fwd_tile_steps(m_block, seqlen_q, seqlen_k, kBlockM, kBlockN, steps_before, steps_after);
+    const int cost = steps_before + steps_after;
+    const int num_m_block = (seqlen_q + kBlockM - 1) / kBlockM;
+    return is_causal_producer(m_block, num_m_block) ? max_cost - cost : 2 * max_cost + 1 - cost;
+}
+
+// Int buffer of the device plan, sized for max_seqlen_q / max_seqlen_k and the block sizes of the
+// kernel: the number of planned tiles, the plan, then the scratch of the planner (the first row
+// block of each sequence, then one counter per key).
+struct Varlen_causal_fwd_plan_layout {
+
+    CUTLASS_HOST_DEVICE Varlen_causal_fwd_plan_layout(const int b, const int h, const int max_seqlen_q, const int max_seqlen_k,
+                                                      const int kBlockM, const int kBlockN)
+        : b(b), h(h), max_num_m_block((max_seqlen_q + kBlockM - 1) / kBlockM),
+          max_cost(causal_fwd_plan_max_cost(max_seqlen_k, kBlockN)),
+          num_keys(causal_fwd_plan_num_keys(max_seqlen_k, kBlockN)) {}
+
+    CUTLASS_HOST_DEVICE int64_t tile_plan_offset() const { return 1; }
+    CUTLASS_HOST_DEVICE int64_t row_block_offsets_offset() const {
+        return tile_plan_offset() + int64_t(b) * h * max_num_m_block * 3;
+    }
+    CUTLASS_HOST_DEVICE int64_t key_counts_offset() const { return row_block_offsets_offset() + b + 1; }
+    CUTLASS_HOST_DEVICE int64_t size() const { return key_counts_offset() + num_keys; }
+
+    int b;
+    int h;
+    int max_num_m_block;
+    int max_cost;
+    int num_keys;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host-side model of the causal dispatch, used to unit-test and benchmark the policy without a GPU.
+
+// Work of one row block in kBlockM x kBlockN steps: {steps before the handshake, steps after it}.
+inline std::pair<int, int> causal_fwd_tile_cost(const int m_block, const int seqlen_q, const int seqlen_k,
+                                                const int kBlockM, const int kBlockN) {
+    int steps_before, steps_after;
+    causal_fwd_tile_steps(m_block, seqlen_q, seqlen_k, kBlockM, kBlockN, steps_before, steps_after);
+    return {steps_before, steps_after};
+}
+
+inline std::vector<int> plan_varlen_causal_fwd(const int *cu_seqlens_q, const int *cu_seqlens_k,
+                                               const int b, const int h, const int kBlockM, const int kBlockN) {
+    struct Row_block {
+        int key;
+        int bidb;
+        int m_block;
+    };
+    int max_seqlen_k = 0;
+    for (int bidb = 0; bidb < b; ++bidb) { max_seqlen_k = std::max(max_seqlen_k, cu_seqlens_k[bidb + 1] - cu_seqlens_k[bidb]); }
+    const int max_cost = causal_fwd_plan_max_cost(max_seqlen_k, kBlockN);
+    std::vector<Row_block> row_blocks;
+    for (int bidb = 0; bidb < b; ++bidb) {
+        const int seqlen_q = cu_seqlens_q[bidb + 1] - cu_seqlens_q[bidb];
+        const int seqlen_k = cu_seqlens_k[bidb + 1] - cu_seqlens_k[bidb];
+        if (seqlen_q <= 0 || seqlen_k <= 0) { continue; }
+        const int num_m_block = (seqlen_q + kBlockM - 1) / kBlockM;
+        for (int m_block = 0; m_block < num_m_block; ++m_block) {
+            row_blocks.push_back({causal_fwd_plan_key(m_block, seqlen_q, seqlen_k, kBlockM, kBlockN, max_cost), bidb, m_block});
+        }
+    }
+    std::stable_sort(row_blocks.begin(), row_blocks.end(), [](const Row_block &a, const Row_block &b) {
+        return a.key < b.key;
+    });
+    std::vector<int> tile_plan;
+    tile_plan.reserve(row_blocks.size() * h * 3);
+    for (const Row_block &row_block : row_blocks) {
+        for (int bidh = 0; bidh < h; ++bidh) {
+            tile_plan.insert(tile_plan.end(), {row_block.bidb, bidh, row_block.m_block});
+        }
+    }
+    return tile_plan;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Tile_dispatch {
+    int worker;
+    int bidb;
+    int bidh;
+    int m_block;
+    int64_t start;
+    int64_t end;
+};
+
+// Replays the dispatch of the causal tiles, in the given order, on num_workers resident CTAs. Idle
+// workers take the next tile, and a consumer can't finish before its producer has published.
+// cu_seqlens_q / cu_seqlens_k give the actual lengths of the b sequences.
+inline std::vector<Tile_dispatch> simulate_causal_fwd_tiles(const std::vector<Causal_fwd_tile_scheduler::Tile> &tiles,
+                                                            const int *cu_seqlens_q, const int *cu_seqlens_k,
+                                                            const int b, const int h,
+                                                            const int kBlockM, const int kBlockN,
+                                                            const int num_workers) {
+    int max_num_m_block = 0;
+    for (int bidb = 0; bidb < b; ++bidb) {
+        max_num_m_block = std::max(max_num_m_block, (cu_seqlens_q[bidb + 1] - cu_seqlens_q[bidb] + kBlockM - 1) / kBlockM);
+    }
+    std::vector<Tile_dispatch> dispatches;
+    dispatches.reserve(tiles.size());
+    // Time at which the producer of row block m_block of (bidb, bidh) has published.
+    std::vector<int64_t> published(int64_t(b) * h * max_num_m_block, -1);
+    using Worker = std::pair<int64_t, int>;  // (free at, worker id)
+    std::priority_queue<Worker, std::vector<Worker>, std::greater<Worker>> workers;
+    for (int w = 0; w < std::max(num_workers, 1); ++w) { workers.push({0, w}); }
+
+    for (const auto &tile : tiles) {
+        const Worker worker = workers.top();
+        workers.pop();
+        const int seqlen_q = cu_seqlens_q[tile.bidb + 1] - cu_seqlens_q[tile.bidb];
+        const int seqlen_k = cu_seqlens_k[tile.bidb + 1] - cu_seqlens_k[tile.bidb];
+        const int num_m_block = (seqlen_q + kBlockM - 1) / kBlockM;
+        const auto cost = causal_fwd_tile_cost(tile.m_block, seqlen_q, seqlen_k, kBlockM, kBlockN);
+        const int64_t start = worker.first;
+        int64_t end = start + cost.first;
+        const int64_t bh_offset = (int64_t(tile.bidb) * h + tile.bidh) * max_num_m_block;
+        if (tile.m_block < num_m_block && seqlen_k > 0) {
+            if (is_causal_producer(tile.m_block, num_m_block)) {
+                published[bh_offset + tile.m_block] = end;
+            } else if (is_causal_consumer(tile.m_block, num_m_block)) {
+                // The tile orders hand out producers first, so the producer has been placed already.
+                end = std::max(end, published[bh_offset + num_m_block - 1 - tile.m_block]) + cost.second;
+            }
+        }
+        dispatches.push_back({worker.second, tile.bidb, tile.bidh, tile.m_block, start, end});
+        workers.push({end, worker.second});
+    }
+    return dispatches;
+}
+
+// Dispatch of a causal forward with b sequences of the same length.
+// per_head_launch models the previous launcher instead, one grid per (batch, head) handing out
+// its row blocks bottom-up, with the grids queued one after another.
+inline std::vector<Tile_dispatch> simulate_causal_fwd_schedule(const int b, const int h,
+                                                               const int seqlen_q, const int seqlen_k,
+                                                               const int kBlockM, const int kBlockN,
+                                                               const int num_workers,
+                                                               const bool per_head_launch=false) {
+    const int num_m_block = (seqlen_q + kBlockM - 1) / kBlockM;
+    const Causal_fwd_tile_scheduler scheduler(b, h, num_m_block);
+    std::vector<Causal_fwd_tile_scheduler::Tile> tiles;
+    tiles.reserve(scheduler.num_tiles());
+    for (int tile_idx = 0; tile_idx < scheduler.num_tiles(); ++tile_idx) {
+        if (per_head_launch) {
+            const int bh = tile_idx / num_m_block;
+            tiles.push_back({bh / h, bh % h, num_m_block - 1 - tile_idx % num_m_block});
+        } else {
+            tiles.push_back(scheduler.get_tile(tile_idx));
+        }
+    }
+    std::vector<int> cu_seqlens_q(b + 1), cu_seqlens_k(b + 1);
+    for (int bidb = 0; bidb <= b; ++bidb) {
+        cu_seqlens_q[bidb] = bidb * seqlen_q;
+        cu_seqlens_k[bidb] = bidb * seqlen_k;
+    }
+    return simulate_causal_fwd_tiles(tiles, cu_seqlens_q.data(), cu_seqlens_k.data(), b, h, kBlockM, kBlockN, num_workers);
+}
+
+// Dispatch of a varlen causal forward, either in the bottom-up order over max_seqlen_q or with the
+// tile plan of plan_varlen_causal_fwd.
+inline std::vector<Tile_dispatch> simulate_varlen_causal_fwd_schedule(const int *cu_seqlens_q, const int *cu_seqlens_k,
+                                                                      const int b, const int h,
+                                                                      const int kBlockM, const int kBlockN,
+                                                                      const int num_workers, const bool planned) {
+    std::vector<Causal_fwd_tile_scheduler::Tile> tiles;
+    if (planned) {
+        const std::vector<int> tile_plan = plan_varlen_causal_fwd(cu_seqlens_q, cu_seqlens_k, b, h, kBlockM, kBlockN);
+        for (size_t i = 0; i < tile_plan.size(); i += 3) { tiles.push_back({tile_plan[i], tile_plan[i + 1], tile_plan[i + 2]}); }
+    } else {
+        int max_seqlen_q = 0;
+        for (int bidb = 0; bidb < b; ++bidb) { max_seqlen_q = std::max(max_seqlen_q, cu_seqlens_q[bidb + 1] - cu_seqlens_q[bidb]); }
+        const Causal_fwd_tile_scheduler scheduler(b, h, (max_seqlen_q + kBlockM - 1) / kBlockM);
+        for (int tile_idx = 0; tile_idx < scheduler.num_tiles(); ++tile_idx) { tiles.push_back(scheduler.get_tile(tile_idx)); }
+    }
+    return simulate_causal_fwd_tiles(tiles, cu_seqlens_q, cu_seqlens_k, b, h, kBlockM, kBlockN, num_workers);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace flash
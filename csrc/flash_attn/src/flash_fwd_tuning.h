@@ -0,0 +1,295 @@
+/******************************************************************************
+ * Copyright (c) 2023, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace flash {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A Flash_fwd_kernel_traits choice of run_mha_fwd_hdim*, named like "128x64x4" (kBlockM x kBlockN x
+// kNWarps) with a "_qregs" / "_shareqk" suffix for Is_Q_in_regs / Share_Q_K_smem.
+struct Fwd_tuning_candidate {
+    int block_m, block_n, num_warps;
+    bool is_q_in_regs, share_q_k_smem;
+
+    // Same as Flash_fwd_kernel_traits::kSmemSize for 16-bit elements.
+    int smem_size(const int hdim) const {
+        const int smem_q = block_m * hdim * 2, smem_kv = 2 * block_n * hdim * 2;
+        return share_q_k_smem ? std::max(smem_q, smem_kv) : smem_q + smem_kv;
+    }
+
+    bool operator==(const Fwd_tuning_candidate &other) const {
+        return block_m == other.block_m && block_n == other.block_n && num_warps == other.num_warps
+            && is_q_in_regs == other.is_q_in_regs && share_q_k_smem == other.share_q_k_smem;
+    }
+
+    std::string name() const {
+        std::string name = std::to_string(block_m) + "x" + std::to_string(block_n) + "x" + std::to_string(num_warps);
+        if (share_q_k_smem) { return name + "_shareqk"; }
+        return is_q_in_regs ? name + "_qregs" : name;
+    }
+};
+
+// The candidates of the forward without dropout, the default choice first. These must be the ones
+// run_mha_fwd_hdim* lists in its run_flash_fwd_tuned call, in flash_fwd_launch_template.h.
+inline std::vector<Fwd_tuning_candidate> fwd_tuning_candidates(const int hdim) {
+    switch (hdim) {
+        case 32: return {{128, 128, 4, false, false}, {128, 64, 4, false, false}};
+        case 64: return {{128, 128, 4, false, false}, {128, 64, 4, true, false}, {128, 64, 4, true, true}};
+        case 96: return {{128, 64, 4, false, false}, {64, 64, 4, false, false}, {128, 64, 4, true, false}};
+        case 128: return {{128, 64, 4, false, false}, {64, 64, 4, false, false}, {128, 32, 4, false, false}, {64, 128, 4, false, false}};
+        case 160: return {{128, 32, 4, false, false}, {64, 64, 4, false, false}, {128, 64, 8, false, false}, {128, 64, 4, false, false}};
+        case 192: return {{128, 64, 8, false, false}, {64, 64, 4, false, false}, {64, 32, 4, false, false}, {128, 32, 8, false, false}};
+        case 224: return {{128, 64, 8, false, false}, {64, 64, 4, false, false}, {128, 32, 4, false, false}, {64, 32, 4, false, false}};
+        case 256: return {{128, 64, 8, false, false}, {64, 64, 4, false, false}, {64, 32, 4, false, false}, {128, 32, 8, false, false}};
+        default: return {};
+    }
+}
+
+// Keys are tuned per power of two of seqlen_k, from 128 to 64k.
+inline int fwd_tuning_seqlen_bucket(const int seqlen_k) {
+    int bucket = 128;
+    while (bucket < seqlen_k && bucket < 65536) { bucket *= 2; }
+    return bucket;
+}
+
+struct Fwd_tuning_key {
+    int hdim;
+    bool is_bf16;
+    bool is_causal;
+    int seqlen_bucket;
+
+    std::tuple<int, bool, bool, int> as_tuple() const { return {hdim, is_bf16, is_causal, seqlen_bucket}; }
+    bool operator<(const Fwd_tuning_key &other) const { return as_tuple() < other.as_tuple(); }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Winning candidate of each key, as timed on one device. On disk, a text file of
+//   flash_attn_fwd_tuning <version>
+//   device <device name>
+//   <hdim> <fp16|bf16> <causal|noncausal> <seqlen bucket> <candidate> <time in ms>
+// A file of another version or of another device is ignored, and so is an entry naming a candidate
+// that's no longer in fwd_tuning_candidates.
+class Fwd_tuning_cache {
+public:
+    static constexpr int kVersion = 1;
+
+    struct Entry {
+        std::string candidate;
+        float time_ms;
+    };
+
+    Fwd_tuning_cache() = default;
+    explicit Fwd_tuning_cache(std::string device) : device_(std::move(device)) {}
+
+    const std::string &device() const { return device_; }
+    const std::map<Fwd_tuning_key, Entry> &entries() const { return entries_; }
+
+    void set(const Fwd_tuning_key &key, const std::string &candidate, const float time_ms) {
+        entries_[key] = Entry{candidate, time_ms};
+    }
+
+    // The candidate of the key, or of the closest seqlen bucket tuned for its (hdim, dtype, causal).
+    // nullptr if there's none, dispatch then keeps its default.
+    const std::string *lookup(const Fwd_tuning_key &key) const {
+        const std::string *best = nullptr;
+        int best_distance = std::numeric_limits<int>::max();
+        for (auto it = entries_.lower_bound({key.hdim, key.is_bf16, key.is_causal, 0});
+             it != entries_.end() && it->first.hdim == key.hdim && it->first.is_bf16 == key.is_bf16
+                 && it->first.is_causal == key.is_causal;
+             ++it) {
+            const int distance = std::abs(int(std::lround(std::log2(double(it->first.seqlen_bucket) / key.seqlen_bucket))));
+            if (distance < best_distance) {
+                best = &it->second.candidate;
+                best_distance = distance;
+            }
+        }
+        return best;
+    }
+
+    bool save(const std::string &path) const {
+        std::ofstream file(path);
+        if (!file) { return false; }
+        file << "flash_attn_fwd_tuning " << kVersion << "\n" << "device " << device_ << "\n";
+        for (const auto &[key, entry] : entries_) {
+            file << key.hdim << " " << (key.is_bf16 ? "bf16" : "fp16") << " " << (key.is_causal ? "causal" : "noncausal")
+                 << " " << key.seqlen_bucket << " " << entry.candidate << " " << entry.time_ms << "\n";
+        }
+        return bool(file);
+    }
+
+    // Replaces the entries with the ones of the file. False, and no entries, if it can't be read or
+    // is not of this version and device.
+    bool load(const std::string &path, const std::string &device) {
+        entries_.clear();
+        device_ = device;
+        std::ifstream file(path);
+        std::string line, magic;
+        int version = 0;
+        if (!std::getline(file, line)) { return false; }
+        std::istringstream(line) >> magic >> version;
+        if (magic != "flash_attn_fwd_tuning" || version != kVersion) { return false; }
+        if (!std::getline(file, line) || line.rfind("device ", 0) != 0 || line.substr(7) != device) { return false; }
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            Fwd_tuning_key key;
+            std::string dtype, causal;
+            Entry entry;
+            if (!(fields >> key.hdim >> dtype >> causal >> key.seqlen_bucket >> entry.candidate >> entry.time_ms)) { continue; }
+            key.is_bf16 = dtype == "bf16";
+            key.is_causal = causal == "causal";
+            bool known = false;
+            for (const auto &candidate : fwd_tuning_candidates(key.hdim)) { known = known || candidate.name() == entry.candidate; }
+            if (known) { entries_[key] = entry; }
+        }
+        return true;
+    }
+
+private:
+    std::string device_;
+    std::map<Fwd_tuning_key, Entry> entries_;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The tuning driver: times every candidate of every key, best of `repeats` runs of timer(key,
+// candidate) in ms, and keeps the fastest in the cache. timer returns +inf for a candidate that
+// can't run (e.g. not enough smem). Keys without a candidate that ran are left out.
+inline void fwd_autotune(Fwd_tuning_cache &cache, const std::vector<Fwd_tuning_key> &keys, const int repeats,
+                         const std::function<float(const Fwd_tuning_key &, const Fwd_tuning_candidate &)> &timer) {
+    for (const auto &key : keys) {
+        const Fwd_tuning_candidate *best = nullptr;
+        float best_ms = std::numeric_limits<float>::infinity();
+        const auto candidates = fwd_tuning_candidates(key.hdim);
+        for (const auto &candidate : candidates) {
+            float ms = std::numeric_limits<float>::infinity();
+            for (int i = 0; i < repeats; ++i) { ms = std::min(ms, timer(key, candidate)); }
+            if (ms < best_ms) {
+                best = &candidate;
+                best_ms = ms;
+            }
+        }
+        if (best != nullptr) { cache.set(key, best->name(), best_ms); }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The cache dispatch reads from. Loaded once, on the first forward, from the file in the environment
+// variable FLASH_ATTENTION_TUNING_CACHE, for the device of that forward. The tuning driver can also
+// install a fresh one with set(). While a candidate is forced on a thread (Fwd_tuning_force), the
+// lookups of that thread return it.
+// The forwards go through resolve(), which keeps the candidate of each (device, key) it looked up in a
+// per-thread table, so that only the first forward of a key on a thread takes the lock. set() bumps a
+// generation that empties these tables.
+class Fwd_tuning_dispatch {
+public:
+    static Fwd_tuning_dispatch &get() {
+        static Fwd_tuning_dispatch dispatch;
+        return dispatch;
+    }
+
+    // The candidate name dispatch should run for the key on the device, empty for the default.
+    std::string lookup(const Fwd_tuning_key &key, const std::string &device) {
+        if (!forced().empty()) { return forced(); }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!loaded_) {
+            loaded_ = true;
+            const char *path = std::getenv("FLASH_ATTENTION_TUNING_CACHE");
+            if (path != nullptr) { cache_.load(path, device); }
+        }
+        if (cache_.device() != device) { return {}; }
+        const std::string *candidate = cache_.lookup(key);
+        return candidate == nullptr ? std::string() : *candidate;
+    }
+
+    // The candidate of lookup() for the forward of the key on the device device_index, named
+    // device_name, nullopt for the default.
+    std::optional<Fwd_tuning_candidate> resolve(const Fwd_tuning_key &key, const int device_index, const char *device_name) {
+        if (!forced().empty()) { return find_candidate(key.hdim, forced()); }
+        Resolved &resolved = resolved_of_thread();
+        // Read before the lookup: a set() in between leaves the table one generation behind, to be
+        // emptied by the next call.
+        const uint64_t generation = generation_.load(std::memory_order_acquire);
+        if (resolved.generation != generation) {
+            resolved.generation = generation;
+            resolved.candidates.clear();
+        }
+        const auto resolved_key = std::make_pair(device_index, key);
+        auto it = resolved.candidates.find(resolved_key);
+        if (it == resolved.candidates.end()) {
+            it = resolved.candidates.emplace(resolved_key, find_candidate(key.hdim, lookup(key, device_name))).first;
+        }
+        return it->second;
+    }
+
+    void set(Fwd_tuning_cache cache) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_ = std::move(cache);
+        loaded_ = true;
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+
+    // For the calling thread only.
+    void force(std::string candidate) { forced() = std::move(candidate); }
+
+private:
+    struct Resolved {
+        uint64_t generation = 0;
+        std::map<std::pair<int, Fwd_tuning_key>, std::optional<Fwd_tuning_candidate>> candidates;
+    };
+
+    Fwd_tuning_dispatch() = default;
+
+    static std::string &forced() {
+        thread_local std::string forced;
+        return forced;
+    }
+
+    static Resolved &resolved_of_thread() {
+        thread_local Resolved resolved;
+        return resolved;
+    }
+
+    static std::optional<Fwd_tuning_candidate> find_candidate(const int hdim, const std::string &name) {
+        if (name.empty()) { return std::nullopt; }
+        for (const auto &candidate : fwd_tuning_candidates(hdim)) {
+            if (candidate.name() == name) { return candidate; }
+        }
+        return std::nullopt;
+    }
+
+    std::mutex mutex_;
+    bool loaded_ = false;
+    Fwd_tuning_cache cache_;
+    std::atomic<uint64_t> generation_{1};
+};
+
+// Forces the dispatch of the calling thread to a candidate for the scope, to time it.
+struct Fwd_tuning_force {
+    explicit Fwd_tuning_force(const std::string &candidate) { Fwd_tuning_dispatch::get().force(candidate); }
+    ~Fwd_tuning_force() { Fwd_tuning_dispatch::get().force({}); }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace flash
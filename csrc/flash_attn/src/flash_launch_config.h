@@ -0,0 +1,150 @@
+/******************************************************************************
+ * Copyright (c) 2023, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#if defined(__CUDACC__)
+#include <cuda_runtime_api.h>
+#include <c10/cuda/CUDAException.h>
+#endif
+
+namespace flash {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// What a kernel instantiation needs set up before it's launched on a device: its dynamic smem, and
+// the CTAs per SM that leaves room for.
+struct Launch_config {
+    int smem_size = 0;
+    int ctas_per_sm = 0;
+    bool cache_hit = false;  // Whether it came from Launch_config_cache, rather than being computed.
+};
+
+// One launch, as reported to the telemetry hook. Device -1 is the CPU backend: its grid is the
+// number of tasks (of workers for the causal forward), its smem the workspace of a task, and a
+// worker runs one task at a time.
+struct Launch_telemetry {
+    std::string kernel;
+    int device;
+    int head_dim, block_m, block_n, num_threads;
+    int smem_size, ctas_per_sm;
+    int grid_x, grid_y, grid_z;
+    bool cache_hit;
+};
+
+// Launch configs by kernel instantiation and device, computed the first time that kernel is
+// launched on that device (cudaFuncSetAttribute then the occupancy query), so that later launches
+// only pay a lookup. Also holds the opt-in telemetry hook, called on every launch while it's set.
+class Launch_config_cache {
+public:
+    static Launch_config_cache &get() {
+        static Launch_config_cache cache;
+        return cache;
+    }
+
+    template<typename Compute>
+    Launch_config get_or_compute(const void *kernel, const int device, Compute &&compute) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = configs_.find({kernel, device});
+        if (it != configs_.end()) {
+            ++hits_;
+            Launch_config config = it->second;
+            config.cache_hit = true;
+            return config;
+        }
+        ++misses_;
+        Launch_config config = compute();
+        config.cache_hit = false;
+        configs_.emplace(std::make_pair(kernel, device), config);
+        return config;
+    }
+
+    // (hits, misses) since the last clear().
+    std::pair<int64_t, int64_t> stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {hits_, misses_};
+    }
+
+    // Forgets the configs, the next launch of every kernel computes its config again.
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        configs_.clear();
+        hits_ = misses_ = 0;
+    }
+
+    // An empty hook turns the telemetry off, which is the default.
+    void set_telemetry_hook(std::function<void(const Launch_telemetry &)> hook) {
+        std::lock_guard<std::mutex> lock(hook_mutex_);
+        hook_ = hook ? std::make_shared<std::function<void(const Launch_telemetry &)>>(std::move(hook)) : nullptr;
+        telemetry_enabled_.store(hook_ != nullptr, std::memory_order_release);
+    }
+
+    bool telemetry_enabled() const { return telemetry_enabled_.load(std::memory_order_acquire); }
+
+    // The hook runs outside of the lock, so it may launch or change the hook itself.
+    void report(const Launch_telemetry &telemetry) {
+        std::shared_ptr<std::function<void(const Launch_telemetry &)>> hook;
+        {
+            std::lock_guard<std::mutex> lock(hook_mutex_);
+            hook = hook_;
+        }
+        if (hook) { (*hook)(telemetry); }
+    }
+
+private:
+    Launch_config_cache() = default;
+
+    std::mutex mutex_;
+    std::map<std::pair<const void *, int>, Launch_config> configs_;
+    int64_t hits_ = 0, misses_ = 0;
+
+    std::mutex hook_mutex_;
+    std::shared_ptr<std::function<void(const Launch_telemetry &)>> hook_;
+    std::atomic<bool> telemetry_enabled_{false};
+};
+
+// Reports a launch of a kernel of Kernel_traits to the telemetry hook, if there's one.
+template<typename Kernel_traits>
+void report_launch(const char *kernel, const int device, const Launch_config &config,
+                   const int grid_x, const int grid_y = 1, const int grid_z = 1) {
+    auto &cache = Launch_config_cache::get();
+    if (!cache.telemetry_enabled()) { return; }
+    cache.report({kernel, device, Kernel_traits::kHeadDim, Kernel_traits::kBlockM, Kernel_traits::kBlockN,
+                  Kernel_traits::kNThreads, config.smem_size, config.ctas_per_sm, grid_x, grid_y, grid_z, config.cache_hit});
+}
+
+#if defined(__CUDACC__)
+
+// The launch config of a kernel instantiation on the current device (returned in device): raises its
+// dynamic smem limit if it needs more than 48 KB and queries its occupancy, the first time only.
+template<typename Kernel>
+Launch_config get_launch_config(Kernel kernel, const int num_threads, const int smem_size, int &device) {
+    C10_CUDA_CHECK(cudaGetDevice(&device));
+    return Launch_config_cache::get().get_or_compute(reinterpret_cast<const void *>(kernel), device, [&] {
+        if (smem_size >= 48 * 1024) {
+            C10_CUDA_CHECK(cudaFuncSetAttribute(
+                kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
+        }
+        Launch_config config;
+        config.smem_size = smem_size;
+        C10_CUDA_CHECK(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+            &config.ctas_per_sm, kernel, num_threads, smem_size));
+        return config;
+    });
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace flash
@@ -0,0 +1,278 @@
+/******************************************************************************
+ * Copyright (c) 2023, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cuda_runtime_api.h>
+#include <c10/cuda/CUDAException.h>
+
+namespace flash {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Pools of lanes that independent launches can be spread over. fork() returns a Fork, the state
+// of one call: it makes the first num_lanes lanes start after the work queued so far on the caller,
+// its launch() queues work on one lane, and its join() makes the caller continue only after
+// everything it queued. A Fork that goes out of scope without join() (on an exception) joins in its
+// destructor, which does not throw. The pools are shared by all callers, and hold no lock between
+// fork() and join(): the work of concurrent calls interleaves on the lanes.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// CPU implementation: each lane is a worker thread draining its own FIFO queue, and the work gets
+// the lane index as its stream. The caller is the host thread, so fork() has nothing to wait for and
+// join() blocks until the work of the call is done. The first exception thrown by that work is
+// rethrown by join(). A fork from inside a lane runs its work on the calling thread, as queuing it
+// behind the work the lane is running would deadlock.
+struct Cpu_stream_pool {
+
+    class Fork {
+    public:
+        Fork(Cpu_stream_pool &pool, const int num_lanes)
+            : pool_(pool), num_lanes_(std::min(std::max(num_lanes, 1), pool.max_lanes())),
+              inline_(is_lane_thread()) {}
+        Fork(const Fork &) = delete;
+        Fork &operator=(const Fork &) = delete;
+        ~Fork() { wait(); }
+
+        void launch(const int lane, std::function<void(int)> work) {
+            if (!inline_) {
+                pool_.queue(lane % num_lanes_, std::move(work), this);
+                return;
+            }
+            try {
+                work(lane % num_lanes_);
+            } catch (...) {
+                if (!error_) { error_ = std::current_exception(); }
+            }
+        }
+
+        void join() {
+            wait();
+            std::exception_ptr error;
+            std::swap(error, error_);
+            if (error) { std::rethrow_exception(error); }
+        }
+
+    private:
+        friend struct Cpu_stream_pool;
+
+        void wait() {
+            std::unique_lock<std::mutex> lock(pool_.queue_mutex_);
+            pool_.idle_cv_.wait(lock, [this] { return pending_ == 0; });
+        }
+
+        Cpu_stream_pool &pool_;
+        const int num_lanes_;
+        const bool inline_;
+        // Guarded by the queue mutex of the pool.
+        int pending_ = 0;
+        std::exception_ptr error_;
+    };
+
+    explicit Cpu_stream_pool(const int num_lanes) : lanes_(std::max(num_lanes, 1)) {
+        for (int i = 0; i < int(lanes_.size()); ++i) {
+            lanes_[i].thread = std::thread([this, i] { run(i); });
+        }
+    }
+
+    ~Cpu_stream_pool() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto &lane : lanes_) { lane.thread.join(); }
+    }
+
+    // One lane per hardware thread, created on first use and kept for the lifetime of the process.
+    static Cpu_stream_pool &get() {
+        static Cpu_stream_pool pool(std::thread::hardware_concurrency());
+        return pool;
+    }
+
+    int max_lanes() const { return lanes_.size(); }
+
+    Fork fork(int /*caller*/, const int num_lanes) { return Fork(*this, num_lanes); }
+
+private:
+    struct Task {
+        std::function<void(int)> work;
+        Fork *fork;
+    };
+
+    struct Lane {
+        std::deque<Task> queue;
+        std::thread thread;
+    };
+
+    static bool &is_lane_thread() {
+        static thread_local bool is_lane = false;
+        return is_lane;
+    }
+
+    void queue(const int lane, std::function<void(int)> work, Fork *fork) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            lanes_[lane].queue.push_back({std::move(work), fork});
+            ++fork->pending_;
+        }
+        work_cv_.notify_all();
+    }
+
+    void run(const int i) {
+        is_lane_thread() = true;
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        while (true) {
+            work_cv_.wait(lock, [&] { return stop_ || !lanes_[i].queue.empty(); });
+            if (lanes_[i].queue.empty()) { return; }
+            auto task = std::move(lanes_[i].queue.front());
+            lanes_[i].queue.pop_front();
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                task.work(i);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            if (error && !task.fork->error_) { task.fork->error_ = error; }
+            if (--task.fork->pending_ == 0) { idle_cv_.notify_all(); }
+        }
+    }
+
+    std::vector<Lane> lanes_;
+
+    std::mutex queue_mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable idle_cv_;
+    bool stop_ = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// CUDA implementation: kMaxLanes non-blocking streams per device, with events to fork off the
+// caller's stream and join back onto it. Nothing here blocks the host. Each Fork borrows its own
+// events from the pool, so that concurrent calls do not record over each other's.
+struct Cuda_stream_pool {
+
+    static constexpr int kMaxLanes = 7;
+
+    class Fork {
+    public:
+        Fork(Cuda_stream_pool &pool, cudaStream_t caller, const int num_lanes)
+            : pool_(pool), caller_(caller), num_lanes_(std::min(std::max(num_lanes, 1), kMaxLanes)),
+              events_(pool, num_lanes_ + 1) {
+            C10_CUDA_CHECK(cudaEventRecord(events_[0], caller_));
+            for (int i = 0; i < num_lanes_; ++i) {
+                C10_CUDA_CHECK(cudaStreamWaitEvent(pool_.streams_[i], events_[0], 0));
+            }
+        }
+        Fork(const Fork &) = delete;
+        Fork &operator=(const Fork &) = delete;
+
+        ~Fork() {
+            if (joined_) { return; }
+            for (int i = 0; i < num_lanes_; ++i) {
+                C10_CUDA_CHECK_WARN(cudaEventRecord(events_[i + 1], pool_.streams_[i]));
+                C10_CUDA_CHECK_WARN(cudaStreamWaitEvent(caller_, events_[i + 1], 0));
+            }
+        }
+
+        void launch(const int lane, const std::function<void(cudaStream_t)> &work) {
+            work(pool_.streams_[lane % num_lanes_]);
+        }
+
+        void join() {
+            joined_ = true;
+            for (int i = 0; i < num_lanes_; ++i) {
+                C10_CUDA_CHECK(cudaEventRecord(events_[i + 1], pool_.streams_[i]));
+                C10_CUDA_CHECK(cudaStreamWaitEvent(caller_, events_[i + 1], 0));
+            }
+        }
+
+    private:
+        // The fork event then one join event per lane, given back to the pool when the Fork ends. An
+        // event can be recorded again as soon as the waits on it are queued.
+        struct Borrowed_events {
+            Borrowed_events(Cuda_stream_pool &owner, const int num) : pool(owner), events(owner.borrow_events(num)) {}
+            ~Borrowed_events() { pool.give_back_events(events); }
+            cudaEvent_t operator[](const int i) const { return events[i]; }
+            Cuda_stream_pool &pool;
+            std::vector<cudaEvent_t> events;
+        };
+
+        Cuda_stream_pool &pool_;
+        cudaStream_t caller_;
+        const int num_lanes_;
+        Borrowed_events events_;
+        bool joined_ = false;
+    };
+
+    Cuda_stream_pool() {
+        for (int i = 0; i < kMaxLanes; ++i) {
+            C10_CUDA_CHECK(cudaStreamCreateWithFlags(&streams_[i], cudaStreamNonBlocking));
+        }
+    }
+
+    // The pool of the current device, created on first use and kept for the lifetime of the process
+    // (the streams and events are never destroyed, like PyTorch's own stream pool).
+    static Cuda_stream_pool &get() {
+        static std::mutex mutex;
+        static std::vector<std::unique_ptr<Cuda_stream_pool>> pools;
+        int device;
+        C10_CUDA_CHECK(cudaGetDevice(&device));
+        std::lock_guard<std::mutex> lock(mutex);
+        if (int(pools.size()) <= device) { pools.resize(device + 1); }
+        if (!pools[device]) { pools[device].reset(new Cuda_stream_pool()); }
+        return *pools[device];
+    }
+
+    int max_lanes() const { return kMaxLanes; }
+
+    Fork fork(cudaStream_t caller, const int num_lanes) { return Fork(*this, caller, num_lanes); }
+
+private:
+    std::vector<cudaEvent_t> borrow_events(const int num) {
+        std::vector<cudaEvent_t> events;
+        {
+            std::lock_guard<std::mutex> lock(events_mutex_);
+            while (int(events.size()) < num && !free_events_.empty()) {
+                events.push_back(free_events_.back());
+                free_events_.pop_back();
+            }
+        }
+        while (int(events.size()) < num) {
+            cudaEvent_t event;
+            const cudaError_t err = cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
+            if (err != cudaSuccess) { give_back_events(events); }
+            C10_CUDA_CHECK(err);
+            events.push_back(event);
+        }
+        return events;
+    }
+
+    void give_back_events(const std::vector<cudaEvent_t> &events) {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        free_events_.insert(free_events_.end(), events.begin(), events.end());
+    }
+
+    cudaStream_t streams_[kMaxLanes];
+    std::mutex events_mutex_;
+    std::vector<cudaEvent_t> free_events_;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace flash
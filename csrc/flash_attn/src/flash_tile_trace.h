@@ -0,0 +1,84 @@
+/******************************************************************************
+ * Copyright (c) 2023, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <sstream>
+#include <string>
+
+namespace flash {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Per-tile timing trace of the forward, for looking at the load imbalance of the causal dispatch.
+// Each tile a CTA (a task of the CPU backend) computes appends one record of kTileTraceFields int64
+// to a ring buffer of Flash_fwd_params::tile_trace_capacity records, at slot
+// (*tile_trace_count)++ % capacity, so the buffer keeps the latest records once it wraps around.
+enum Tile_trace_field {
+    kTileTraceTile = 0,    // Tile index in dispatch order, or the linear block index of a grid launch.
+    kTileTraceBatch,
+    kTileTraceHead,
+    kTileTraceMBlock,
+    kTileTraceWorker,      // Persistent CTA or linear block index on CUDA, worker thread on the CPU.
+    kTileTraceSm,          // SM id on CUDA, -1 on the CPU.
+    kTileTraceStart,       // ns, %globaltimer on CUDA, steady_clock on the CPU.
+    kTileTraceEnd,
+    kTileTraceFields
+};
+
+// Host-side append, the CPU backend's counterpart of flash::record_tile (flash_fwd_kernel.h).
+inline void record_tile_host(int64_t *trace, unsigned long long *count, const int capacity,
+                             const int tile, const int bidb, const int bidh, const int m_block, const int worker,
+                             const int64_t start, const int64_t end) {
+    const unsigned long long slot = __atomic_fetch_add(count, 1ull, __ATOMIC_RELAXED) % capacity;
+    int64_t *record = trace + slot * kTileTraceFields;
+    record[kTileTraceTile] = tile;
+    record[kTileTraceBatch] = bidb;
+    record[kTileTraceHead] = bidh;
+    record[kTileTraceMBlock] = m_block;
+    record[kTileTraceWorker] = worker;
+    record[kTileTraceSm] = -1;
+    record[kTileTraceStart] = start;
+    record[kTileTraceEnd] = end;
+}
+
+// Chrome trace JSON (chrome://tracing, Perfetto) of num_records records: one complete event per
+// tile, on a track per worker, grouped by SM (a single "CPU" process for the CPU backend). Times are
+// in us from the earliest start.
+inline std::string tile_trace_to_chrome_json(const int64_t *records, const int64_t num_records) {
+    int64_t t0 = 0;
+    for (int64_t i = 0; i < num_records; ++i) {
+        const int64_t start = records[i * kTileTraceFields + kTileTraceStart];
+        t0 = i == 0 ? start : std::min(t0, start);
+    }
+    std::ostringstream json;
+    json << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    for (int64_t i = 0; i < num_records; ++i) {
+        const int64_t *r = records + i * kTileTraceFields;
+        const int64_t pid = r[kTileTraceSm] < 0 ? 0 : r[kTileTraceSm] + 1;
+        json << (i == 0 ? "\n" : ",\n")
+             << "{\"name\": \"b" << r[kTileTraceBatch] << " h" << r[kTileTraceHead] << " m" << r[kTileTraceMBlock]
+             << "\", \"cat\": \"tile\", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << r[kTileTraceWorker]
+             << ", \"ts\": " << double(r[kTileTraceStart] - t0) * 1e-3
+             << ", \"dur\": " << double(r[kTileTraceEnd] - r[kTileTraceStart]) * 1e-3
+             << ", \"args\": {\"tile\": " << r[kTileTraceTile] << ", \"bidb\": " << r[kTileTraceBatch]
+             << ", \"bidh\": " << r[kTileTraceHead] << ", \"m_block\": " << r[kTileTraceMBlock] << "}}";
+    }
+    // Names of the processes.
+    std::set<int64_t> sms;
+    for (int64_t i = 0; i < num_records; ++i) { sms.insert(records[i * kTileTraceFields + kTileTraceSm]); }
+    for (const int64_t sm : sms) {
+        json << ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << (sm < 0 ? 0 : sm + 1)
+             << ", \"args\": {\"name\": \"" << (sm < 0 ? std::string("CPU") : "SM " + std::to_string(sm)) << "\"}}";
+    }
+    json << "\n]}\n";
+    return json.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace flash
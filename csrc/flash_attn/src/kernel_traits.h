@@ -12,7 +12,9 @@
 
 using namespace cute;
 
-template<int kHeadDim_, int kBlockM_, int kBlockN_, int kNWarps_, typename elem_type=cutlass::half_t>
+// index_t is the type of the gmem offsets. 32 bits save registers, the launch switches to the 64-bit
+// variant (Index64 of the traits below) when an offset could overflow them, see Flash_fwd_params::is_index64.
+template<int kHeadDim_, int kBlockM_, int kBlockN_, int kNWarps_, typename elem_type=cutlass::half_t, typename index_t_=uint32_t>
 struct Flash_kernel_traits {
 
 #if defined(__CUDA_ARCH__) &&  __CUDA_ARCH__ >= 800
@@ -24,7 +26,7 @@ struct Flash_kernel_traits {
 #endif
 
     using ElementAccum = float;
-    using index_t = uint32_t;
+    using index_t = index_t_;
 
 #if defined(__CUDA_ARCH__) &&  __CUDA_ARCH__ >= 800
     using MMA_Atom_Arch = std::conditional_t<
@@ -61,6 +63,10 @@ struct Flash_fwd_kernel_traits : public Base {
     static constexpr bool Share_Q_K_smem = Share_Q_K_smem_;
     static constexpr bool Is_Q_in_regs = Is_Q_in_regs_ || Share_Q_K_smem;
 
+    // The same traits with 64-bit gmem offsets.
+    using Index64 = Flash_fwd_kernel_traits<kHeadDim_, kBlockM_, kBlockN_, kNWarps_, Is_Q_in_regs_, Share_Q_K_smem_, elem_type,
+                                            Flash_kernel_traits<kHeadDim_, kBlockM_, kBlockN_, kNWarps_, elem_type, int64_t> >;
+
     // The number of threads.
     static constexpr int kNWarps = kNWarps_;
     static constexpr int kNThreads = kNWarps * 32;
@@ -177,6 +183,11 @@ struct Flash_bwd_kernel_traits : public Base {
     static constexpr bool Is_V_in_regs = Is_V_in_regs_;
     static constexpr bool No_double_buffer = No_double_buffer_;
 
+    // The same traits with 64-bit gmem offsets.
+    using Index64 = Flash_bwd_kernel_traits<kHeadDim_, kBlockM_, kBlockN_, kNWarps_, AtomLayoutMSdP_, AtomLayoutNdKV, AtomLayoutMdQ,
+                                            Is_V_in_regs_, No_double_buffer_, elem_type,
+                                            Flash_kernel_traits<kHeadDim_, kBlockM_, kBlockN_, kNWarps_, elem_type, int64_t> >;
+
     // The number of threads.
     static constexpr int kNWarps = kNWarps_;
     static constexpr int kNThreads = kNWarps * 32;
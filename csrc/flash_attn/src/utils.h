@@ -270,6 +270,34 @@ inline __device__ auto convert_type(Tensor<Engine, Layout> const &tensor) {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Rotates the rows [0, max_MN) of a (BLK, kHeadDim) tile in smem by the rotary tables of params,
+// the first row of the tile being at position row_start. Each pair of columns is owned by a single
+// thread, so the caller only needs a __syncthreads before (for the loads) and after (for the reads).
+// The rotation is done in fp32 and rounded once, like the separate rotary kernel.
+template <int kNThreads, typename Params, typename Engine, typename Layout>
+inline __device__ void apply_rotary(const Params &params, Tensor<Engine, Layout> &tensor,
+                                    const int row_start, const int max_MN, const int tidx) {
+    using Element = typename Engine::value_type;
+    const int rows = std::min(int(size<0>(tensor)), max_MN);
+    const int rotary_dim_half = params.rotary_dim / 2;
+    const Element *rotary_cos = reinterpret_cast<const Element *>(params.rotary_cos_ptr);
+    const Element *rotary_sin = reinterpret_cast<const Element *>(params.rotary_sin_ptr);
+    for (int i = tidx; i < rows * rotary_dim_half; i += kNThreads) {
+        const int row = i / rotary_dim_half;
+        const int j = i % rotary_dim_half;
+        const int col0 = params.is_rotary_interleaved ? 2 * j : j;
+        const int col1 = params.is_rotary_interleaved ? 2 * j + 1 : j + rotary_dim_half;
+        const float cos = float(rotary_cos[(row_start + row) * rotary_dim_half + j]);
+        const float sin = float(rotary_sin[(row_start + row) * rotary_dim_half + j]);
+        const float x0 = float(tensor(row, col0));
+        const float x1 = float(tensor(row, col1));
+        tensor(row, col0) = Element(x0 * cos - x1 * sin);
+        tensor(row, col1) = Element(x0 * sin + x1 * cos);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template <typename Engine, typename Layout>
 inline __device__ void relu_(Tensor<Engine, Layout> &tensor) {
     constexpr int numel = decltype(size(tensor))::value;
@@ -0,0 +1,367 @@
+// Few-query variant of the masked multihead attention: the num_queries (up to 8) new tokens of each
+// sequence, e.g. the draft tokens of speculative decoding, attend to the KV cache and causally to each
+// other in one launch, reading the cache once for all of them. One block per (head, sequence): the new
+// Q / K / V go through the rotary embedding at positions tlength + j into shared memory, and the new K / V
+// are appended to the cache at tlength + j. The timesteps then go by tiles of TILE, with an online softmax
+// of all the queries across tiles:
+// - Q.K: THREADS_PER_KEY threads per timestep, each loading 16B of K at a time in the layout of the
+//   cache, [B, H, Dh/X, L, X], so that the lanes of a warp read consecutive timesteps of the same 16B
+//   column. The partial dot products of all the queries are reduced over the THREADS_PER_KEY threads.
+// - softmax: one warp per query rescales its running max / sum by the tile.
+// - P.V: each thread owns 16B of channels of all the queries and a slice of the tile's timesteps.
+// The drafts are taken from shared memory rather than from the cache that the other heads of the group
+// are appending to. The cache is not circular here: the caller keeps tlength + num_queries <=
+// memory_max_len. Rejected drafts are rolled back by not counting them in length_per_sample of the next
+// step, which then overwrites them.
+
+#include "decoder_masked_multihead_attention.h"
+#include "decoder_masked_multihead_attention_utils.h"
+#include "cuda_bf16_wrapper.h"
+#include <assert.h>
+#include <float.h>
+#include <type_traits>
+
+#include "decoder_masked_multihead_attention_template.hpp"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace mmha {
+
+constexpr int FEW_QUERY_MAX = 8;
+
+template<typename T>
+inline __device__ float round_to(const float x)
+{
+    T t;
+    convert_from_float(t, x);
+    return elt_to_float(t);
+}
+
+// 16B of the K or V cache, in fp32.
+template<typename T, int X>
+inline __device__ void load_16B(const T* ptr, float (&dst)[X])
+{
+    T elts[X];
+    *reinterpret_cast<uint4*>(elts) = *reinterpret_cast<const uint4*>(ptr);
+#pragma unroll
+    for (int x = 0; x < X; ++x) {
+        dst[x] = elt_to_float(elts[x]);
+    }
+}
+
+template<typename T, int Dh_MAX, int THREADS_PER_BLOCK>
+__global__ void few_query_attention_kernel(Masked_multihead_attention_params<T> params)
+{
+    constexpr int WARP_SIZE = 32;
+    constexpr int WARPS     = THREADS_PER_BLOCK / WARP_SIZE;
+    // The elements of T in 16B, the K cache is [B, H, Dh/X, L, X].
+    constexpr int X       = 16 / sizeof(T);
+    constexpr int VECS    = Dh_MAX / X;
+    constexpr int THREADS_PER_KEY = 4;
+    static_assert(VECS % THREADS_PER_KEY == 0, "");
+    constexpr int KEYS_PER_WARP   = WARP_SIZE / THREADS_PER_KEY;
+    // The timesteps of a tile, KEYS_PER_THREAD for each group of THREADS_PER_KEY threads.
+    constexpr int KEYS_PER_THREAD = 2;
+    constexpr int TILE            = KEYS_PER_THREAD * WARPS * KEYS_PER_WARP;
+    static_assert(TILE == KEYS_PER_THREAD * WARP_SIZE, "");
+    // P.V: the 16B of channels and the slice of the timesteps of each thread.
+    static_assert(VECS <= THREADS_PER_BLOCK, "");
+    constexpr int SLICES = THREADS_PER_BLOCK / VECS;
+
+    // The new queries, keys and values, in fp32 rounded to T.
+    __shared__ float q_smem[FEW_QUERY_MAX][Dh_MAX];
+    __shared__ float k_smem[FEW_QUERY_MAX][Dh_MAX];
+    __shared__ float v_smem[FEW_QUERY_MAX][Dh_MAX];
+    // The logits of the tile, then its probabilities.
+    __shared__ float p_smem[FEW_QUERY_MAX][TILE];
+    // The running softmax max / sum of each query, and the rescaling of the tile.
+    __shared__ float max_smem[FEW_QUERY_MAX];
+    __shared__ float sum_smem[FEW_QUERY_MAX];
+    __shared__ float corr_smem[FEW_QUERY_MAX];
+    __shared__ float out_smem[FEW_QUERY_MAX][Dh_MAX];
+
+    const int Dh     = params.hidden_size_per_head;
+    const int nq     = params.num_queries;
+    const int L      = params.memory_max_len;
+    const int hi     = blockIdx.x;
+    const int bi     = blockIdx.y;
+    const int hi_kv  = hi / params.num_heads_q_kv_ratio;
+    const int bhi_kv = bi * params.num_heads_kv + hi_kv;
+    const int tidx   = threadIdx.x;
+    const int warp   = tidx / WARP_SIZE;
+    const int lane   = tidx % WARP_SIZE;
+
+    const int tlength = params.length_per_sample == nullptr ? params.timestep : params.length_per_sample[bi];
+
+    for (int idx = tidx; idx < nq * Dh; idx += THREADS_PER_BLOCK) {
+        const int j = idx / Dh, c = idx % Dh;
+        q_smem[j][c] = elt_to_float(params.q[bi * params.stride_q + (j * params.num_heads + hi) * Dh + c]);
+        k_smem[j][c] = elt_to_float(params.k[bi * params.stride_k + (j * params.num_heads_kv + hi_kv) * Dh + c]);
+        v_smem[j][c] = elt_to_float(params.v[bi * params.stride_v + (j * params.num_heads_kv + hi_kv) * Dh + c]);
+        out_smem[j][c] = 0.f;
+    }
+    if (tidx < FEW_QUERY_MAX) {
+        max_smem[tidx] = -FLT_MAX;
+        sum_smem[tidx] = 0.f;
+    }
+    __syncthreads();
+
+    const int rot_dim = params.rotary_embedding_dim;
+    if (rot_dim > 0) {
+        for (int idx = tidx; idx < nq * rot_dim / 2; idx += THREADS_PER_BLOCK) {
+            const int   j = idx / (rot_dim / 2), i = idx % (rot_dim / 2);
+            const float pos_idx_inv_freq = (tlength + j) / powf(params.rotary_base, 2 * i / (float)rot_dim);
+            const float cos = cosf(pos_idx_inv_freq), sin = sinf(pos_idx_inv_freq);
+            const int   i0 = params.neox_rotary_style ? i : 2 * i;
+            const int   i1 = params.neox_rotary_style ? i + rot_dim / 2 : 2 * i + 1;
+            const float q0 = q_smem[j][i0], q1 = q_smem[j][i1];
+            q_smem[j][i0]  = round_to<T>(cos * q0 - sin * q1);
+            q_smem[j][i1]  = round_to<T>(cos * q1 + sin * q0);
+            const float k0 = k_smem[j][i0], k1 = k_smem[j][i1];
+            k_smem[j][i0]  = round_to<T>(cos * k0 - sin * k1);
+            k_smem[j][i1]  = round_to<T>(cos * k1 + sin * k0);
+        }
+        __syncthreads();
+    }
+
+    // Append the new keys / values, by the first query head of the group.
+    if (hi % params.num_heads_q_kv_ratio == 0) {
+        for (int idx = tidx; idx < nq * Dh; idx += THREADS_PER_BLOCK) {
+            const int j = idx / Dh, c = idx % Dh, ti = tlength + j;
+            if (ti < L) {
+                convert_from_float(params.k_cache[(bhi_kv * L * Dh) + (c / X) * L * X + ti * X + c % X], k_smem[j][c]);
+                convert_from_float(params.v_cache[(bhi_kv * L + ti) * Dh + c], v_smem[j][c]);
+            }
+        }
+    }
+
+    const T* k_cache = &params.k_cache[bhi_kv * L * Dh];
+    const T* v_cache = &params.v_cache[bhi_kv * L * Dh];
+    // Q.K: the timestep within the tile of the group, and the 16B columns of the thread.
+    const int key_in_warp = lane % KEYS_PER_WARP;
+    const int key_thread  = lane / KEYS_PER_WARP;
+    // P.V: the 16B of channels and the slice of the thread.
+    const int vec   = tidx % VECS;
+    const int slice = tidx / VECS;
+    float     out[FEW_QUERY_MAX][X];
+#pragma unroll
+    for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+#pragma unroll
+        for (int x = 0; x < X; ++x) {
+            out[j][x] = 0.f;
+        }
+    }
+
+    // Timestep ti is the cached one if ti < tlength, the draft ti - tlength otherwise, which the queries
+    // j >= ti - tlength see.
+    const int num_timesteps = tlength + nq;
+    for (int tile_start = 0; tile_start < num_timesteps; tile_start += TILE) {
+#pragma unroll
+        for (int kk = 0; kk < KEYS_PER_THREAD; ++kk) {
+            const int t  = kk * WARP_SIZE + warp * KEYS_PER_WARP + key_in_warp;
+            const int ti = tile_start + t;
+            float     qk[FEW_QUERY_MAX];
+#pragma unroll
+            for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+                qk[j] = 0.f;
+            }
+            if (ti < num_timesteps) {
+#pragma unroll
+                for (int ii = 0; ii < VECS / THREADS_PER_KEY; ++ii) {
+                    const int vi = ii * THREADS_PER_KEY + key_thread;
+                    if (vi * X < Dh) {
+                        float k[X];
+                        if (ti < tlength) {
+                            load_16B<T, X>(&k_cache[vi * L * X + ti * X], k);
+                        }
+                        else {
+#pragma unroll
+                            for (int x = 0; x < X; ++x) {
+                                k[x] = k_smem[ti - tlength][vi * X + x];
+                            }
+                        }
+#pragma unroll
+                        for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+                            if (j < nq) {
+#pragma unroll
+                                for (int x = 0; x < X; ++x) {
+                                    qk[j] += q_smem[j][vi * X + x] * k[x];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+#pragma unroll
+            for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+#pragma unroll
+                for (int mask = KEYS_PER_WARP; mask < WARP_SIZE; mask *= 2) {
+                    qk[j] += __shfl_xor_sync(uint32_t(-1), qk[j], mask);
+                }
+            }
+            if (key_thread == 0) {
+#pragma unroll
+                for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+                    p_smem[j][t] = qk[j] * params.inv_sqrt_dh;
+                }
+            }
+        }
+        __syncthreads();
+
+        // Softmax of the tile, one warp per query.
+        for (int j = warp; j < nq; j += WARPS) {
+            float logits[KEYS_PER_THREAD];
+            bool  visible[KEYS_PER_THREAD];
+            float tile_max = -FLT_MAX;
+#pragma unroll
+            for (int kk = 0; kk < KEYS_PER_THREAD; ++kk) {
+                const int t = kk * WARP_SIZE + lane, ti = tile_start + t;
+                visible[kk] = ti < num_timesteps && ti - tlength <= j;
+                logits[kk]  = p_smem[j][t];
+                tile_max    = visible[kk] ? fmaxf(tile_max, logits[kk]) : tile_max;
+            }
+#pragma unroll
+            for (int mask = WARP_SIZE / 2; mask >= 1; mask /= 2) {
+                tile_max = fmaxf(tile_max, __shfl_xor_sync(uint32_t(-1), tile_max, mask));
+            }
+            const float new_max = fmaxf(max_smem[j], tile_max);
+            float       tile_sum = 0.f;
+#pragma unroll
+            for (int kk = 0; kk < KEYS_PER_THREAD; ++kk) {
+                const float p = visible[kk] ? __expf(logits[kk] - new_max) : 0.f;
+                p_smem[j][kk * WARP_SIZE + lane] = p;
+                tile_sum += p;
+            }
+#pragma unroll
+            for (int mask = WARP_SIZE / 2; mask >= 1; mask /= 2) {
+                tile_sum += __shfl_xor_sync(uint32_t(-1), tile_sum, mask);
+            }
+            __syncwarp();
+            if (lane == 0) {
+                const float corr = __expf(max_smem[j] - new_max);
+                corr_smem[j]     = corr;
+                sum_smem[j]      = sum_smem[j] * corr + tile_sum;
+                max_smem[j]      = new_max;
+            }
+        }
+        __syncthreads();
+
+        // P.V of the tile.
+        if (vec * X < Dh) {
+#pragma unroll
+            for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+                const float corr = j < nq ? corr_smem[j] : 0.f;
+#pragma unroll
+                for (int x = 0; x < X; ++x) {
+                    out[j][x] *= corr;
+                }
+            }
+            for (int t = slice; t < TILE && tile_start + t < num_timesteps; t += SLICES) {
+                const int ti = tile_start + t;
+                float     v[X];
+                if (ti < tlength) {
+                    load_16B<T, X>(&v_cache[ti * Dh + vec * X], v);
+                }
+                else {
+#pragma unroll
+                    for (int x = 0; x < X; ++x) {
+                        v[x] = v_smem[ti - tlength][vec * X + x];
+                    }
+                }
+#pragma unroll
+                for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+                    if (j < nq) {
+                        const float p = p_smem[j][t];
+#pragma unroll
+                        for (int x = 0; x < X; ++x) {
+                            out[j][x] += p * v[x];
+                        }
+                    }
+                }
+            }
+        }
+        // The next tile overwrites p_smem and corr_smem.
+        __syncthreads();
+    }
+
+    // Combine the slices, one after the other so that the output does not depend on their timing.
+    for (int s = 0; s < SLICES; ++s) {
+        if (slice == s && vec * X < Dh) {
+#pragma unroll
+            for (int j = 0; j < FEW_QUERY_MAX; ++j) {
+                if (j < nq) {
+#pragma unroll
+                    for (int x = 0; x < X; ++x) {
+                        out_smem[j][vec * X + x] += out[j][x];
+                    }
+                }
+            }
+        }
+        __syncthreads();
+    }
+
+    for (int idx = tidx; idx < nq * Dh; idx += THREADS_PER_BLOCK) {
+        const int j = idx / Dh, c = idx % Dh;
+        convert_from_float(params.out[((bi * nq + j) * params.num_heads + hi) * Dh + c], out_smem[j][c] / sum_smem[j]);
+    }
+}
+
+}  // namespace mmha
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T, int Dh_MAX>
+void fqa_launch_kernel(const Masked_multihead_attention_params<T>& params, const cudaStream_t& stream)
+{
+    constexpr int THREADS_PER_BLOCK = 128;
+    dim3          grid(params.num_heads, params.batch_size);
+    mmha::few_query_attention_kernel<T, Dh_MAX, THREADS_PER_BLOCK><<<grid, THREADS_PER_BLOCK, 0, stream>>>(params);
+}
+
+template<typename T>
+void few_query_attention_(const Masked_multihead_attention_params<T>& params, const cudaStream_t& stream)
+{
+    assert(params.num_queries <= mmha::FEW_QUERY_MAX);
+    if (params.hidden_size_per_head <= 32) {
+        fqa_launch_kernel<T, 32>(params, stream);
+    }
+    else if (params.hidden_size_per_head <= 64) {
+        fqa_launch_kernel<T, 64>(params, stream);
+    }
+    else if (params.hidden_size_per_head <= 128) {
+        fqa_launch_kernel<T, 128>(params, stream);
+    }
+    else if (params.hidden_size_per_head <= 256) {
+        fqa_launch_kernel<T, 256>(params, stream);
+    }
+    else {
+        assert(false);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void few_query_multihead_attention(const Masked_multihead_attention_params<float>& params, const cudaStream_t& stream)
+{
+    few_query_attention_<float>(params, stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void few_query_multihead_attention(const Masked_multihead_attention_params<uint16_t>& params,
+                                   const cudaStream_t&                               stream)
+{
+    few_query_attention_<uint16_t>(params, stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef ENABLE_BF16
+void few_query_multihead_attention(const Masked_multihead_attention_params<__nv_bfloat16>& params,
+                                   const cudaStream_t&                                     stream)
+{
+    few_query_attention_<__nv_bfloat16>(params, stream);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -34,7 +34,8 @@
     if (smem_sz >= 48 * 1024) {                                                                                        \
         cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_sz);                            \
     }                                                                                                                  \
-    dim3 grid(params.nnz_head_idx == nullptr ? params.num_heads : params.nnz_heads, params.batch_size);                \
+    dim3 grid(params.nnz_head_idx == nullptr ? params.num_heads : params.nnz_heads + params.num_heads_kv,              \
+              params.batch_size);                                                                                      \
     kernel<<<grid, THDS_PER_BLOCK, smem_sz, stream>>>(params)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -45,7 +46,10 @@ void mmha_launch_kernel(const KERNEL_PARAMS_TYPE& params, const cudaStream_t& st
 {
     constexpr int  THREADS_PER_VALUE  = Dh_MAX * sizeof(T) / 16;
     constexpr bool DO_CROSS_ATTENTION = std::is_same<KERNEL_PARAMS_TYPE, Cross_multihead_attention_params<T>>::value;
-    int            tlength            = (DO_CROSS_ATTENTION) ? params.memory_max_len : params.timestep;
+    // With sparse page retrieval the kernel goes over at most max_attended cached timesteps.
+    int tlength = (DO_CROSS_ATTENTION)          ? params.memory_max_len :
+                  (params.timestep_idx != nullptr) ? min(params.timestep, params.max_attended) :
+                                                     params.timestep;
     // printf("tlength, CROSS_ATTENTION = %d, %d\n", tlength, DO_CROSS_ATTENTION);
     if (tlength < 32) {
         MMHA_LAUNCH_KERNEL(T, Dh, Dh_MAX, 4, THREADS_PER_VALUE, 64, DO_CROSS_ATTENTION, stream);
@@ -123,6 +123,42 @@ struct Multihead_attention_params_base {
 
     const int *nnz_head_idx = nullptr;
     int nnz_heads = 0;
+
+    // 8-bit KV cache (kv_cache_quant.h): when kv_cache_quant is not KV_CACHE_QUANT_NONE, k_cache and
+    // v_cache are not used and the keys / values are stored as codes in k_cache_quant / v_cache_quant,
+    // in the same layouts with 1-byte elements, with the scale of each head and token in
+    // k_cache_scale / v_cache_scale [B, H, L]. The new key and value are quantized as they are
+    // appended, and the cached ones dequantized as they are loaded.
+    int      kv_cache_quant = 0;
+    uint8_t* k_cache_quant  = nullptr;
+    uint8_t* v_cache_quant  = nullptr;
+    float*   k_cache_scale  = nullptr;
+    float*   v_cache_scale  = nullptr;
+
+    // few_query_multihead_attention: the num_queries new tokens of each sequence, with q [B, num_queries, H, Dh],
+    // k / v [B, num_queries, H_kv, Dh] (stride_q / stride_k / stride_v between the sequences) and out
+    // [B, num_queries, H, Dh].
+    int num_queries = 1;
+
+    // Sparse page retrieval (single_query_attention with a page summary): page_summary [B, H_kv, num_pages,
+    // 2, Dh] holds the min / max of the cached keys of each page of page_size timesteps, and the attention
+    // step adds the key it appends to it (the cache must not wrap around: tlength < memory_max_len). Each
+    // head attends the cached timesteps of the top_k_pages pages with the highest bound of q.k, out of those
+    // before tlength - recent_window, and the recent_window timesteps after them. select_pages lists these,
+    // in increasing order, as the first num_attended[bhi] of timestep_idx[bhi * max_attended, ...), and the
+    // attention step goes over them only, with max_attended bounding its shared memory.
+    float*       page_summary  = nullptr;
+    int          page_size     = 0;
+    int          num_pages     = 0;
+    int          top_k_pages   = 0;
+    int          recent_window = 0;
+    int*         timestep_idx  = nullptr;
+    int*         num_attended  = nullptr;
+    int          max_attended  = 0;
+    // The scratch of select_pages: the scores of the pages [B, H, num_pages] and the top_k_pages best
+    // ones [B, H, top_k_pages].
+    float* page_scores    = nullptr;
+    int*   selected_pages = nullptr;
 };
 
 template<typename T, bool CROSS_ATTENTION>
@@ -182,6 +218,18 @@ void masked_multihead_attention(const Masked_multihead_attention_params<uint16_t
 void masked_multihead_attention(const Masked_multihead_attention_params<__nv_bfloat16>& params,
                                 const cudaStream_t&                                     stream);
 #endif
+void few_query_multihead_attention(const Masked_multihead_attention_params<float>& params, const cudaStream_t& stream);
+void few_query_multihead_attention(const Masked_multihead_attention_params<uint16_t>& params,
+                                   const cudaStream_t&                               stream);
+#ifdef ENABLE_BF16
+void few_query_multihead_attention(const Masked_multihead_attention_params<__nv_bfloat16>& params,
+                                   const cudaStream_t&                                     stream);
+#endif
+void select_pages(const Masked_multihead_attention_params<float>& params, const cudaStream_t& stream);
+void select_pages(const Masked_multihead_attention_params<uint16_t>& params, const cudaStream_t& stream);
+#ifdef ENABLE_BF16
+void select_pages(const Masked_multihead_attention_params<__nv_bfloat16>& params, const cudaStream_t& stream);
+#endif
 void cross_multihead_attention(const Cross_multihead_attention_params<float>& params, const cudaStream_t& stream);
 void cross_multihead_attention(const Cross_multihead_attention_params<uint16_t>& params, const cudaStream_t& stream);
 #ifdef ENABLE_BF16
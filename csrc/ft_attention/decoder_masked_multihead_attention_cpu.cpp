@@ -0,0 +1,355 @@
+// CPU reference of masked_multihead_attention (decoder_masked_multihead_attention_template.hpp), so
+// that single_query_attention can be checked and used on machines without a GPU. It consumes the same
+// Masked_multihead_attention_params, with T the ATen element type rather than the CUDA one, and follows
+// the kernel: one task per (sequence, head), the rotary embedding applied to the new Q and K at position
+// tlength, the new K / V appended to the cache at tlength (by the first query head of the group, or by
+// a task of its own with nnz_head_idx), and the cached keys and values of the earlier steps read through
+// cache_indir when beam searching.
+// Q, K, P and the output are rounded to T where the kernel keeps them in T. With an 8-bit cache
+// (kv_cache_quant.h) the new K / V are quantized with their absmax and the cached ones dequantized to T.
+
+#include <ATen/Parallel.h>
+#include <c10/util/BFloat16.h>
+#include <c10/util/Half.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "decoder_masked_multihead_attention.h"
+#include "kv_cache_quant.h"
+
+namespace {
+
+// Rotates the pairs (x[i], x[i + rotary_dim / 2]) (NeoX style) or (x[2i], x[2i + 1]) (GPT-J style)
+// of the first rotary_embedding_dim dimensions, at position t_step or with the cos / sin of sequence bi.
+template<typename T>
+void apply_rotary_embedding(float *x, const Masked_multihead_attention_params<T> &params, const int bi, const int t_step) {
+    const int rotary_dim = params.rotary_embedding_dim;
+    for (int i = 0; i < rotary_dim / 2; ++i) {
+        float cos, sin;
+        if (params.rotary_cos == nullptr) {
+            const float pos_idx_inv_freq = t_step / std::pow(params.rotary_base, 2 * i / float(rotary_dim));
+            cos = std::cos(pos_idx_inv_freq);
+            sin = std::sin(pos_idx_inv_freq);
+        } else {
+            cos = float(params.rotary_cos[bi * rotary_dim / 2 + i]);
+            sin = float(params.rotary_sin[bi * rotary_dim / 2 + i]);
+        }
+        const int i0 = params.neox_rotary_style ? i : 2 * i;
+        const int i1 = params.neox_rotary_style ? i + rotary_dim / 2 : 2 * i + 1;
+        const float x0 = x[i0], x1 = x[i1];
+        x[i0] = cos * x0 - sin * x1;
+        x[i1] = cos * x1 + sin * x0;
+    }
+}
+
+template<typename T>
+inline float round_to(const float x) { return float(T(x)); }
+
+}  // namespace
+
+template<typename T>
+void masked_multihead_attention_cpu(const Masked_multihead_attention_params<T> &params) {
+    const int Dh = params.hidden_size_per_head;
+    const int L = params.memory_max_len;
+    // The K cache is [B, H, Dh/x, L, x] with x the elements of 16B, the V cache [B, H, L, Dh].
+    constexpr int x = 16 / sizeof(T);
+    // With nnz_head_idx, the tasks of the nnz_heads heads it lists, then one per KV head group that only
+    // appends the new key / value.
+    const int num_heads = params.nnz_head_idx == nullptr ? params.num_heads : params.nnz_heads + params.num_heads_kv;
+    auto k_cache_at = [&](const int bhi_kv, const int c, const int ti_circ) -> T & {
+        return params.k_cache[size_t(bhi_kv) * L * Dh + size_t(c / x) * L * x + size_t(ti_circ) * x + c % x];
+    };
+    auto v_cache_at = [&](const int bhi_kv, const int c, const int ti_circ) -> T & {
+        return params.v_cache[(size_t(bhi_kv) * L + ti_circ) * Dh + c];
+    };
+    // The 8-bit caches have the same layouts, with x still the elements of T in 16B.
+    const int quant = params.kv_cache_quant;
+    auto k_code_at = [&](const int bhi_kv, const int c, const int ti_circ) -> uint8_t & {
+        return params.k_cache_quant[size_t(bhi_kv) * L * Dh + size_t(c / x) * L * x + size_t(ti_circ) * x + c % x];
+    };
+    auto v_code_at = [&](const int bhi_kv, const int c, const int ti_circ) -> uint8_t & {
+        return params.v_cache_quant[(size_t(bhi_kv) * L + ti_circ) * Dh + c];
+    };
+    auto k_cached = [&](const int bhi_kv, const int c, const int ti_circ) {
+        return quant == KV_CACHE_QUANT_NONE ? float(k_cache_at(bhi_kv, c, ti_circ))
+            : round_to<T>(params.k_cache_scale[size_t(bhi_kv) * L + ti_circ] * dequantize_kv(k_code_at(bhi_kv, c, ti_circ), quant));
+    };
+    auto v_cached = [&](const int bhi_kv, const int c, const int ti_circ) {
+        return quant == KV_CACHE_QUANT_NONE ? float(v_cache_at(bhi_kv, c, ti_circ))
+            : round_to<T>(params.v_cache_scale[size_t(bhi_kv) * L + ti_circ] * dequantize_kv(v_code_at(bhi_kv, c, ti_circ), quant));
+    };
+
+    at::parallel_for(0, int64_t(params.batch_size) * num_heads, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> q(Dh), k(Dh), v(Dh), logits, out(Dh);
+        for (int64_t task = begin; task < end; ++task) {
+            const int bi = task / num_heads;
+            const int hj = task % num_heads;
+            const bool attends = params.nnz_head_idx == nullptr || hj < params.nnz_heads;
+            const int hi = params.nnz_head_idx == nullptr ? hj
+                : attends ? params.nnz_head_idx[hj] : (hj - params.nnz_heads) * params.num_heads_q_kv_ratio;
+            const bool appends_kv = params.nnz_head_idx == nullptr ? hi % params.num_heads_q_kv_ratio == 0 : !attends;
+            const int hi_kv = hi / params.num_heads_q_kv_ratio;
+            const int bhi_kv = bi * params.num_heads_kv + hi_kv;
+            // The first beam of the sequence, the rows cache_indir picks from.
+            const int bbhi = bi / params.beam_width * params.beam_width * params.num_heads_kv + hi_kv;
+            const int tlength = params.length_per_sample == nullptr
+                ? params.timestep : params.length_per_sample[bi] + params.max_prefix_prompt_length;
+            const int first_step = std::max(0, tlength + 1 - L);
+            const int tlength_circ = tlength % L;
+
+            const T *q_in = params.q + (params.stride_q == 0 ? (bi * params.num_heads + hi) * Dh : bi * params.stride_q + hi * Dh);
+            const T *k_in = params.k + (params.stride_k == 0 ? bhi_kv * Dh : bi * params.stride_k + hi_kv * Dh);
+            const T *v_in = params.v + (params.stride_v == 0 ? bhi_kv * Dh : bi * params.stride_v + hi_kv * Dh);
+            for (int c = 0; c < Dh; ++c) {
+                q[c] = float(q_in[c]);
+                k[c] = float(k_in[c]);
+                v[c] = float(v_in[c]);
+            }
+            if (params.rotary_embedding_dim > 0) {
+                apply_rotary_embedding(q.data(), params, bi, tlength);
+                apply_rotary_embedding(k.data(), params, bi, tlength);
+                for (int c = 0; c < Dh; ++c) {
+                    q[c] = round_to<T>(q[c]);
+                    k[c] = round_to<T>(k[c]);
+                }
+            }
+            if (appends_kv && quant == KV_CACHE_QUANT_NONE) {
+                for (int c = 0; c < Dh; ++c) {
+                    k_cache_at(bhi_kv, c, tlength_circ) = T(k[c]);
+                    v_cache_at(bhi_kv, c, tlength_circ) = T(v[c]);
+                }
+                // The page summary of sparse page retrieval follows the cache, which must not wrap around.
+                if (params.page_summary != nullptr && tlength < L) {
+                    float *key_min = params.page_summary + (size_t(bhi_kv) * params.num_pages + tlength / params.page_size) * 2 * Dh;
+                    float *key_max = key_min + Dh;
+                    const bool first = tlength % params.page_size == 0;
+                    for (int c = 0; c < Dh; ++c) {
+                        const float x = float(T(k[c]));
+                        key_min[c] = first ? x : std::min(key_min[c], x);
+                        key_max[c] = first ? x : std::max(key_max[c], x);
+                    }
+                }
+            } else if (appends_kv) {
+                float k_amax = 0.f, v_amax = 0.f;
+                for (int c = 0; c < Dh; ++c) {
+                    k_amax = std::max(k_amax, std::abs(k[c]));
+                    v_amax = std::max(v_amax, std::abs(v[c]));
+                }
+                const float k_scale = k_amax / kv_cache_quant_max(quant);
+                const float v_scale = v_amax / kv_cache_quant_max(quant);
+                for (int c = 0; c < Dh; ++c) {
+                    k_code_at(bhi_kv, c, tlength_circ) = quantize_kv(k[c], kv_cache_inv_scale(k_scale), quant);
+                    v_code_at(bhi_kv, c, tlength_circ) = quantize_kv(v[c], kv_cache_inv_scale(v_scale), quant);
+                }
+                params.k_cache_scale[size_t(bhi_kv) * L + tlength_circ] = k_scale;
+                params.v_cache_scale[size_t(bhi_kv) * L + tlength_circ] = v_scale;
+            }
+            if (!attends) { continue; }
+
+            // The rows of the cache holding step ti.
+            auto cache_row = [&](const int ti_circ) {
+                return params.cache_indir == nullptr
+                    ? bhi_kv : bbhi + params.cache_indir[size_t(bi) * L + ti_circ] * params.num_heads_kv;
+            };
+            // The cached timesteps attended, one per logit: the ones listed by select_pages_cpu with sparse
+            // page retrieval, else all of them from first_step. The new token comes last.
+            const int bhi = bi * params.num_heads + hi;
+            const int *attended_ti = params.timestep_idx == nullptr ? nullptr : params.timestep_idx + size_t(bhi) * params.max_attended;
+            const int num_slots = attended_ti == nullptr ? tlength - first_step : params.num_attended[bhi];
+            auto slot_timestep = [&](const int si) { return attended_ti == nullptr ? first_step + si : attended_ti[si]; };
+            logits.assign(num_slots + 1, 0.f);
+            for (int si = 0; si < num_slots; ++si) {
+                const int ti_circ = slot_timestep(si) % L;
+                const int row = cache_row(ti_circ);
+                float qk = 0.f;
+                for (int c = 0; c < Dh; ++c) { qk += q[c] * k_cached(row, c, ti_circ); }
+                logits[si] = qk * params.inv_sqrt_dh;
+            }
+            float qk = 0.f;
+            for (int c = 0; c < Dh; ++c) { qk += q[c] * k[c]; }
+            logits[num_slots] = qk * params.inv_sqrt_dh;
+
+            const float qk_max = *std::max_element(logits.begin(), logits.end());
+            float sum = 0.f;
+            for (float &logit : logits) {
+                logit = std::exp(logit - qk_max);
+                sum += logit;
+            }
+            const float inv_sum = 1.f / (sum + 1.e-6f);
+            std::fill(out.begin(), out.end(), 0.f);
+            for (int si = 0; si <= num_slots; ++si) {
+                const float p = round_to<T>(logits[si] * inv_sum);
+                if (si < num_slots) {
+                    const int ti_circ = slot_timestep(si) % L;
+                    const int row = cache_row(ti_circ);
+                    for (int c = 0; c < Dh; ++c) { out[c] += p * v_cached(row, c, ti_circ); }
+                } else {
+                    for (int c = 0; c < Dh; ++c) { out[c] += p * v[c]; }
+                }
+            }
+            T *out_ptr = params.out + (bi * params.num_heads + hi) * Dh;
+            for (int c = 0; c < Dh; ++c) { out_ptr[c] = T(out[c]); }
+        }
+    });
+}
+
+template void masked_multihead_attention_cpu<float>(const Masked_multihead_attention_params<float> &params);
+template void masked_multihead_attention_cpu<at::Half>(const Masked_multihead_attention_params<at::Half> &params);
+template void masked_multihead_attention_cpu<at::BFloat16>(const Masked_multihead_attention_params<at::BFloat16> &params);
+
+// CPU reference of select_pages (decoder_masked_sparse_pages.cu): the candidate pages of each head sorted
+// by score, the ties to the earlier pages, and the timesteps of the top_k_pages first then of the recent
+// window listed in increasing order.
+template<typename T>
+void select_pages_cpu(const Masked_multihead_attention_params<T> &params) {
+    const int Dh = params.hidden_size_per_head;
+    const int page_size = params.page_size;
+    at::parallel_for(0, int64_t(params.batch_size) * params.num_heads, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> q(Dh);
+        std::vector<int> pages;
+        for (int64_t bhi = begin; bhi < end; ++bhi) {
+            const int bi = bhi / params.num_heads;
+            const int hi = bhi % params.num_heads;
+            const int bhi_kv = bi * params.num_heads_kv + hi / params.num_heads_q_kv_ratio;
+            const int tlength = params.length_per_sample == nullptr
+                ? params.timestep : params.length_per_sample[bi] + params.max_prefix_prompt_length;
+            const int window_start = std::max(tlength - params.recent_window, 0);
+            const int num_candidates = std::min((window_start + page_size - 1) / page_size, params.num_pages);
+            const int k = std::min(params.top_k_pages, num_candidates);
+
+            const T *q_in = params.q + (params.stride_q == 0 ? bhi * Dh : bi * params.stride_q + hi * Dh);
+            for (int c = 0; c < Dh; ++c) { q[c] = float(q_in[c]); }
+            if (params.rotary_embedding_dim > 0) { apply_rotary_embedding(q.data(), params, bi, tlength); }
+            float *scores = params.page_scores + size_t(bhi) * params.num_pages;
+            const float *summary = params.page_summary + size_t(bhi_kv) * params.num_pages * 2 * Dh;
+            for (int p = 0; p < num_candidates; ++p) {
+                const float *key_min = summary + size_t(p) * 2 * Dh;
+                const float *key_max = key_min + Dh;
+                float score = 0.f;
+                for (int c = 0; c < Dh; ++c) { score += std::max(q[c] * key_min[c], q[c] * key_max[c]); }
+                scores[p] = score;
+            }
+            pages.resize(num_candidates);
+            for (int p = 0; p < num_candidates; ++p) { pages[p] = p; }
+            std::partial_sort(pages.begin(), pages.begin() + k, pages.end(), [&](const int a, const int b) {
+                return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+            });
+            std::sort(pages.begin(), pages.begin() + k);
+
+            int *attended = params.timestep_idx + size_t(bhi) * params.max_attended;
+            int num_attended = 0;
+            for (int i = 0; i < k; ++i) {
+                params.selected_pages[size_t(bhi) * params.top_k_pages + i] = pages[i];
+                for (int ti = pages[i] * page_size; ti < std::min((pages[i] + 1) * page_size, window_start); ++ti) {
+                    attended[num_attended++] = ti;
+                }
+            }
+            for (int ti = window_start; ti < tlength; ++ti) { attended[num_attended++] = ti; }
+            params.num_attended[bhi] = num_attended;
+        }
+    });
+}
+
+template void select_pages_cpu<float>(const Masked_multihead_attention_params<float> &params);
+template void select_pages_cpu<at::Half>(const Masked_multihead_attention_params<at::Half> &params);
+template void select_pages_cpu<at::BFloat16>(const Masked_multihead_attention_params<at::BFloat16> &params);
+
+// CPU reference of few_query_multihead_attention (decoder_masked_few_query_attention.cu): the
+// num_queries new tokens of each sequence at positions tlength + j, each seeing the cache before tlength
+// and the new tokens up to itself.
+template<typename T>
+void few_query_attention_cpu(const Masked_multihead_attention_params<T> &params) {
+    const int Dh = params.hidden_size_per_head;
+    const int L = params.memory_max_len;
+    const int nq = params.num_queries;
+    constexpr int x = 16 / sizeof(T);
+    auto k_cache_at = [&](const int bhi_kv, const int c, const int ti) -> T & {
+        return params.k_cache[size_t(bhi_kv) * L * Dh + size_t(c / x) * L * x + size_t(ti) * x + c % x];
+    };
+    auto v_cache_at = [&](const int bhi_kv, const int c, const int ti) -> T & {
+        return params.v_cache[(size_t(bhi_kv) * L + ti) * Dh + c];
+    };
+
+    at::parallel_for(0, int64_t(params.batch_size) * params.num_heads, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> q(nq * Dh), k(nq * Dh), v(nq * Dh), logits, out(Dh);
+        for (int64_t task = begin; task < end; ++task) {
+            const int bi = task / params.num_heads;
+            const int hi = task % params.num_heads;
+            const int hi_kv = hi / params.num_heads_q_kv_ratio;
+            const int bhi_kv = bi * params.num_heads_kv + hi_kv;
+            const int tlength = params.length_per_sample == nullptr ? params.timestep : params.length_per_sample[bi];
+
+            for (int j = 0; j < nq; ++j) {
+                const T *q_in = params.q + bi * params.stride_q + (j * params.num_heads + hi) * Dh;
+                const T *k_in = params.k + bi * params.stride_k + (j * params.num_heads_kv + hi_kv) * Dh;
+                const T *v_in = params.v + bi * params.stride_v + (j * params.num_heads_kv + hi_kv) * Dh;
+                for (int c = 0; c < Dh; ++c) {
+                    q[j * Dh + c] = float(q_in[c]);
+                    k[j * Dh + c] = float(k_in[c]);
+                    v[j * Dh + c] = float(v_in[c]);
+                }
+                if (params.rotary_embedding_dim > 0) {
+                    apply_rotary_embedding(&q[j * Dh], params, bi, tlength + j);
+                    apply_rotary_embedding(&k[j * Dh], params, bi, tlength + j);
+                    for (int c = 0; c < Dh; ++c) {
+                        q[j * Dh + c] = round_to<T>(q[j * Dh + c]);
+                        k[j * Dh + c] = round_to<T>(k[j * Dh + c]);
+                    }
+                }
+            }
+            // Timestep ti < tlength from the cache, the new token ti - tlength otherwise.
+            auto key = [&](const int ti, const int c) {
+                return ti < tlength ? float(k_cache_at(bhi_kv, c, ti)) : k[(ti - tlength) * Dh + c];
+            };
+            auto value = [&](const int ti, const int c) {
+                return ti < tlength ? float(v_cache_at(bhi_kv, c, ti)) : v[(ti - tlength) * Dh + c];
+            };
+            for (int j = 0; j < nq; ++j) {
+                logits.assign(tlength + j + 1, 0.f);
+                for (int ti = 0; ti <= tlength + j; ++ti) {
+                    float qk = 0.f;
+                    for (int c = 0; c < Dh; ++c) { qk += q[j * Dh + c] * key(ti, c); }
+                    logits[ti] = qk * params.inv_sqrt_dh;
+                }
+                const float qk_max = *std::max_element(logits.begin(), logits.end());
+                float sum = 0.f;
+                for (float &logit : logits) {
+                    logit = std::exp(logit - qk_max);
+                    sum += logit;
+                }
+                std::fill(out.begin(), out.end(), 0.f);
+                for (int ti = 0; ti <= tlength + j; ++ti) {
+                    for (int c = 0; c < Dh; ++c) { out[c] += logits[ti] / sum * value(ti, c); }
+                }
+                T *out_ptr = params.out + ((size_t(bi) * nq + j) * params.num_heads + hi) * Dh;
+                for (int c = 0; c < Dh; ++c) { out_ptr[c] = T(out[c]); }
+            }
+        }
+    });
+
+    // Append the new keys / values once every task has read the cache.
+    at::parallel_for(0, int64_t(params.batch_size) * params.num_heads_kv, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> k(Dh);
+        for (int64_t bhi_kv = begin; bhi_kv < end; ++bhi_kv) {
+            const int bi = bhi_kv / params.num_heads_kv;
+            const int hi_kv = bhi_kv % params.num_heads_kv;
+            const int tlength = params.length_per_sample == nullptr ? params.timestep : params.length_per_sample[bi];
+            for (int j = 0; j < nq && tlength + j < L; ++j) {
+                const T *k_in = params.k + bi * params.stride_k + (j * params.num_heads_kv + hi_kv) * Dh;
+                const T *v_in = params.v + bi * params.stride_v + (j * params.num_heads_kv + hi_kv) * Dh;
+                for (int c = 0; c < Dh; ++c) { k[c] = float(k_in[c]); }
+                if (params.rotary_embedding_dim > 0) { apply_rotary_embedding(k.data(), params, bi, tlength + j); }
+                for (int c = 0; c < Dh; ++c) {
+                    k_cache_at(bhi_kv, c, tlength + j) = T(k[c]);
+                    v_cache_at(bhi_kv, c, tlength + j) = v_in[c];
+                }
+            }
+        }
+    });
+}
+
+template void few_query_attention_cpu<float>(const Masked_multihead_attention_params<float> &params);
+template void few_query_attention_cpu<at::Half>(const Masked_multihead_attention_params<at::Half> &params);
+template void few_query_attention_cpu<at::BFloat16>(const Masked_multihead_attention_params<at::BFloat16> &params);
@@ -19,6 +19,7 @@
 
 #include "decoder_masked_multihead_attention.h"
 #include "decoder_masked_multihead_attention_utils.h"
+#include "kv_cache_quant.h"
 #include "cuda_bf16_wrapper.h"
 #include "cuda_bf16_fallbacks.cuh"
 #include <assert.h>
@@ -502,6 +503,45 @@ inline __device__ float block_sum(float* red_smem, float sum)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+template<int WARPS_PER_BLOCK, int WARP_SIZE = 32>
+inline __device__ float block_max(float* red_smem, float max)
+{
+
+    // Decompose the thread index into warp / lane.
+    int warp = threadIdx.x / WARP_SIZE;
+    int lane = threadIdx.x % WARP_SIZE;
+
+// Compute the max per warp.
+#pragma unroll
+    for (int mask = WARP_SIZE / 2; mask >= 1; mask /= 2) {
+        max = fmaxf(max, __shfl_xor_sync(uint32_t(-1), max, mask));
+    }
+
+    // Warp leaders store the data to shared memory.
+    if (lane == 0) {
+        red_smem[warp] = max;
+    }
+
+    // Make sure the data is in shared memory.
+    __syncthreads();
+
+    // The warps compute the final maxes.
+    if (lane < WARPS_PER_BLOCK) {
+        max = red_smem[lane];
+    }
+
+// Parallel reduction inside the warp.
+#pragma unroll
+    for (int mask = WARPS_PER_BLOCK / 2; mask >= 1; mask /= 2) {
+        max = fmaxf(max, __shfl_xor_sync(uint32_t(-1), max, mask));
+    }
+
+    // Broadcast to other threads.
+    return __shfl_sync(uint32_t(-1), max, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 inline __device__ void convert_from_float(float& dst, float src)
 {
     dst = src;
@@ -796,6 +836,96 @@ inline __device__ int64_t cast_to_int8(Float8_ val)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// 8-bit KV cache, see kv_cache_quant.h. A Vec holds sizeof(Vec) / sizeof(T) elements of type T.
+
+inline __device__ float elt_to_float(float u)
+{
+    return u;
+}
+
+inline __device__ float elt_to_float(uint16_t u)
+{
+    return half_to_float(u);
+}
+
+#ifdef ENABLE_BF16
+inline __device__ float elt_to_float(__nv_bfloat16 u)
+{
+    return __bfloat162float(u);
+}
+#endif
+
+template<typename T, typename Vec>
+inline __device__ float vec_absmax(const Vec& v)
+{
+    const T* elts = reinterpret_cast<const T*>(&v);
+    float    amax = 0.f;
+#pragma unroll
+    for (int i = 0; i < int(sizeof(Vec) / sizeof(T)); ++i) {
+        amax = fmaxf(amax, fabsf(elt_to_float(elts[i])));
+    }
+    return amax;
+}
+
+template<typename T, typename Vec>
+inline __device__ void store_quantized_kv(uint8_t* dst, const Vec& v, const float inv_scale, const int mode)
+{
+    const T* elts = reinterpret_cast<const T*>(&v);
+#pragma unroll
+    for (int i = 0; i < int(sizeof(Vec) / sizeof(T)); ++i) {
+        dst[i] = quantize_kv(elt_to_float(elts[i]), inv_scale, mode);
+    }
+}
+
+template<typename T, typename Vec>
+inline __device__ Vec load_dequantized_kv(const uint8_t* src, const float scale, const int mode)
+{
+    Vec v;
+    T*  elts = reinterpret_cast<T*>(&v);
+#pragma unroll
+    for (int i = 0; i < int(sizeof(Vec) / sizeof(T)); ++i) {
+        convert_from_float(elts[i], scale * dequantize_kv(src[i], mode));
+    }
+    return v;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Sparse page retrieval: adds the elements [ci, ci + size) of the key appended at timestep ti to the
+// min / max summary of its page, restarting the summary at the first timestep of a page.
+template<typename T, typename Vec, typename PARAMS>
+inline __device__ void
+update_page_summary(const PARAMS& params, const int bhi_kv, const int ti, const int ci, const Vec& k)
+{
+    const int  Dh      = params.hidden_size_per_head;
+    float*     key_min = &params.page_summary[((size_t)bhi_kv * params.num_pages + ti / params.page_size) * 2 * Dh + ci];
+    float*     key_max = key_min + Dh;
+    const bool first   = ti % params.page_size == 0;
+    const T*   elts    = reinterpret_cast<const T*>(&k);
+#pragma unroll
+    for (int i = 0; i < int(sizeof(Vec) / sizeof(T)); ++i) {
+        const float x = elt_to_float(elts[i]);
+        key_min[i]    = first ? x : fminf(key_min[i], x);
+        key_max[i]    = first ? x : fmaxf(key_max[i], x);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The timestep of the slot si of qk_smem / logits_smem: the cached ones go from first_step in the dense
+// case and are listed by attended_ti (the first num_slots of the list of select_pages) with sparse page
+// retrieval; the current timestep tlength comes after them, at slot num_slots.
+inline __device__ int
+slot_timestep(const int* attended_ti, const int first_step, const int num_slots, const int tlength, const int si)
+{
+    if (attended_ti == nullptr) {
+        return first_step + si;
+    }
+    return si < num_slots ? attended_ti[si] : tlength + si - num_slots;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<typename T>
 inline __device__ __host__ T div_up(T m, T n)
 {
@@ -804,22 +934,34 @@ inline __device__ __host__ T div_up(T m, T n)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// The number of cached timesteps that qk_smem / logits_smem hold for any sequence: at most max_attended
+// with sparse page retrieval, whatever the length of the cache.
+template<typename T, bool DO_CROSS_ATTENTION>
+inline __device__ __host__ int max_smem_timesteps(const Multihead_attention_params<T, DO_CROSS_ATTENTION>& params)
+{
+    if (DO_CROSS_ATTENTION) {
+        return params.memory_max_len;
+    }
+    return params.timestep_idx != nullptr ? params.max_attended : min(params.timestep, params.memory_max_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<typename T, bool DO_CROSS_ATTENTION>
 inline size_t smem_size_in_bytes(const Multihead_attention_params<T, DO_CROSS_ATTENTION>& params,
                                  int                                                      threads_per_value,
                                  int                                                      threads_per_block)
 {
     // The amount of shared memory needed to store the Q*K^T values in float.
-    const int max_timesteps = min(params.timestep, params.memory_max_len);
-    size_t qk_sz = (DO_CROSS_ATTENTION) ? div_up(params.memory_max_len + 1, 4) * 16 : div_up(max_timesteps + 1, 4) * 16;
+    const int max_timesteps = max_smem_timesteps(params);
+    size_t    qk_sz         = div_up(max_timesteps + 1, 4) * 16;
 
     // The extra memory needed if we are not using floats for the final logits.
     size_t logits_sz = 0;
 #ifndef MMHA_USE_FP32_ACUM_FOR_LOGITS
     if (sizeof(T) != 4) {
         // TDOD
-        logits_sz = (DO_CROSS_ATTENTION) ? div_up(params.memory_max_len + 1, 4) * 4 * sizeof(T) :
-                                           div_up(max_timesteps + 1, 4) * 4 * sizeof(T);
+        logits_sz = div_up(max_timesteps + 1, 4) * 4 * sizeof(T);
     }
 #endif
 
@@ -885,10 +1027,7 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
     char* logits_smem_ = smem_;
 #ifndef MMHA_USE_FP32_ACUM_FOR_LOGITS
     if (sizeof(T) != 4) {
-        // TODO - change to tlength
-        const int max_timesteps = min(params.timestep, params.memory_max_len);
-        logits_smem_ +=
-            (DO_CROSS_ATTENTION) ? div_up(params.memory_max_len + 1, 4) * 16 : div_up(max_timesteps + 1, 4) * 16;
+        logits_smem_ += div_up(max_smem_timesteps(params) + 1, 4) * 16;
     }
     T* logits_smem = reinterpret_cast<T*>(logits_smem_);
 #else
@@ -942,7 +1081,14 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
     const int bbi = bi / params.beam_width;
     // The head.
     // const int hi = blockIdx.x;
-    const int hi = params.nnz_head_idx == nullptr ? blockIdx.x : params.nnz_head_idx[blockIdx.x];
+    // With nnz_head_idx, the first nnz_heads blocks attend for the heads it lists, and the num_heads_kv
+    // blocks after them only append the new key / value of each KV head group to the cache, so that the
+    // cache stays complete whichever heads are skipped.
+    const bool attends = params.nnz_head_idx == nullptr || blockIdx.x < params.nnz_heads;
+    const int  hi      = params.nnz_head_idx == nullptr ? blockIdx.x :
+                         attends ? params.nnz_head_idx[blockIdx.x] :
+                                   (blockIdx.x - params.nnz_heads) * params.num_heads_q_kv_ratio;
+    const bool appends_kv = params.nnz_head_idx == nullptr ? hi % params.num_heads_q_kv_ratio == 0 : !attends;
     const int hi_kv = hi / params.num_heads_q_kv_ratio;
     // Combine the batch and the head indices.
     const int bhi = bi * params.num_heads + hi;
@@ -972,6 +1118,11 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
                                                     params.length_per_sample[bi] + params.max_prefix_prompt_length;
     const int first_step   = max(0, tlength + 1 - params.memory_max_len);
     const int tlength_circ = tlength % params.memory_max_len;
+    // The cached timesteps attended, one per slot of qk_smem / logits_smem: the ones listed by select_pages
+    // with sparse page retrieval, else all of them from first_step.
+    const int* attended_ti =
+        params.timestep_idx == nullptr ? nullptr : &params.timestep_idx[bhi * params.max_attended];
+    const int num_slots = attended_ti == nullptr ? tlength - first_step : params.num_attended[bhi];
 
     // First QK_VECS_PER_WARP load Q and K + the bias values for the current timestep.
     const bool is_masked = tidx >= QK_VECS_PER_WARP;
@@ -1182,10 +1333,14 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
                      // params.timestep*QK_ELTS_IN_16B +
                      tlength_circ * QK_ELTS_IN_16B + ci;
 
-        if (handle_kv && hi % params.num_heads_q_kv_ratio == 0) {
+        if (handle_kv && appends_kv && params.kv_cache_quant == KV_CACHE_QUANT_NONE) {
             // Trigger the stores to global memory.
             if (Dh == Dh_MAX || co < Dh / QK_ELTS_IN_16B) {
                 *reinterpret_cast<Qk_vec*>(&params.k_cache[offset]) = k;
+                // The page summary of sparse page retrieval follows the cache, which must not wrap around.
+                if (params.page_summary != nullptr && tlength < params.memory_max_len) {
+                    update_page_summary<T>(params, bhi_kv, tlength, tidx * QK_VEC_SIZE, k);
+                }
             }
         }
 
@@ -1209,6 +1364,55 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
         qk                          = block_sum<WARPS_PER_RED>(&red_smem[WARPS_PER_RED], qk);
     }
 
+    // 8-bit KV cache: the new key and value are quantized with their absmax over the head dimension
+    // (the value loaded here the same way as the key). All the threads enter the reductions.
+    float v_scale = 0.f;
+    if (params.kv_cache_quant != KV_CACHE_QUANT_NONE && handle_kv) {
+        Qk_vec v_new;
+        zero(v_new);
+        if (!is_masked && (Dh == Dh_MAX || tidx * QK_VEC_SIZE < Dh)) {
+            v_new = *reinterpret_cast<const Qk_vec*>(&params.v[v_base_offset + tidx * QK_VEC_SIZE]);
+        }
+        const float k_amax = block_max<WARPS_PER_BLOCK>(red_smem, vec_absmax<T>(k));
+        __syncthreads();
+        const float v_amax = block_max<WARPS_PER_BLOCK>(red_smem, vec_absmax<T>(v_new));
+        __syncthreads();
+        const float k_scale = k_amax / kv_cache_quant_max(params.kv_cache_quant);
+        v_scale             = v_amax / kv_cache_quant_max(params.kv_cache_quant);
+
+        if (appends_kv) {
+            // Same place as the K values above, in the codes.
+            int co     = tidx / QK_VECS_IN_16B;
+            int ci     = tidx % QK_VECS_IN_16B * QK_VEC_SIZE;
+            int offset = bhi_kv * params.memory_max_len * Dh + co * params.memory_max_len * QK_ELTS_IN_16B
+                         + tlength_circ * QK_ELTS_IN_16B + ci;
+            if (!is_masked && (Dh == Dh_MAX || co < Dh / QK_ELTS_IN_16B)) {
+                store_quantized_kv<T>(
+                    &params.k_cache_quant[offset], k, kv_cache_inv_scale(k_scale), params.kv_cache_quant);
+            }
+            if (tidx == 0) {
+                params.k_cache_scale[bhi_kv * params.memory_max_len + tlength_circ] = k_scale;
+                params.v_cache_scale[bhi_kv * params.memory_max_len + tlength_circ] = v_scale;
+            }
+        }
+    }
+
+    // The blocks that only append: the key is in the cache, the value (without bias) goes the same way.
+    if (!attends) {
+        if (handle_kv && !is_masked && (Dh == Dh_MAX || tidx * QK_VEC_SIZE < Dh)) {
+            const Qk_vec v_new = *reinterpret_cast<const Qk_vec*>(&params.v[v_base_offset + tidx * QK_VEC_SIZE]);
+            const int    offset = (bhi_kv * params.memory_max_len + tlength_circ) * Dh + tidx * QK_VEC_SIZE;
+            if (params.kv_cache_quant != KV_CACHE_QUANT_NONE) {
+                store_quantized_kv<T>(
+                    &params.v_cache_quant[offset], v_new, kv_cache_inv_scale(v_scale), params.kv_cache_quant);
+            }
+            else {
+                *reinterpret_cast<Qk_vec*>(&params.v_cache[offset]) = v_new;
+            }
+        }
+        return;
+    }
+
     // Store that value in shared memory. Keep the Q*K^T value in register for softmax.
     if (tidx == 0) {
         // Normalize qk.
@@ -1222,8 +1426,8 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
         }
         // We don't need to apply the linear position bias here since qi - ki = 0 yields the position bias 0.
 
-        qk_max                        = qk;
-        qk_smem[tlength - first_step] = qk;
+        qk_max             = qk;
+        qk_smem[num_slots] = qk;
         // qk_smem[params.timestep] = qk;
     }
 
@@ -1272,10 +1476,12 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
     T* k_cache = &params.k_cache[bhi_kv * params.memory_max_len * Dh + ki];
     // Base pointer for the beam's batch, before offsetting with indirection buffer
     T* k_cache_batch = &params.k_cache[bbhi * params.memory_max_len * Dh + ki];
+    // The same in the codes of an 8-bit cache.
+    const uint8_t* k_cache_quant_batch = &params.k_cache_quant[bbhi * params.memory_max_len * Dh + ki];
 
     // Pick a number of keys to make sure all the threads of a warp enter (due to shfl_sync).
     // int ti_end = div_up(params.timestep, K_PER_WARP) * K_PER_WARP;
-    int ti_end = div_up(tlength - first_step, K_PER_WARP) * K_PER_WARP + first_step;
+    int si_end = div_up(num_slots, K_PER_WARP) * K_PER_WARP;
 
     // prefix prompt length if has
     const int prefix_prompt_length = (params.prefix_prompt_lengths == nullptr) ? 0 : params.prefix_prompt_lengths[bi];
@@ -1284,7 +1490,8 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
     const bool has_beams    = params.cache_indir != nullptr;
     const int* beam_indices = has_beams ? &params.cache_indir[bi_seq_len_offset] : nullptr;
 
-    for (int ti = first_step + ko; ti < ti_end; ti += K_PER_ITER) {
+    for (int si = ko; si < si_end; si += K_PER_ITER) {
+        const int ti      = slot_timestep(attended_ti, first_step, num_slots, tlength, si);
         const int ti_circ = ti % params.memory_max_len;
 
         // The keys loaded from the key cache.
@@ -1301,8 +1508,18 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
                     k[ii] = k_vec_zero;
                 }
                 else {
-                    if (has_beams) {
-                        const int beam_offset = beam_indices[ti_circ] * params.num_heads * params.memory_max_len * Dh;
+                    if (params.kv_cache_quant != KV_CACHE_QUANT_NONE) {
+                        const int beam_src = has_beams ? beam_indices[ti_circ] : 0;
+                        const float k_scale =
+                            params.k_cache_scale[(bbhi + beam_src * params.num_heads_kv) * params.memory_max_len + ti_circ];
+                        k[ii] = load_dequantized_kv<T, K_vec>(
+                            &k_cache_quant_batch[beam_src * params.num_heads_kv * params.memory_max_len * Dh
+                                                 + jj * QK_ELTS_IN_16B],
+                            k_scale,
+                            params.kv_cache_quant);
+                    }
+                    else if (has_beams) {
+                        const int beam_offset = beam_indices[ti_circ] * params.num_heads_kv * params.memory_max_len * Dh;
                         k[ii] = *reinterpret_cast<const K_vec*>(&k_cache_batch[beam_offset + jj * QK_ELTS_IN_16B]);
                     }
                     else {
@@ -1355,8 +1572,8 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
 
                 qk += mul<float, T, float>(params.linear_bias_slopes[hi], dist);
             }
-            qk_max                   = is_mask ? qk_max : fmaxf(qk_max, qk);
-            qk_smem[ti - first_step] = qk;
+            qk_max      = is_mask ? qk_max : fmaxf(qk_max, qk);
+            qk_smem[si] = qk;
         }
     }
 
@@ -1394,11 +1611,12 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
     // Compute the logits and start the sum.
     float sum = 0.f;
     // for( int ti = tidx; ti <= params.timestep; ti += THREADS_PER_BLOCK ) {
-    for (int ti = first_step + tidx; ti <= tlength; ti += THREADS_PER_BLOCK) {
-        bool  is_mask = (params.masked_tokens != nullptr) && params.masked_tokens[bi_seq_len_offset + ti];
-        float logit   = is_mask ? 0.f : __expf(qk_smem[ti - first_step] - qk_max);
+    for (int si = tidx; si <= num_slots; si += THREADS_PER_BLOCK) {
+        const int ti      = slot_timestep(attended_ti, first_step, num_slots, tlength, si);
+        bool      is_mask = (params.masked_tokens != nullptr) && params.masked_tokens[bi_seq_len_offset + ti];
+        float     logit   = is_mask ? 0.f : __expf(qk_smem[si] - qk_max);
         sum += logit;
-        qk_smem[ti - first_step] = logit;
+        qk_smem[si] = logit;
     }
 
     // Compute the sum.
@@ -1411,12 +1629,12 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
         params.is_return_cross_attentions ?
             bhi * params.max_decoder_seq_len * params.memory_max_len + params.timestep * params.memory_max_len :
             0;
-    for (int ti = first_step + tidx; ti <= tlength; ti += THREADS_PER_BLOCK) {
-        float logit = qk_smem[ti - first_step] * inv_sum;
+    for (int si = tidx; si <= num_slots; si += THREADS_PER_BLOCK) {
+        float logit = qk_smem[si] * inv_sum;
         if (params.is_return_cross_attentions) {
-            params.cross_attention_out[cross_attention_out_offset + ti] = logit;
+            params.cross_attention_out[cross_attention_out_offset + first_step + si] = logit;
         }
-        convert_from_float(logits_smem[ti - first_step], logit);
+        convert_from_float(logits_smem[si], logit);
     }
 
     // Put Values part below so we leverage __syncthreads
@@ -1436,6 +1654,9 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
     T* v_cache = &params.v_cache[bhi_kv * params.memory_max_len * Dh + vi];
     // Base pointer for the beam's batch, before offsetting with indirection buffer
     T* v_cache_batch = &params.v_cache[bbhi * params.memory_max_len * Dh + vi];
+    // The same in the codes of an 8-bit cache.
+    uint8_t*       v_cache_quant       = &params.v_cache_quant[bhi_kv * params.memory_max_len * Dh + vi];
+    const uint8_t* v_cache_quant_batch = &params.v_cache_quant[bbhi * params.memory_max_len * Dh + vi];
 
     // The number of values processed per iteration of the loop.
     constexpr int V_PER_ITER = THREADS_PER_BLOCK / THREADS_PER_VALUE;
@@ -1475,14 +1696,24 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
     // Loop over the timesteps to compute the partial outputs.
     // for( int ti = vo; ti < params.timestep; ti += V_PER_ITER ) {
     if (Dh == Dh_MAX || vi < Dh) {
-        for (int ti = first_step + vo; ti < tlength; ti += V_PER_ITER) {
+        for (int si = vo; si < num_slots; si += V_PER_ITER) {
+            const int ti      = slot_timestep(attended_ti, first_step, num_slots, tlength, si);
             const int ti_circ = ti % params.memory_max_len;
 
             // Fetch offset based on cache_indir when beam sampling
             const int beam_src = (params.cache_indir != nullptr) ? params.cache_indir[bi_seq_len_offset + ti_circ] : 0;
-            const int beam_offset = beam_src * params.num_heads * params.memory_max_len * Dh;
+            const int beam_offset = beam_src * params.num_heads_kv * params.memory_max_len * Dh;
             // Load the values from the cache.
-            V_vec v = *reinterpret_cast<const V_vec*>(&v_cache_batch[beam_offset + ti_circ * Dh]);
+            V_vec v;
+            if (params.kv_cache_quant != KV_CACHE_QUANT_NONE) {
+                const float v_scale_ti =
+                    params.v_cache_scale[(bbhi + beam_src * params.num_heads_kv) * params.memory_max_len + ti_circ];
+                v = load_dequantized_kv<T, V_vec>(
+                    &v_cache_quant_batch[beam_offset + ti_circ * Dh], v_scale_ti, params.kv_cache_quant);
+            }
+            else {
+                v = *reinterpret_cast<const V_vec*>(&v_cache_batch[beam_offset + ti_circ * Dh]);
+            }
             if (DO_CROSS_ATTENTION && params.timestep == 0) {
                 v = add(v, *reinterpret_cast<V_vec*>(&bias_smem[vi]));
                 if (do_ia3) {
@@ -1495,10 +1726,10 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
             }
             // Load the logits from shared memory.
 #if defined(MMHA_USE_FP32_ACUM_FOR_LOGITS)
-            float logit = logits_smem[ti - first_step];
+            float logit = logits_smem[si];
             out         = fma(logit, cast_to_float(v), out);
 #else
-            T logit = logits_smem[ti - first_step];
+            T logit = logits_smem[si];
 
             // Update the partial sums.
             out = fma(logit, v, out);
@@ -1545,19 +1776,25 @@ __global__ void masked_multihead_attention_kernel(Multihead_attention_params<T,
             }
 
             // Store the values with bias back to global memory in the cache for V.
-            if (hi % params.num_heads_q_kv_ratio == 0) {
+            if (appends_kv) {
                 //*reinterpret_cast<V_vec*>(&v_cache[params.timestep*Dh]) = v;
-                *reinterpret_cast<V_vec*>(&v_cache[tlength_circ * Dh]) = v;
+                if (params.kv_cache_quant != KV_CACHE_QUANT_NONE) {
+                    store_quantized_kv<T>(
+                        &v_cache_quant[tlength_circ * Dh], v, kv_cache_inv_scale(v_scale), params.kv_cache_quant);
+                }
+                else {
+                    *reinterpret_cast<V_vec*>(&v_cache[tlength_circ * Dh]) = v;
+                }
             }
         }
 
         // Initialize the output value with the current timestep.
 #if defined(MMHA_USE_FP32_ACUM_FOR_LOGITS)
         // out = fma(logits_smem[params.timestep], cast_to_float(v), out);
-        out = fma(logits_smem[tlength - first_step], cast_to_float(v), out);
+        out = fma(logits_smem[num_slots], cast_to_float(v), out);
 #else
         // out = fma(logits_smem[params.timestep], v, out);
-        out = fma(logits_smem[tlength - first_step], v, out);
+        out = fma(logits_smem[num_slots], v, out);
 #endif
     }
 
@@ -0,0 +1,238 @@
+// Sparse page retrieval of single_query_attention, ahead of the attention step: one block per (head,
+// sequence) rotates its query to position tlength as the cached keys were, scores the pages before
+// tlength - recent_window by the bound sum_c max(q_c * min_c, q_c * max_c) of q.k over their keys, picks
+// the top_k_pages of them (a radix select of the k-th best score, the ties going to the earlier pages) and
+// lists the timesteps the head attends in increasing order: those of the pages it picked, then the recent
+// window. The attention step then goes over that list only, so that its work and its shared memory scale
+// with top_k_pages * page_size + recent_window rather than with the length of the cache.
+
+#include "decoder_masked_multihead_attention.h"
+#include "decoder_masked_multihead_attention_utils.h"
+#include "cuda_bf16_wrapper.h"
+#include <assert.h>
+#include <float.h>
+#include <type_traits>
+
+#include "decoder_masked_multihead_attention_template.hpp"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace mmha {
+
+// The scores as unsigned ints in the same order.
+inline __device__ uint32_t orderable_score(const float score)
+{
+    const uint32_t bits = __float_as_uint(score);
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+// Exclusive prefix sum of x over the block, and its total.
+template<int THREADS>
+inline __device__ int block_exclusive_sum(const int x, int* scan_smem, int& total)
+{
+    const int tidx  = threadIdx.x;
+    scan_smem[tidx] = x;
+    __syncthreads();
+#pragma unroll
+    for (int offset = 1; offset < THREADS; offset *= 2) {
+        const int y = tidx >= offset ? scan_smem[tidx - offset] : 0;
+        __syncthreads();
+        scan_smem[tidx] += y;
+        __syncthreads();
+    }
+    const int inclusive = scan_smem[tidx];
+    total               = scan_smem[THREADS - 1];
+    __syncthreads();
+    return inclusive - x;
+}
+
+template<typename T, int THREADS>
+__global__ void select_pages_kernel(Masked_multihead_attention_params<T> params)
+{
+    constexpr int WARP_SIZE = 32;
+    constexpr int WARPS     = THREADS / WARP_SIZE;
+    constexpr int Dh_MAX    = 256;
+    // The radix select goes 8 bits at a time, one bin of the histogram per thread.
+    constexpr int RADIX_BITS = 8;
+    static_assert(THREADS == 1 << RADIX_BITS, "");
+
+    __shared__ float q_smem[Dh_MAX];
+    __shared__ int   scan_smem[THREADS];
+    __shared__ int   hist_smem[THREADS];
+    __shared__ int   bin_smem, remaining_smem;
+
+    const int Dh     = params.hidden_size_per_head;
+    const int hi     = blockIdx.x;
+    const int bi     = blockIdx.y;
+    const int bhi    = bi * params.num_heads + hi;
+    const int bhi_kv = bi * params.num_heads_kv + hi / params.num_heads_q_kv_ratio;
+    const int tidx   = threadIdx.x;
+    const int warp   = tidx / WARP_SIZE;
+    const int lane   = tidx % WARP_SIZE;
+
+    const int tlength        = params.length_per_sample == nullptr ?
+                                   params.timestep :
+                                   params.length_per_sample[bi] + params.max_prefix_prompt_length;
+    const int window_start   = max(tlength - params.recent_window, 0);
+    const int num_candidates = min(div_up(window_start, params.page_size), params.num_pages);
+    const int k              = min(params.top_k_pages, num_candidates);
+
+    // The query, rotated in fp32.
+    const int q_offset = params.stride_q == 0 ? bhi * Dh : bi * params.stride_q + hi * Dh;
+    for (int c = tidx; c < Dh; c += THREADS) {
+        q_smem[c] = elt_to_float(params.q[q_offset + c]);
+    }
+    __syncthreads();
+    const int rot_dim = params.rotary_embedding_dim;
+    for (int i = tidx; i < rot_dim / 2; i += THREADS) {
+        float cos, sin;
+        if (params.rotary_cos == nullptr) {
+            const float pos_idx_inv_freq = tlength / powf(params.rotary_base, 2 * i / (float)rot_dim);
+            cos                          = cosf(pos_idx_inv_freq);
+            sin                          = sinf(pos_idx_inv_freq);
+        }
+        else {
+            cos = elt_to_float(params.rotary_cos[bi * rot_dim / 2 + i]);
+            sin = elt_to_float(params.rotary_sin[bi * rot_dim / 2 + i]);
+        }
+        const int   i0 = params.neox_rotary_style ? i : 2 * i;
+        const int   i1 = params.neox_rotary_style ? i + rot_dim / 2 : 2 * i + 1;
+        const float q0 = q_smem[i0], q1 = q_smem[i1];
+        q_smem[i0]     = cos * q0 - sin * q1;
+        q_smem[i1]     = cos * q1 + sin * q0;
+    }
+    __syncthreads();
+
+    // The scores of the candidates, one warp per page.
+    float*       scores  = &params.page_scores[(size_t)bhi * params.num_pages];
+    const float* summary = &params.page_summary[(size_t)bhi_kv * params.num_pages * 2 * Dh];
+    for (int p = warp; p < num_candidates; p += WARPS) {
+        const float* key_min = &summary[(size_t)p * 2 * Dh];
+        const float* key_max = key_min + Dh;
+        float        score   = 0.f;
+        for (int c = lane; c < Dh; c += WARP_SIZE) {
+            score += fmaxf(q_smem[c] * key_min[c], q_smem[c] * key_max[c]);
+        }
+#pragma unroll
+        for (int mask = WARP_SIZE / 2; mask >= 1; mask /= 2) {
+            score += __shfl_xor_sync(uint32_t(-1), score, mask);
+        }
+        if (lane == 0) {
+            scores[p] = score;
+        }
+    }
+    __syncthreads();
+
+    // The k-th best score as threshold, and how many of the scores equal to it are picked.
+    const bool picks_all = k == num_candidates;
+    uint32_t   threshold = 0;
+    int        remaining = k;
+    if (!picks_all) {
+        uint32_t prefix_mask = 0;
+        for (int shift = 32 - RADIX_BITS; shift >= 0; shift -= RADIX_BITS) {
+            hist_smem[tidx] = 0;
+            __syncthreads();
+            for (int p = tidx; p < num_candidates; p += THREADS) {
+                const uint32_t key = orderable_score(scores[p]);
+                if ((key & prefix_mask) == threshold) {
+                    atomicAdd(&hist_smem[(key >> shift) & (THREADS - 1)], 1);
+                }
+            }
+            __syncthreads();
+            if (tidx == 0) {
+                int bin = THREADS - 1;
+                while (hist_smem[bin] < remaining) {
+                    remaining -= hist_smem[bin];
+                    --bin;
+                }
+                bin_smem       = bin;
+                remaining_smem = remaining;
+            }
+            __syncthreads();
+            threshold |= uint32_t(bin_smem) << shift;
+            prefix_mask |= uint32_t(THREADS - 1) << shift;
+            remaining = remaining_smem;
+        }
+    }
+
+    // The picked pages in increasing order.
+    int* selected        = &params.selected_pages[(size_t)bhi * params.top_k_pages];
+    int  ties_before     = 0;
+    int  selected_before = 0;
+    for (int start = 0; start < num_candidates; start += THREADS) {
+        const int p     = start + tidx;
+        bool      above = false, is_tie = false;
+        if (p < num_candidates && !picks_all) {
+            const uint32_t key = orderable_score(scores[p]);
+            above              = key > threshold;
+            is_tie             = key == threshold;
+        }
+        int       num_ties;
+        const int tie_rank    = ties_before + block_exclusive_sum<THREADS>(is_tie, scan_smem, num_ties);
+        const bool is_selected = p < num_candidates && (picks_all || above || (is_tie && tie_rank < remaining));
+        int       num_selected;
+        const int pos = selected_before + block_exclusive_sum<THREADS>(is_selected, scan_smem, num_selected);
+        if (is_selected) {
+            selected[pos] = p;
+        }
+        ties_before += num_ties;
+        selected_before += num_selected;
+    }
+    __syncthreads();
+
+    // Their timesteps before the window: only the last candidate can go past its start, and it comes last
+    // when picked.
+    int* attended = &params.timestep_idx[(size_t)bhi * params.max_attended];
+    for (int idx = tidx; idx < k * params.page_size; idx += THREADS) {
+        const int ti = selected[idx / params.page_size] * params.page_size + idx % params.page_size;
+        if (ti < window_start) {
+            attended[idx] = ti;
+        }
+    }
+    const int num_paged =
+        k == 0 ? 0 : k * params.page_size - max((selected[k - 1] + 1) * params.page_size - window_start, 0);
+    for (int idx = tidx; idx < tlength - window_start; idx += THREADS) {
+        attended[num_paged + idx] = window_start + idx;
+    }
+    if (tidx == 0) {
+        params.num_attended[bhi] = num_paged + tlength - window_start;
+    }
+}
+
+}  // namespace mmha
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+void select_pages_(const Masked_multihead_attention_params<T>& params, const cudaStream_t& stream)
+{
+    constexpr int THREADS_PER_BLOCK = 256;
+    assert(params.hidden_size_per_head <= 256);
+    dim3 grid(params.num_heads, params.batch_size);
+    mmha::select_pages_kernel<T, THREADS_PER_BLOCK><<<grid, THREADS_PER_BLOCK, 0, stream>>>(params);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void select_pages(const Masked_multihead_attention_params<float>& params, const cudaStream_t& stream)
+{
+    select_pages_<float>(params, stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void select_pages(const Masked_multihead_attention_params<uint16_t>& params, const cudaStream_t& stream)
+{
+    select_pages_<uint16_t>(params, stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef ENABLE_BF16
+void select_pages(const Masked_multihead_attention_params<__nv_bfloat16>& params, const cudaStream_t& stream)
+{
+    select_pages_<__nv_bfloat16>(params, stream);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
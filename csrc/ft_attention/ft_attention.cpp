@@ -4,8 +4,10 @@
 
 
 #include "decoder_masked_multihead_attention.h"
+#include "kv_cache_quant.h"
 
-#define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
+// Inputs are on CUDA, or all on the CPU for the reference implementation.
+#define CHECK_DEVICE(x) TORCH_CHECK(x.device() == q.device(), #x " must be on the same device as q")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
 #define CHECK_CONTIGUOUS(x) TORCH_CHECK(x.is_contiguous(), #x " must be contiguous")
 
@@ -31,6 +33,15 @@ template<typename T>
 void cross_multihead_attention(const Masked_multihead_attention_params<T>& params,
                                const cudaStream_t& stream);
 
+template<typename T>
+void masked_multihead_attention_cpu(const Masked_multihead_attention_params<T>& params);
+
+template<typename T>
+void few_query_attention_cpu(const Masked_multihead_attention_params<T>& params);
+
+template<typename T>
+void select_pages_cpu(const Masked_multihead_attention_params<T>& params);
+
 template<typename T>
 struct SATypeConverter {
     using Type = T;
@@ -53,6 +64,7 @@ void set_params(Masked_multihead_attention_params<T> &params,
                 const size_t nheads_kv,
                 const size_t memory_max_seqlen,
                 const size_t headdim,
+                const int beam_width,
                 const int timestep,
                 const int rotary_embedding_dim,
                 const float rotary_base,
@@ -67,6 +79,7 @@ void set_params(Masked_multihead_attention_params<T> &params,
                 T *k_cache_ptr,
                 T *v_cache_ptr,
                 int *length_per_sample,
+                const int *cache_indir,
                 T *rotary_cos,
                 T *rotary_sin,
                 T *out_ptr,
@@ -82,12 +95,12 @@ void set_params(Masked_multihead_attention_params<T> &params,
     params.k_cache = k_cache_ptr;
     params.v_cache = v_cache_ptr;
     params.out = out_ptr;
-    params.cache_indir = nullptr;
+    params.cache_indir = cache_indir;
     params.stride_q = q_batch_stride;
     params.stride_k = k_batch_stride;
     params.stride_v = v_batch_stride;
     params.batch_size = batch_size;
-    params.beam_width = 1;
+    params.beam_width = beam_width;
     params.memory_max_len = memory_max_seqlen;
     params.num_heads = nheads;
     params.num_heads_kv = nheads_kv;
@@ -128,8 +141,18 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const int timestep,
                                      int rotary_embedding_dim = 0,
                                      const float rotary_base = 10000.0f,
-                                     const bool neox_rotary_style=true) {
-    CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); CHECK_DEVICE(k_cache); CHECK_DEVICE(v_cache);
+                                     const bool neox_rotary_style=true,
+                                     const int beam_width=1,
+                                     c10::optional<const torch::Tensor> cache_indir_=c10::nullopt,
+                                     c10::optional<const torch::Tensor> k_cache_scale_=c10::nullopt,
+                                     c10::optional<const torch::Tensor> v_cache_scale_=c10::nullopt,
+                                     c10::optional<const torch::Tensor> page_summary_=c10::nullopt,
+                                     const int page_size=0,
+                                     const int top_k_pages=0,
+                                     const int recent_window=0) {
+    const bool is_cpu = q.is_cpu();
+    TORCH_CHECK(q.is_cuda() || is_cpu, "q must be on CUDA or on the CPU");
+    CHECK_DEVICE(k); CHECK_DEVICE(v); CHECK_DEVICE(k_cache); CHECK_DEVICE(v_cache);
     int batch_size = v_cache.size(0);
     int nheads = q.size(1);
     int nheads_kv = v_cache.size(1);
@@ -143,7 +166,7 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     CHECK_SHAPE(v, batch_size, nheads_kv, headdim);
     CHECK_SHAPE(v_cache, batch_size, nheads_kv, memory_max_seqlen, headdim);
     // k_cache shape: [B, H, Dh/x, L, x] where x=8 for fp16 and x=4 for fp32
-    int packsize = k_cache.dtype() == torch::kFloat32 ? 4 : 8;
+    int packsize = input_type == torch::kFloat32 ? 4 : 8;
     CHECK_SHAPE(k_cache, batch_size, nheads_kv, headdim / packsize, memory_max_seqlen, packsize);
     TORCH_CHECK(q.stride(2) == 1 && q.stride(1) == headdim);
     TORCH_CHECK(k.stride(2) == 1 && k.stride(1) == headdim);
@@ -153,8 +176,27 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     TORCH_CHECK(q.scalar_type() == input_type);
     TORCH_CHECK(k.scalar_type() == input_type);
     TORCH_CHECK(v.scalar_type() == input_type);
-    TORCH_CHECK(k_cache.scalar_type() == input_type);
-    TORCH_CHECK(v_cache.scalar_type() == input_type);
+    // 8-bit KV cache (kv_cache_quant.h): int8 caches hold int8 codes, uint8 caches the bits of fp8 e4m3
+    // codes, with the fp32 scales of each head and token in k_cache_scale / v_cache_scale. The step
+    // quantizes the new key and value as it appends them and dequantizes the cached ones to q's type.
+    const int kv_cache_quant = k_cache.scalar_type() == torch::kInt8 ? KV_CACHE_QUANT_INT8
+        : k_cache.scalar_type() == torch::kUInt8 ? KV_CACHE_QUANT_FP8_E4M3 : KV_CACHE_QUANT_NONE;
+    if (kv_cache_quant == KV_CACHE_QUANT_NONE) {
+        TORCH_CHECK(k_cache.scalar_type() == input_type);
+        TORCH_CHECK(v_cache.scalar_type() == input_type);
+        TORCH_CHECK(!k_cache_scale_.has_value() && !v_cache_scale_.has_value(),
+                    "k_cache_scale and v_cache_scale are only for 8-bit caches");
+    } else {
+        TORCH_CHECK(v_cache.scalar_type() == k_cache.scalar_type(), "k_cache and v_cache must have the same dtype");
+        TORCH_CHECK(k_cache_scale_.has_value() && v_cache_scale_.has_value(),
+                    "8-bit caches need k_cache_scale and v_cache_scale");
+        for (const auto &scale : {k_cache_scale_.value(), v_cache_scale_.value()}) {
+            CHECK_DEVICE(scale);
+            CHECK_SHAPE(scale, batch_size, nheads_kv, memory_max_seqlen);
+            CHECK_CONTIGUOUS(scale);
+            TORCH_CHECK(scale.dtype() == torch::kFloat32, "k_cache_scale and v_cache_scale must have dtype float32");
+        }
+    }
 
     if (length_per_sample_.has_value()) {
         auto length_per_sample = length_per_sample_.value();
@@ -164,6 +206,21 @@ torch::Tensor single_query_attention(const torch::Tensor q,
         TORCH_CHECK(length_per_sample.dtype() == torch::kInt32);
     }
 
+    // Beam search: the rows of k_cache / v_cache are the beam_width beams of each of the
+    // batch_size / beam_width sequences, and cache_indir[i, t] which beam of its sequence has the key
+    // and value of step t of the beam i in its rows, so that beams share their prefixes instead of
+    // copying them around when they are reordered. Each beam appends its new key and value to its own
+    // rows.
+    TORCH_CHECK(beam_width >= 1 && batch_size % beam_width == 0, "beam_width must divide the batch size");
+    TORCH_CHECK(beam_width == 1 || cache_indir_.has_value(), "beam search needs cache_indir");
+    if (cache_indir_.has_value()) {
+        auto cache_indir = cache_indir_.value();
+        CHECK_DEVICE(cache_indir);
+        CHECK_SHAPE(cache_indir, batch_size, memory_max_seqlen);
+        CHECK_CONTIGUOUS(cache_indir);
+        TORCH_CHECK(cache_indir.dtype() == torch::kInt32, "cache_indir must have dtype int32");
+    }
+
     if (rotary_cos_.has_value()) {
         auto rotary_cos = rotary_cos_.value();
         CHECK_DEVICE(rotary_cos);
@@ -191,33 +248,196 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    c10::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
 
-    torch::Tensor out = torch::empty_like(q);
+    // Sparse page retrieval for long caches: page_summary (batch_size, nheads_kv, num_pages, 2, headdim)
+    // float32 holds the per-channel min / max of the cached keys of each page of page_size timesteps. A page
+    // can give q.k at most sum(max(q * min, q * max)), and each head attends only the top_k_pages pages by
+    // that bound, on top of the recent_window timesteps. select_pages lists the timesteps on the device, and
+    // the attention goes over them only, in time and shared memory bounded by top_k_pages * page_size +
+    // recent_window. The caller keeps page_summary up to date for the prompt (kv_page_summary in
+    // flash_attn/utils/generation.py), and the attention kernel adds the key of the step to it. The cache
+    // must not wrap around: timestep < memory_max_seqlen, and so must length_per_sample for each sequence
+    // (not checked here, that would sync with the device).
+    torch::Tensor timestep_idx, num_attended, page_scores, selected_pages;
+    int num_pages = 0, max_attended = 0;
+    if (page_summary_.has_value()) {
+        auto page_summary = page_summary_.value();
+        TORCH_CHECK(page_size > 0 && top_k_pages > 0 && recent_window >= 0,
+                    "sparse page retrieval needs page_size > 0, top_k_pages > 0 and recent_window >= 0");
+        TORCH_CHECK(kv_cache_quant == KV_CACHE_QUANT_NONE, "sparse page retrieval does not support 8-bit caches");
+        TORCH_CHECK(!cache_indir_.has_value(), "sparse page retrieval does not support beam search");
+        TORCH_CHECK(headdim <= 256, "sparse page retrieval supports head dimensions up to 256");
+        TORCH_CHECK(timestep < memory_max_seqlen,
+                    "sparse page retrieval needs timestep < memory_max_seqlen, the cache must not wrap around");
+        num_pages = (memory_max_seqlen + page_size - 1) / page_size;
+        CHECK_DEVICE(page_summary);
+        CHECK_SHAPE(page_summary, batch_size, nheads_kv, num_pages, 2, headdim);
+        CHECK_CONTIGUOUS(page_summary);
+        TORCH_CHECK(page_summary.dtype() == torch::kFloat32, "page_summary must have dtype float32");
+        max_attended = std::min(top_k_pages, num_pages) * page_size + recent_window;
+        auto int_opts = q.options().dtype(torch::kInt32);
+        timestep_idx = torch::empty({batch_size, nheads, max_attended}, int_opts);
+        num_attended = torch::empty({batch_size, nheads}, int_opts);
+        page_scores = torch::empty({batch_size, nheads, num_pages}, q.options().dtype(torch::kFloat32));
+        selected_pages = torch::empty({batch_size, nheads, std::min(top_k_pages, num_pages)}, int_opts);
+    }
+
+    // The heads not in nnz_head_idx are skipped, and output zeros. Their KV heads still get the new key
+    // and value appended, so that they can be attended again at a later step.
+    torch::Tensor out = nnz_head_idx_.has_value() ? torch::zeros_like(q) : torch::empty_like(q);
 
     DISPATCH_FLOAT_AND_HALF_AND_BF16(q.scalar_type(), "single_query_attention", [&] {
-        using DataType = typename SATypeConverter<scalar_t>::Type;
-        Masked_multihead_attention_params<DataType> params;
-        set_params(params, batch_size, nheads, nheads_kv, memory_max_seqlen, headdim, timestep,
-                   rotary_embedding_dim, rotary_base, neox_rotary_style,
-                   q.stride(0), k.stride(0), v.stride(0),
-                   nnz_head_idx_.has_value() ? nnz_head_idx_.value().size(0) : 0,
-                   reinterpret_cast<DataType*>(q.data_ptr()),
-                   reinterpret_cast<DataType*>(k.data_ptr()),
-                   reinterpret_cast<DataType*>(v.data_ptr()),
-                   reinterpret_cast<DataType*>(k_cache.data_ptr()),
-                   reinterpret_cast<DataType*>(v_cache.data_ptr()),
-                   length_per_sample_.has_value()
-                       ? length_per_sample_.value().data_ptr<int>() : nullptr,
-                   rotary_cos_.has_value()
-                       ? reinterpret_cast<DataType*>(rotary_cos_.value().data_ptr()) : nullptr,
-                   rotary_sin_.has_value()
-                       ? reinterpret_cast<DataType*>(rotary_sin_.value().data_ptr()) : nullptr,
-                   reinterpret_cast<DataType*>(out.data_ptr()),
-                   nnz_head_idx_.has_value() ? nnz_head_idx_.value().data_ptr<int>() : nullptr
-                   );
-        auto stream = at::cuda::getCurrentCUDAStream();
-        masked_multihead_attention(params, stream);
+        // The CUDA kernel takes its own element types, the CPU reference the ATen ones.
+        auto set_params_from_inputs = [&](auto &params) {
+            using DataType = std::remove_pointer_t<decltype(params.out)>;
+            set_params(params, batch_size, nheads, nheads_kv, memory_max_seqlen, headdim, beam_width, timestep,
+                       rotary_embedding_dim, rotary_base, neox_rotary_style,
+                       q.stride(0), k.stride(0), v.stride(0),
+                       nnz_head_idx_.has_value() ? nnz_head_idx_.value().size(0) : 0,
+                       reinterpret_cast<DataType*>(q.data_ptr()),
+                       reinterpret_cast<DataType*>(k.data_ptr()),
+                       reinterpret_cast<DataType*>(v.data_ptr()),
+                       kv_cache_quant == KV_CACHE_QUANT_NONE ? reinterpret_cast<DataType*>(k_cache.data_ptr()) : nullptr,
+                       kv_cache_quant == KV_CACHE_QUANT_NONE ? reinterpret_cast<DataType*>(v_cache.data_ptr()) : nullptr,
+                       length_per_sample_.has_value()
+                           ? length_per_sample_.value().data_ptr<int>() : nullptr,
+                       cache_indir_.has_value() ? cache_indir_.value().data_ptr<int>() : nullptr,
+                       rotary_cos_.has_value()
+                           ? reinterpret_cast<DataType*>(rotary_cos_.value().data_ptr()) : nullptr,
+                       rotary_sin_.has_value()
+                           ? reinterpret_cast<DataType*>(rotary_sin_.value().data_ptr()) : nullptr,
+                       reinterpret_cast<DataType*>(out.data_ptr()),
+                       nnz_head_idx_.has_value() ? nnz_head_idx_.value().data_ptr<int>() : nullptr
+                       );
+            if (kv_cache_quant != KV_CACHE_QUANT_NONE) {
+                params.kv_cache_quant = kv_cache_quant;
+                params.k_cache_quant = reinterpret_cast<uint8_t*>(k_cache.data_ptr());
+                params.v_cache_quant = reinterpret_cast<uint8_t*>(v_cache.data_ptr());
+                params.k_cache_scale = k_cache_scale_.value().data_ptr<float>();
+                params.v_cache_scale = v_cache_scale_.value().data_ptr<float>();
+            }
+            if (page_summary_.has_value()) {
+                params.page_summary = page_summary_.value().data_ptr<float>();
+                params.page_size = page_size;
+                params.num_pages = num_pages;
+                params.top_k_pages = std::min(top_k_pages, num_pages);
+                params.recent_window = recent_window;
+                params.timestep_idx = timestep_idx.data_ptr<int>();
+                params.num_attended = num_attended.data_ptr<int>();
+                params.max_attended = max_attended;
+                params.page_scores = page_scores.data_ptr<float>();
+                params.selected_pages = selected_pages.data_ptr<int>();
+            }
+        };
+        if (is_cpu) {
+            Masked_multihead_attention_params<scalar_t> params;
+            set_params_from_inputs(params);
+            if (params.timestep_idx != nullptr) { select_pages_cpu(params); }
+            masked_multihead_attention_cpu(params);
+        } else {
+            using DataType = typename SATypeConverter<scalar_t>::Type;
+            Masked_multihead_attention_params<DataType> params;
+            set_params_from_inputs(params);
+            auto stream = at::cuda::getCurrentCUDAStream();
+            if (params.timestep_idx != nullptr) { select_pages(params, stream); }
+            masked_multihead_attention(params, stream);
+        }
+    });
+    return out;
+}
+
+// Speculative decoding: the num_queries (at most 8) draft tokens of each sequence attend to the cache
+// and causally to each other, q: (batch_size, num_queries, nheads, headdim), k / v: (batch_size,
+// num_queries, nheads_kv, headdim), the drafts at positions length_per_sample + j (or timestep + j) and
+// appended to the cache there. The cache must have room for them, no circular cache here. To roll back
+// the rejected drafts, add only the accepted ones to length_per_sample: the next step overwrites the rest.
+torch::Tensor few_query_attention(const torch::Tensor q,
+                                  const torch::Tensor k,
+                                  const torch::Tensor v,
+                                  torch::Tensor k_cache,
+                                  torch::Tensor v_cache,
+                                  c10::optional<const torch::Tensor> length_per_sample_,
+                                  const int timestep,
+                                  const int rotary_embedding_dim = 0,
+                                  const float rotary_base = 10000.0f,
+                                  const bool neox_rotary_style=true) {
+    const bool is_cpu = q.is_cpu();
+    TORCH_CHECK(q.is_cuda() || is_cpu, "q must be on CUDA or on the CPU");
+    CHECK_DEVICE(k); CHECK_DEVICE(v); CHECK_DEVICE(k_cache); CHECK_DEVICE(v_cache);
+    int batch_size = v_cache.size(0);
+    int num_queries = q.size(1);
+    int nheads = q.size(2);
+    int nheads_kv = v_cache.size(1);
+    int memory_max_seqlen = v_cache.size(2);
+    int headdim = v_cache.size(3);
+    auto input_type = q.scalar_type();
+    TORCH_CHECK(input_type == at::ScalarType::Float || input_type == at::ScalarType::Half || input_type == at::ScalarType::BFloat16);
+    TORCH_CHECK(num_queries >= 1 && num_queries <= 8, "few_query_attention supports 1 to 8 queries per sequence");
+    TORCH_CHECK(headdim <= 256, "few_query_attention supports head dimensions up to 256");
+
+    CHECK_SHAPE(q, batch_size, num_queries, nheads, headdim);
+    CHECK_SHAPE(k, batch_size, num_queries, nheads_kv, headdim);
+    CHECK_SHAPE(v, batch_size, num_queries, nheads_kv, headdim);
+    CHECK_SHAPE(v_cache, batch_size, nheads_kv, memory_max_seqlen, headdim);
+    int packsize = input_type == torch::kFloat32 ? 4 : 8;
+    TORCH_CHECK(headdim % packsize == 0, "few_query_attention reads the caches 16 bytes at a time, headdim must be a multiple of ", packsize);
+    CHECK_SHAPE(k_cache, batch_size, nheads_kv, headdim / packsize, memory_max_seqlen, packsize);
+    TORCH_CHECK(q.stride(3) == 1 && q.stride(2) == headdim && q.stride(1) == nheads * headdim);
+    TORCH_CHECK(k.stride(3) == 1 && k.stride(2) == headdim && k.stride(1) == nheads_kv * headdim);
+    TORCH_CHECK(v.stride(3) == 1 && v.stride(2) == headdim && v.stride(1) == nheads_kv * headdim);
+    CHECK_CONTIGUOUS(v_cache); CHECK_CONTIGUOUS(k_cache);
+    TORCH_CHECK(k.scalar_type() == input_type);
+    TORCH_CHECK(v.scalar_type() == input_type);
+    TORCH_CHECK(k_cache.scalar_type() == input_type);
+    TORCH_CHECK(v_cache.scalar_type() == input_type);
+    TORCH_CHECK(nheads % nheads_kv == 0, "Number of heads in key/value must divide number of heads in query");
+
+    if (length_per_sample_.has_value()) {
+        auto length_per_sample = length_per_sample_.value();
+        CHECK_DEVICE(length_per_sample);
+        CHECK_SHAPE(length_per_sample, batch_size);
+        CHECK_CONTIGUOUS(length_per_sample);
+        TORCH_CHECK(length_per_sample.dtype() == torch::kInt32);
+    } else {
+        TORCH_CHECK(timestep + num_queries <= memory_max_seqlen, "the KV cache has no room for the queries");
+    }
+
+    c10::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
+
+    torch::Tensor out = torch::empty_like(q);
+
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(q.scalar_type(), "few_query_attention", [&] {
+        auto set_params_from_inputs = [&](auto &params) {
+            using DataType = std::remove_pointer_t<decltype(params.out)>;
+            set_params(params, batch_size, nheads, nheads_kv, memory_max_seqlen, headdim, /*beam_width=*/1, timestep,
+                       rotary_embedding_dim, rotary_base, neox_rotary_style,
+                       q.stride(0), k.stride(0), v.stride(0), /*nnz_heads=*/0,
+                       reinterpret_cast<DataType*>(q.data_ptr()),
+                       reinterpret_cast<DataType*>(k.data_ptr()),
+                       reinterpret_cast<DataType*>(v.data_ptr()),
+                       reinterpret_cast<DataType*>(k_cache.data_ptr()),
+                       reinterpret_cast<DataType*>(v_cache.data_ptr()),
+                       length_per_sample_.has_value()
+                           ? length_per_sample_.value().data_ptr<int>() : nullptr,
+                       /*cache_indir=*/nullptr, /*rotary_cos=*/nullptr, /*rotary_sin=*/nullptr,
+                       reinterpret_cast<DataType*>(out.data_ptr()),
+                       /*nnz_head_idx=*/nullptr);
+            params.num_queries = num_queries;
+        };
+        if (is_cpu) {
+            Masked_multihead_attention_params<scalar_t> params;
+            set_params_from_inputs(params);
+            few_query_attention_cpu(params);
+        } else {
+            using DataType = typename SATypeConverter<scalar_t>::Type;
+            Masked_multihead_attention_params<DataType> params;
+            set_params_from_inputs(params);
+            auto stream = at::cuda::getCurrentCUDAStream();
+            few_query_multihead_attention(params, stream);
+        }
     });
     return out;
 }
@@ -228,5 +448,13 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
           py::arg("length_per_sample_"), py::arg("rotary_cos_"),
           py::arg("rotary_sin_"), py::arg("nnz_head_idx_"),
           py::arg("timestep"), py::arg("rotary_embedding_dim")=0,
+          py::arg("rotary_base")=10000.0f, py::arg("neox_rotary_style")=true,
+          py::arg("beam_width")=1, py::arg("cache_indir_")=py::none(),
+          py::arg("k_cache_scale_")=py::none(), py::arg("v_cache_scale_")=py::none(),
+          py::arg("page_summary_")=py::none(), py::arg("page_size")=0, py::arg("top_k_pages")=0,
+          py::arg("recent_window")=0);
+    m.def("few_query_attention", &few_query_attention, "Attention with a few queries per sequence",
+          py::arg("q"), py::arg("k"), py::arg("v"), py::arg("k_cache"), py::arg("v_cache"),
+          py::arg("length_per_sample_"), py::arg("timestep"), py::arg("rotary_embedding_dim")=0,
           py::arg("rotary_base")=10000.0f, py::arg("neox_rotary_style")=true);
 }
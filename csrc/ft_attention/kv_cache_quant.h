@@ -0,0 +1,67 @@
+// 8-bit storage of the KV cache of the masked multihead attention: each key / value vector of a head
+// and a token is stored as Dh 8-bit codes and one fp32 scale, value = scale * decode(code). The codes
+// are int8 with a scale of absmax / 127, or fp8 e4m3 (the "fn" flavour: bias 7, no infinities, max
+// 448) with a scale of absmax / 448. Shared by the CUDA kernel and the CPU reference so that both
+// quantize bit for bit the same.
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#if defined(__CUDACC__)
+#define KV_QUANT_HOST_DEVICE __host__ __device__ __forceinline__
+#else
+#define KV_QUANT_HOST_DEVICE inline
+#endif
+
+// Multihead_attention_params_base::kv_cache_quant.
+enum Kv_cache_quant {
+    KV_CACHE_QUANT_NONE = 0,
+    KV_CACHE_QUANT_INT8 = 1,
+    KV_CACHE_QUANT_FP8_E4M3 = 2,
+};
+
+// The largest code, the scale of a vector is its absmax over that.
+KV_QUANT_HOST_DEVICE float kv_cache_quant_max(const int mode) {
+    return mode == KV_CACHE_QUANT_INT8 ? 127.f : 448.f;
+}
+
+// Round to nearest even, saturated to +-448 (NaN included).
+KV_QUANT_HOST_DEVICE uint8_t float_to_e4m3(const float x) {
+    const uint8_t sign = x < 0.f ? 0x80 : 0;
+    const float a = fminf(fabsf(x), 448.f);
+    if (a < ldexpf(1.f, -6)) {
+        // Subnormals, multiples of 2^-9. A carry into 8 is the smallest normal.
+        return sign | uint8_t(rintf(ldexpf(a, 9)));
+    }
+    int e;
+    const float f = frexpf(a, &e);  // a = f * 2^e, f in [0.5, 1)
+    int exponent = e + 6, mantissa = int(rintf((2.f * f - 1.f) * 8.f));
+    if (mantissa == 8) { mantissa = 0; ++exponent; }
+    const int code = exponent * 8 + mantissa;
+    return sign | uint8_t(code > 0x7e ? 0x7e : code);
+}
+
+KV_QUANT_HOST_DEVICE float e4m3_to_float(const uint8_t code) {
+    const int exponent = (code >> 3) & 0xf, mantissa = code & 0x7;
+    const float a = exponent == 0 ? ldexpf(float(mantissa), -9) : ldexpf(1.f + mantissa / 8.f, exponent - 7);
+    return code & 0x80 ? -a : a;
+}
+
+// x / scale to a code, inv_scale 0 for an all-zero vector.
+KV_QUANT_HOST_DEVICE uint8_t quantize_kv(const float x, const float inv_scale, const int mode) {
+    if (mode == KV_CACHE_QUANT_INT8) {
+        return uint8_t(int8_t(fminf(fmaxf(rintf(x * inv_scale), -127.f), 127.f)));
+    }
+    return float_to_e4m3(x * inv_scale);
+}
+
+// The code without its scale.
+KV_QUANT_HOST_DEVICE float dequantize_kv(const uint8_t code, const int mode) {
+    return mode == KV_CACHE_QUANT_INT8 ? float(int8_t(code)) : e4m3_to_float(code);
+}
+
+KV_QUANT_HOST_DEVICE float kv_cache_inv_scale(const float scale) {
+    return scale > 0.f ? 1.f / scale : 0.f;
+}
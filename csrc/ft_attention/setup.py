@@ -118,6 +118,9 @@ ext_modules.append(
         sources=[
             "ft_attention.cpp",
             "decoder_masked_multihead_attention.cu",
+            "decoder_masked_few_query_attention.cu",
+            "decoder_masked_sparse_pages.cu",
+            "decoder_masked_multihead_attention_cpu.cpp",
         ],
         extra_compile_args={
             "cxx": ["-O3", "-DENABLE_BF16"] + generator_flag,
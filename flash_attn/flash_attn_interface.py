@@ -39,12 +39,31 @@ def _get_block_size(device, head_dim, is_dropout, is_causal):
         return (128, 64) if is_sm80 else (64, 64)
 
 
-def _flash_attn_forward(q, k, v, dropout_p, softmax_scale, causal, return_softmax):
+def _apply_rotary(x, cos, sin, interleaved, conjugate=False):
+    """Rotates the first rotary_dim of x: (batch_size, seqlen, nheads, headdim) like the forward
+    kernel does on load, with cos / sin of (seqlen_ro, rotary_dim / 2). conjugate rotates back.
+    """
+    seqlen, rotary_dim = x.shape[1], cos.shape[-1] * 2
+    cos = cos[:seqlen, None].float()
+    sin = sin[:seqlen, None].float() if not conjugate else -sin[:seqlen, None].float()
+    x_ro = x[..., :rotary_dim].float()
+    x1, x2 = (x_ro[..., ::2], x_ro[..., 1::2]) if interleaved else x_ro.chunk(2, dim=-1)
+    o1, o2 = x1 * cos - x2 * sin, x1 * sin + x2 * cos
+    o_ro = torch.stack((o1, o2), dim=-1).flatten(-2) if interleaved else torch.cat((o1, o2), dim=-1)
+    return torch.cat((o_ro.to(x.dtype), x[..., rotary_dim:]), dim=-1)
+
+
+def _flash_attn_forward(
+    q, k, v, dropout_p, softmax_scale, causal, window_size, alibi_slopes, return_softmax,
+    rotary_cos=None, rotary_sin=None, rotary_interleaved=False,
+):
     #print("666")
     maybe_contiguous = lambda x: x.contiguous() if x.stride(-1) != 1 else x
     q, k, v = [maybe_contiguous(x) for x in (q, k, v)]
     out, q, k, v, out_padded, softmax_lse, S_dmask, rng_state = flash_attn_cuda.fwd(
-        q, k, v, None, dropout_p, softmax_scale, causal, return_softmax, None
+        q, k, v, None, alibi_slopes, dropout_p, softmax_scale, causal, window_size[0],
+        window_size[1], return_softmax, None, 0, None, None, None, None, rotary_cos, rotary_sin,
+        rotary_interleaved, None,
     )
     return out, q, k, v, out_padded, softmax_lse, S_dmask, rng_state
 
@@ -60,6 +79,8 @@ def _flash_attn_varlen_forward(
     dropout_p,
     softmax_scale,
     causal,
+    window_size,
+    alibi_slopes,
     return_softmax,
 ):
     maybe_contiguous = lambda x: x.contiguous() if x.stride(-1) != 1 else x
@@ -71,14 +92,20 @@ def _flash_attn_varlen_forward(
         None,
         cu_seqlens_q,
         cu_seqlens_k,
+        alibi_slopes,
         max_seqlen_q,
         max_seqlen_k,
         dropout_p,
         softmax_scale,
         False,
         causal,
+        window_size[0],
+        window_size[1],
         return_softmax,
         None,
+        None,
+        None,
+        False,
     )
     # if out.isnan().any() or softmax_lse.isnan().any():
     #     breakpoint()
@@ -86,11 +113,17 @@ def _flash_attn_varlen_forward(
 
 
 def _flash_attn_backward(
-    dout, q, k, v, out, softmax_lse, dq, dk, dv, dropout_p, softmax_scale, causal, rng_state=None
+    dout, q, k, v, out, softmax_lse, dq, dk, dv, dropout_p, softmax_scale, causal, window_size,
+    alibi_slopes, rng_state=None, rotary_cos=None, rotary_sin=None, rotary_interleaved=False,
+    deterministic=False,
 ):
     maybe_contiguous = lambda x: x.contiguous() if x.stride(-1) != 1 else x
     # dq, dk, dv are allocated by us so they should already be contiguous
     dout, q, k, v, out = [maybe_contiguous(x) for x in (dout, q, k, v, out)]
+    if rotary_cos is not None:
+        # The forward rotated q and k on load: the backward takes them rotated, and the gradients
+        # w.r.t. the rotated q and k are rotated back.
+        q, k = [_apply_rotary(x, rotary_cos, rotary_sin, rotary_interleaved) for x in (q, k)]
     dq, dk, dv, softmax_d, = flash_attn_cuda.bwd(
         dout,
         q,
@@ -101,12 +134,19 @@ def _flash_attn_backward(
         dq,
         dk,
         dv,
+        alibi_slopes,
         dropout_p,
         softmax_scale,
         causal,
+        window_size[0],
+        window_size[1],
+        deterministic,
         None,
         rng_state,
     )
+    if rotary_cos is not None:
+        for dx in (dq, dk):
+            dx.copy_(_apply_rotary(dx, rotary_cos, rotary_sin, rotary_interleaved, conjugate=True))
     return dq, dk, dv, softmax_d
 
 
@@ -127,7 +167,10 @@ def _flash_attn_varlen_backward(
     dropout_p,
     softmax_scale,
     causal,
+    window_size,
+    alibi_slopes,
     rng_state=None,
+    deterministic=False,
 ):
     maybe_contiguous = lambda x: x.contiguous() if x.stride(-1) != 1 else x
     # dq, dk, dv are allocated by us so they should already be contiguous
@@ -144,12 +187,16 @@ def _flash_attn_varlen_backward(
         dv,
         cu_seqlens_q,
         cu_seqlens_k,
+        alibi_slopes,
         max_seqlen_q,
         max_seqlen_k,
         dropout_p,
         softmax_scale,
         False,
         causal,
+        window_size[0],
+        window_size[1],
+        deterministic,
         None,
         rng_state,
     )
@@ -160,7 +207,10 @@ def _flash_attn_varlen_backward(
 
 class FlashAttnQKVPackedFunc(torch.autograd.Function):
     @staticmethod
-    def forward(ctx, qkv, dropout_p, softmax_scale, causal, return_softmax):
+    def forward(
+        ctx, qkv, dropout_p, softmax_scale, causal, window_size, alibi_slopes, rotary_cos, rotary_sin,
+        rotary_interleaved, return_softmax, deterministic,
+    ):
         if softmax_scale is None:
             softmax_scale = qkv.shape[-1] ** (-0.5)
         out, q, k, v, out_padded, softmax_lse, S_dmask, rng_state = _flash_attn_forward(
@@ -170,12 +220,21 @@ class FlashAttnQKVPackedFunc(torch.autograd.Function):
             dropout_p,
             softmax_scale,
             causal=causal,
+            window_size=window_size,
+            alibi_slopes=alibi_slopes,
             return_softmax=return_softmax and dropout_p > 0,
+            rotary_cos=rotary_cos,
+            rotary_sin=rotary_sin,
+            rotary_interleaved=rotary_interleaved,
         )
         ctx.save_for_backward(q, k, v, out_padded, softmax_lse, rng_state)
         ctx.dropout_p = dropout_p
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.deterministic = deterministic
+        ctx.rotary = (rotary_cos, rotary_sin, rotary_interleaved)
         return out if not return_softmax else (out, softmax_lse, S_dmask)
 
     @staticmethod
@@ -196,15 +255,33 @@ class FlashAttnQKVPackedFunc(torch.autograd.Function):
             ctx.dropout_p,
             ctx.softmax_scale,
             ctx.causal,
+            ctx.window_size,
+            ctx.alibi_slopes,
             rng_state=rng_state,
+            deterministic=ctx.deterministic,
+            rotary_cos=ctx.rotary[0],
+            rotary_sin=ctx.rotary[1],
+            rotary_interleaved=ctx.rotary[2],
         )
         dqkv = dqkv[..., : dout.shape[-1]]  # We could have padded the head dimension
-        return dqkv, None, None, None, None
+        return dqkv, None, None, None, None, None, None, None, None, None, None
 
 
 class FlashAttnVarlenQKVPackedFunc(torch.autograd.Function):
     @staticmethod
-    def forward(ctx, qkv, cu_seqlens, max_seqlen, dropout_p, softmax_scale, causal, return_softmax):
+    def forward(
+        ctx,
+        qkv,
+        cu_seqlens,
+        max_seqlen,
+        dropout_p,
+        softmax_scale,
+        causal,
+        window_size,
+        alibi_slopes,
+        return_softmax,
+        deterministic,
+    ):
         if softmax_scale is None:
             softmax_scale = qkv.shape[-1] ** (-0.5)
         out, q, k, v, out_padded, softmax_lse, S_dmask, rng_state = _flash_attn_varlen_forward(
@@ -218,6 +295,8 @@ class FlashAttnVarlenQKVPackedFunc(torch.autograd.Function):
             dropout_p,
             softmax_scale,
             causal=causal,
+            window_size=window_size,
+            alibi_slopes=alibi_slopes,
             return_softmax=return_softmax and dropout_p > 0,
         )
         ctx.save_for_backward(q, k, v, out_padded, softmax_lse, cu_seqlens, rng_state)
@@ -225,6 +304,9 @@ class FlashAttnVarlenQKVPackedFunc(torch.autograd.Function):
         ctx.max_seqlen = max_seqlen
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.deterministic = deterministic
         return out if not return_softmax else (out, softmax_lse, S_dmask)
 
     @staticmethod
@@ -249,15 +331,21 @@ class FlashAttnVarlenQKVPackedFunc(torch.autograd.Function):
             ctx.dropout_p,
             ctx.softmax_scale,
             ctx.causal,
+            ctx.window_size,
+            ctx.alibi_slopes,
             rng_state=rng_state,
+            deterministic=ctx.deterministic,
         )
         dqkv = dqkv[..., : dout.shape[-1]]  # We could have padded the head dimension
-        return dqkv, None, None, None, None, None, None
+        return dqkv, None, None, None, None, None, None, None, None, None
 
 
 class FlashAttnKVPackedFunc(torch.autograd.Function):
     @staticmethod
-    def forward(ctx, q, kv, dropout_p, softmax_scale, causal, return_softmax):
+    def forward(
+        ctx, q, kv, dropout_p, softmax_scale, causal, window_size, alibi_slopes, rotary_cos, rotary_sin,
+        rotary_interleaved, return_softmax, deterministic,
+    ):
         if softmax_scale is None:
             softmax_scale = q.shape[-1] ** (-0.5)
         out, q, k, v, out_padded, softmax_lse, S_dmask, rng_state = _flash_attn_forward(
@@ -267,12 +355,21 @@ class FlashAttnKVPackedFunc(torch.autograd.Function):
             dropout_p,
             softmax_scale,
             causal=causal,
+            window_size=window_size,
+            alibi_slopes=alibi_slopes,
             return_softmax=return_softmax and dropout_p > 0,
+            rotary_cos=rotary_cos,
+            rotary_sin=rotary_sin,
+            rotary_interleaved=rotary_interleaved,
         )
         ctx.save_for_backward(q, k, v, out_padded, softmax_lse, rng_state)
         ctx.dropout_p = dropout_p
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.deterministic = deterministic
+        ctx.rotary = (rotary_cos, rotary_sin, rotary_interleaved)
         return out if not return_softmax else (out, softmax_lse, S_dmask)
 
     @staticmethod
@@ -294,11 +391,17 @@ class FlashAttnKVPackedFunc(torch.autograd.Function):
             ctx.dropout_p,
             ctx.softmax_scale,
             ctx.causal,
+            ctx.window_size,
+            ctx.alibi_slopes,
             rng_state=rng_state,
+            deterministic=ctx.deterministic,
+            rotary_cos=ctx.rotary[0],
+            rotary_sin=ctx.rotary[1],
+            rotary_interleaved=ctx.rotary[2],
         )
         dq = dq[..., : dout.shape[-1]]  # We could have padded the head dimension
         dkv = dkv[..., : dout.shape[-1]]
-        return dq, dkv, None, None, None, None
+        return dq, dkv, None, None, None, None, None, None, None, None, None, None
 
 
 class FlashAttnVarlenKVPackedFunc(torch.autograd.Function):
@@ -314,7 +417,10 @@ class FlashAttnVarlenKVPackedFunc(torch.autograd.Function):
         dropout_p,
         softmax_scale,
         causal,
+        window_size,
+        alibi_slopes,
         return_softmax,
+        deterministic,
     ):
         if softmax_scale is None:
             softmax_scale = q.shape[-1] ** (-0.5)
@@ -329,6 +435,8 @@ class FlashAttnVarlenKVPackedFunc(torch.autograd.Function):
             dropout_p,
             softmax_scale,
             causal=causal,
+            window_size=window_size,
+            alibi_slopes=alibi_slopes,
             return_softmax=return_softmax and dropout_p > 0,
         )
         ctx.save_for_backward(
@@ -339,6 +447,9 @@ class FlashAttnVarlenKVPackedFunc(torch.autograd.Function):
         ctx.max_seqlen_k = max_seqlen_k
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.deterministic = deterministic
         return out if not return_softmax else (out, softmax_lse, S_dmask)
 
     @staticmethod
@@ -364,16 +475,22 @@ class FlashAttnVarlenKVPackedFunc(torch.autograd.Function):
             ctx.dropout_p,
             ctx.softmax_scale,
             ctx.causal,
+            ctx.window_size,
+            ctx.alibi_slopes,
             rng_state=rng_state,
+            deterministic=ctx.deterministic,
         )
         dq = dq[..., : dout.shape[-1]]  # We could have padded the head dimension
         dkv = dkv[..., : dout.shape[-1]]
-        return dq, dkv, None, None, None, None, None, None, None, None
+        return dq, dkv, None, None, None, None, None, None, None, None, None, None
 
 
 class FlashAttnFunc(torch.autograd.Function):
     @staticmethod
-    def forward(ctx, q, k, v, dropout_p, softmax_scale, causal, return_softmax):
+    def forward(
+        ctx, q, k, v, dropout_p, softmax_scale, causal, window_size, alibi_slopes, rotary_cos,
+        rotary_sin, rotary_interleaved, return_softmax, deterministic,
+    ):
         if softmax_scale is None:
             softmax_scale = q.shape[-1] ** (-0.5)
         out, q, k, v, out_padded, softmax_lse, S_dmask, rng_state = _flash_attn_forward(
@@ -383,12 +500,21 @@ class FlashAttnFunc(torch.autograd.Function):
             dropout_p,
             softmax_scale,
             causal=causal,
+            window_size=window_size,
+            alibi_slopes=alibi_slopes,
             return_softmax=return_softmax and dropout_p > 0,
+            rotary_cos=rotary_cos,
+            rotary_sin=rotary_sin,
+            rotary_interleaved=rotary_interleaved,
         )
         ctx.save_for_backward(q, k, v, out_padded, softmax_lse, rng_state)
         ctx.dropout_p = dropout_p
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.deterministic = deterministic
+        ctx.rotary = (rotary_cos, rotary_sin, rotary_interleaved)
         return out if not return_softmax else (out, softmax_lse, S_dmask)
 
     @staticmethod
@@ -408,12 +534,18 @@ class FlashAttnFunc(torch.autograd.Function):
             ctx.dropout_p,
             ctx.softmax_scale,
             ctx.causal,
+            ctx.window_size,
+            ctx.alibi_slopes,
             rng_state=rng_state,
+            deterministic=ctx.deterministic,
+            rotary_cos=ctx.rotary[0],
+            rotary_sin=ctx.rotary[1],
+            rotary_interleaved=ctx.rotary[2],
         )
         dq = dq[..., : dout.shape[-1]]  # We could have padded the head dimension
         dk = dk[..., : dout.shape[-1]]
         dv = dv[..., : dout.shape[-1]]
-        return dq, dk, dv, None, None, None, None, None, None, None, None
+        return dq, dk, dv, None, None, None, None, None, None, None, None, None, None
 
 
 class FlashAttnVarlenFunc(torch.autograd.Function):
@@ -430,7 +562,10 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
         dropout_p,
         softmax_scale,
         causal,
+        window_size,
+        alibi_slopes,
         return_softmax,
+        deterministic,
     ):
         if softmax_scale is None:
             softmax_scale = q.shape[-1] ** (-0.5)
@@ -445,6 +580,8 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
             dropout_p,
             softmax_scale,
             causal=causal,
+            window_size=window_size,
+            alibi_slopes=alibi_slopes,
             return_softmax=return_softmax and dropout_p > 0,
         )
         ctx.save_for_backward(
@@ -455,6 +592,9 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
         ctx.max_seqlen_k = max_seqlen_k
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.deterministic = deterministic
         return out if not return_softmax else (out, softmax_lse, S_dmask)
 
     @staticmethod
@@ -478,16 +618,22 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
             ctx.dropout_p,
             ctx.softmax_scale,
             ctx.causal,
+            ctx.window_size,
+            ctx.alibi_slopes,
             rng_state=rng_state,
+            deterministic=ctx.deterministic,
         )
         dq = dq[..., : dout.shape[-1]]  # We could have padded the head dimension
         dk = dk[..., : dout.shape[-1]]
         dv = dv[..., : dout.shape[-1]]
-        return dq, dk, dv, None, None, None, None, None, None, None, None
+        return dq, dk, dv, None, None, None, None, None, None, None, None, None, None
 
 
 def flash_attn_qkvpacked_func(
-    qkv, dropout_p=0.0, softmax_scale=None, causal=False, return_attn_probs=False
+    qkv, dropout_p=0.0, softmax_scale=None, causal=False, window_size=(-1, -1),
+    alibi_slopes=None, rotary_cos=None, rotary_sin=None, rotary_interleaved=False,
+    return_attn_probs=False,
+    deterministic=False,
 ):
     """dropout_p should be set to 0.0 during evaluation
     If Q, K, V are already stacked into 1 tensor, this function will be faster than
@@ -502,9 +648,22 @@ def flash_attn_qkvpacked_func(
         softmax_scale: float. The scaling of QK^T before applying softmax.
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
+        window_size: (left, right). If not (-1, -1), implements sliding window local attention:
+            query i only attends to the keys [i - left, i + right], -1 leaving that side unbounded.
+            The key blocks outside of the window are skipped. causal=True is the same as (-1, 0),
+            and a left window with causal=True is (left, 0).
+        alibi_slopes: (nheads,) or (batch_size, nheads), fp32. A bias of
+            (-alibi_slope * |i - j|) is added to the attention score of query i and key j.
+        rotary_cos, rotary_sin: (seqlen_ro, rotary_dim / 2), same dtype as q. If passed, the rotary
+            embedding is applied to the first rotary_dim of q and k as the kernel loads them,
+            instead of in a separate pass over q and k (as apply_rotary_emb_qkv_ does).
+        rotary_interleaved: bool. If True, rotate pairs of even and odd dimensions (GPT-J style)
+            instead of 1st half and 2nd half (GPT-NeoX style).
         return_attn_probs: bool. Whether to return the attention probabilities. This option is for
            testing only. The returned probabilities are not guaranteed to be correct
            (they might not have the right scaling).
+        deterministic: bool. Whether to use the deterministic implementation of the backward pass,
+            which is slightly slower and uses more memory. The forward pass is always deterministic.
     Return:
         out: (batch_size, seqlen, nheads, headdim).
         softmax_lse [optional, if return_attn_probs=True]: (batch_size, nheads, seqlen). The
@@ -514,11 +673,17 @@ def flash_attn_qkvpacked_func(
             The output of softmax (possibly with different scaling). It also encodes the dropout
             pattern (negative means that location was dropped, nonnegative means it was kept).
     """
-    return FlashAttnQKVPackedFunc.apply(qkv, dropout_p, softmax_scale, causal, return_attn_probs)
+    return FlashAttnQKVPackedFunc.apply(
+        qkv, dropout_p, softmax_scale, causal, window_size, alibi_slopes, rotary_cos, rotary_sin,
+        rotary_interleaved, return_attn_probs, deterministic,
+    )
 
 
 def flash_attn_kvpacked_func(
-    q, kv, dropout_p=0.0, softmax_scale=None, causal=False, return_attn_probs=False
+    q, kv, dropout_p=0.0, softmax_scale=None, causal=False, window_size=(-1, -1),
+    alibi_slopes=None, rotary_cos=None, rotary_sin=None, rotary_interleaved=False,
+    return_attn_probs=False,
+    deterministic=False,
 ):
     """dropout_p should be set to 0.0 during evaluation
     If K, V are already stacked into 1 tensor, this function will be faster than
@@ -536,9 +701,22 @@ def flash_attn_kvpacked_func(
         softmax_scale: float. The scaling of QK^T before applying softmax.
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
+        window_size: (left, right). If not (-1, -1), implements sliding window local attention:
+            query i only attends to the keys [i - left, i + right], -1 leaving that side unbounded.
+            The key blocks outside of the window are skipped. causal=True is the same as (-1, 0),
+            and a left window with causal=True is (left, 0).
+        alibi_slopes: (nheads,) or (batch_size, nheads), fp32. A bias of
+            (-alibi_slope * |i - j|) is added to the attention score of query i and key j.
+        rotary_cos, rotary_sin: (seqlen_ro, rotary_dim / 2), same dtype as q. If passed, the rotary
+            embedding is applied to the first rotary_dim of q and k as the kernel loads them,
+            instead of in a separate pass over q and k (as apply_rotary_emb_qkv_ does).
+        rotary_interleaved: bool. If True, rotate pairs of even and odd dimensions (GPT-J style)
+            instead of 1st half and 2nd half (GPT-NeoX style).
         return_attn_probs: bool. Whether to return the attention probabilities. This option is for
            testing only. The returned probabilities are not guaranteed to be correct
            (they might not have the right scaling).
+        deterministic: bool. Whether to use the deterministic implementation of the backward pass,
+            which is slightly slower and uses more memory. The forward pass is always deterministic.
     Return:
         out: (batch_size, seqlen, nheads, headdim).
         softmax_lse [optional, if return_attn_probs=True]: (batch_size, nheads, seqlen). The
@@ -548,11 +726,17 @@ def flash_attn_kvpacked_func(
             The output of softmax (possibly with different scaling). It also encodes the dropout
             pattern (negative means that location was dropped, nonnegative means it was kept).
     """
-    return FlashAttnKVPackedFunc.apply(q, kv, dropout_p, softmax_scale, causal, return_attn_probs)
+    return FlashAttnKVPackedFunc.apply(
+        q, kv, dropout_p, softmax_scale, causal, window_size, alibi_slopes, rotary_cos, rotary_sin,
+        rotary_interleaved, return_attn_probs, deterministic,
+    )
 
 
 def flash_attn_func(
-    q, k, v, dropout_p=0.0, softmax_scale=None, causal=False, return_attn_probs=False
+    q, k, v, dropout_p=0.0, softmax_scale=None, causal=False, window_size=(-1, -1),
+    alibi_slopes=None, rotary_cos=None, rotary_sin=None, rotary_interleaved=False,
+    return_attn_probs=False,
+    deterministic=False,
 ):
     """dropout_p should be set to 0.0 during evaluation
     Supports multi-query and grouped-query attention (MQA/GQA) by passing in KV with fewer heads
@@ -568,9 +752,22 @@ def flash_attn_func(
         softmax_scale: float. The scaling of QK^T before applying softmax.
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
+        window_size: (left, right). If not (-1, -1), implements sliding window local attention:
+            query i only attends to the keys [i - left, i + right], -1 leaving that side unbounded.
+            The key blocks outside of the window are skipped. causal=True is the same as (-1, 0),
+            and a left window with causal=True is (left, 0).
+        alibi_slopes: (nheads,) or (batch_size, nheads), fp32. A bias of
+            (-alibi_slope * |i - j|) is added to the attention score of query i and key j.
+        rotary_cos, rotary_sin: (seqlen_ro, rotary_dim / 2), same dtype as q. If passed, the rotary
+            embedding is applied to the first rotary_dim of q and k as the kernel loads them,
+            instead of in a separate pass over q and k (as apply_rotary_emb_qkv_ does).
+        rotary_interleaved: bool. If True, rotate pairs of even and odd dimensions (GPT-J style)
+            instead of 1st half and 2nd half (GPT-NeoX style).
         return_attn_probs: bool. Whether to return the attention probabilities. This option is for
            testing only. The returned probabilities are not guaranteed to be correct
            (they might not have the right scaling).
+        deterministic: bool. Whether to use the deterministic implementation of the backward pass,
+            which is slightly slower and uses more memory. The forward pass is always deterministic.
     Return:
         out: (batch_size, seqlen, nheads, headdim).
         softmax_lse [optional, if return_attn_probs=True]: (batch_size, nheads, seqlen). The
@@ -580,7 +777,10 @@ def flash_attn_func(
             The output of softmax (possibly with different scaling). It also encodes the dropout
             pattern (negative means that location was dropped, nonnegative means it was kept).
     """
-    return FlashAttnFunc.apply(q, k, v, dropout_p, softmax_scale, causal, return_attn_probs)
+    return FlashAttnFunc.apply(
+        q, k, v, dropout_p, softmax_scale, causal, window_size, alibi_slopes, rotary_cos, rotary_sin,
+        rotary_interleaved, return_attn_probs, deterministic,
+    )
 
 
 def flash_attn_varlen_qkvpacked_func(
@@ -590,7 +790,10 @@ def flash_attn_varlen_qkvpacked_func(
     dropout_p=0.0,
     softmax_scale=None,
     causal=False,
+    window_size=(-1, -1),
+    alibi_slopes=None,
     return_attn_probs=False,
+    deterministic=False,
 ):
     """dropout_p should be set to 0.0 during evaluation
     If Q, K, V are already stacked into 1 tensor, this function will be faster than
@@ -608,9 +811,17 @@ def flash_attn_varlen_qkvpacked_func(
         softmax_scale: float. The scaling of QK^T before applying softmax.
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
+        window_size: (left, right). If not (-1, -1), implements sliding window local attention:
+            query i only attends to the keys [i - left, i + right], -1 leaving that side unbounded.
+            The key blocks outside of the window are skipped. causal=True is the same as (-1, 0),
+            and a left window with causal=True is (left, 0).
+        alibi_slopes: (nheads,) or (batch_size, nheads), fp32. A bias of
+            (-alibi_slope * |i - j|) is added to the attention score of query i and key j.
         return_attn_probs: bool. Whether to return the attention probabilities. This option is for
            testing only. The returned probabilities are not guaranteed to be correct
            (they might not have the right scaling).
+        deterministic: bool. Whether to use the deterministic implementation of the backward pass,
+            which is slightly slower and uses more memory. The forward pass is always deterministic.
     Return:
         out: (total, nheads, headdim).
         softmax_lse [optional, if return_attn_probs=True]: (batch_size, nheads, seqlen). The
@@ -621,7 +832,16 @@ def flash_attn_varlen_qkvpacked_func(
             pattern (negative means that location was dropped, nonnegative means it was kept).
     """
     return FlashAttnVarlenQKVPackedFunc.apply(
-        qkv, cu_seqlens, max_seqlen, dropout_p, softmax_scale, causal, return_attn_probs
+        qkv,
+        cu_seqlens,
+        max_seqlen,
+        dropout_p,
+        softmax_scale,
+        causal,
+        window_size,
+        alibi_slopes,
+        return_attn_probs,
+        deterministic,
     )
 
 
@@ -635,7 +855,10 @@ def flash_attn_varlen_kvpacked_func(
     dropout_p=0.0,
     softmax_scale=None,
     causal=False,
+    window_size=(-1, -1),
+    alibi_slopes=None,
     return_attn_probs=False,
+    deterministic=False,
 ):
     """dropout_p should be set to 0.0 during evaluation
     If K, V are already stacked into 1 tensor, this function will be faster than
@@ -659,9 +882,17 @@ def flash_attn_varlen_kvpacked_func(
         softmax_scale: float. The scaling of QK^T before applying softmax.
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
+        window_size: (left, right). If not (-1, -1), implements sliding window local attention:
+            query i only attends to the keys [i - left, i + right], -1 leaving that side unbounded.
+            The key blocks outside of the window are skipped. causal=True is the same as (-1, 0),
+            and a left window with causal=True is (left, 0).
+        alibi_slopes: (nheads,) or (batch_size, nheads), fp32. A bias of
+            (-alibi_slope * |i - j|) is added to the attention score of query i and key j.
         return_attn_probs: bool. Whether to return the attention probabilities. This option is for
            testing only. The returned probabilities are not guaranteed to be correct
            (they might not have the right scaling).
+        deterministic: bool. Whether to use the deterministic implementation of the backward pass,
+            which is slightly slower and uses more memory. The forward pass is always deterministic.
     Return:
         out: (total, nheads, headdim).
         softmax_lse [optional, if return_attn_probs=True]: (batch_size, nheads, seqlen). The
@@ -681,7 +912,10 @@ def flash_attn_varlen_kvpacked_func(
         dropout_p,
         softmax_scale,
         causal,
+        window_size,
+        alibi_slopes,
         return_attn_probs,
+        deterministic,
     )
 
 
@@ -696,7 +930,10 @@ def flash_attn_varlen_func(
     dropout_p=0.0,
     softmax_scale=None,
     causal=False,
+    window_size=(-1, -1),
+    alibi_slopes=None,
     return_attn_probs=False,
+    deterministic=False,
 ):
     """dropout_p should be set to 0.0 during evaluation
     Supports multi-query and grouped-query attention (MQA/GQA) by passing in K, V with fewer heads
@@ -718,9 +955,17 @@ def flash_attn_varlen_func(
         softmax_scale: float. The scaling of QK^T before applying softmax.
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
+        window_size: (left, right). If not (-1, -1), implements sliding window local attention:
+            query i only attends to the keys [i - left, i + right], -1 leaving that side unbounded.
+            The key blocks outside of the window are skipped. causal=True is the same as (-1, 0),
+            and a left window with causal=True is (left, 0).
+        alibi_slopes: (nheads,) or (batch_size, nheads), fp32. A bias of
+            (-alibi_slope * |i - j|) is added to the attention score of query i and key j.
         return_attn_probs: bool. Whether to return the attention probabilities. This option is for
            testing only. The returned probabilities are not guaranteed to be correct
            (they might not have the right scaling).
+        deterministic: bool. Whether to use the deterministic implementation of the backward pass,
+            which is slightly slower and uses more memory. The forward pass is always deterministic.
     Return:
         out: (total, nheads, headdim).
         softmax_lse [optional, if return_attn_probs=True]: (batch_size, nheads, seqlen). The
@@ -741,5 +986,57 @@ def flash_attn_varlen_func(
         dropout_p,
         softmax_scale,
         causal,
+        window_size,
+        alibi_slopes,
         return_attn_probs,
+        deterministic,
+    )
+
+
+def flash_attn_with_kvcache(
+    q,
+    k_cache,
+    v_cache,
+    k=None,
+    v=None,
+    cache_seqlens=None,
+    block_table=None,
+    softmax_scale=None,
+    num_splits=0,
+):
+    """Attention of q over a KV cache, for inference. If k and v are passed, they are written to the
+    cache right after the first cache_seqlens keys / values of each sequence, in place, and attended
+    over together with them, all in one call. cache_seqlens is not updated: the caller advances it.
+    There is no causal mask and no backward.
+
+    Arguments:
+        q: (batch_size, seqlen_q, nheads, headdim)
+        k_cache: (batch_size, seqlen_cache, nheads_k, headdim), or
+            (num_blocks, page_block_size, nheads_k, headdim) if there's a block_table.
+        v_cache: same shape as k_cache.
+        k [optional]: (batch_size, seqlen_new, nheads_k, headdim). cache_seqlens + seqlen_new must
+            be at most seqlen_cache. This is checked on the CPU. On the GPU it would need a sync with
+            the device, so it is only checked with the environment variable
+            FLASH_ATTENTION_CHECK_KV_APPEND=1, for debugging. Otherwise an append past the end of the
+            cache writes out of its bounds.
+        v [optional]: (batch_size, seqlen_new, nheads_k, headdim).
+        cache_seqlens [optional]: (batch_size,), dtype torch.int32. The number of keys / values in
+            the cache of each sequence. Required if k and v are passed. Default to the whole cache.
+        block_table [optional]: (batch_size, max_num_blocks_per_seq), dtype torch.int32. The pages
+            of the paged KV cache of each sequence. page_block_size must be a multiple of 128.
+        softmax_scale: float. The scaling of QK^T before applying softmax.
+            Default to 1 / sqrt(headdim).
+        num_splits: int. Number of splits of the keys for the split-KV forward. 0 picks it with a
+            heuristic, 1 turns it off.
+    Return:
+        out: (batch_size, seqlen_q, nheads, headdim).
+    """
+    if softmax_scale is None:
+        softmax_scale = q.shape[-1] ** (-0.5)
+    maybe_contiguous = lambda x: x.contiguous() if x is not None and x.stride(-1) != 1 else x
+    q, k, v = [maybe_contiguous(x) for x in (q, k, v)]
+    out, *_ = flash_attn_cuda.fwd(
+        q, k_cache, v_cache, None, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits,
+        block_table, k, v, cache_seqlens, None, None, False, None,
     )
+    return out
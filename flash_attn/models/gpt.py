@@ -79,13 +79,18 @@ def create_mixer_cls(config, layer_idx=None, process_group=None, device=None, dt
     rotary_emb_base = getattr(config, "rotary_emb_base", 10000.0)
     rotary_emb_scale_base = getattr(config, "rotary_emb_scale_base", None)
     rotary_emb_interleaved = getattr(config, "rotary_emb_interleaved", False)
+    use_alibi = getattr(config, "use_alibi", False)
+    if use_alibi:
+        assert process_group is None, "TensorParallel MHA does not support ALiBi yet"
     use_flash_attn = getattr(config, "use_flash_attn", False)
     fused_bias_fc = getattr(config, "fused_bias_fc", False)
     if not fused_bias_fc:
         assert process_group is None, "TensorParallel MHA requires fused_bias_fc"
     mha_cls = MHA if process_group is None else ParallelMHA
     serial_kwargs = (
-        {"fused_bias_fc": fused_bias_fc, "dwconv": dwconv} if process_group is None else {}
+        {"fused_bias_fc": fused_bias_fc, "dwconv": dwconv, "use_alibi": use_alibi}
+        if process_group is None
+        else {}
     )
     parallel_kwargs = (
         {
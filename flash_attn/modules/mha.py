@@ -15,10 +15,12 @@ try:
         flash_attn_qkvpacked_func,
         flash_attn_varlen_kvpacked_func,
         flash_attn_varlen_qkvpacked_func,
+        flash_attn_with_kvcache,
     )
 except ImportError:
     flash_attn_varlen_qkvpacked_func, flash_attn_varlen_kvpacked_func = None, None
     flash_attn_qkvpacked_func, flash_attn_kvpacked_func = None, None
+    flash_attn_with_kvcache = None
 
 try:
     from flash_attn.ops.fused_dense import ColumnParallelLinear, FusedDense, RowParallelLinear
@@ -36,6 +38,35 @@ except ImportError:
     ft_attention = None
 
 
+def get_alibi_slopes(nheads):
+    """The ALiBi slopes of https://arxiv.org/abs/2108.12409: a geometric sequence starting at
+    2^(-8 / nheads), interleaved with the slopes of 2 * nheads when nheads isn't a power of 2.
+    """
+
+    def get_slopes_power_of_2(nheads):
+        start = 2 ** (-(2 ** -(math.log2(nheads) - 3)))
+        ratio = start
+        return [start * ratio**i for i in range(nheads)]
+
+    if math.log2(nheads).is_integer():
+        return get_slopes_power_of_2(nheads)
+    else:
+        closest_power_of_2 = 2 ** math.floor(math.log2(nheads))
+        return (
+            get_slopes_power_of_2(closest_power_of_2)
+            + get_alibi_slopes(2 * closest_power_of_2)[0::2][: nheads - closest_power_of_2]
+        )
+
+
+def alibi_bias(alibi_slopes, seqlen_q, seqlen_k, device=None):
+    """(nheads, seqlen_q, seqlen_k) bias of -alibi_slopes[h] * |i - j|, the same as the ALiBi bias
+    of the FlashAttention kernels.
+    """
+    row_idx = torch.arange(seqlen_q, device=device).unsqueeze(-1)
+    col_idx = torch.arange(seqlen_k, device=device)
+    return -rearrange(alibi_slopes, "h -> h 1 1") * (row_idx - col_idx).abs()
+
+
 class FlashSelfAttention(nn.Module):
     """Implement the scaled dot product attention with softmax.
     Arguments
@@ -45,17 +76,22 @@ class FlashSelfAttention(nn.Module):
                       runtime)
         attention_dropout: The dropout rate to apply to the attention
                            (default: 0.0)
+        alibi_slopes: (nheads,) fp32 ALiBi slopes, applied inside the kernel (default: None)
     """
 
-    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0):
+    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0, alibi_slopes=None):
         super().__init__()
         assert flash_attn_varlen_qkvpacked_func is not None, "FlashAttention is not installed"
         assert flash_attn_qkvpacked_func is not None, "FlashAttention is not installed"
         self.causal = causal
         self.softmax_scale = softmax_scale
         self.drop = nn.Dropout(attention_dropout)
+        self.register_buffer("alibi_slopes", alibi_slopes, persistent=False)
 
-    def forward(self, qkv, causal=None, cu_seqlens=None, max_seqlen=None):
+    def forward(
+        self, qkv, causal=None, cu_seqlens=None, max_seqlen=None, rotary_cos=None, rotary_sin=None,
+        rotary_interleaved=False,
+    ):
         """Implements the multihead softmax attention.
         Arguments
         ---------
@@ -67,6 +103,8 @@ class FlashSelfAttention(nn.Module):
             cu_seqlens: (batch_size + 1,), dtype torch.int32. The cumulative sequence lengths
                 of the sequences in the batch, used to index into qkv.
             max_seqlen: int. Maximum sequence length in the batch.
+            rotary_cos, rotary_sin: (seqlen_ro, rotary_dim / 2). If passed, the rotary embedding
+                of q and k is applied inside the kernel. Only for the padded qkv.
         Returns:
         --------
             out: (total, H, D) if cu_seqlens is not None and max_seqlen is not None,
@@ -80,6 +118,7 @@ class FlashSelfAttention(nn.Module):
             assert cu_seqlens.dtype == torch.int32
             assert max_seqlen is not None
             assert isinstance(max_seqlen, int)
+            assert rotary_cos is None
             return flash_attn_varlen_qkvpacked_func(
                 qkv,
                 cu_seqlens,
@@ -87,6 +126,7 @@ class FlashSelfAttention(nn.Module):
                 self.drop.p if self.training else 0.0,
                 softmax_scale=self.softmax_scale,
                 causal=causal,
+                alibi_slopes=self.alibi_slopes,
             )
         else:
             return flash_attn_qkvpacked_func(
@@ -94,6 +134,10 @@ class FlashSelfAttention(nn.Module):
                 self.drop.p if self.training else 0.0,
                 softmax_scale=self.softmax_scale,
                 causal=causal,
+                alibi_slopes=self.alibi_slopes,
+                rotary_cos=rotary_cos,
+                rotary_sin=rotary_sin,
+                rotary_interleaved=rotary_interleaved,
             )
 
 
@@ -106,15 +150,17 @@ class FlashCrossAttention(nn.Module):
                       runtime)
         attention_dropout: The dropout rate to apply to the attention
                            (default: 0.0)
+        alibi_slopes: (nheads,) fp32 ALiBi slopes, applied inside the kernel (default: None)
     """
 
-    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0):
+    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0, alibi_slopes=None):
         super().__init__()
         assert flash_attn_varlen_kvpacked_func is not None, "FlashAttention is not installed"
         assert flash_attn_kvpacked_func is not None, "FlashAttention is not installed"
         self.causal = causal
         self.softmax_scale = softmax_scale
         self.drop = nn.Dropout(attention_dropout)
+        self.register_buffer("alibi_slopes", alibi_slopes, persistent=False)
 
     def forward(
         self,
@@ -161,6 +207,7 @@ class FlashCrossAttention(nn.Module):
                 self.drop.p if self.training else 0.0,
                 softmax_scale=self.softmax_scale,
                 causal=causal,
+                alibi_slopes=self.alibi_slopes,
             )
         else:
             batch_size, seqlen_q = q.shape[0], q.shape[1]
@@ -172,6 +219,7 @@ class FlashCrossAttention(nn.Module):
                 self.drop.p if self.training else 0.0,
                 causal=causal,
                 softmax_scale=self.softmax_scale,
+                alibi_slopes=self.alibi_slopes,
             )
 
 
@@ -184,13 +232,15 @@ class SelfAttention(nn.Module):
                       runtime)
         attention_dropout: The dropout rate to apply to the attention
                            (default: 0.0)
+        alibi_slopes: (nheads,) fp32 ALiBi slopes (default: None)
     """
 
-    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0):
+    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0, alibi_slopes=None):
         super().__init__()
         self.causal = causal
         self.softmax_scale = softmax_scale
         self.drop = nn.Dropout(attention_dropout)
+        self.register_buffer("alibi_slopes", alibi_slopes, persistent=False)
 
     def forward(self, qkv, causal=None, key_padding_mask=None):
         """Implements the multihead softmax attention.
@@ -213,6 +263,10 @@ class SelfAttention(nn.Module):
             padding_mask.masked_fill_(key_padding_mask, 0.0)
             # TD [2022-09-30]: Adding is faster than masked_fill_ (idk why, just better kernel I guess)
             scores = scores + rearrange(padding_mask, "b s -> b 1 1 s")
+        if self.alibi_slopes is not None:
+            scores = scores + alibi_bias(self.alibi_slopes, seqlen, seqlen, scores.device).to(
+                scores.dtype
+            )
         if causal:
             # "triu_tril_cuda_template" not implemented for 'BFloat16'
             # So we have to construct the mask in float
@@ -236,13 +290,15 @@ class CrossAttention(nn.Module):
                       runtime)
         attention_dropout: The dropout rate to apply to the attention
                            (default: 0.0)
+        alibi_slopes: (nheads,) fp32 ALiBi slopes (default: None)
     """
 
-    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0):
+    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0, alibi_slopes=None):
         super().__init__()
         self.causal = causal
         self.softmax_scale = softmax_scale
         self.drop = nn.Dropout(attention_dropout)
+        self.register_buffer("alibi_slopes", alibi_slopes, persistent=False)
 
     def forward(self, q, kv, causal=None, key_padding_mask=None):
         """Implements the multihead softmax attention.
@@ -270,6 +326,10 @@ class CrossAttention(nn.Module):
             padding_mask.masked_fill_(key_padding_mask, 0.0)
             # TD [2022-09-30]: Adding is faster than masked_fill_ (idk why, just better kernel I guess)
             scores = scores + rearrange(padding_mask, "b s -> b 1 1 s")
+        if self.alibi_slopes is not None:
+            scores = scores + alibi_bias(self.alibi_slopes, seqlen_q, seqlen_k, scores.device).to(
+                scores.dtype
+            )
         if causal:
             # "triu_tril_cuda_template" not implemented for 'BFloat16'
             # So we have to construct the mask in float
@@ -379,6 +439,13 @@ def _apply_rotary_single_query_attention(
         if inference_params.lengths_per_sample is not None
         else None
     )
+    cache_indir = (
+        inference_params.cache_indir[batch_start:batch_end]
+        if inference_params.cache_indir is not None
+        else None
+    )
+    head_pruning = inference_params.head_pruning
+    nnz_head_idx = head_pruning.nnz_head_idx(layer_idx) if head_pruning is not None else None
     context = ft_attention.single_query_attention(
         q,
         k,
@@ -388,12 +455,16 @@ def _apply_rotary_single_query_attention(
         lengths_per_sample,
         None,  # rotary_cos_
         None,  # rotary_sin_
-        None,  # nnz_head_idx
+        nnz_head_idx,
         inference_params.sequence_len_offset,
         rotary_emb_dim,
         rotary_emb_base,
         not rotary_emb_interleaved,  # neox_rotary_style
+        inference_params.beam_width,
+        cache_indir,
     )
+    if head_pruning is not None:
+        head_pruning.observe(layer_idx, context, nnz_head_idx)
     return rearrange(context, "b h d -> b 1 h d")
 
 
@@ -417,6 +488,7 @@ class MHA(nn.Module):
         rotary_emb_base=10000.0,
         rotary_emb_scale_base=None,
         rotary_emb_interleaved=False,
+        use_alibi=False,
         fused_bias_fc=False,
         use_flash_attn=False,
         return_residual=False,
@@ -426,6 +498,8 @@ class MHA(nn.Module):
     ) -> None:
         """
         num_heads_kv: can be used to toggle MQA / GQA. If None, use num_heads.
+        use_alibi: add the ALiBi bias with the slopes of get_alibi_slopes(num_heads). With
+            FlashAttention the bias is applied inside the kernel. Not supported when decoding.
         return_residual: whether to return the input x along with the output. This is for
             performance reason: for post-norm architecture, returning the input allows us
             to fuse the backward of nn.Linear with the residual connection.
@@ -438,6 +512,7 @@ class MHA(nn.Module):
         self.layer_idx = layer_idx
         self.dwconv = dwconv
         self.rotary_emb_dim = rotary_emb_dim
+        self.use_alibi = use_alibi
         self.use_flash_attn = use_flash_attn
         self.return_residual = return_residual
         self.checkpointing = checkpointing
@@ -472,6 +547,11 @@ class MHA(nn.Module):
         wqkv_cls = linear_cls if not self.return_residual else linear_resid_cls
         inner_attn_cls = FlashSelfAttention if use_flash_attn else SelfAttention
         inner_cross_attn_cls = FlashCrossAttention if use_flash_attn else CrossAttention
+        alibi_slopes = (
+            torch.tensor(get_alibi_slopes(num_heads), dtype=torch.float32, device=device)
+            if use_alibi
+            else None
+        )
         if not self.cross_attn:
             self.Wqkv = wqkv_cls(embed_dim, qkv_dim, bias=qkv_proj_bias, **factory_kwargs)
         else:
@@ -488,10 +568,16 @@ class MHA(nn.Module):
                 )
                 self.dwconv_kv = nn.Conv1d(kv_dim, kv_dim, kernel_size=3, padding=2, groups=kv_dim)
         self.inner_attn = inner_attn_cls(
-            causal=causal, softmax_scale=softmax_scale, attention_dropout=dropout
+            causal=causal,
+            softmax_scale=softmax_scale,
+            attention_dropout=dropout,
+            alibi_slopes=alibi_slopes,
         )
         self.inner_cross_attn = inner_cross_attn_cls(
-            causal=causal, softmax_scale=softmax_scale, attention_dropout=dropout
+            causal=causal,
+            softmax_scale=softmax_scale,
+            attention_dropout=dropout,
+            alibi_slopes=alibi_slopes,
         )
         self.out_proj = linear_cls(embed_dim, embed_dim, bias=out_proj_bias, **factory_kwargs)
 
@@ -532,6 +618,49 @@ class MHA(nn.Module):
         assert self.layer_idx is not None, "Generation requires layer_idx in the constructor"
         return _update_kv_cache(kv, inference_params, self.layer_idx)
 
+    def _update_kvcache_attention(self, q, kv, inference_params):
+        """Write kv to the KV cache and attend over the cache. When decoding with FlashAttention,
+        both happen in the same call.
+        q: (batch_size, seqlen_q, nheads, head_dim)
+        kv: (batch_size, seqlen_k, 2, nheads_kv, head_dim)
+        """
+        if (
+            inference_params.sequence_len_offset == 0
+            or flash_attn_with_kvcache is None
+            or not self.use_flash_attn
+            or self.head_dim % 8 != 0
+        ):
+            kv = self._update_kv_cache(kv, inference_params)
+            # If we're processing the prompt, causal=None (use self.causal).
+            # If we're decoding, then causal=False.
+            causal = None if inference_params.sequence_len_offset == 0 else False
+            return self.inner_cross_attn(q, kv, causal=causal)
+        batch_start = inference_params.batch_size_offset
+        batch_end = batch_start + q.shape[0]
+        kv_cache = inference_params.key_value_memory_dict[self.layer_idx][batch_start:batch_end]
+        cache_seqlens = torch.full(
+            (q.shape[0],), inference_params.sequence_len_offset, dtype=torch.int32, device=q.device
+        )
+        return flash_attn_with_kvcache(
+            q,
+            kv_cache[:, :, 0],
+            kv_cache[:, :, 1],
+            kv[:, :, 0],
+            kv[:, :, 1],
+            cache_seqlens=cache_seqlens,
+            softmax_scale=self.inner_cross_attn.softmax_scale,
+        )
+
+    def _fuse_rotary(self, inference_params, cu_seqlens):
+        """Whether the rotary embedding of the packed qkv can be left to FlashSelfAttention: not with
+        a KV cache, an unpadded qkv or xPos scaling."""
+        return (
+            self.use_flash_attn
+            and inference_params is None
+            and cu_seqlens is None
+            and self.rotary_emb.scale is None
+        )
+
     def _apply_rotary_single_query_attention(self, qkv, inference_params, kv=None):
         """
         qkv: (batch_size, 1, 3, nheads, head_dim) if kv is None else it's just
@@ -594,6 +723,8 @@ class MHA(nn.Module):
             assert key_padding_mask is None
             assert cu_seqlens is None and max_seqlen is None
             assert not self.dwconv
+            # The bias would have to be aligned to the end of the KV cache.
+            assert not self.use_alibi or inference_params.sequence_len_offset == 0
 
         kwargs = (
             {"cu_seqlens": cu_seqlens, "max_seqlen": max_seqlen, **kwargs}
@@ -617,7 +748,18 @@ class MHA(nn.Module):
                 or inference_params.sequence_len_offset == 0
                 or not inference_params.fused_ft_kernel
             ):
-                if self.rotary_emb_dim > 0:
+                if self.rotary_emb_dim > 0 and self._fuse_rotary(inference_params, cu_seqlens):
+                    # Applied by the attention kernel as it loads q and k, saving a pass over them.
+                    self.rotary_emb._update_cos_sin_cache(
+                        qkv.shape[1], device=qkv.device, dtype=qkv.dtype
+                    )
+                    kwargs = {
+                        "rotary_cos": self.rotary_emb._cos_cached,
+                        "rotary_sin": self.rotary_emb._sin_cached,
+                        "rotary_interleaved": self.rotary_emb.interleaved,
+                        **kwargs,
+                    }
+                elif self.rotary_emb_dim > 0:
                     qkv = self.rotary_emb(qkv, seqlen_offset=seqlen_offset)
                 if inference_params is None:
                     if not self.checkpointing:
@@ -625,12 +767,9 @@ class MHA(nn.Module):
                     else:
                         context = torch.utils.checkpoint.checkpoint(self.inner_attn, qkv, **kwargs)
                 else:
-                    q = qkv[:, :, 0]
-                    kv = self._update_kv_cache(qkv[:, :, 1:], inference_params)
-                    # If we're processing the prompt, causal=None (use self.causal).
-                    # If we're decoding, then causal=False.
-                    causal = None if inference_params.sequence_len_offset == 0 else False
-                    context = self.inner_cross_attn(q, kv, causal=causal)
+                    context = self._update_kvcache_attention(
+                        qkv[:, :, 0], qkv[:, :, 1:], inference_params
+                    )
             else:
                 context = self._apply_rotary_single_query_attention(qkv, inference_params)
         else:
@@ -676,11 +815,7 @@ class MHA(nn.Module):
                             self.inner_cross_attn, q, kv, **kwargs
                         )
                 else:
-                    kv = self._update_kv_cache(kv, inference_params)
-                    # If we're processing the prompt, causal=None (use self.causal).
-                    # If we're decoding, then causal=False.
-                    causal = None if inference_params.sequence_len_offset == 0 else False
-                    context = self.inner_cross_attn(q, kv, causal=causal)
+                    context = self._update_kvcache_attention(q, kv, inference_params)
             else:
                 context = self._apply_rotary_single_query_attention(q, inference_params, kv=kv)
         out = self.out_proj(rearrange(context, "... h d -> ... (h d)"))
@@ -1,13 +1,15 @@
 # Copyright (c) 2023, Tri Dao.
 # Adapted from https://github.com/NVIDIA/Megatron-LM/blob/0bb597b42c53355a567aba2a1357cc34b9d99ddd/megatron/text_generation/forward_step.py#L31
 import gc
+import math
 import time
 from collections import namedtuple
 from dataclasses import dataclass, field
 from typing import Callable, Optional, Sequence, Union
 
 import torch
-from einops import rearrange
+import torch.nn.functional as F
+from einops import rearrange, repeat
 from torch import Tensor
 from torch.profiler import ProfilerActivity, profile, record_function
 from transformers.generation import GreedySearchDecoderOnlyOutput, SampleDecoderOnlyOutput
@@ -25,6 +27,156 @@ class InferenceParams:
     key_value_memory_dict: dict = field(default_factory=dict)
     fused_ft_kernel: bool = False
     lengths_per_sample: Optional[Tensor] = None
+    # Beam search with the fused_ft_kernel: the batch is made of max_batch_size // beam_width
+    # sequences of beam_width beams each, and cache_indir (max_batch_size, max_sequence_len) int32
+    # says which beam of the sequence holds each step of each beam in the KV cache, see
+    # update_cache_indir.
+    beam_width: int = 1
+    cache_indir: Optional[Tensor] = None
+    # Skip the heads with little output with the fused_ft_kernel, see HeadPruningPolicy.
+    head_pruning: Optional["HeadPruningPolicy"] = None
+
+
+class HeadPruningPolicy:
+    """Online head pruning for decoding with the fused_ft_kernel.
+
+    The importance of a head of a layer is a running average (ema_decay) of the norm of its attention
+    output, averaged over the batch. At each step every layer attends only the keep_ratio of its heads
+    that have the highest importance, through the nnz_head_idx of single_query_attention. The skipped
+    heads output zeros, but their keys and values still go into the KV cache. Every refresh_interval
+    steps, and during the first warmup_steps, all the heads are attended. This refreshes the importance
+    of the skipped heads so that they can come back.
+
+    The decode loop calls step() after each token. MHA calls nnz_head_idx() and observe() around the
+    kernel.
+    """
+
+    def __init__(self, keep_ratio=0.5, ema_decay=0.9, refresh_interval=16, warmup_steps=4):
+        assert 0.0 < keep_ratio <= 1.0
+        self.keep_ratio = keep_ratio
+        self.ema_decay = ema_decay
+        self.refresh_interval = refresh_interval
+        self.warmup_steps = warmup_steps
+        self.step_idx = 0
+        self.importance = {}  # layer_idx -> (nheads,) float32
+        self._nnz_head_idx = {}  # layer_idx -> (nheads_keep,) int32, sorted
+
+    def step(self):
+        self.step_idx += 1
+
+    def nnz_head_idx(self, layer_idx):
+        """The heads that layer_idx attends at this step, None for all of them."""
+        if (
+            self.step_idx < self.warmup_steps
+            or self.step_idx % self.refresh_interval == 0
+            or layer_idx not in self._nnz_head_idx
+        ):
+            return None
+        return self._nnz_head_idx[layer_idx]
+
+    def observe(self, layer_idx, context, nnz_head_idx=None):
+        """context: (batch_size, nheads, headdim), the attention output of the step with the heads
+        nnz_head_idx (all of them if None)."""
+        score = context.float().norm(dim=-1).mean(dim=0)
+        importance = self.importance.get(layer_idx)
+        if importance is None:
+            importance = score
+        elif nnz_head_idx is None:
+            importance = self.ema_decay * importance + (1 - self.ema_decay) * score
+        else:
+            heads = nnz_head_idx.long()
+            importance[heads] = self.ema_decay * importance[heads] + (1 - self.ema_decay) * score[heads]
+        self.importance[layer_idx] = importance
+        nheads_keep = max(1, math.ceil(self.keep_ratio * importance.shape[0]))
+        self._nnz_head_idx[layer_idx] = (
+            torch.topk(importance, nheads_keep, sorted=False).indices.sort().values.to(torch.int32)
+        )
+
+
+def update_cache_indir(cache_indir, beam_parents, seqlen):
+    """Reorder the beams after a step of beam search without touching the KV cache.
+    Arguments:
+        cache_indir: (batch_size * beam_width, max_sequence_len) int32, updated in place.
+        beam_parents: (batch_size, beam_width), the beam of the same sequence that each beam continues.
+        seqlen: the number of steps in the KV cache, including the one just computed.
+    Each beam appended the last step to its own rows of the KV cache; a beam then shares the steps of
+    its parent, wherever those are, and appends the next one to its own rows again.
+    """
+    batch_size, beam_width = beam_parents.shape
+    indir = rearrange(cache_indir, "(b beam) l -> b beam l", beam=beam_width)
+    indir[:, :, seqlen - 1] = torch.arange(beam_width, dtype=indir.dtype, device=indir.device)
+    parents = repeat(beam_parents.to(torch.long), "b beam -> b beam l", l=seqlen)
+    indir[:, :, :seqlen] = torch.gather(indir[:, :, :seqlen], 1, parents)
+    return cache_indir
+
+
+def _float_to_e4m3(x):
+    """fp32 to the bits of fp8 e4m3 (bias 7, max 448, no infinities), rounded to nearest even and
+    saturated, as in csrc/ft_attention/kv_cache_quant.h."""
+    a = x.abs().clamp(max=448.0)
+    mantissa, exponent = torch.frexp(a)  # a = mantissa * 2^exponent, mantissa in [0.5, 1)
+    code = (exponent + 6) * 8 + torch.round((2 * mantissa - 1) * 8).to(torch.int32)  # a carry bumps the exponent
+    code = torch.where(a < 2.0**-6, torch.round(a * 2.0**9).to(torch.int32), code.clamp(max=0x7E))
+    return (code | ((x < 0).to(torch.int32) << 7)).to(torch.uint8)
+
+
+def _e4m3_to_float(code):
+    code = code.to(torch.int32)
+    exponent, mantissa = (code >> 3) & 0xF, (code & 0x7).float()
+    a = torch.where(exponent == 0, mantissa * 2.0**-9, torch.ldexp(1 + mantissa / 8, exponent - 7))
+    return torch.where(code >= 0x80, -a, a)
+
+
+def quantize_kv_cache(x, dtype=torch.int8):
+    """Quantize keys or values for the 8-bit KV cache of the fused_ft_kernel.
+    Arguments:
+        x: (..., headdim), e.g. (batch_size, nheads, seqlen, headdim).
+        dtype: torch.int8 for int8 codes, torch.uint8 for the bits of fp8 e4m3 codes.
+    Return:
+        codes: (..., headdim) of dtype, the K cache still to be packed like the fp16 one.
+        scale: (...) float32, the absmax of each vector over the largest code.
+    x = scale * decode(codes) up to rounding, bit for bit what single_query_attention appends.
+    """
+    assert dtype in [torch.int8, torch.uint8]
+    x = x.float()
+    scale = x.abs().amax(dim=-1) / (127.0 if dtype == torch.int8 else 448.0)
+    inv_scale = torch.where(scale > 0, 1.0 / scale, torch.zeros_like(scale))
+    x = x * inv_scale[..., None]
+    if dtype == torch.int8:
+        return torch.round(x).clamp(-127, 127).to(torch.int8), scale
+    return _float_to_e4m3(x), scale
+
+
+def dequantize_kv_cache(codes, scale, dtype=torch.float16):
+    """The inverse of quantize_kv_cache, in dtype."""
+    values = codes.float() if codes.dtype == torch.int8 else _e4m3_to_float(codes)
+    return (values * scale[..., None]).to(dtype)
+
+
+def kv_page_summary(k_cache, page_size, lengths=None):
+    """The page summary of sparse page retrieval in single_query_attention, for a prompt in the cache.
+    Arguments:
+        k_cache: (batch_size, nheads_kv, headdim / x, max_sequence_len, x), the packed K cache.
+        page_size: the timesteps of a page.
+        lengths: (batch_size,), the timesteps in the cache of each sequence, all of them if None.
+    Return:
+        page_summary: (batch_size, nheads_kv, num_pages, 2, headdim) float32, the min and the max of
+            the keys of each page over its timesteps before the length, 0 for the pages with none.
+    single_query_attention then adds the key of each step to it.
+    """
+    batch_size, nheads_kv, _, seqlen, _ = k_cache.shape
+    k = rearrange(k_cache, "b h d s x -> b h s (d x)").float()
+    num_pages = (seqlen + page_size - 1) // page_size
+    k = F.pad(k, (0, 0, 0, num_pages * page_size - seqlen))
+    if lengths is None:
+        lengths = torch.full((batch_size,), seqlen, device=k_cache.device)
+    valid = torch.arange(num_pages * page_size, device=k_cache.device) < lengths[:, None]
+    valid = rearrange(valid, "b (p s) -> b 1 p s 1", s=page_size)
+    k = rearrange(k, "b h (p s) d -> b h p s d", s=page_size)
+    key_min = torch.where(valid, k, float("inf")).amin(dim=3)
+    key_max = torch.where(valid, k, float("-inf")).amax(dim=3)
+    summary = torch.stack([key_min, key_max], dim=3)
+    return summary.masked_fill_(~valid.any(dim=3, keepdim=True), 0.0).contiguous()
 
 
 # https://github.com/NVIDIA/Megatron-LM/blob/0bb597b42c53355a567aba2a1357cc34b9d99ddd/megatron/text_generation/sampling.py
@@ -86,6 +238,7 @@ def decode(
     fused_ft_kernel=False,
     cg=False,
     timing=False,
+    head_pruning=None,
 ):
     """Decoding, either greedy or with top-k or top-p sampling.
     If top-k = 0, don't limit the number of candidates (pure sampling).
@@ -98,12 +251,15 @@ def decode(
         max_length: int
         teacher_outputs (optional): (batch, seq_len). If provided, instead of sampling from the
             logits, the next token is taken from the teacher_outputs. Useful for testing.
+        head_pruning (optional): a HeadPruningPolicy, which skips heads at the decoding steps
+            (needs fused_ft_kernel, and not cg).
     Returns: GreedySearchDecoderOnlyOutput or SampleDecoderOnlyOutput, with the following fields:
         sequences: (batch, max_length)
         scores: tuples of (batch, vocab_size)
     """
     batch_size, seqlen_og = input_ids.shape
     teacher_output_len = teacher_outputs.shape[1] if teacher_outputs is not None else 0
+    assert head_pruning is None or (fused_ft_kernel and not cg)
     if cg:
         assert fused_ft_kernel
         if not hasattr(model, "_decoding_cache"):
@@ -122,7 +278,10 @@ def decode(
         inference_params.sequence_len_offset = 0
     else:
         inference_params = InferenceParams(
-            max_sequence_len=max_length, max_batch_size=batch_size, fused_ft_kernel=fused_ft_kernel
+            max_sequence_len=max_length,
+            max_batch_size=batch_size,
+            fused_ft_kernel=fused_ft_kernel,
+            head_pruning=head_pruning,
         )
     scores = []
     with torch.inference_mode():
@@ -161,6 +320,8 @@ def decode(
                     position_ids,
                     inference_params.sequence_len_offset,
                 )
+            if head_pruning is not None:
+                head_pruning.step()
             if vocab_size is not None:
                 logits = logits[..., :vocab_size]
             scores.append(logits if not cg else logits.clone())
@@ -3,6 +3,7 @@ import math
 import pytest
 import torch
 import torch.nn.functional as F
+import flash_attn_2_cuda as flash_attn_cuda
 from einops import rearrange, repeat
 from flash_attn import (
     flash_attn_func,
@@ -11,17 +12,20 @@ from flash_attn import (
     flash_attn_varlen_func,
     flash_attn_varlen_kvpacked_func,
     flash_attn_varlen_qkvpacked_func,
+    flash_attn_with_kvcache,
 )
 from flash_attn.bert_padding import index_first_axis, pad_input, unpad_input
-from flash_attn.flash_attn_interface import _get_block_size
+from flash_attn.flash_attn_interface import _apply_rotary, _get_block_size
 
 MAX_HEADDIM_SM8x = 192
 
 
-is_sm75 = torch.cuda.get_device_capability("cuda") == (7, 5)
-is_sm8x = torch.cuda.get_device_capability("cuda")[0] == 8
-is_sm80 = torch.cuda.get_device_capability("cuda") == (8, 0)
-is_sm90 = torch.cuda.get_device_capability("cuda") == (9, 0)
+# The CPU backend tests below also run on machines without a GPU.
+has_cuda = torch.cuda.is_available()
+is_sm75 = has_cuda and torch.cuda.get_device_capability("cuda") == (7, 5)
+is_sm8x = has_cuda and torch.cuda.get_device_capability("cuda")[0] == 8
+is_sm80 = has_cuda and torch.cuda.get_device_capability("cuda") == (8, 0)
+is_sm90 = has_cuda and torch.cuda.get_device_capability("cuda") == (9, 0)
 
 
 def generate_random_padding_mask(max_seqlen, batch_size, device, mode="random"):
@@ -146,6 +150,18 @@ def generate_qkv(
         )
 
 
+def construct_local_mask(seqlen_q, seqlen_k, window_size=(-1, -1), device=None):
+    """(seqlen_q, seqlen_k) mask, True outside of the sliding window of each query."""
+    row_idx = rearrange(torch.arange(seqlen_q, device=device, dtype=torch.long), "s -> s 1")
+    col_idx = torch.arange(seqlen_k, device=device, dtype=torch.long)
+    mask = torch.zeros(seqlen_q, seqlen_k, dtype=torch.bool, device=device)
+    if window_size[0] >= 0:
+        mask |= col_idx < row_idx - window_size[0]
+    if window_size[1] >= 0:
+        mask |= col_idx > row_idx + window_size[1]
+    return mask
+
+
 def attention_ref(
     q,
     k,
@@ -157,6 +173,8 @@ def attention_ref(
     causal=False,
     upcast=True,
     reorder_ops=False,
+    window_size=(-1, -1),
+    alibi_slopes=None,
 ):
     """
     Arguments:
@@ -172,6 +190,9 @@ def attention_ref(
         reorder_ops: whether to change the order of operations (scaling k instead of scaling k, etc.)
             without changing the math. This is to estimate the numerical error from operation
             reordering.
+        window_size: (left, right). Query i only attends to the keys [i - left, i + right], -1
+            leaving that side unbounded. Queries without any key in their window output 0.
+        alibi_slopes: (nheads,) or (batch_size, nheads). Adds -alibi_slopes * |i - j| to the scores.
     Output:
         output: (batch_size, seqlen_q, nheads, head_dim)
         attention: (batch_size, nheads, seqlen_q, seqlen_k), softmax after dropout
@@ -187,6 +208,11 @@ def attention_ref(
         scores = torch.einsum("bthd,bshd->bhts", q / math.sqrt(d), k)
     else:
         scores = torch.einsum("bthd,bshd->bhts", q, k / math.sqrt(d))
+    if alibi_slopes is not None:
+        alibi_slopes = alibi_slopes.expand(q.shape[0], q.shape[2])
+        row_idx = rearrange(torch.arange(seqlen_q, device=q.device), "s -> s 1")
+        col_idx = torch.arange(seqlen_k, device=q.device)
+        scores = scores - rearrange(alibi_slopes, "b h -> b h 1 1") * (row_idx - col_idx).abs()
     if key_padding_mask is not None:
         scores.masked_fill_(rearrange(~key_padding_mask, "b s -> b 1 1 s"), float("-inf"))
     if causal:
@@ -194,7 +220,13 @@ def attention_ref(
             torch.ones(seqlen_q, seqlen_k, dtype=torch.bool, device=q.device), 1
         )
         scores.masked_fill_(causal_mask, float("-inf"))
+    if window_size[0] >= 0 or window_size[1] >= 0:
+        local_mask = construct_local_mask(seqlen_q, seqlen_k, window_size, q.device)
+        scores.masked_fill_(local_mask, float("-inf"))
     attention = torch.softmax(scores, dim=-1)
+    if window_size[0] >= 0 or window_size[1] >= 0:
+        # Rows that are fully masked out would otherwise be NaN.
+        attention = attention.masked_fill(torch.all(scores == float("-inf"), dim=-1, keepdim=True), 0.0)
     dropout_scaling = 1.0 / (1 - dropout_p)
     # attention_drop = attention.masked_fill(~dropout_mask, 0.0) * dropout_scaling
     # output = torch.einsum('bhts,bshd->bthd', attention_drop , v)
@@ -1291,3 +1323,1307 @@ def test_flash_attn_bwd_varlen_overflow(d, causal, dtype):
     assert not q.grad.isnan().any()
     assert not k.grad.isnan().any()
     assert not v.grad.isnan().any()
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+# @pytest.mark.parametrize('dtype', [torch.float16])
+@pytest.mark.parametrize("mha_type", ["mha", "mqa", "gqa"])
+# @pytest.mark.parametrize('mha_type', ["mha"])
+@pytest.mark.parametrize("causal", [False, True])
+# @pytest.mark.parametrize('causal', [True])
+@pytest.mark.parametrize("d", [32, 40, 59, 64, 96, 128, 160, 256])
+# @pytest.mark.parametrize('d', [64])
+@pytest.mark.parametrize(
+    "seqlen_q,seqlen_k",
+    [
+        (1, 239),
+        (113, 203),
+        (128, 217),
+        (108, 256),
+        (256, 128),
+    ],
+)
+# @pytest.mark.parametrize('seqlen_q,seqlen_k', [(128, 128)])
+def test_flash_attn_cpu_output(seqlen_q, seqlen_k, d, causal, mha_type, dtype):
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size = 4
+    nheads = 6
+    nheads_k = nheads if mha_type == "mha" else (1 if mha_type == "mqa" else 3)
+    assert nheads % nheads_k == 0
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+
+    out, lse, _ = flash_attn_func(q, k, v, 0.0, return_attn_probs=True, causal=causal)
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None, causal=causal)
+    out_pt, _ = attention_ref(
+        q, k, v, None, None, 0.0, None, causal=causal, upcast=False, reorder_ops=True
+    )
+
+    k_rep = repeat(k, "b s h d -> b s (h g) d", g=nheads // nheads_k)
+    scores = torch.einsum("bthd,bshd->bhts", q.float(), k_rep.float()) / math.sqrt(d)
+    if causal:
+        causal_mask = torch.triu(torch.ones(seqlen_q, seqlen_k, dtype=torch.bool), 1)
+        scores.masked_fill_(causal_mask, float("-inf"))
+    lse_ref = torch.logsumexp(scores, dim=-1)
+
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    print(f"Output mean diff: {(out - out_ref).abs().mean().item()}")
+    print(f"Pytorch max diff: {(out_pt - out_ref).abs().max().item()}")
+    print(f"LSE max diff: {(lse - lse_ref).abs().max().item()}")
+
+    # Check that the CPU backend has at most twice the numerical error
+    # of a Pytorch implementation.
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item()
+    assert (lse - lse_ref).abs().max().item() <= 1e-3
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+# @pytest.mark.parametrize('dtype', [torch.float16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+# @pytest.mark.parametrize('mha_type', ["mha"])
+@pytest.mark.parametrize("causal", [False, True])
+# @pytest.mark.parametrize('causal', [True])
+@pytest.mark.parametrize("d", [32, 59, 64, 128])
+# @pytest.mark.parametrize('d', [64])
+@pytest.mark.parametrize(
+    "seqlen_q,seqlen_k",
+    [
+        (113, 203),
+        (128, 217),
+        (256, 128),
+    ],
+)
+# @pytest.mark.parametrize('seqlen_q,seqlen_k', [(128, 128)])
+def test_flash_attn_varlen_cpu_output(seqlen_q, seqlen_k, d, causal, mha_type, dtype):
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size = 4
+    nheads = 6
+    nheads_k = nheads if mha_type == "mha" else 3
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+
+    query_padding_mask = generate_random_padding_mask(seqlen_q, batch_size, device, mode="random")
+    key_padding_mask = generate_random_padding_mask(seqlen_k, batch_size, device, mode="random")
+    (
+        q_unpad,
+        k_unpad,
+        v_unpad,
+        cu_seqlens_q,
+        cu_seqlens_k,
+        max_seqlen_q,
+        max_seqlen_k,
+        q,
+        k,
+        v,
+        output_pad_fn,
+        dq_pad_fn,
+        dk_pad_fn,
+    ) = generate_qkv(q, k, v, query_padding_mask, key_padding_mask, kvpacked=False)
+    out_unpad = flash_attn_varlen_func(
+        q_unpad.detach(),
+        k_unpad.detach(),
+        v_unpad.detach(),
+        cu_seqlens_q,
+        cu_seqlens_k,
+        max_seqlen_q,
+        max_seqlen_k,
+        0.0,
+        causal=causal,
+    )
+    out = output_pad_fn(out_unpad)
+
+    out_ref, _ = attention_ref(
+        q.detach(), k.detach(), v.detach(), query_padding_mask, key_padding_mask, causal=causal
+    )
+    out_pt, _ = attention_ref(
+        q.detach(),
+        k.detach(),
+        v.detach(),
+        query_padding_mask,
+        key_padding_mask,
+        causal=causal,
+        upcast=False,
+        reorder_ops=True,
+    )
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    print(f"Output mean diff: {(out - out_ref).abs().mean().item()}")
+    print(f"Pytorch max diff: {(out_pt - out_ref).abs().max().item()}")
+
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item()
+
+
+@pytest.mark.parametrize("num_workers", [1, 7, 108])
+@pytest.mark.parametrize("seqlen", [1, 97, 128, 1000, 2048])
+@pytest.mark.parametrize("batch_size,nheads", [(1, 1), (2, 16), (9, 7)])
+def test_flash_attn_causal_schedule(batch_size, nheads, seqlen, num_workers):
+    block_m, block_n = 128, 64
+    num_m_block = (seqlen + block_m - 1) // block_m
+    schedule = flash_attn_cuda.fwd_causal_schedule(
+        batch_size, nheads, seqlen, seqlen, block_m, block_n, num_workers, False
+    )
+    worker, bidb, bidh, m_block, start, end = schedule.unbind(dim=1)
+    # Every (batch, head, m_block) tile is handed out exactly once.
+    tile_id = (bidb * nheads + bidh) * num_m_block + m_block
+    assert torch.equal(tile_id.sort().values, torch.arange(batch_size * nheads * num_m_block))
+    # Producers are handed out before the consumers that wait on them.
+    dispatch_idx = torch.empty_like(tile_id)
+    dispatch_idx[tile_id] = torch.arange(tile_id.numel())
+    is_consumer = m_block + 1 < (num_m_block + 1) // 2
+    producer_id = tile_id - m_block + (num_m_block - 1 - m_block)
+    assert (dispatch_idx[producer_id[is_consumer]] < dispatch_idx[tile_id[is_consumer]]).all()
+    # A worker runs one tile at a time.
+    for w in worker.unique():
+        order = start[worker == w].argsort()
+        assert (start[worker == w][order][1:] >= end[worker == w][order][:-1]).all()
+    # Workers never sit idle while there are tiles left (list scheduling bound).
+    busy = end - start
+    assert end.max() <= busy.sum() / num_workers + busy.max()
+
+
+@pytest.mark.parametrize("num_workers", [1, 7, 108, 216])
+@pytest.mark.parametrize("block_m,block_n", [(128, 64), (128, 128), (64, 128)])
+@pytest.mark.parametrize(
+    "seqlens",
+    [[1000], [8192, 128, 300, 4000, 64, 1000, 2048, 17], [4096, 4096, 100, 200, 0, 400], [5, 3]],
+)
+def test_flash_attn_varlen_causal_schedule(seqlens, block_m, block_n, num_workers):
+    nheads = 16
+    batch_size = len(seqlens)
+    seqlens = torch.tensor(seqlens, dtype=torch.int32)
+    cu_seqlens = F.pad(seqlens.cumsum(0, dtype=torch.int32), (1, 0))
+    num_m_blocks = (seqlens.long() + block_m - 1) // block_m
+    max_num_m_block = num_m_blocks.max().item()
+    schedule = flash_attn_cuda.fwd_varlen_causal_schedule(
+        cu_seqlens, cu_seqlens, nheads, block_m, block_n, num_workers, True
+    )
+    worker, bidb, bidh, m_block, start, end = schedule.unbind(dim=1)
+    # Every non-empty (batch, head, m_block) tile is handed out exactly once, and nothing else.
+    tile_id = (bidb * nheads + bidh) * max_num_m_block + m_block
+    expected = torch.cat(
+        [
+            (b * nheads + h) * max_num_m_block + torch.arange(num_m_blocks[b].item())
+            for b in range(batch_size)
+            for h in range(nheads)
+        ]
+    )
+    assert torch.equal(tile_id.sort().values, expected.sort().values)
+    # Producers are handed out before the consumers that wait on them.
+    dispatch_idx = torch.full((batch_size * nheads * max_num_m_block,), -1, dtype=torch.long)
+    dispatch_idx[tile_id] = torch.arange(tile_id.numel())
+    num_m_block = num_m_blocks[bidb]
+    is_consumer = m_block + 1 < (num_m_block + 1) // 2
+    producer_id = tile_id - m_block + (num_m_block - 1 - m_block)
+    assert (dispatch_idx[producer_id[is_consumer]] >= 0).all()
+    assert (dispatch_idx[producer_id[is_consumer]] < dispatch_idx[tile_id[is_consumer]]).all()
+    # A worker runs one tile at a time.
+    for w in worker.unique():
+        order = start[worker == w].argsort()
+        assert (start[worker == w][order][1:] >= end[worker == w][order][:-1]).all()
+    # Workers never sit idle while there are tiles left (list scheduling bound).
+    busy = end - start
+    assert end.max() <= busy.sum() / num_workers + busy.max()
+    # On a packed batch of mixed lengths, the plan beats the bottom-up order.
+    if seqlens.tolist() == [8192, 128, 300, 4000, 64, 1000, 2048, 17] and num_workers >= 108 and block_m == 128:
+        schedule_bottom_up = flash_attn_cuda.fwd_varlen_causal_schedule(
+            cu_seqlens, cu_seqlens, nheads, block_m, block_n, num_workers, False
+        )
+        assert end.max() < schedule_bottom_up[:, 5].max()
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("seqlen", [97, 128, 1000])
+def test_flash_attn_cpu_stream_pool(seqlen, dtype):
+    """The causal CPU forward forks its workers off the CPU stream pool and joins them back before
+    returning, so the output must be complete and identical whatever the number of workers, also
+    when several callers share the pool.
+    """
+    import threading
+
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size = 3
+    nheads = 5
+    d = 64
+    q, k, v = [
+        torch.randn(batch_size, seqlen, nheads, d, device=device, dtype=dtype) for _ in range(3)
+    ]
+    num_threads_og = torch.get_num_threads()
+    try:
+        torch.set_num_threads(1)
+        out_ref = flash_attn_func(q, k, v, causal=True)
+        for num_threads in [2, 3, 8]:
+            torch.set_num_threads(num_threads)
+            for _ in range(3):
+                assert torch.equal(flash_attn_func(q, k, v, causal=True), out_ref)
+        outs = [None] * 4
+
+        def run(i):
+            outs[i] = flash_attn_func(q, k, v, causal=True)
+
+        callers = [threading.Thread(target=run, args=(i,)) for i in range(len(outs))]
+        for caller in callers:
+            caller.start()
+        for caller in callers:
+            caller.join()
+        assert all(torch.equal(out, out_ref) for out in outs)
+    finally:
+        torch.set_num_threads(num_threads_og)
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+def test_flash_attn_cpu_causal_pairing(dtype):
+    """Stress the producer / consumer handshake of the causal forward: more than 32 heads and
+    batches, flag buffers that grow and get reused across calls and thread counts, and varlen
+    batches where every sequence pairs up a different number of row blocks. A flag left raised by
+    a previous call would let a consumer merge in a stale producer.
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    d = 32
+    num_threads_og = torch.get_num_threads()
+    try:
+        shapes = [(33, 2, 300), (2, 40, 700), (1, 3, 1500), (33, 2, 300)]
+        for num_threads, (batch_size, nheads, seqlen) in [(t, s) for t in [1, 3] for s in shapes]:
+            torch.set_num_threads(num_threads)
+            q, k, v = [
+                torch.randn(batch_size, seqlen, nheads, d, device=device, dtype=dtype)
+                for _ in range(3)
+            ]
+            out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None, causal=True)
+            out_pt, _ = attention_ref(
+                q, k, v, None, None, 0.0, None, causal=True, upcast=False, reorder_ops=True
+            )
+            for _ in range(2):
+                out = flash_attn_func(q, k, v, causal=True)
+                # The producer's half of the row goes through dtype before the merge.
+                assert (out - out_ref).abs().max().item() <= 2 * (
+                    out_pt - out_ref
+                ).abs().max().item() + torch.finfo(dtype).eps
+
+        seqlens = torch.tensor([1, 129, 385, 700, 1030, 256], dtype=torch.int32)
+        cu_seqlens = F.pad(seqlens.cumsum(0, dtype=torch.int32), (1, 0))
+        nheads = 3
+        q, k, v = [
+            torch.randn(seqlens.sum().item(), nheads, d, device=device, dtype=dtype)
+            for _ in range(3)
+        ]
+        out = flash_attn_varlen_func(
+            q, k, v, cu_seqlens, cu_seqlens, seqlens.max().item(), seqlens.max().item(), causal=True
+        )
+        for i, seqlen in enumerate(seqlens.tolist()):
+            rows = slice(cu_seqlens[i].item(), cu_seqlens[i + 1].item())
+            out_ref, _ = attention_ref(
+                q[None, rows], k[None, rows], v[None, rows], None, None, 0.0, None, causal=True
+            )
+            out_pt, _ = attention_ref(
+                q[None, rows], k[None, rows], v[None, rows], None, None, 0.0, None, causal=True,
+                upcast=False, reorder_ops=True,
+            )
+            assert (out[None, rows] - out_ref).abs().max().item() <= 2 * (
+                out_pt - out_ref
+            ).abs().max().item() + torch.finfo(dtype).eps
+    finally:
+        torch.set_num_threads(num_threads_og)
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("num_splits", [2, 3, 7, 64])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 239), (1, 4096), (7, 1000), (128, 3000), (300, 113)])
+def test_flash_attn_cpu_splitkv(seqlen_q, seqlen_k, num_splits, dtype):
+    """Split-KV against the single pass: the partial O / LSE of each split of seqlen_k, combined,
+    should give back the same output and LSE. 64 splits leaves some of them empty.
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, d = 2, 3, 64
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    softmax_scale = d ** (-0.5)
+    out_og, *_, lse_og, _, _ = flash_attn_cuda.fwd(
+        q, k, v, None, None, 0.0, softmax_scale, False, -1, -1, False, None, 1,
+        None, None, None, None, None, None, False, None,
+    )
+    out, *_, lse, _, _ = flash_attn_cuda.fwd(
+        q, k, v, None, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None)
+    out_pt, _ = attention_ref(q, k, v, None, None, 0.0, None, upcast=False, reorder_ops=True)
+    print(f"Output max diff vs single pass: {(out - out_og).abs().max().item()}")
+    print(f"LSE max diff vs single pass: {(lse - lse_og).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+        dtype
+    ).eps
+    assert torch.allclose(lse, lse_og, rtol=1e-4, atol=1e-4)
+
+    # Split-KV is only taken without causal masking and dropout.
+    with pytest.raises(RuntimeError):
+        flash_attn_cuda.fwd(
+            q, k, v, None, None, 0.0, softmax_scale, True, -1, -1, False, None, num_splits,
+            None, None, None, None, None, None, False, None,
+        )
+    with pytest.raises(RuntimeError):
+        flash_attn_cuda.fwd(
+            q, k, v, None, None, 0.1, softmax_scale, False, -1, -1, False, None, num_splits,
+            None, None, None, None, None, None, False, None,
+        )
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("page_block_size", [128, 256])
+@pytest.mark.parametrize("seqlen_q,num_pages", [(1, 1), (1, 5), (7, 3), (300, 2)])
+def test_flash_attn_cpu_paged_kv(seqlen_q, num_pages, page_block_size, mha_type, num_splits, dtype):
+    """Paged KV cache against the same keys / values gathered into contiguous tensors. The pages are
+    shuffled in a pool with more pages than in use, so that a wrong lookup reads the wrong keys.
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, d = 3, 4, 64
+    nheads_k = nheads if mha_type == "mha" else 2
+    num_blocks = batch_size * num_pages + 5
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k_cache, v_cache = [
+        torch.randn(num_blocks, page_block_size, nheads_k, d, device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    block_table = rearrange(
+        torch.randperm(num_blocks, dtype=torch.int32, device=device)[: batch_size * num_pages],
+        "(b nblocks) -> b nblocks",
+        b=batch_size,
+    )
+    k, v = [
+        rearrange(
+            cache[block_table.flatten().long()],
+            "(b nblocks) block_size ... -> b (nblocks block_size) ...",
+            b=batch_size,
+        )
+        for cache in (k_cache, v_cache)
+    ]
+    softmax_scale = d ** (-0.5)
+    out_og, *_, lse_og, _, _ = flash_attn_cuda.fwd(
+        q, k, v, None, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+    out, *_, lse, _, _ = flash_attn_cuda.fwd(
+        q, k_cache, v_cache, None, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits, block_table,
+        None, None, None, None, None, False, None,
+    )
+    assert torch.equal(out, out_og)
+    assert torch.equal(lse, lse_og)
+
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None)
+    out_pt, _ = attention_ref(q, k, v, None, None, 0.0, None, upcast=False, reorder_ops=True)
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+        dtype
+    ).eps
+
+    # A kBlockN tile must not cross a page.
+    with pytest.raises(RuntimeError):
+        flash_attn_cuda.fwd(
+            q, k_cache[:, :64], v_cache[:, :64], None, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits,
+            block_table, None, None, None, None, None, False, None,
+        )
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("paged_kv", [False, True])
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("seqlen_new", [1, 5])
+def test_flash_attn_cpu_kvcache_append(seqlen_new, mha_type, num_splits, paged_kv, dtype):
+    """Decode for a few steps, appending k / v to the cache in the forward call. After every step
+    the cache must hold exactly what a separate copy would have written, and the output must be
+    the attention over the cache up to the new length of each sequence.
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, seqlen_cache, num_steps = 3, 4, 64, 256, 4
+    nheads_k = nheads if mha_type == "mha" else 2
+    page_block_size = 128
+    cache_seqlens = torch.tensor([0, 37, seqlen_cache - num_steps * seqlen_new], dtype=torch.int32)
+    k_cache_ref, v_cache_ref = [
+        torch.randn(batch_size, seqlen_cache, nheads_k, d, device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    if not paged_kv:
+        k_cache, v_cache = k_cache_ref.clone(), v_cache_ref.clone()
+        block_table = None
+    else:
+        num_pages = seqlen_cache // page_block_size
+        block_table = rearrange(
+            torch.randperm(batch_size * num_pages, dtype=torch.int32, device=device),
+            "(b nblocks) -> b nblocks",
+            b=batch_size,
+        )
+        k_cache, v_cache = [
+            torch.empty(batch_size * num_pages, page_block_size, nheads_k, d, device=device, dtype=dtype)
+            for _ in range(2)
+        ]
+        for cache, cache_ref in [(k_cache, k_cache_ref), (v_cache, v_cache_ref)]:
+            cache[block_table.flatten().long()] = rearrange(
+                cache_ref, "b (nblocks block_size) ... -> (b nblocks) block_size ...",
+                block_size=page_block_size,
+            )
+    arange = rearrange(torch.arange(seqlen_cache, device=device), "s -> 1 s")
+    for _ in range(num_steps):
+        q = torch.randn(batch_size, seqlen_new, nheads, d, device=device, dtype=dtype)
+        k, v = [
+            torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype)
+            for _ in range(2)
+        ]
+        out = flash_attn_with_kvcache(
+            q, k_cache, v_cache, k, v, cache_seqlens=cache_seqlens, block_table=block_table,
+            num_splits=num_splits,
+        )
+        for i, start in enumerate(cache_seqlens.tolist()):
+            k_cache_ref[i, start : start + seqlen_new] = k[i]
+            v_cache_ref[i, start : start + seqlen_new] = v[i]
+        cache_seqlens += seqlen_new
+        if not paged_kv:
+            k_cache_out, v_cache_out = k_cache, v_cache
+        else:
+            k_cache_out, v_cache_out = [
+                rearrange(
+                    cache[block_table.flatten().long()],
+                    "(b nblocks) block_size ... -> b (nblocks block_size) ...",
+                    b=batch_size,
+                )
+                for cache in (k_cache, v_cache)
+            ]
+        assert torch.equal(k_cache_out, k_cache_ref)
+        assert torch.equal(v_cache_out, v_cache_ref)
+
+        key_padding_mask = arange < rearrange(cache_seqlens, "b -> b 1")
+        out_ref, _ = attention_ref(q, k_cache_ref, v_cache_ref, None, key_padding_mask)
+        out_pt, _ = attention_ref(
+            q, k_cache_ref, v_cache_ref, None, key_padding_mask, upcast=False, reorder_ops=True
+        )
+        print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+        assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+            dtype
+        ).eps
+
+    with pytest.raises(RuntimeError):
+        # More keys than the cache can hold.
+        flash_attn_with_kvcache(
+            q, k_cache, v_cache, k, v, cache_seqlens=cache_seqlens, block_table=block_table
+        )
+
+
+@pytest.mark.skipif(not has_cuda, reason="no GPU")
+def test_flash_attn_kvcache_append_bounds_check(monkeypatch):
+    """On the GPU, an append past the end of the KV cache is caught with FLASH_ATTENTION_CHECK_KV_APPEND=1."""
+    device, dtype = "cuda", torch.float16
+    batch_size, nheads, d, seqlen_cache, seqlen_new = 2, 4, 64, 256, 5
+    q = torch.randn(batch_size, seqlen_new, nheads, d, device=device, dtype=dtype)
+    k_cache, v_cache = [
+        torch.zeros(batch_size, seqlen_cache, nheads, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    k, v = [torch.randn(batch_size, seqlen_new, nheads, d, device=device, dtype=dtype) for _ in range(2)]
+    cache_seqlens = torch.tensor([0, seqlen_cache - seqlen_new + 1], dtype=torch.int32, device=device)
+    monkeypatch.setenv("FLASH_ATTENTION_CHECK_KV_APPEND", "1")
+    with pytest.raises(RuntimeError, match="too small"):
+        flash_attn_with_kvcache(q, k_cache, v_cache, k, v, cache_seqlens=cache_seqlens)
+    # Appends that fit still go through.
+    flash_attn_with_kvcache(q, k_cache, v_cache, k, v, cache_seqlens=cache_seqlens - 1)
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("window_size", [(0, 0), (1, 0), (37, 5), (130, -1), (-1, 200), (256, 256)])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 239), (113, 203), (300, 1000), (1000, 300)])
+def test_flash_attn_cpu_local(seqlen_q, seqlen_k, window_size, mha_type, causal, num_splits, dtype):
+    """Sliding window against the reference with the window mask. (1000, 300) leaves the last
+    queries without any key in their window, those must output 0.
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, d = 2, 4, 64
+    nheads_k = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    softmax_scale = d ** (-0.5)
+    if causal and num_splits > 1:
+        # A left window with causal is the window (left, 0), which can split.
+        window_size = (max(window_size[0], 0), -1)
+    out, *_ = flash_attn_cuda.fwd(
+        q, k, v, None, None, 0.0, softmax_scale, causal, window_size[0], window_size[1], False, None,
+        num_splits, None, None, None, None, None, None, False, None,
+    )
+    window_size_ref = (window_size[0], 0) if causal else window_size
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None, window_size=window_size_ref)
+    out_pt, _ = attention_ref(
+        q, k, v, None, None, 0.0, None, upcast=False, reorder_ops=True, window_size=window_size_ref
+    )
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    assert not out.isnan().any()
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+        dtype
+    ).eps
+
+    # The same window through the varlen forward, with the two sequences packed.
+    cu_seqlens_q = torch.arange(0, (batch_size + 1) * seqlen_q, seqlen_q, dtype=torch.int32)
+    cu_seqlens_k = torch.arange(0, (batch_size + 1) * seqlen_k, seqlen_k, dtype=torch.int32)
+    out_varlen = flash_attn_varlen_func(
+        rearrange(q, "b s ... -> (b s) ..."),
+        rearrange(k, "b s ... -> (b s) ..."),
+        rearrange(v, "b s ... -> (b s) ..."),
+        cu_seqlens_q, cu_seqlens_k, seqlen_q, seqlen_k, causal=causal, window_size=window_size,
+    )
+    # The varlen forward doesn't split, so the outputs only match bitwise without splits.
+    if num_splits == 1:
+        assert torch.equal(out_varlen, rearrange(out, "b s ... -> (b s) ..."))
+    else:
+        out_varlen = rearrange(out_varlen, "(b s) ... -> b s ...", b=batch_size)
+        assert (out_varlen - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+            dtype
+        ).eps
+
+
+@pytest.mark.parametrize("block_m,block_n", [(128, 64), (64, 64), (128, 128)])
+@pytest.mark.parametrize("window_size", [(0, 0), (100, 0), (257, 31), (-1, 64), (1000, 1000)])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 239), (1024, 1024), (1000, 300), (300, 4096)])
+def test_flash_attn_local_tile_count(seqlen_q, seqlen_k, window_size, block_m, block_n):
+    """The tiles the sliding window forward computes are those with a key in the window of one of
+    their queries, plus one fully masked tile for the row blocks that have none.
+    """
+    computed, skipped = flash_attn_cuda.fwd_local_tile_count(
+        seqlen_q, seqlen_k, block_m, block_n, window_size[0], window_size[1]
+    )
+    num_m_block, num_n_block = math.ceil(seqlen_q / block_m), math.ceil(seqlen_k / block_n)
+    assert computed + skipped == num_m_block * num_n_block
+    tile_mask = ~construct_local_mask(seqlen_q, seqlen_k, window_size)
+    tile_mask = F.pad(tile_mask, (0, num_n_block * block_n - seqlen_k, 0, num_m_block * block_m - seqlen_q))
+    in_window = rearrange(tile_mask, "(m bm) (n bn) -> m n (bm bn)", bm=block_m, bn=block_n).any(-1)
+    assert computed == in_window.sum().item() + (~in_window.any(-1)).sum().item()
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("alibi_batched", [False, True])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 239), (113, 203), (300, 1000), (1000, 300)])
+def test_flash_attn_cpu_alibi(seqlen_q, seqlen_k, alibi_batched, mha_type, causal, num_splits, dtype):
+    """ALiBi against the reference with the bias added to the full score matrix, slopes shared
+    by the batch or per sequence.
+    """
+    if causal and num_splits > 1:
+        pytest.skip()
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, d = 2, 4, 64
+    nheads_k = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    alibi_slopes = torch.rand(batch_size, nheads, device=device, dtype=torch.float32) * 0.3
+    if not alibi_batched:
+        alibi_slopes = alibi_slopes[0]
+    softmax_scale = d ** (-0.5)
+    out, *_, lse, _, _ = flash_attn_cuda.fwd(
+        q, k, v, None, alibi_slopes, 0.0, softmax_scale, causal, -1, -1, False, None, num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None, causal=causal, alibi_slopes=alibi_slopes)
+    out_pt, _ = attention_ref(
+        q, k, v, None, None, 0.0, None, causal=causal, upcast=False, reorder_ops=True,
+        alibi_slopes=alibi_slopes,
+    )
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+        dtype
+    ).eps
+
+    # The LSE includes the bias.
+    scores = torch.einsum(
+        "bthd,bshd->bhts", q.float(), repeat(k.float(), "b s h d -> b s (h g) d", g=nheads // nheads_k)
+    ) * softmax_scale
+    row_idx = rearrange(torch.arange(seqlen_q), "s -> s 1")
+    scores -= rearrange(alibi_slopes.expand(batch_size, nheads), "b h -> b h 1 1") * (
+        row_idx - torch.arange(seqlen_k)
+    ).abs()
+    if causal:
+        scores.masked_fill_(torch.triu(torch.ones(seqlen_q, seqlen_k, dtype=torch.bool), 1), float("-inf"))
+    lse_ref = torch.logsumexp(scores, dim=-1)
+    # Queries past seqlen_k keep key 0 at least, so no row is fully masked.
+    assert torch.allclose(lse, lse_ref, atol=1e-3, rtol=1e-3)
+
+    # The same slopes through the varlen forward, with the two sequences packed.
+    cu_seqlens_q = torch.arange(0, (batch_size + 1) * seqlen_q, seqlen_q, dtype=torch.int32)
+    cu_seqlens_k = torch.arange(0, (batch_size + 1) * seqlen_k, seqlen_k, dtype=torch.int32)
+    out_varlen = flash_attn_varlen_func(
+        rearrange(q, "b s ... -> (b s) ..."),
+        rearrange(k, "b s ... -> (b s) ..."),
+        rearrange(v, "b s ... -> (b s) ..."),
+        cu_seqlens_q, cu_seqlens_k, seqlen_q, seqlen_k, causal=causal, alibi_slopes=alibi_slopes,
+    )
+    # The varlen forward doesn't split, so the outputs only match bitwise without splits.
+    if num_splits == 1:
+        assert torch.equal(out_varlen, rearrange(out, "b s ... -> (b s) ..."))
+    else:
+        out_varlen = rearrange(out_varlen, "(b s) ... -> b s ...", b=batch_size)
+        assert (out_varlen - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+            dtype
+        ).eps
+
+    with pytest.raises(RuntimeError):
+        # The slopes must be fp32.
+        flash_attn_cuda.fwd(
+            q, k, v, None, alibi_slopes.half(), 0.0, softmax_scale, causal, -1, -1, False, None,
+            num_splits, None, None, None, None, None, None, False, None,
+        )
+
+
+def rotary_ref(x, cos, sin, interleaved):
+    """The separate rotary pass (apply_rotary_emb_torch), in fp32 and rounded once like the
+    rotary_emb kernel.
+    """
+    rotary_dim = cos.shape[-1] * 2
+    x_ro = x[..., :rotary_dim].float()
+    if not interleaved:
+        x1, x2 = x_ro.chunk(2, dim=-1)
+        x_rot = torch.cat((-x2, x1), dim=-1)
+    else:
+        x_rot = rearrange(torch.stack((-x_ro[..., 1::2], x_ro[..., ::2]), dim=-1), "... d two -> ... (d two)")
+    cos = repeat(cos[: x.shape[1]].float(), "s d -> s 1 (d two)" if interleaved else "s d -> s 1 (two d)", two=2)
+    sin = repeat(sin[: x.shape[1]].float(), "s d -> s 1 (d two)" if interleaved else "s d -> s 1 (two d)", two=2)
+    return torch.cat(((x_ro * cos + x_rot * sin).to(x.dtype), x[..., rotary_dim:]), dim=-1)
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("rotary_interleaved", [False, True])
+@pytest.mark.parametrize("rotary_fraction", [0.5, 1.0])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 239), (113, 203), (300, 1000), (1000, 300)])
+def test_flash_attn_cpu_rotary(
+    seqlen_q, seqlen_k, rotary_fraction, rotary_interleaved, mha_type, causal, num_splits, dtype
+):
+    """Rotary embedding fused into the loads of Q and K against the separate rotary pass followed
+    by the attention.
+    """
+    if causal and num_splits > 1:
+        pytest.skip()
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, d = 2, 4, 64
+    nheads_k = nheads if mha_type == "mha" else 2
+    rotary_dim = int(rotary_fraction * d)
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    angle = torch.rand(max(seqlen_q, seqlen_k), rotary_dim // 2, device=device) * 2 * math.pi
+    rotary_cos, rotary_sin = torch.cos(angle).to(dtype), torch.sin(angle).to(dtype)
+    q_ro = rotary_ref(q, rotary_cos, rotary_sin, rotary_interleaved)
+    k_ro = rotary_ref(k, rotary_cos, rotary_sin, rotary_interleaved)
+    softmax_scale = d ** (-0.5)
+    out, *_, lse, _, _ = flash_attn_cuda.fwd(
+        q, k, v, None, None, 0.0, softmax_scale, causal, -1, -1, False, None, num_splits,
+        None, None, None, None, rotary_cos, rotary_sin, rotary_interleaved, None,
+    )
+    out_unfused, *_, lse_unfused, _, _ = flash_attn_cuda.fwd(
+        q_ro, k_ro, v, None, None, 0.0, softmax_scale, causal, -1, -1, False, None, num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+    # Q and K are rotated in fp32 and rounded once either way, so only the order of the fp32 ops
+    # can differ.
+    print(f"Output max diff with the unfused rotary: {(out - out_unfused).abs().max().item()}")
+    assert torch.allclose(out, out_unfused, atol=torch.finfo(dtype).eps, rtol=0)
+    assert torch.allclose(lse, lse_unfused, atol=1e-5, rtol=1e-5)
+    out_ref, _ = attention_ref(q_ro, k_ro, v, None, None, 0.0, None, causal=causal)
+    out_pt, _ = attention_ref(q_ro, k_ro, v, None, None, 0.0, None, causal=causal, upcast=False, reorder_ops=True)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+        dtype
+    ).eps
+
+    # The varlen forward rotates each row by its position in its own sequence.
+    cu_seqlens_q = torch.arange(0, (batch_size + 1) * seqlen_q, seqlen_q, dtype=torch.int32)
+    cu_seqlens_k = torch.arange(0, (batch_size + 1) * seqlen_k, seqlen_k, dtype=torch.int32)
+    out_varlen, *_ = flash_attn_cuda.varlen_fwd(
+        rearrange(q, "b s h d -> (b s) h d"), rearrange(k, "b s h d -> (b s) h d"),
+        rearrange(v, "b s h d -> (b s) h d"), None, cu_seqlens_q, cu_seqlens_k, None, seqlen_q, seqlen_k,
+        0.0, softmax_scale, False, causal, -1, -1, False, None, rotary_cos, rotary_sin, rotary_interleaved,
+    )
+    out_varlen = rearrange(out_varlen, "(b s) h d -> b s h d", b=batch_size)
+    # The varlen forward doesn't split, so the outputs only match bitwise without splits.
+    if num_splits == 1:
+        assert torch.equal(out_varlen, out)
+    else:
+        assert (out_varlen - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+            dtype
+        ).eps
+
+    # The backward rotates q / k like the kernel, and the gradients w.r.t. them back.
+    assert torch.equal(_apply_rotary(q, rotary_cos, rotary_sin, rotary_interleaved), q_ro)
+    q_back = _apply_rotary(q_ro.float(), rotary_cos, rotary_sin, rotary_interleaved, conjugate=True)
+    assert torch.allclose(q_back, q.float(), atol=1e-2, rtol=1e-2)
+
+    with pytest.raises(RuntimeError):
+        # The tables must cover every position.
+        flash_attn_cuda.fwd(
+            q, k, v, None, None, 0.0, softmax_scale, causal, -1, -1, False, None, num_splits,
+            None, None, None, None, rotary_cos[:-1], rotary_sin[:-1], rotary_interleaved, None,
+        )
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("nheads,nheads_k", [(8, 1), (8, 2), (32, 4), (136, 1)])
+@pytest.mark.parametrize("seqlen_k", [1, 239, 1000])
+def test_flash_attn_cpu_gqa_grouped(seqlen_k, nheads, nheads_k, num_splits, dtype):
+    """GQA / MQA decoding with the query heads of a group folded into one row block, against the
+    same attention with K / V repeated for every query head, which keeps one row block per head.
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, d = 3, 64
+    q = torch.randn(batch_size, 1, nheads, d, device=device, dtype=dtype)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    softmax_scale = d ** (-0.5)
+    out_buf = torch.empty_like(q)
+    out, q_padded, *_, lse, _, _ = flash_attn_cuda.fwd(
+        q, k, v, out_buf, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+    k_rep, v_rep = [repeat(x, "b s h d -> b s (h g) d", g=nheads // nheads_k) for x in (k, v)]
+    out_per_head, *_, lse_per_head, _, _ = flash_attn_cuda.fwd(
+        q, k_rep, v_rep, None, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+    # Each row is computed the same way in either row block.
+    assert out.shape == q.shape and lse.shape == (batch_size, nheads, 1)
+    assert torch.equal(out, out_per_head)
+    assert torch.equal(lse, lse_per_head)
+    assert torch.equal(out_buf, out)
+    assert torch.equal(q_padded, q)
+    # An out_ that is a strided slice of a larger buffer is filled as well.
+    out_buf_strided = torch.zeros(batch_size * 2, 1, nheads, d * 2, device=device, dtype=dtype)[::2, :, :, :d]
+    out_strided, *_ = flash_attn_cuda.fwd(
+        q, k, v, out_buf_strided, None, 0.0, softmax_scale, False, -1, -1, False, None, num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+    assert torch.equal(out_buf_strided, out)
+    assert torch.equal(out_strided, out)
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None)
+    out_pt, _ = attention_ref(q, k, v, None, None, 0.0, None, upcast=False, reorder_ops=True)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + torch.finfo(
+        dtype
+    ).eps
+
+    # With a mask that depends on the row, the heads are not folded.
+    out_causal, *_ = flash_attn_cuda.fwd(
+        q, k, v, None, None, 0.0, softmax_scale, True, -1, -1, False, None, 1,
+        None, None, None, None, None, None, False, None,
+    )
+    out_causal_per_head, *_ = flash_attn_cuda.fwd(
+        q, k_rep, v_rep, None, None, 0.0, softmax_scale, True, -1, -1, False, None, 1,
+        None, None, None, None, None, None, False, None,
+    )
+    assert torch.equal(out_causal, out_causal_per_head)
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("num_chunks", [1, 2, 5])
+@pytest.mark.parametrize("seqlen", [128, 397, 1024])
+def test_flash_attn_cpu_chunked_state(seqlen, num_chunks, causal, mha_type, num_splits, dtype):
+    """Chunked / ring attention: the attention over each key chunk is merged into the incoming
+    (out, softmax_lse) state, which must end up as the attention over all of the keys at once.
+    With causal, the query chunk i attends to the key chunks j < i in full and to j = i causally.
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, d = 2, 6, 64
+    nheads_k = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, seqlen, nheads, d, device=device, dtype=dtype)
+    k, v = [
+        torch.randn(batch_size, seqlen, nheads_k, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    softmax_scale = d ** (-0.5)
+    out_once, *_, lse_once, _, _ = flash_attn_cuda.fwd(
+        q, k, v, None, None, 0.0, softmax_scale, causal, -1, -1, False, None, 1 if causal else num_splits,
+        None, None, None, None, None, None, False, None,
+    )
+
+    bounds = [seqlen * i // num_chunks for i in range(num_chunks + 1)]
+    out = torch.zeros_like(q)
+    lse = torch.full((batch_size, nheads, seqlen), float("-inf"))
+    for i in range(num_chunks):
+        rows = slice(bounds[i], bounds[i + 1])
+        out_i, lse_i = out[:, rows], lse[:, :, rows].contiguous()
+        for j in range(i + 1 if causal else num_chunks):
+            cols = slice(bounds[j], bounds[j + 1])
+            out_ret, *_, lse_ret, _, _ = flash_attn_cuda.fwd(
+                q[:, rows], k[:, cols], v[:, cols], out_i, None, 0.0, softmax_scale, causal and j == i,
+                -1, -1, False, None, num_splits if not causal or j < i else 1,
+                None, None, None, None, None, None, False, lse_i,
+            )
+            # The state is updated in place and returned.
+            assert out_ret.data_ptr() == out_i.data_ptr() and lse_ret.data_ptr() == lse_i.data_ptr()
+        lse[:, :, rows] = lse_i
+
+    # The fresh state (-inf) takes no weight, so a single chunk is the plain forward.
+    if num_chunks == 1:
+        assert torch.equal(out, out_once)
+        assert torch.equal(lse, lse_once)
+    print(f"Output max diff: {(out - out_once).abs().max().item()}")
+    print(f"LSE max diff: {(lse - lse_once).abs().max().item()}")
+    assert torch.allclose(lse, lse_once, rtol=0, atol=1e-4)
+    # O is rounded once per merge.
+    assert (out - out_once).abs().max().item() <= num_chunks * 4 * torch.finfo(dtype).eps
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None, causal=causal)
+    out_pt, _ = attention_ref(q, k, v, None, None, 0.0, None, causal=causal, upcast=False, reorder_ops=True)
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + num_chunks * torch.finfo(
+        dtype
+    ).eps
+
+    # A key chunk the rows have no key in (an empty KV cache) leaves the state as it is.
+    out_before, lse_before = out.clone(), lse.clone()
+    k_cache, v_cache = [torch.zeros(batch_size, 8, nheads_k, d, dtype=dtype) for _ in range(2)]
+    cache_seqlens = torch.zeros(batch_size, dtype=torch.int32)
+    flash_attn_cuda.fwd(
+        q, k_cache, v_cache, out, None, 0.0, softmax_scale, False, -1, -1, False, None, 1,
+        None, None, None, cache_seqlens, None, None, False, lse,
+    )
+    assert torch.equal(out, out_before) and torch.equal(lse, lse_before)
+
+    with pytest.raises(RuntimeError):
+        flash_attn_cuda.fwd(
+            q, k, v, None, None, 0.0, softmax_scale, causal, -1, -1, False, None, 1,
+            None, None, None, None, None, None, False, lse,
+        )
+
+
+def test_flash_attn_is_index64():
+    """The 64-bit variant of the kernels is picked when an offset into one of the tensors could reach
+    2^31, from the sizes and strides alone (meta tensors, nothing is allocated).
+    """
+    nheads, d = 128, 128
+
+    def qkv(batch_size, seqlen_q, seqlen_k=128, nheads_k=nheads):
+        q = torch.empty(batch_size, seqlen_q, nheads, d, device="meta", dtype=torch.float16)
+        k, v = [
+            torch.empty(batch_size, seqlen_k, nheads_k, d, device="meta", dtype=torch.float16)
+            for _ in range(2)
+        ]
+        return q, k, v
+
+    assert not flash_attn_cuda.is_index64(*qkv(2, 1024), False)
+    assert not flash_attn_cuda.is_index64(*qkv(2, 1024), True)
+    # The last element of q is at 2^31 - 1, then at 2^31 + 2^14 - 1.
+    assert not flash_attn_cuda.is_index64(*qkv(1, 2 ** 17), False)
+    assert flash_attn_cuda.is_index64(*qkv(1, 2 ** 17 + 1), False)
+    assert flash_attn_cuda.is_index64(*qkv(1, 2 ** 17 - 1, seqlen_k=2 ** 17 + 1), False)
+    # dQ accum is padded to a multiple of 128 rows, and to 2^31 elements here.
+    assert not flash_attn_cuda.is_index64(*qkv(1, 2 ** 17 - 100), False)
+    assert flash_attn_cuda.is_index64(*qkv(1, 2 ** 17 - 100), True)
+    # A transposed layout has the same extent.
+    q, k, v = qkv(1, 2 ** 17 + 1)
+    q_t = torch.empty(1, nheads, 2 ** 17 + 1, d, device="meta", dtype=torch.float16).transpose(1, 2)
+    assert flash_attn_cuda.is_index64(q_t, k, v, False)
+    # K / V broadcast along the batch take no memory, whatever the number of sequences sharing them.
+    q, k, v = qkv(2 ** 10, 16, seqlen_k=2 ** 15)
+    k, v = [x[:1].expand(2 ** 10, -1, -1, -1) for x in (k, v)]
+    assert k.numel() >= 2 ** 31
+    assert not flash_attn_cuda.is_index64(q, k, v, False)
+    # GQA: only the query side is large.
+    assert flash_attn_cuda.is_index64(*qkv(1, 2 ** 17 + 1, nheads_k=1), False)
+
+
+def test_flash_attn_fwd_autotune(tmp_path):
+    """The autotuner keeps the fastest kernel trait set per (hdim, dtype, causal, seqlen bucket), in a
+    versioned cache file that dispatch then reads. Timed with a mock timer, so no GPU is needed.
+    """
+    device = "Mock GPU"
+    candidates = {d: flash_attn_cuda.fwd_tuning_candidates(d) for d in (64, 128)}
+    assert candidates[128][0] == "128x64x4"
+    assert flash_attn_cuda.fwd_tuning_candidates(72) == []
+
+    calls = []
+
+    def timer(hdim, is_bf16, is_causal, seqlen_bucket, candidate):
+        calls.append((hdim, is_bf16, is_causal, seqlen_bucket, candidate))
+        # The last candidate wins for short sequences, the first for long ones.
+        rank = candidates[hdim].index(candidate)
+        if seqlen_bucket < 4096:
+            rank = len(candidates[hdim]) - 1 - rank
+        # Noisy repeats, the best of them is kept.
+        return 1.0 + rank + 0.1 * (len(calls) % repeats)
+
+    path = tmp_path / "fwd_tuning.txt"
+    repeats = 3
+    entries = flash_attn_cuda.fwd_autotune(str(path), [64, 128], [200, 512, 8000], repeats, timer, device)
+    # 2 hdims x 2 dtypes x 2 causal x 2 buckets (512, 8192) keys, every candidate `repeats` times.
+    assert len(calls) == 2 * 2 * 2 * repeats * (len(candidates[64]) + len(candidates[128]))
+    assert len(entries) == 16
+    for hdim, is_bf16, is_causal, seqlen_bucket, candidate, ms in entries:
+        expected = candidates[hdim][-1] if seqlen_bucket == 512 else candidates[hdim][0]
+        assert candidate == expected
+        assert ms == 1.0
+
+    lines = path.read_text().splitlines()
+    assert lines[0] == "flash_attn_fwd_tuning 1"
+    assert lines[1] == f"device {device}"
+    assert len(lines) == 2 + 16
+
+    assert flash_attn_cuda.fwd_load_tuning_cache(str(path), device)
+    assert flash_attn_cuda.fwd_tuned_candidate(128, True, True, 300, device) == candidates[128][-1]
+    assert flash_attn_cuda.fwd_tuned_candidate(128, False, False, 8192, device) == candidates[128][0]
+    # Closest tuned bucket: 65536 is nearer 8192 than 512, 128 nearer 512.
+    assert flash_attn_cuda.fwd_tuned_candidate(64, False, True, 100000, device) == candidates[64][0]
+    assert flash_attn_cuda.fwd_tuned_candidate(64, False, True, 1, device) == candidates[64][-1]
+    # Untuned head dimension, or a cache of another device: the default dispatch.
+    assert flash_attn_cuda.fwd_tuned_candidate(96, False, False, 512, device) == ""
+    assert flash_attn_cuda.fwd_tuned_candidate(128, False, False, 512, "Other GPU") == ""
+    assert not flash_attn_cuda.fwd_load_tuning_cache(str(path), "Other GPU")
+    assert flash_attn_cuda.fwd_tuned_candidate(128, False, False, 512, "Other GPU") == ""
+
+    # A cache of another version is ignored, and so are entries of unknown candidates.
+    stale = tmp_path / "stale.txt"
+    stale.write_text("\n".join(["flash_attn_fwd_tuning 0"] + lines[1:]) + "\n")
+    assert not flash_attn_cuda.fwd_load_tuning_cache(str(stale), device)
+    assert flash_attn_cuda.fwd_tuned_candidate(128, False, False, 512, device) == ""
+    stale.write_text("\n".join(lines[:2] + ["128 fp16 noncausal 512 256x256x16 1.0", "128 fp16 causal 512 64x64x4 1.0"]) + "\n")
+    assert flash_attn_cuda.fwd_load_tuning_cache(str(stale), device)
+    assert flash_attn_cuda.fwd_tuned_candidate(128, False, False, 512, device) == ""
+    assert flash_attn_cuda.fwd_tuned_candidate(128, False, True, 512, device) == "64x64x4"
+
+    # Keys where no candidate could run are left out.
+    entries = flash_attn_cuda.fwd_autotune(str(path), [64], [1024], 1, lambda *args: float("inf"), device)
+    assert entries == []
+    assert flash_attn_cuda.fwd_tuned_candidate(64, False, False, 1024, device) == ""
+    flash_attn_cuda.fwd_load_tuning_cache(str(tmp_path / "missing.txt"), device)
+
+
+@pytest.mark.parametrize("causal", [False, True])
+def test_flash_attn_cpu_launch_config_cache(causal):
+    """The launch config of a kernel instantiation is computed on its first launch only, and the
+    opt-in telemetry hook sees every launch with its smem, occupancy and grid.
+    """
+    batch_size, seqlen, nheads, d = 2, 300, 3, 64
+    q, k, v = [torch.randn(batch_size, seqlen, nheads, d, dtype=torch.float16) for _ in range(3)]
+
+    def run(num_splits=1):
+        return flash_attn_cuda.fwd(
+            q, k, v, None, None, 0.0, d ** -0.5, causal, -1, -1, False, None, num_splits,
+            None, None, None, None, None, None, False, None,
+        )[0]
+
+    flash_attn_cuda.clear_launch_config_cache()
+    records = []
+    flash_attn_cuda.set_launch_telemetry_hook(records.append)
+    try:
+        run()
+        assert flash_attn_cuda.launch_config_cache_stats() == (0, 1)
+        for _ in range(3):
+            run()
+        assert flash_attn_cuda.launch_config_cache_stats() == (3, 1)
+    finally:
+        flash_attn_cuda.set_launch_telemetry_hook(None)
+    assert [r["cache_hit"] for r in records] == [False, True, True, True]
+    block_m, block_n = 128, 128
+    for r in records:
+        assert r["device"] == -1
+        assert (r["head_dim"], r["block_m"], r["block_n"], r["num_threads"]) == (d, block_m, block_n, 1)
+        assert r["smem_size"] == 4 * (3 * block_m * d + 2 * block_n * d + block_m * block_n + 2 * block_m)
+        assert r["ctas_per_sm"] == 1
+    if causal:
+        assert records[0]["kernel"] == "compute_attn_1rowblock_causal"
+        assert 1 <= records[0]["grid"][0] <= torch.get_num_threads()
+    else:
+        assert records[0]["kernel"] == "compute_attn_1rowblock"
+        assert records[0]["grid"] == ((seqlen + block_m - 1) // block_m, batch_size, nheads)
+
+    # Without a hook nothing is reported, the cache is still used.
+    run()
+    assert len(records) == 4
+    assert flash_attn_cuda.launch_config_cache_stats() == (4, 1)
+    if not causal:
+        # Split-KV is the same instantiation, so it hits too.
+        flash_attn_cuda.set_launch_telemetry_hook(records.append)
+        try:
+            run(num_splits=2)
+        finally:
+            flash_attn_cuda.set_launch_telemetry_hook(None)
+        assert records[-1]["kernel"] == "compute_attn_1rowblock_splitkv"
+        assert records[-1]["cache_hit"]
+        assert records[-1]["grid"] == ((seqlen + block_m - 1) // block_m, 2, batch_size * nheads)
+
+
+@pytest.mark.parametrize("causal", [False, True])
+def test_flash_attn_cpu_tile_trace(causal):
+    """The tile trace records every tile of the forward once, with its worker and timings, keeps the
+    latest tiles once its ring buffer wraps around, and exports them as Chrome trace JSON.
+    """
+    import json
+
+    batch_size, seqlen, nheads, d = 2, 1000, 3, 64
+    block_m = 128
+    num_m_block = (seqlen + block_m - 1) // block_m
+    num_tiles = batch_size * nheads * num_m_block
+    q, k, v = [torch.randn(batch_size, seqlen, nheads, d, dtype=torch.float16) for _ in range(3)]
+
+    def run():
+        return flash_attn_cuda.fwd(
+            q, k, v, None, None, 0.0, d ** -0.5, causal, -1, -1, False, None, 1,
+            None, None, None, None, None, None, False, None,
+        )[0]
+
+    out_ref = run()
+    flash_attn_cuda.fwd_tile_trace_start(4 * num_tiles)
+    out = run()
+    records, num_recorded, trace_json = flash_attn_cuda.fwd_tile_trace_stop()
+    assert torch.allclose(out, out_ref, atol=1e-3)
+    assert num_recorded == num_tiles
+    assert records.shape == (num_tiles, 8)
+    tile, bidb, bidh, m_block, worker, sm, start, end = records.unbind(1)
+    assert sorted(tile.tolist()) == list(range(num_tiles))
+    assert sorted(zip(bidb.tolist(), bidh.tolist(), m_block.tolist())) == [
+        (b, h, m) for b in range(batch_size) for h in range(nheads) for m in range(num_m_block)
+    ]
+    if not causal:
+        assert torch.equal(tile, (bidb * nheads + bidh) * num_m_block + m_block)
+    assert (worker >= 0).all() and (sm == -1).all()
+    assert (end >= start).all()
+    if causal:
+        # A worker takes one tile at a time.
+        for w in worker.unique().tolist():
+            mask = worker == w
+            s, order = start[mask].sort()
+            assert (s[1:] >= end[mask][order][:-1]).all()
+
+    trace = json.loads(trace_json)
+    events = [e for e in trace["traceEvents"] if e["ph"] == "X"]
+    assert len(events) == num_tiles
+    assert min(e["ts"] for e in events) == 0
+    assert sorted(e["args"]["tile"] for e in events) == list(range(num_tiles))
+    assert [e["args"]["name"] for e in trace["traceEvents"] if e["ph"] == "M"] == ["CPU"]
+
+    # Ring buffer: three forwards into room for one and a half.
+    capacity = num_tiles * 3 // 2
+    flash_attn_cuda.fwd_tile_trace_start(capacity)
+    for _ in range(3):
+        run()
+    records, num_recorded, trace_json = flash_attn_cuda.fwd_tile_trace_stop()
+    assert num_recorded == 3 * num_tiles
+    assert records.shape == (capacity, 8)
+    # Oldest first: the second half of the second forward, then all of the third.
+    assert sorted(records[capacity - num_tiles:, 0].tolist()) == list(range(num_tiles))
+
+    # Off: nothing is recorded.
+    run()
+    records, num_recorded, trace_json = flash_attn_cuda.fwd_tile_trace_stop()
+    assert num_recorded == 0 and records.shape == (0, 8)
+    assert json.loads(trace_json)["traceEvents"] == []
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("d", [32, 59, 64, 128, 256])
+@pytest.mark.parametrize(
+    "seqlen_q,seqlen_k", [(1, 239), (113, 203), (128, 217), (300, 128), (640, 640), (513, 769)]
+)
+def test_flash_attn_cpu_bwd(seqlen_q, seqlen_k, d, causal, mha_type, dtype):
+    """Gradients of the CPU backward against autograd through the reference. The causal column
+    blocks are paired up over odd and even numbers of them (kBlockN is 128, or 64 for d = 256).
+    """
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads = 2, 4
+    nheads_k = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype, requires_grad=True)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype, requires_grad=True)
+        for _ in range(2)
+    ]
+    out = flash_attn_func(q, k, v, 0.0, causal=causal)
+    out_ref, _ = attention_ref(q, k, v, None, None, 0.0, None, causal=causal)
+    out_pt, _ = attention_ref(
+        q, k, v, None, None, 0.0, None, causal=causal, upcast=False, reorder_ops=True
+    )
+    g = torch.randn_like(out)
+    dq, dk, dv = torch.autograd.grad(out, (q, k, v), g)
+    dq_ref, dk_ref, dv_ref = torch.autograd.grad(out_ref, (q, k, v), g)
+    dq_pt, dk_pt, dv_pt = torch.autograd.grad(out_pt, (q, k, v), g)
+    print(f"dQ max diff: {(dq - dq_ref).abs().max().item()}")
+    print(f"dK max diff: {(dk - dk_ref).abs().max().item()}")
+    print(f"dV max diff: {(dv - dv_ref).abs().max().item()}")
+    print(f"dQ Pytorch max diff: {(dq_pt - dq_ref).abs().max().item()}")
+    print(f"dK Pytorch max diff: {(dk_pt - dk_ref).abs().max().item()}")
+    print(f"dV Pytorch max diff: {(dv_pt - dv_ref).abs().max().item()}")
+    eps = torch.finfo(dtype).eps
+    assert (dq - dq_ref).abs().max().item() <= 2 * (dq_pt - dq_ref).abs().max().item() + eps
+    assert (dk - dk_ref).abs().max().item() <= 2 * (dk_pt - dk_ref).abs().max().item() + eps
+    assert (dv - dv_ref).abs().max().item() <= 2 * (dv_pt - dv_ref).abs().max().item() + eps
+
+    # Same gradients with the tasks spread over a different number of threads, up to the order of
+    # the dQ atomics.
+    num_threads_og = torch.get_num_threads()
+    try:
+        torch.set_num_threads(1 if num_threads_og > 1 else 3)
+        dq1, dk1, dv1 = torch.autograd.grad(flash_attn_func(q, k, v, 0.0, causal=causal), (q, k, v), g)
+    finally:
+        torch.set_num_threads(num_threads_og)
+    assert torch.equal(dk1, dk) and torch.equal(dv1, dv)
+    assert torch.allclose(dq1, dq, atol=eps, rtol=eps)
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("d", [32, 64, 128])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(113, 203), (128, 217), (256, 128)])
+def test_flash_attn_varlen_cpu_bwd(seqlen_q, seqlen_k, d, causal, mha_type, dtype):
+    """Gradients of flash_attn_varlen_func on the CPU against autograd through the padded reference."""
+    device = "cpu"
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads = 4, 6
+    nheads_k = nheads if mha_type == "mha" else 3
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype, requires_grad=True)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype, requires_grad=True)
+        for _ in range(2)
+    ]
+    query_padding_mask = generate_random_padding_mask(seqlen_q, batch_size, device, mode="random")
+    key_padding_mask = generate_random_padding_mask(seqlen_k, batch_size, device, mode="random")
+    (
+        q_unpad,
+        k_unpad,
+        v_unpad,
+        cu_seqlens_q,
+        cu_seqlens_k,
+        max_seqlen_q,
+        max_seqlen_k,
+        q,
+        k,
+        v,
+        output_pad_fn,
+        dq_pad_fn,
+        dk_pad_fn,
+    ) = generate_qkv(q, k, v, query_padding_mask, key_padding_mask, kvpacked=False)
+    out_unpad = flash_attn_varlen_func(
+        q_unpad, k_unpad, v_unpad, cu_seqlens_q, cu_seqlens_k, max_seqlen_q, max_seqlen_k, 0.0, causal=causal
+    )
+    out = output_pad_fn(out_unpad)
+    out_ref, _ = attention_ref(q, k, v, query_padding_mask, key_padding_mask, causal=causal)
+    out_pt, _ = attention_ref(
+        q, k, v, query_padding_mask, key_padding_mask, causal=causal, upcast=False, reorder_ops=True
+    )
+    g = torch.randn_like(out)
+    dq_unpad, dk_unpad, dv_unpad = torch.autograd.grad(out, (q_unpad, k_unpad, v_unpad), g)
+    dq, dk, dv = dq_pad_fn(dq_unpad), dk_pad_fn(dk_unpad), dk_pad_fn(dv_unpad)
+    dq_ref, dk_ref, dv_ref = torch.autograd.grad(out_ref, (q, k, v), g)
+    dq_pt, dk_pt, dv_pt = torch.autograd.grad(out_pt, (q, k, v), g)
+    print(f"dQ max diff: {(dq - dq_ref).abs().max().item()}")
+    print(f"dK max diff: {(dk - dk_ref).abs().max().item()}")
+    print(f"dV max diff: {(dv - dv_ref).abs().max().item()}")
+    eps = torch.finfo(dtype).eps
+    assert (dq - dq_ref).abs().max().item() <= 2 * (dq_pt - dq_ref).abs().max().item() + eps
+    assert (dk - dk_ref).abs().max().item() <= 2 * (dk_pt - dk_ref).abs().max().item() + eps
+    assert (dv - dv_ref).abs().max().item() <= 2 * (dv_pt - dv_ref).abs().max().item() + eps
+
+
+@pytest.mark.parametrize("block_m,block_n", [(64, 128), (128, 128), (64, 64), (128, 64)])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(4096, 4096), (4000, 4000), (129, 129), (1000, 3000), (3000, 1000)])
+def test_flash_attn_bwd_causal_cta_tiles(seqlen_q, seqlen_k, block_m, block_n):
+    """Pairing up the causal column blocks halves the CTAs of the backward, and with seqlen_q ==
+    seqlen_k gives each CTA the same work up to a tile, instead of 1 to num_m_block tiles.
+    """
+    unpaired = flash_attn_cuda.bwd_causal_cta_tiles(seqlen_q, seqlen_k, block_m, block_n, False)
+    paired = flash_attn_cuda.bwd_causal_cta_tiles(seqlen_q, seqlen_k, block_m, block_n, True)
+    num_m_block = (seqlen_q + block_m - 1) // block_m
+    num_n_block = (seqlen_k + block_n - 1) // block_n
+    assert len(unpaired) == num_n_block
+    assert len(paired) == (num_n_block + 1) // 2
+    assert sum(paired) == sum(unpaired)
+    assert unpaired == [max(0, num_m_block - n * block_n // block_m) for n in range(num_n_block)]
+    if seqlen_q == seqlen_k:
+        # The middle column block of an odd count is on its own.
+        pairs = paired[: num_n_block // 2]
+        assert max(pairs) - min(pairs) <= 1
+        assert max(paired) <= max(unpaired) + 2 * ((block_n + block_m - 1) // block_m)
+        assert max(unpaired) - min(unpaired) >= num_m_block - 2 * ((block_n + block_m - 1) // block_m)
+
+
+@pytest.mark.parametrize(
+    "device", ["cpu", pytest.param("cuda", marks=pytest.mark.skipif(not has_cuda, reason="no GPU"))]
+)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("d", [32, 64, 128])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(113, 203), (300, 128), (513, 769), (1024, 1024)])
+def test_flash_attn_deterministic(seqlen_q, seqlen_k, d, causal, mha_type, dtype, device):
+    """The deterministic backward gives bitwise the same gradients from run to run, and on the CPU
+    whatever the number of threads, and the same up to rounding as the default one.
+    """
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads = 2, 4
+    nheads_k = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype, requires_grad=True)
+    k, v = [
+        torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype, requires_grad=True)
+        for _ in range(2)
+    ]
+    g = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+
+    def grads(deterministic):
+        out = flash_attn_func(q, k, v, 0.0, causal=causal, deterministic=deterministic)
+        return torch.autograd.grad(out, (q, k, v), g)
+
+    dq, dk, dv = grads(True)
+    dq_atomic, dk_atomic, dv_atomic = grads(False)
+    eps = torch.finfo(dtype).eps
+    assert torch.equal(dk, dk_atomic) and torch.equal(dv, dv_atomic)
+    assert torch.allclose(dq, dq_atomic, atol=4 * eps, rtol=4 * eps)
+
+    num_threads_og = torch.get_num_threads()
+    try:
+        for num_threads in ([1, 3, num_threads_og + 5] if device == "cpu" else [num_threads_og] * 10):
+            torch.set_num_threads(num_threads)
+            dq1, dk1, dv1 = grads(True)
+            assert torch.equal(dq1, dq) and torch.equal(dk1, dk) and torch.equal(dv1, dv)
+    finally:
+        torch.set_num_threads(num_threads_og)
@@ -0,0 +1,461 @@
+import math
+
+import pytest
+import torch
+from einops import rearrange, repeat
+from flash_attn.utils.generation import (
+    HeadPruningPolicy,
+    dequantize_kv_cache,
+    kv_page_summary,
+    quantize_kv_cache,
+    update_cache_indir,
+)
+
+ft_attention = pytest.importorskip("ft_attention")
+
+# The CPU reference runs on machines without a GPU.
+has_cuda = torch.cuda.is_available()
+devices = ["cpu", pytest.param("cuda", marks=pytest.mark.skipif(not has_cuda, reason="no GPU"))]
+
+
+def pack_k_cache(k_cache):
+    """(batch_size, nheads_kv, seqlen, headdim) -> the (batch_size, nheads_kv, headdim / x, seqlen, x)
+    layout of the kernel, with x the elements of 16 bytes."""
+    packsize = 4 if k_cache.dtype == torch.float32 else 8
+    return rearrange(k_cache, "b h s (d x) -> b h d s x", x=packsize).contiguous()
+
+
+def unpack_k_cache(k_cache):
+    return rearrange(k_cache, "b h d s x -> b h s (d x)")
+
+
+def apply_rotary_ref(x, seqlen_offsets, rotary_dim, base, interleaved):
+    """x: (batch_size, nheads, headdim), rotated at position seqlen_offsets[i] for sequence i."""
+    inv_freq = 1.0 / base ** (torch.arange(0, rotary_dim, 2, dtype=torch.float32) / rotary_dim)
+    angle = seqlen_offsets.float().cpu()[:, None] * inv_freq
+    cos, sin = [rearrange(f(angle), "b d -> b 1 d").to(x.device) for f in (torch.cos, torch.sin)]
+    x_ro = x[..., :rotary_dim].float()
+    if interleaved:
+        x0, x1 = x_ro[..., ::2], x_ro[..., 1::2]
+        x_ro = rearrange(torch.stack([x0 * cos - x1 * sin, x1 * cos + x0 * sin], dim=-1), "... d two -> ... (d two)")
+    else:
+        x0, x1 = x_ro.chunk(2, dim=-1)
+        x_ro = torch.cat([x0 * cos - x1 * sin, x1 * cos + x0 * sin], dim=-1)
+    return torch.cat([x_ro.to(x.dtype), x[..., rotary_dim:]], dim=-1)
+
+
+def single_query_attention_ref(q, k, v, k_cache, v_cache, lengths, rotary_dim=0, rotary_base=10000.0,
+                               interleaved=False, attended=None):
+    """q: (batch_size, nheads, headdim), k, v: (batch_size, nheads_kv, headdim),
+    k_cache, v_cache: (batch_size, nheads_kv, seqlen, headdim), lengths: (batch_size,),
+    attended: (batch_size, nheads, seqlen) bool, the cached timesteps each head sees, all if None.
+    Returns the output and the keys / values the step appends at lengths."""
+    if rotary_dim > 0:
+        q = apply_rotary_ref(q, lengths, rotary_dim, rotary_base, interleaved)
+        k = apply_rotary_ref(k, lengths, rotary_dim, rotary_base, interleaved)
+    g = q.shape[1] // k.shape[1]
+    out = torch.empty_like(q)
+    for i, length in enumerate(lengths.tolist()):
+        keys = torch.cat([k_cache[i, :, :length], k[i, :, None]], dim=1).float()
+        values = torch.cat([v_cache[i, :, :length], v[i, :, None]], dim=1).float()
+        keys, values = [repeat(t, "h s d -> (h g) s d", g=g) for t in (keys, values)]
+        scores = torch.einsum("hd,hsd->hs", q[i].float() / math.sqrt(q.shape[-1]), keys)
+        if attended is not None:
+            scores[:, :length].masked_fill_(~attended[i, :, :length], float("-inf"))
+        out[i] = torch.einsum("hs,hsd->hd", torch.softmax(scores, dim=-1), values).to(q.dtype)
+    return out, k, v
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("rotary", ["none", "neox", "interleaved"])
+@pytest.mark.parametrize("d", [64, 128])
+def test_single_query_attention(d, rotary, mha_type, dtype, device):
+    """Against the attention of the query over the cached keys and the new one, with sequences of
+    different lengths."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, seqlen = 4, 8, 256
+    nheads_kv = nheads if mha_type == "mha" else 2
+    rotary_dim = 0 if rotary == "none" else d // 2
+    q = torch.randn(batch_size, nheads, d, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, nheads_kv, d, device=device, dtype=dtype) for _ in range(2)]
+    k_cache, v_cache = [
+        torch.randn(batch_size, nheads_kv, seqlen, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    lengths = torch.tensor([0, 1, 100, seqlen - 1], dtype=torch.int32, device=device)
+    out_ref, k_ref, v_ref = single_query_attention_ref(
+        q, k, v, k_cache, v_cache, lengths, rotary_dim, interleaved=rotary == "interleaved"
+    )
+    k_cache_packed = pack_k_cache(k_cache)
+    out = ft_attention.single_query_attention(
+        q, k, v, k_cache_packed, v_cache, lengths, None, None, None, seqlen - 1, rotary_dim, 10000.0,
+        rotary != "interleaved",
+    )
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    atol = 2e-3 if dtype == torch.float16 else 1.6e-2
+    assert torch.allclose(out, out_ref, atol=atol, rtol=atol)
+    # The new key and value are appended to the cache.
+    batch_idx = torch.arange(batch_size, device=device)
+    lengths = lengths.long()
+    assert torch.allclose(unpack_k_cache(k_cache_packed)[batch_idx, :, lengths], k_ref, atol=atol, rtol=atol)
+    assert torch.equal(v_cache[batch_idx, :, lengths], v_ref)
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("beam_width", [1, 4])
+def test_single_query_attention_beam(beam_width, mha_type, dtype, device):
+    """Beam search through cache_indir and update_cache_indir gives bitwise the same outputs as
+    reordering the KV cache itself after every step."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, seqlen_og, max_seqlen = 3, 8, 64, 5, 32
+    nheads_kv = nheads if mha_type == "mha" else 2
+    nbeams = batch_size * beam_width
+    k_cache, v_cache = [
+        torch.randn(nbeams, nheads_kv, max_seqlen, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    k_cache = pack_k_cache(k_cache)
+    k_cache_copy, v_cache_copy = k_cache.clone(), v_cache.clone()
+    cache_indir = repeat(
+        torch.arange(beam_width, dtype=torch.int32, device=device), "beam -> (b beam) l", b=batch_size, l=max_seqlen
+    ).contiguous()
+    for seqlen in range(seqlen_og, max_seqlen):
+        q = torch.randn(nbeams, nheads, d, device=device, dtype=dtype)
+        k, v = [torch.randn(nbeams, nheads_kv, d, device=device, dtype=dtype) for _ in range(2)]
+        out = ft_attention.single_query_attention(
+            q, k, v, k_cache, v_cache, None, None, None, None, seqlen, d, 10000.0, True,
+            beam_width, cache_indir,
+        )
+        out_copy = ft_attention.single_query_attention(
+            q, k, v, k_cache_copy, v_cache_copy, None, None, None, None, seqlen, d, 10000.0, True,
+        )
+        assert torch.equal(out, out_copy)
+        # Each beam continues a random beam of its sequence.
+        beam_parents = torch.randint(0, beam_width, (batch_size, beam_width), device=device)
+        update_cache_indir(cache_indir, beam_parents, seqlen + 1)
+        rows = (torch.arange(batch_size, device=device)[:, None] * beam_width + beam_parents).flatten()
+        k_cache_copy, v_cache_copy = k_cache_copy[rows], v_cache_copy[rows]
+
+
+def test_single_query_attention_beam_checks():
+    q = torch.randn(4, 8, 64, dtype=torch.float16)
+    k, v = [torch.randn(4, 8, 64, dtype=torch.float16) for _ in range(2)]
+    k_cache = pack_k_cache(torch.randn(4, 8, 32, 64, dtype=torch.float16))
+    v_cache = torch.randn(4, 8, 32, 64, dtype=torch.float16)
+    with pytest.raises(RuntimeError, match="beam_width must divide"):
+        ft_attention.single_query_attention(q, k, v, k_cache, v_cache, None, None, None, None, 3, 0, 10000.0, True, 3)
+    with pytest.raises(RuntimeError, match="needs cache_indir"):
+        ft_attention.single_query_attention(q, k, v, k_cache, v_cache, None, None, None, None, 3, 0, 10000.0, True, 2)
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+def test_single_query_attention_nnz_heads(mha_type, dtype, device):
+    """The heads of nnz_head_idx get the same outputs as with all the heads, the others zeros, and the
+    cache gets the new keys / values of every KV head either way."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, seqlen = 4, 8, 64, 128
+    nheads_kv = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, nheads, d, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, nheads_kv, d, device=device, dtype=dtype) for _ in range(2)]
+    k_cache, v_cache = [
+        torch.randn(batch_size, nheads_kv, seqlen, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    k_cache = pack_k_cache(k_cache)
+    k_cache_nnz, v_cache_nnz = k_cache.clone(), v_cache.clone()
+    lengths = torch.tensor([0, 1, 50, seqlen - 1], dtype=torch.int32, device=device)
+    # No head of the first KV group when grouped.
+    nnz_head_idx = torch.tensor([5, 6], dtype=torch.int32, device=device)
+    out = ft_attention.single_query_attention(
+        q, k, v, k_cache, v_cache, lengths, None, None, None, 0, d, 10000.0, True
+    )
+    out_nnz = ft_attention.single_query_attention(
+        q, k, v, k_cache_nnz, v_cache_nnz, lengths, None, None, nnz_head_idx, 0, d, 10000.0, True
+    )
+    skipped = torch.ones(nheads, dtype=torch.bool, device=device)
+    skipped[nnz_head_idx.long()] = False
+    assert torch.equal(out_nnz[:, nnz_head_idx.long()], out[:, nnz_head_idx.long()])
+    assert (out_nnz[:, skipped] == 0).all()
+    assert torch.equal(k_cache_nnz, k_cache)
+    assert torch.equal(v_cache_nnz, v_cache)
+
+
+def test_head_pruning_policy():
+    """The policy keeps the heads with the largest outputs, attends all of them at the refresh steps,
+    and lets a head whose output grew back in."""
+    nheads, headdim = 8, 16
+    policy = HeadPruningPolicy(keep_ratio=0.25, ema_decay=0.5, refresh_interval=4, warmup_steps=2)
+    scales = torch.tensor([1.0, 5.0, 0.1, 0.1, 3.0, 0.1, 0.1, 0.1])
+    kept = []
+    for step in range(12):
+        if step == 6:
+            scales[2] = 10.0
+        nnz_head_idx = policy.nnz_head_idx(0)
+        assert (nnz_head_idx is None) == (step < 2 or step % 4 == 0)
+        context = scales[None, :, None] * torch.ones(2, nheads, headdim)
+        if nnz_head_idx is not None:
+            kept.append(nnz_head_idx.tolist())
+            skipped = torch.ones(nheads, dtype=torch.bool)
+            skipped[nnz_head_idx.long()] = False
+            context[:, skipped] = 0
+        policy.observe(0, context, nnz_head_idx)
+        policy.step()
+    assert kept[0] == [1, 4]
+    # Head 2 grew at step 6 while skipped, the refresh at step 8 brings it back.
+    assert kept[-1] == [1, 2]
+
+
+@pytest.mark.parametrize("quant_dtype", [torch.int8, torch.uint8])
+def test_kv_cache_quant(quant_dtype):
+    """Every fp8 code but the NaNs and -0 comes back from its value, and the codes are within half a
+    step (int8) or a relative half ulp of e4m3 (fp8) of the values."""
+    torch.random.manual_seed(0)
+    if quant_dtype == torch.uint8:
+        codes = torch.tensor([c for c in range(256) if c not in (0x7F, 0x80, 0xFF)], dtype=torch.uint8)
+        values = dequantize_kv_cache(codes, torch.full((), 1.0 / 448), torch.float32)
+        assert torch.equal(quantize_kv_cache(values, quant_dtype)[0], codes)
+    x = torch.randn(4, 8, 64, 128)
+    codes, scale = quantize_kv_cache(x, quant_dtype)
+    assert codes.dtype == quant_dtype and scale.shape == x.shape[:-1]
+    err = (dequantize_kv_cache(codes, scale, torch.float32) - x).abs()
+    if quant_dtype == torch.int8:
+        assert (err <= scale[..., None] * 0.5 * (1 + 1e-5)).all()
+    else:
+        assert (err <= torch.maximum(x.abs() / 16, scale[..., None] * 2.0**-10) * (1 + 1e-5)).all()
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("quant_dtype", [torch.int8, torch.uint8])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+def test_single_query_attention_kv_cache_quant(mha_type, quant_dtype, dtype, device):
+    """With an 8-bit cache, against the attention over the dequantized cache, and the new key and
+    value appended as quantize_kv_cache quantizes them."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, seqlen = 4, 8, 128, 256
+    nheads_kv = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, nheads, d, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, nheads_kv, d, device=device, dtype=dtype) for _ in range(2)]
+    (k_codes, k_scale), (v_codes, v_scale) = [
+        quantize_kv_cache(torch.randn(batch_size, nheads_kv, seqlen, d, device=device), quant_dtype)
+        for _ in range(2)
+    ]
+    lengths = torch.tensor([0, 1, 100, seqlen - 1], dtype=torch.int32, device=device)
+    out_ref, _, _ = single_query_attention_ref(
+        q, k, v, dequantize_kv_cache(k_codes, k_scale, dtype), dequantize_kv_cache(v_codes, v_scale, dtype),
+        lengths,
+    )
+    # The codes are packed like the cache of dtype.
+    k_cache_packed = pack_k_cache(k_codes)
+    out = ft_attention.single_query_attention(
+        q, k, v, k_cache_packed, v_codes, lengths, None, None, None, seqlen - 1, 0, 10000.0, True, 1, None,
+        k_scale, v_scale,
+    )
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    atol = 2e-3 if dtype == torch.float16 else 1.6e-2
+    assert torch.allclose(out, out_ref, atol=atol, rtol=atol)
+    batch_idx = torch.arange(batch_size, device=device)
+    lengths = lengths.long()
+    for codes, scale, x in [(unpack_k_cache(k_cache_packed), k_scale, k), (v_codes, v_scale, v)]:
+        codes_ref, scale_ref = quantize_kv_cache(x, quant_dtype)
+        assert torch.equal(codes[batch_idx, :, lengths], codes_ref)
+        assert torch.equal(scale[batch_idx, :, lengths], scale_ref)
+
+
+def few_query_attention_ref(q, k, v, k_cache, v_cache, lengths, rotary_dim=0, interleaved=False):
+    """q: (batch_size, num_queries, nheads, headdim), k, v: (batch_size, num_queries, nheads_kv, headdim).
+    The queries one after the other, each appending its key and value (to copies of the caches).
+    Returns the output and the caches with the new keys / values."""
+    k_cache, v_cache = k_cache.clone(), v_cache.clone()
+    batch_idx = torch.arange(q.shape[0], device=q.device)
+    out = torch.empty_like(q)
+    for j in range(q.shape[1]):
+        out[:, j], k_j, v_j = single_query_attention_ref(
+            q[:, j], k[:, j], v[:, j], k_cache, v_cache, lengths + j, rotary_dim, interleaved=interleaved
+        )
+        k_cache[batch_idx, :, (lengths + j).long()] = k_j
+        v_cache[batch_idx, :, (lengths + j).long()] = v_j
+    return out, k_cache, v_cache
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("rotary", ["none", "neox", "interleaved"])
+@pytest.mark.parametrize("num_queries", [1, 4, 8])
+@pytest.mark.parametrize("d", [80, 128])
+def test_few_query_attention(d, num_queries, rotary, mha_type, dtype, device):
+    """Against the queries decoded one at a time: each draft sees the cache and the drafts before it."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, seqlen = 4, 8, 256
+    nheads_kv = nheads if mha_type == "mha" else 2
+    rotary_dim = 0 if rotary == "none" else d // 2
+    q = torch.randn(batch_size, num_queries, nheads, d, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, num_queries, nheads_kv, d, device=device, dtype=dtype) for _ in range(2)]
+    k_cache, v_cache = [
+        torch.randn(batch_size, nheads_kv, seqlen, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    lengths = torch.tensor([0, 1, 100, seqlen - num_queries], dtype=torch.int32, device=device)
+    out_ref, k_cache_ref, v_cache_ref = few_query_attention_ref(
+        q, k, v, k_cache, v_cache, lengths, rotary_dim, interleaved=rotary == "interleaved"
+    )
+    k_cache_packed = pack_k_cache(k_cache)
+    out = ft_attention.few_query_attention(
+        q, k, v, k_cache_packed, v_cache, lengths, 0, rotary_dim, 10000.0, rotary != "interleaved"
+    )
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    atol = 2e-3 if dtype == torch.float16 else 1.6e-2
+    assert torch.allclose(out, out_ref, atol=atol, rtol=atol)
+    assert torch.allclose(unpack_k_cache(k_cache_packed), k_cache_ref, atol=atol, rtol=atol)
+    assert torch.equal(v_cache, v_cache_ref)
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+def test_few_query_attention_rollback(dtype, device):
+    """Speculative decoding: the drafts rejected at a step leave no trace, the next step gives the same
+    outputs as a cache that only ever got the accepted ones."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, seqlen, num_queries = 3, 8, 64, 64, 4
+    k_cache, v_cache = [torch.randn(batch_size, nheads, seqlen, d, device=device, dtype=dtype) for _ in range(2)]
+    k_cache = pack_k_cache(k_cache)
+    lengths = torch.tensor([5, 10, 20], dtype=torch.int32, device=device)
+    q, k, v = [torch.randn(batch_size, num_queries, nheads, d, device=device, dtype=dtype) for _ in range(3)]
+    accepted = torch.tensor([0, 2, 4], dtype=torch.int32, device=device)
+    ft_attention.few_query_attention(q, k, v, k_cache, v_cache, lengths, 0, d, 10000.0, True)
+    lengths = lengths + accepted
+    # The same cache, with the accepted drafts only.
+    k_cache_clean, v_cache_clean = unpack_k_cache(k_cache).clone(), v_cache.clone()
+    for i, length in enumerate(lengths.tolist()):
+        k_cache_clean[i, :, length:] = 0
+        v_cache_clean[i, :, length:] = 0
+    k_cache_clean = pack_k_cache(k_cache_clean)
+    q, k, v = [torch.randn(batch_size, num_queries, nheads, d, device=device, dtype=dtype) for _ in range(3)]
+    out = ft_attention.few_query_attention(q, k, v, k_cache, v_cache, lengths, 0, d, 10000.0, True)
+    out_clean = ft_attention.few_query_attention(q, k, v, k_cache_clean, v_cache_clean, lengths, 0, d, 10000.0, True)
+    assert torch.equal(out, out_clean)
+    for i, length in enumerate((lengths + num_queries).tolist()):
+        assert torch.equal(unpack_k_cache(k_cache)[i, :, :length], unpack_k_cache(k_cache_clean)[i, :, :length])
+        assert torch.equal(v_cache[i, :, :length], v_cache_clean[i, :, :length])
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+def test_single_query_attention_sparse_pages_all(mha_type, dtype, device):
+    """Sparse page retrieval with every page selected gives the dense outputs, and the step adds its keys
+    to the page summary as kv_page_summary would."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, seqlen, page_size = 4, 8, 64, 256, 32
+    nheads_kv = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, nheads, d, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, nheads_kv, d, device=device, dtype=dtype) for _ in range(2)]
+    k_cache, v_cache = [
+        torch.randn(batch_size, nheads_kv, seqlen, d, device=device, dtype=dtype) for _ in range(2)
+    ]
+    k_cache = pack_k_cache(k_cache)
+    k_cache_sparse, v_cache_sparse = k_cache.clone(), v_cache.clone()
+    # A page starts at the new key of the second and third sequences.
+    lengths = torch.tensor([0, 32, 64, 200], dtype=torch.int32, device=device)
+    page_summary = kv_page_summary(k_cache, page_size, lengths)
+    out = ft_attention.single_query_attention(
+        q, k, v, k_cache, v_cache, lengths, None, None, None, 0, d, 10000.0, True
+    )
+    out_sparse = ft_attention.single_query_attention(
+        q, k, v, k_cache_sparse, v_cache_sparse, lengths, None, None, None, 0, d, 10000.0, True,
+        page_summary_=page_summary, page_size=page_size, top_k_pages=seqlen // page_size, recent_window=16,
+    )
+    assert torch.equal(out_sparse, out)
+    assert torch.equal(k_cache_sparse, k_cache)
+    assert torch.equal(page_summary, kv_page_summary(k_cache, page_size, lengths + 1))
+    with pytest.raises(RuntimeError, match="top_k_pages > 0"):
+        ft_attention.single_query_attention(
+            q, k, v, k_cache, v_cache, lengths, None, None, None, 0, d, 10000.0, True,
+            page_summary_=page_summary, page_size=page_size,
+        )
+    with pytest.raises(RuntimeError, match="timestep < memory_max_seqlen"):
+        ft_attention.single_query_attention(
+            q, k, v, k_cache, v_cache, None, None, None, None, seqlen, d, 10000.0, True,
+            page_summary_=page_summary, page_size=page_size, top_k_pages=seqlen // page_size, recent_window=16,
+        )
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("rotary", ["none", "neox", "interleaved"])
+def test_single_query_attention_sparse_pages_needles(rotary, dtype, device):
+    """Each head has keys close to its query in a few pages out of many weak ones: the top-k pages are
+    those, the output is the attention over them and the recent window, and they hold nearly all the
+    attention mass of exact attention."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, seqlen, page_size = 2, 4, 64, 1024, 32
+    top_k_pages, recent_window = 3, 64
+    rotary_dim = 0 if rotary == "none" else d // 2
+    q = torch.randn(batch_size, nheads, d, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, nheads, d, device=device, dtype=dtype) for _ in range(2)]
+    k_cache = 0.1 * torch.randn(batch_size, nheads, seqlen, d, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, nheads, seqlen, d, device=device, dtype=dtype)
+    lengths = torch.tensor([1000, 700], dtype=torch.int32, device=device)
+    # The cached keys are rotated, so are the needles.
+    q_rot = apply_rotary_ref(q, lengths, rotary_dim, 10000.0, rotary == "interleaved") if rotary_dim > 0 else q
+    attended = torch.zeros(batch_size, nheads, seqlen, dtype=torch.bool, device=device)
+    for i, length in enumerate(lengths.tolist()):
+        attended[i, :, length - recent_window:length] = True
+        for h in range(nheads):
+            for page in torch.randperm((length - recent_window) // page_size)[:top_k_pages].tolist():
+                k_cache[i, h, page * page_size + torch.randint(page_size, (1,)).item()] = 1.5 * q_rot[i, h]
+                attended[i, h, page * page_size:(page + 1) * page_size] = True
+    k_cache_packed = pack_k_cache(k_cache)
+    out = ft_attention.single_query_attention(
+        q, k, v, k_cache_packed, v_cache, lengths, None, None, None, 0, rotary_dim, 10000.0,
+        rotary != "interleaved", page_summary_=kv_page_summary(k_cache_packed, page_size, lengths),
+        page_size=page_size, top_k_pages=top_k_pages, recent_window=recent_window,
+    )
+    out_ref, _, _ = single_query_attention_ref(
+        q, k, v, k_cache, v_cache, lengths, rotary_dim, interleaved=rotary == "interleaved", attended=attended
+    )
+    scores = torch.einsum("bhd,bhsd->bhs", q_rot.float(), k_cache.float()) / math.sqrt(d)
+    valid = torch.arange(seqlen, device=device) < lengths[:, None, None]
+    probs = torch.softmax(scores.masked_fill(~valid, float("-inf")), dim=-1)
+    mass = probs.masked_fill(~attended, 0.0).sum(dim=-1)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}, attention mass recall: {mass.min().item()}")
+    assert mass.min().item() > 0.99
+    atol = 2e-3 if dtype == torch.float16 else 1.6e-2
+    assert torch.allclose(out, out_ref, atol=atol, rtol=atol)
+
+
+@pytest.mark.parametrize("device", devices)
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+def test_single_query_attention_sparse_pages_long_cache(dtype, device):
+    """With a cache of 100k timesteps, the step attends the compacted list of the timesteps of the top-k
+    pages and the recent window: its shared memory does not grow with the length of the cache, which dense
+    attention could not hold."""
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, page_size = 2, 4, 64, 64
+    seqlen = 1600 * page_size
+    top_k_pages, recent_window = 4, 128
+    q = torch.randn(batch_size, nheads, d, device=device, dtype=dtype)
+    k, v = [torch.randn(batch_size, nheads, d, device=device, dtype=dtype) for _ in range(2)]
+    k_cache = 0.1 * torch.randn(batch_size, nheads, seqlen, d, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, nheads, seqlen, d, device=device, dtype=dtype)
+    lengths = torch.tensor([seqlen - 1, 70000], dtype=torch.int32, device=device)
+    attended = torch.zeros(batch_size, nheads, seqlen, dtype=torch.bool, device=device)
+    for i, length in enumerate(lengths.tolist()):
+        attended[i, :, length - recent_window:length] = True
+        for h in range(nheads):
+            for page in torch.randperm((length - recent_window) // page_size)[:top_k_pages].tolist():
+                k_cache[i, h, page * page_size + torch.randint(page_size, (1,)).item()] = 1.5 * q[i, h]
+                attended[i, h, page * page_size:(page + 1) * page_size] = True
+    k_cache_packed = pack_k_cache(k_cache)
+    out = ft_attention.single_query_attention(
+        q, k, v, k_cache_packed, v_cache, lengths, None, None, None, seqlen - 1,
+        page_summary_=kv_page_summary(k_cache_packed, page_size, lengths),
+        page_size=page_size, top_k_pages=top_k_pages, recent_window=recent_window,
+    )
+    out_ref, _, _ = single_query_attention_ref(q, k, v, k_cache, v_cache, lengths, attended=attended)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    atol = 2e-3 if dtype == torch.float16 else 1.6e-2
+    assert torch.allclose(out, out_ref, atol=atol, rtol=atol)